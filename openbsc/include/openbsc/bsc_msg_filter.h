@@ -28,6 +28,8 @@ enum bsc_filter_acc_ctr {
 	ACC_LIST_GLOBAL_FILTER,
 };
 
+struct bsc_msg_acc_match;
+
 struct bsc_msg_acc_lst {
 	struct llist_head list;
 
@@ -37,6 +39,10 @@ struct bsc_msg_acc_lst {
 	/* the name of the list */
 	const char *name;
 	struct llist_head fltr_list;
+
+	/* compiled on the next check after a change of the entries */
+	struct bsc_msg_acc_match *allow_match;
+	struct bsc_msg_acc_match *deny_match;
 };
 
 struct bsc_msg_acc_lst_entry {
@@ -102,6 +108,8 @@ void bsc_msg_acc_lst_delete(struct bsc_msg_acc_lst *lst);
 
 struct bsc_msg_acc_lst_entry *bsc_msg_acc_lst_entry_create(struct bsc_msg_acc_lst *);
 int bsc_msg_acc_lst_check_allow(struct bsc_msg_acc_lst *lst, const char *imsi);
+struct bsc_msg_acc_lst_entry *bsc_msg_acc_lst_find_deny(struct bsc_msg_acc_lst *lst, const char *imsi);
+void bsc_msg_acc_lst_changed(struct bsc_msg_acc_lst *lst);
 
 void bsc_msg_acc_lst_vty_init(void *ctx, struct llist_head *lst, int node);
 void bsc_msg_acc_lst_write(struct vty *vty);
@@ -23,6 +23,7 @@
 
 #include "mgcp.h"
 #include "bsc_msg_filter.h"
+#include "nat_timer_wheel.h"
 
 
 #include <osmocom/core/select.h>
@@ -36,17 +37,30 @@
 
 #include <regex.h>
 #include <stdbool.h>
+#include <time.h>
 
 #define DIR_BSC 1
 #define DIR_MSC 2
 
 #define PAGIN_GROUP_UNASSIGNED -1
 
+/* buckets of each index into the SCCP connections */
+#define NAT_SCCP_HASH_BITS	16
+#define NAT_SCCP_HASH_SIZE	(1 << NAT_SCCP_HASH_BITS)
+
+/* buckets of the LAC to BSC paging index */
+#define NAT_PAGING_HASH_SIZE	1024
+
+/* buckets of the token and number index of the BSC configs */
+#define NAT_BSC_HASH_SIZE	256
+
 struct sccp_source_reference;
 struct nat_sccp_connection;
+struct nat_sccp_ref_pool;
 struct bsc_nat_parsed;
 struct bsc_nat;
 struct bsc_nat_ussd_con;
+struct bsc_nat_mux;
 struct nat_rewrite_rule;
 
 /*
@@ -65,7 +79,7 @@ enum {
 struct bsc_cmd_list {
 	struct llist_head list_entry;
 
-	struct osmo_timer_list timeout;
+	struct nat_wheel_timer timeout;
 
 	/* The NATed ID used on the bsc_con*/
 	int nat_id;
@@ -95,6 +109,8 @@ struct bsc_connection {
 
 	/* a timeout node */
 	struct osmo_timer_list id_timeout;
+	/* when it was accepted, for the auth latency */
+	struct timespec accept_time;
 
 	/* pong timeout */
 	struct osmo_timer_list ping_timeout;
@@ -113,6 +129,18 @@ struct bsc_connection {
 	struct llist_head cmd_pending;
 	int last_id;
 
+	/* the LACs paged here, see bsc_nat_paging_update() */
+	struct llist_head paging_lacs;
+	/* the last paging sent here */
+	unsigned int paging_seq;
+
+	/* the deepest the write queue has been */
+	unsigned int queue_peak;
+
+	/* the SCCP connections of this BSC, see sccp_connection_add() */
+	struct llist_head sccp_connections;
+	unsigned int sccp_count;
+
 	/* a back pointer */
 	struct bsc_nat *nat;
 };
@@ -138,6 +166,13 @@ enum bsc_cfg_ctr {
 	BCFG_CTR_CON_PAG_RESP,
 	BCFG_CTR_CON_SSA,
 	BCFG_CTR_CON_OTHER,
+	BCFG_CTR_WRITE_CALLS,
+	BCFG_CTR_WRITE_FRAMES,
+};
+
+enum {
+	NAT_MSC_CTR_WRITE_CALLS,
+	NAT_MSC_CTR_WRITE_FRAMES,
 };
 
 /**
@@ -145,6 +180,9 @@ enum bsc_cfg_ctr {
  */
 struct bsc_config {
 	struct llist_head entry;
+	/* in nat->bsc_by_token and nat->bsc_by_nr */
+	struct llist_head token_entry;
+	struct llist_head nr_entry;
 
 	uint8_t key[16];
 	uint8_t key_present;
@@ -198,6 +236,17 @@ struct bsc_nat_paging_group {
 	/* list of lac entries */
 	struct llist_head lists;
 	int nr;
+
+	struct bsc_nat *nat;
+};
+
+/* an authenticated BSC handling the LAC, in nat->paging_by_lac */
+struct bsc_paging_lac {
+	struct llist_head lac_entry;
+	struct llist_head bsc_entry;
+
+	struct bsc_connection *bsc;
+	uint16_t lac;
 };
 
 /**
@@ -224,10 +273,16 @@ struct bsc_nat_statistics {
 	struct {
 		struct osmo_counter *reconn;
                 struct osmo_counter *auth_fail;
+
+		/* accept() to authentication in microseconds */
+		unsigned long auth_count;
+		unsigned long long auth_total_us;
+		unsigned long auth_max_us;
 	} bsc;
 
 	struct {
 		struct osmo_counter *reconn;
+		struct rate_ctr_group *ctrg;
 	} msc;
 
 	struct {
@@ -242,6 +297,21 @@ struct bsc_nat {
 	/* active SCCP connections that need patching */
 	struct llist_head sccp_connections;
 
+	/*
+	 * the above by (bsc, real_ref), patched_ref, (bsc, remote_ref)
+	 * and msc_endp, NAT_SCCP_HASH_SIZE buckets each
+	 */
+	struct llist_head *sccp_by_real;
+	struct llist_head *sccp_by_patched;
+	struct llist_head *sccp_by_remote;
+	struct llist_head *sccp_by_msc_endp;
+
+	/* the patched_ref of the SCCP connections */
+	struct nat_sccp_ref_pool *sccp_refs;
+
+	/* connection and command timeouts */
+	struct nat_timer_wheel *timers;
+
 	/* active BSC connections that need patching */
 	struct llist_head bsc_connections;
 
@@ -251,8 +321,15 @@ struct bsc_nat {
 	/* paging groups */
 	struct llist_head paging_groups;
 
+	/* NAT_PAGING_HASH_SIZE buckets of struct bsc_paging_lac */
+	struct llist_head *paging_by_lac;
+	unsigned int paging_seq;
+
 	/* known BSC's */
 	struct llist_head bsc_configs;
+	/* NAT_BSC_HASH_SIZE buckets of them by token and by number */
+	struct llist_head *bsc_by_token;
+	struct llist_head *bsc_by_nr;
 	int num_bsc;
 	int bsc_ip_dscp;
 
@@ -325,6 +402,13 @@ struct bsc_nat {
 
 	/* control interface */
 	struct ctrl_handle *ctrl;
+
+	/* worker processes, see bsc_nat_mux.h */
+	int num_workers;
+	/* -1 unless this is one of the workers */
+	int worker_nr;
+	/* only in the process that owns the MSC link */
+	struct bsc_nat_mux *mux;
 };
 
 struct bsc_nat_ussd_con {
@@ -342,12 +426,15 @@ struct bsc_config *bsc_config_alloc(struct bsc_nat *nat, const char *token,
 				    unsigned int number);
 struct bsc_config *bsc_config_num(struct bsc_nat *nat, int num);
 struct bsc_config *bsc_config_by_token(struct bsc_nat *nat, const char *token, int len);
+void bsc_config_set_token(struct bsc_config *cfg, const char *token);
 void bsc_config_free(struct bsc_config *);
 void bsc_config_add_lac(struct bsc_config *cfg, int lac);
 void bsc_config_del_lac(struct bsc_config *cfg, int lac);
 int bsc_config_handles_lac(struct bsc_config *cfg, int lac);
 
 struct bsc_nat *bsc_nat_alloc(void);
+void bsc_nat_stat_auth(struct bsc_nat *nat, const struct timespec *start,
+		       const struct timespec *end);
 struct bsc_connection *bsc_connection_alloc(struct bsc_nat *nat);
 void bsc_nat_set_msc_ip(struct bsc_nat *bsc, const char *ip);
 
@@ -376,7 +463,15 @@ int update_sccp_src_ref(struct nat_sccp_connection *sccp, struct bsc_nat_parsed
 void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bsc_nat_parsed *parsed);
 struct nat_sccp_connection *patch_sccp_src_ref_to_bsc(struct msgb *, struct bsc_nat_parsed *, struct bsc_nat *);
 struct nat_sccp_connection *patch_sccp_src_ref_to_msc(struct msgb *, struct bsc_nat_parsed *, struct bsc_connection *);
-struct nat_sccp_connection *bsc_nat_find_con_by_bsc(struct bsc_nat *, struct sccp_source_reference *);
+struct nat_sccp_connection *bsc_nat_find_con_by_bsc(struct bsc_nat *, struct bsc_connection *,
+						    const struct sccp_source_reference *);
+void sccp_connection_add(struct bsc_nat *nat, struct nat_sccp_connection *conn);
+void sccp_connection_del(struct nat_sccp_connection *conn);
+void sccp_connection_set_patched_ref(struct nat_sccp_connection *conn,
+				     const struct sccp_source_reference *ref);
+void sccp_connection_set_remote_ref(struct nat_sccp_connection *conn,
+				    const struct sccp_source_reference *ref);
+void sccp_connection_set_msc_endp(struct nat_sccp_connection *conn, int endp);
 
 /**
  * MGCP/Audio handling
@@ -390,7 +485,7 @@ void bsc_mgcp_free_endpoints(struct bsc_nat *nat);
 int bsc_mgcp_nat_init(struct bsc_nat *nat);
 
 struct nat_sccp_connection *bsc_mgcp_find_con(struct bsc_nat *, int endpoint_number);
-struct msgb *bsc_mgcp_rewrite(char *input, int length, int endp, const char *ip,
+struct msgb *bsc_mgcp_rewrite(const char *input, int length, int endp, const char *ip,
 			      int port, int osmux, int *first_payload_type, int mode_set);
 void bsc_mgcp_forward(struct bsc_connection *bsc, struct msgb *msg);
 
@@ -404,6 +499,11 @@ int bsc_do_write(struct osmo_wqueue *queue, struct msgb *msg, int id);
 int bsc_write_msg(struct osmo_wqueue *queue, struct msgb *msg);
 int bsc_write_cb(struct osmo_fd *bfd, struct msgb *msg);
 
+/* the most a single writev() of a write queue sends */
+#define NAT_WRITEV_MAX_FRAMES	64
+#define NAT_WRITEV_MAX_BYTES	(32 * 1024)
+int bsc_nat_writev(struct osmo_fd *bfd, struct msgb *msg, unsigned int *frames);
+
 int bsc_nat_msc_is_connected(struct bsc_nat *nat);
 
 int bsc_conn_type_to_ctr(struct nat_sccp_connection *conn);
@@ -424,9 +524,19 @@ void bsc_nat_paging_group_delete(struct bsc_nat_paging_group *);
 void bsc_nat_paging_group_add_lac(struct bsc_nat_paging_group *grp, int lac);
 void bsc_nat_paging_group_del_lac(struct bsc_nat_paging_group *grp, int lac);
 
+void bsc_nat_paging_update(struct bsc_connection *bsc);
+void bsc_nat_paging_clear(struct bsc_connection *bsc);
+void bsc_nat_paging_update_cfg(struct bsc_config *cfg);
+void bsc_nat_paging_update_group(struct bsc_nat *nat, int group);
+int bsc_nat_paging_fan_out(struct bsc_nat *nat, const uint8_t *cell_list, int len,
+			   void (*send)(struct bsc_connection *bsc, void *data),
+			   void *data);
+
 /**
  * Number rewriting support below
  */
+struct bsc_nat_num_rewr_match;
+
 struct bsc_nat_num_rewr_entry {
 	struct llist_head list;
 
@@ -435,9 +545,24 @@ struct bsc_nat_num_rewr_entry {
 
 	char *replace;
 	uint8_t is_prefix_lookup;
+
+	/* the patterns of the regexps and how often the entry was used */
+	char *msisdn_pattern;
+	char *num_pattern;
+	unsigned long hits;
+
+	/* shared by the entries of a list, pos is the index in it */
+	struct bsc_nat_num_rewr_match *match;
+	int pos;
 };
 
 void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head, const struct osmo_config_list *);
+struct bsc_nat_num_rewr_match *bsc_nat_num_rewr_compile(void *ctx, struct llist_head *head);
+struct bsc_nat_num_rewr_entry *bsc_nat_num_rewr_find(struct llist_head *head,
+						     struct bsc_nat_num_rewr_entry *after,
+						     const char *imsi, const char *number,
+						     int *group);
+int bsc_nat_num_rewr_is_compiled(struct bsc_nat_num_rewr_entry *entry);
 
 void bsc_nat_send_mgcp_to_msc(struct bsc_nat *bsc_nat, struct msgb *msg);
 void bsc_nat_handle_mgcp(struct bsc_nat *bsc, struct msgb *msg);
@@ -0,0 +1,78 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef BSC_NAT_MUX_H
+#define BSC_NAT_MUX_H
+
+#include <osmocom/core/write_queue.h>
+
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * With more than one worker the BSC connections are spread over
+ * worker processes that all accept() on the same SO_REUSEPORT port.
+ * The process they were forked from owns the link to the MSC and
+ * passes the IPA frames between it and the workers over a socketpair
+ * each. Worker n hands out the SCCP references of the n-th part of
+ * the reference space, the frames of the MSC are routed by them.
+ */
+#define NAT_MUX_MAX_WORKERS	16
+#define NAT_MUX_QUEUE_LEN	1024
+
+/* CCM message types only used between the multiplexer and a worker */
+#define NAT_MUX_MSGT_MSC_UP	0xf0
+#define NAT_MUX_MSGT_MSC_DOWN	0xf1
+
+struct bsc_nat;
+struct bsc_nat_parsed;
+struct msgb;
+
+struct nat_mux_worker {
+	struct osmo_wqueue queue;
+	struct bsc_nat_mux *mux;
+	struct msgb *pending_msg;
+
+	int nr;
+	pid_t pid;
+};
+
+struct bsc_nat_mux {
+	struct bsc_nat *nat;
+
+	int num_workers;
+	struct nat_mux_worker workers[NAT_MUX_MAX_WORKERS];
+
+	/* the worker the MSC last assigned an endpoint to */
+	uint8_t *endp_owner;
+	int num_endp;
+};
+
+int bsc_nat_mux_fork(struct bsc_nat *nat, int workers, int *fd);
+int bsc_nat_mux_worker_for(struct bsc_nat_mux *mux, struct msgb *msg,
+			   struct bsc_nat_parsed *parsed);
+void bsc_nat_mux_route(struct bsc_nat_mux *mux, struct msgb *msg);
+void bsc_nat_mux_msc_state(struct bsc_nat_mux *mux, int connected);
+int bsc_nat_mux_mgcp_endp(const uint8_t *data, int len);
+
+int bsc_nat_worker_listen(struct osmo_fd *bfd, struct in_addr addr, int port,
+			  int (*cb)(struct osmo_fd *fd, unsigned int what),
+			  void *data);
+
+#endif
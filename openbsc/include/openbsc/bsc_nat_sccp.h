@@ -23,9 +23,12 @@
 #define BSC_NAT_SCCP_H
 
 #include "bsc_msg_filter.h"
+#include "nat_timer_wheel.h"
 
 #include <osmocom/sccp/sccp_types.h>
 
+#include <stdint.h>
+
 /*
  * For the NAT we will need to analyze and later patch
  * the received message. This would require us to parse
@@ -70,6 +73,14 @@ struct bsc_nat_parsed {
 struct nat_sccp_connection {
 	struct llist_head list_entry;
 
+	/* the hash indexes of the nat, see sccp_connection_add() */
+	struct llist_head real_entry;
+	struct llist_head patched_entry;
+	struct llist_head remote_entry;
+	struct llist_head msc_endp_entry;
+	/* on the list of the BSC */
+	struct llist_head bsc_entry;
+
 	struct bsc_connection *bsc;
 	struct bsc_msc_connection *msc_con;
 
@@ -99,7 +110,40 @@ struct nat_sccp_connection {
 
 	/* timeout handling */
 	struct timespec creation_time;
+	struct nat_wheel_timer unconfirmed;
+};
+
+/*
+ * The 24 bit local references the NAT hands out to the MSC. One bit
+ * per reference and two levels of bits for the words and blocks of
+ * words that are completely used, finding the next free reference
+ * looks at no more than a few words.
+ */
+#define NAT_SCCP_REF_COUNT	(1 << 24)
+/* the reserved 0xffffff is never handed out */
+#define NAT_SCCP_REF_USABLE	(NAT_SCCP_REF_COUNT - 1)
+#define NAT_SCCP_REF_WORDS	(NAT_SCCP_REF_COUNT / 64)
+#define NAT_SCCP_REF_BLOCKS	(NAT_SCCP_REF_WORDS / 64)
+#define NAT_SCCP_REF_BLOCK_SIZE	(64 * 64)
+
+struct nat_sccp_ref_pool {
+	uint64_t *used;
+	uint64_t *full_words;
+	uint64_t full_blocks[NAT_SCCP_REF_BLOCKS / 64];
+
+	/* references are handed out in order starting here */
+	uint32_t next;
+
+	/* less than NAT_SCCP_REF_USABLE when restricted to a part */
+	unsigned int usable;
+	unsigned int num_used;
+	unsigned int peak_used;
 };
 
+struct nat_sccp_ref_pool *nat_sccp_ref_pool_alloc(void *ctx, uint32_t first);
+int nat_sccp_ref_pool_get(struct nat_sccp_ref_pool *pool, uint32_t *ref);
+void nat_sccp_ref_pool_put(struct nat_sccp_ref_pool *pool, uint32_t ref);
+void nat_sccp_ref_pool_restrict(struct nat_sccp_ref_pool *pool, int part, int parts);
+int nat_sccp_ref_part(uint32_t ref, int parts);
 
 #endif
@@ -36,13 +36,46 @@ int db_init(const char *name);
 int db_prepare(void);
 int db_fini(void);
 
+/* a connection of its own for another thread */
+void *db_thread_connect(void);
+void db_thread_attach(void *db);
+void db_thread_disconnect(void *db);
+
+/*
+ * The logging is not thread-safe. While db_thread_log is set, e.g. on
+ * the database thread, the most severe message is kept in it instead
+ * and logged later by the main loop.
+ */
+struct db_log {
+	int subsys;
+	int level;
+	char text[160];
+};
+
+extern __thread struct db_log *db_thread_log;
+void db_log_record(int subsys, int level, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+#define LOGP_DB(ss, level, fmt, args...)				\
+	do {								\
+		if (db_thread_log)					\
+			db_log_record(ss, level, fmt, ##args);		\
+		else							\
+			LOGP(ss, level, fmt, ##args);			\
+	} while (0)
+
+#define DEBUGP_DB(ss, fmt, args...) LOGP_DB(ss, LOGL_DEBUG, fmt, ##args)
+
 /* subscriber management */
 struct gsm_subscriber *db_create_subscriber(const char *imsi, uint64_t smin,
 					    uint64_t smax, bool alloc_exten);
 struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 					 const char *subscr);
 int db_sync_subscriber(struct gsm_subscriber *subscriber);
-int db_subscriber_expire(void *priv, void (*callback)(void *priv, long long unsigned int id));
+int db_sync_subscribers(const struct gsm_subscriber *subscrs, int num);
+int db_subscriber_expired(unsigned long long after,
+			  unsigned long long *ids, int max);
+int db_subscriber_detach(const unsigned long long *ids, int num);
 int db_subscriber_alloc_tmsi(struct gsm_subscriber *subscriber);
 int db_subscriber_alloc_exten(struct gsm_subscriber *subscriber, uint64_t smin,
 			      uint64_t smax);
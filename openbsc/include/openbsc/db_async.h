@@ -0,0 +1,62 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DB_ASYNC_H
+#define _DB_ASYNC_H
+
+/*
+ * The queries of the signalling paths are run on a database thread.
+ * The requests are executed in the order they were queued and the
+ * callback is called from the main loop once it has been done. The
+ * thread works on a copy of the subscriber, only the fields written
+ * by the query are copied back. Until db_async_start() has been called
+ * the requests are executed right away.
+ */
+
+struct gsm_subscriber;
+struct gsm_auth_tuple;
+struct gsm_sms;
+
+typedef void db_async_cb(int rc, void *data);
+typedef void db_async_auth_cb(int rc, struct gsm_auth_tuple *atuple,
+			      void *data);
+typedef void db_async_sms_cb(int rc, struct gsm_sms *sms, void *data);
+
+int db_async_start(void);
+void db_async_cancel(void *data);
+
+int db_async_sync_subscriber(struct gsm_subscriber *subscr,
+			     db_async_cb *cb, void *data);
+int db_async_alloc_tmsi(struct gsm_subscriber *subscr,
+			db_async_cb *cb, void *data);
+int db_async_assoc_imei(struct gsm_subscriber *subscr, const char *imei,
+			db_async_cb *cb, void *data);
+int db_async_sync_equipment(struct gsm_subscriber *subscr,
+			    db_async_cb *cb, void *data);
+int db_async_auth_tuple(struct gsm_subscriber *subscr, int key_seq,
+			db_async_auth_cb *cb, void *data);
+int db_async_sms_store(struct gsm_sms *sms, db_async_sms_cb *cb, void *data);
+int db_async_detach(unsigned long long *ids, int num,
+		    db_async_cb *cb, void *data);
+
+int db_async_journal_add(struct gsm_subscriber *subscr);
+int db_async_journal_flush(void);
+int db_async_drain(int timeout_ms);
+
+#endif /* _DB_ASYNC_H */
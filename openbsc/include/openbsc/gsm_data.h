@@ -82,6 +82,7 @@ struct gsm_auth_tuple {
  */
 struct gsm_loc_updating_operation {
         struct osmo_timer_list updating_timer;
+	struct gsm_subscriber_connection *conn;
 	unsigned int waiting_for_imsi : 1;
 	unsigned int waiting_for_imei : 1;
 	unsigned int key_seq : 4;
@@ -91,6 +92,7 @@ struct gsm_loc_updating_operation {
  * AUTHENTICATION/CIPHERING state
  */
 struct gsm_security_operation {
+	struct gsm_subscriber_connection *conn;
 	struct gsm_auth_tuple atuple;
 	gsm_cbfn *cb;
 	void *cb_data;
@@ -248,6 +250,12 @@ enum {
 	MSC_CTR_CALL_ACTIVE,
 	MSC_CTR_CALL_COMPLETE,
 	MSC_CTR_CALL_INCOMPLETE,
+	MSC_CTR_SUBSCR_CACHE_HIT,
+	MSC_CTR_SUBSCR_CACHE_MISS,
+	MSC_CTR_SUBSCR_CACHE_EVICTED,
+	MSC_CTR_SUBSCR_JOURNAL_FLUSHED,
+	MSC_CTR_SUBSCR_JOURNAL_WRITTEN,
+	MSC_CTR_SUBSCR_EXPIRED,
 };
 
 static const struct rate_ctr_desc msc_ctr_description[] = {
@@ -271,6 +279,22 @@ static const struct rate_ctr_desc msc_ctr_description[] = {
 	[MSC_CTR_CALL_ACTIVE] =			{"call:active", "Count total amount of calls that ever reached active state."},
 	[MSC_CTR_CALL_COMPLETE] = 		{"call:complete", "Count total amount of calls which got terminated by disconnect req or ind after reaching active state."},
 	[MSC_CTR_CALL_INCOMPLETE] = 		{"call:incomplete", "Count total amount of call which got terminated by any other reason after reaching active state."},
+	[MSC_CTR_SUBSCR_CACHE_HIT] =		{"subscr_cache:hit", "Subscribers found in RAM."},
+	[MSC_CTR_SUBSCR_CACHE_MISS] =		{"subscr_cache:miss", "Subscribers looked up in the database."},
+	[MSC_CTR_SUBSCR_CACHE_EVICTED] =	{"subscr_cache:evicted", "Unused subscribers freed to make room."},
+	[MSC_CTR_SUBSCR_JOURNAL_FLUSHED] =	{"subscr_journal:flushed", "Transactions writing the changed subscribers."},
+	[MSC_CTR_SUBSCR_JOURNAL_WRITTEN] =	{"subscr_journal:written", "Changed subscribers written to the database."},
+	[MSC_CTR_SUBSCR_EXPIRED] =		{"subscr:expired", "Subscribers detached as their location updating expired."},
+};
+
+enum {
+	MSC_STAT_SUBSCR_JOURNAL_BATCH,
+	MSC_STAT_SUBSCR_JOURNAL_LATENCY,
+};
+
+static const struct osmo_stat_item_desc msc_stat_desc[] = {
+	[MSC_STAT_SUBSCR_JOURNAL_BATCH] =	{ "subscr_journal:batch", "Subscribers written in a transaction.", "", 16, 0 },
+	[MSC_STAT_SUBSCR_JOURNAL_LATENCY] =	{ "subscr_journal:latency", "Time taken to write a transaction.", "ms", 16, 0 },
 };
 
 
@@ -290,6 +314,14 @@ static const struct rate_ctr_group_desc msc_ctrg_desc = {
 	msc_ctr_description,
 };
 
+static const struct osmo_stat_item_group_desc msc_statg_desc = {
+	.group_name_prefix = "msc",
+	.group_description = "mobile switching center",
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+	.num_items = ARRAY_SIZE(msc_stat_desc),
+	.item_desc = msc_stat_desc,
+};
+
 enum gsm_auth_policy {
 	GSM_AUTH_POLICY_CLOSED, /* only subscribers authorized in DB */
 	GSM_AUTH_POLICY_ACCEPT_ALL, /* accept everyone, even if not authorized in DB */
@@ -348,6 +380,7 @@ struct gsm_network {
 
 	struct rate_ctr_group *bsc_ctrs;
 	struct rate_ctr_group *msc_ctrs;
+	struct osmo_stat_item_group *msc_statg;
 	struct osmo_counter *active_calls;
 
 	/* layer 4 */
@@ -404,6 +437,10 @@ struct gsm_network {
 	/* nitb related control */
 	int avoid_tmsi;
 
+	/* changed subscribers are written every interval (ms) or batch */
+	int subscr_write_interval;
+	int subscr_write_batch;
+
 	/* control interface */
 	struct ctrl_handle *ctrl;
 
@@ -19,14 +19,27 @@
 
 #define GSM_SUBSCRIBER_NO_EXPIRATION	0x0
 
+/* unused subscribers kept in RAM unless configured otherwise */
+#define GSM_SUBSCR_CACHE_DEFAULT	100000
+
+/* how long and how many changed subscribers are kept before writing */
+#define GSM_SUBSCR_WRITE_INTERVAL_DEFAULT	500
+#define GSM_SUBSCR_WRITE_BATCH_DEFAULT		500
+
 struct vty;
 
 struct subscr_request;
+struct gsm_subscriber;
 
 struct gsm_subscriber_group {
 	struct gsm_network *net;
 
 	int keep_subscr;
+
+	/* unused subscribers kept, the least recently used are freed */
+	int cache_size;
+	/* writes a subscriber marked by subscr_mark_dirty() to the DB */
+	int (*write_back)(struct gsm_subscriber *subscr);
 };
 
 struct gsm_equipment {
@@ -66,6 +79,14 @@ struct gsm_subscriber {
 	int use_count;
 	struct llist_head entry;
 
+	/* the VLR cache, see gsm_subscriber_base.c */
+	struct llist_head by_imsi;
+	struct llist_head by_tmsi;
+	struct llist_head by_extension;
+	struct llist_head by_id;
+	struct llist_head lru;
+	int dirty;
+
 	/* pending requests */
 	int is_paging;
 	struct llist_head requests;
@@ -107,7 +128,10 @@ struct gsm_subscriber *subscr_active_by_imsi(struct gsm_subscriber_group *sgrp,
 char *subscr_name(struct gsm_subscriber *subscr);
 
 int subscr_purge_inactive(struct gsm_subscriber_group *sgrp);
+void subscr_mark_dirty(struct gsm_subscriber *subscr);
+int subscr_write_back_all(void);
 void subscr_update_from_db(struct gsm_subscriber *subscr);
+int subscr_write_back_db(struct gsm_subscriber *subscr);
 void subscr_expire(struct gsm_subscriber_group *sgrp);
 int subscr_update_expire_lu(struct gsm_subscriber *subscr, struct gsm_bts *bts);
 
@@ -122,4 +146,15 @@ void subscr_remove_request(struct subscr_request *req);
 struct gsm_subscriber *subscr_alloc(void);
 extern struct llist_head active_subscribers;
 
+void subscr_cache_index(struct gsm_subscriber *subscr);
+void subscr_cache_forget(struct gsm_subscriber *subscr);
+struct gsm_subscriber *subscr_cache_by_imsi(struct gsm_subscriber_group *sgrp,
+					    const char *imsi);
+struct gsm_subscriber *subscr_cache_by_tmsi(struct gsm_subscriber_group *sgrp,
+					    uint32_t tmsi);
+struct gsm_subscriber *subscr_cache_by_extension(struct gsm_subscriber_group *sgrp,
+						 const char *ext);
+struct gsm_subscriber *subscr_cache_by_id(struct gsm_subscriber_group *sgrp,
+					  unsigned long long id);
+
 #endif /* _GSM_SUBSCR_H */
@@ -37,6 +37,9 @@
 #define RTP_PORT_DEFAULT 4000
 #define RTP_PORT_NET_DEFAULT 16000
 
+/* upper bound for the packets handled per recvmmsg()/sendmmsg() */
+#define MGCP_RTP_BATCH_MAX 32
+
 /**
  * Calculate the RTP audio port for the given multiplex
  * and the direction. This allows a semi static endpoint
@@ -69,6 +72,27 @@ struct mgcp_endpoint;
 struct mgcp_config;
 struct mgcp_trunk_config;
 struct mgcp_rtp_end;
+struct mgcp_rtp_worker;
+struct mgcp_endp_cache_entry;
+struct mgcp_transcode_pool;
+
+/* Counters of the RTP path, one set per thread forwarding RTP */
+struct mgcp_rtp_stats {
+	/* recvmmsg()/sendmmsg() batching */
+	uint64_t rx_syscalls;
+	uint64_t rx_packets;
+	uint64_t tx_syscalls;
+	uint64_t tx_packets;
+
+	/* UDP_SEGMENT/UDP_GRO offload */
+	uint64_t gso_sends;
+	uint64_t gso_packets;
+	uint64_t gro_reads;
+	uint64_t gro_packets;
+
+	/* messages not logged as the thread may not log */
+	uint64_t logs_dropped;
+};
 
 #define MGCP_ENDP_CRCX 1
 #define MGCP_ENDP_DLCX 2
@@ -103,6 +127,14 @@ typedef int (*mgcp_processing_setup)(struct mgcp_endpoint *endp,
 				     struct mgcp_rtp_end *dst_end,
 				     struct mgcp_rtp_end *src_end);
 
+/**
+ * Hand a RTP packet to asynchronous processing. Returns 1 if it has
+ * been queued (or dropped) and 0 if it should be processed inline.
+ */
+typedef int (*mgcp_processing_submit)(struct mgcp_endpoint *endp, int dest,
+				      struct sockaddr_in *addr,
+				      char *data, int len);
+
 typedef void (*mgcp_get_format)(struct mgcp_endpoint *endp,
 				int *payload_type,
 				const char**subtype_name,
@@ -126,7 +158,8 @@ struct mgcp_port_range {
 	/* dynamically allocated */
 	int range_start;
 	int range_end;
-	int last_port;
+	/* the free/used pairs of the range, see mgcp_port_pool.c */
+	struct mgcp_port_pool *pool;
 };
 
 #define MGCP_KEEPALIVE_ONCE (-1)
@@ -187,6 +220,7 @@ struct mgcp_config {
 	/* RTP processing */
 	mgcp_processing rtp_processing_cb;
 	mgcp_processing_setup setup_rtp_processing_cb;
+	mgcp_processing_submit rtp_processing_submit_cb;
 
 	mgcp_get_format get_net_downlink_format_cb;
 
@@ -242,6 +276,55 @@ struct mgcp_config {
 	/* Minimum and maximum buffer size for the jitter buffer, in ms */
 	uint32_t bts_jitter_delay_min;
 	uint32_t bts_jitter_delay_max;
+
+	/* Packets per recvmmsg()/sendmmsg(), 0 disables batching */
+	int rtp_batch;
+
+	/* connect() the RTP sockets to a peer heard from, see mgcp_udp.h */
+	int rtp_connect;
+
+	/* RTP path counters of the main loop, the workers keep their own */
+	struct mgcp_rtp_stats rtp_stats;
+
+	/* RTP worker threads requested, 0 keeps RTP on the main loop */
+	int rtp_worker_threads;
+	/* the workers actually running, see mgcp_rtp_workers_start() */
+	struct mgcp_rtp_worker *rtp_workers;
+	int rtp_workers_count;
+	/* logs what the workers could not log */
+	struct osmo_timer_list rtp_workers_timer;
+
+	/* endpoint names resolved by the MGCP parser */
+	struct mgcp_endp_cache_entry *endp_cache;
+
+	/* transcoding threads requested, 0 transcodes inline */
+	int transcoding_threads;
+	struct mgcp_transcode_pool *transcode_pool;
+	struct {
+		uint64_t submitted;
+		uint64_t dropped;
+		/* completed, cancelled ones are not part of the latency */
+		uint64_t transcoded;
+		uint64_t cancelled;
+		uint64_t frames;
+		uint64_t latency_sum_us;
+		uint32_t latency_max_us;
+		int queue_depth;
+		int queue_max;
+		/* completions the threads failed to signal */
+		uint64_t wake_failed;
+	} transcode_stats;
+
+	/* free RTP port pairs kept bound, 0/0 closes every released pair */
+	int rtp_socket_pool_low;
+	int rtp_socket_pool_high;
+
+	/* how the packets entering a jitter buffer were stored */
+	struct {
+		uint64_t rx_direct;
+		uint64_t slot_copies;
+		uint64_t heap_allocs;
+	} jibuf_stats;
 };
 
 /* config management */
@@ -249,6 +332,9 @@ struct mgcp_config *mgcp_config_alloc(void);
 int mgcp_parse_config(const char *config_file, struct mgcp_config *cfg,
 		      enum mgcp_role role);
 int mgcp_vty_init(void);
+int mgcp_rtp_workers_start(struct mgcp_config *cfg);
+void mgcp_rtp_workers_stop(struct mgcp_config *cfg);
+void mgcp_port_pools_init(struct mgcp_config *cfg);
 int mgcp_endpoints_allocate(struct mgcp_trunk_config *cfg);
 void mgcp_release_endp(struct mgcp_endpoint *endp);
 void mgcp_initialize_endp(struct mgcp_endpoint *endp);
@@ -0,0 +1,50 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef OPENBSC_MGCP_G711_H
+#define OPENBSC_MGCP_G711_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum mgcp_g711_impl {
+	MGCP_G711_SCALAR,	/* g711common.h, one sample per call */
+	MGCP_G711_TABLE,	/* 64K/256 entry lookup tables */
+	MGCP_G711_SSE2,		/* tables plus SSE2 for L16 */
+	MGCP_G711_AVX2,		/* tables plus AVX2 for L16 and the decoders */
+	_NUM_MGCP_G711_IMPL
+};
+
+/* PCMA/PCMU/L16 <-> host order 16 bit sample conversion */
+struct mgcp_g711_ops {
+	const char *name;
+	void (*alaw_encode)(const int16_t *sample, uint8_t *buf, size_t n);
+	void (*alaw_decode)(const uint8_t *buf, int16_t *sample, size_t n);
+	void (*ulaw_encode)(const int16_t *sample, uint8_t *buf, size_t n);
+	void (*ulaw_decode)(const uint8_t *buf, int16_t *sample, size_t n);
+	void (*l16_encode)(const int16_t *sample, uint8_t *buf, size_t n);
+	void (*l16_decode)(const uint8_t *buf, int16_t *sample, size_t n);
+};
+
+/* the fastest implementation the CPU supports */
+extern const struct mgcp_g711_ops *mgcp_g711;
+
+/* NULL when the CPU does not support it */
+const struct mgcp_g711_ops *mgcp_g711_get_impl(enum mgcp_g711_impl impl);
+
+#endif /* OPENBSC_MGCP_G711_H */
@@ -27,6 +27,8 @@
 #include <osmocom/core/select.h>
 #include <osmocom/netif/jibuf.h>
 
+#include <openbsc/mgcp_udp.h>
+
 #define CI_UNUSED 0
 
 enum mgcp_connection_mode {
@@ -120,6 +122,14 @@ struct mgcp_rtp_end {
 
 	int local_port;
 	int local_alloc;
+	/* the pool local_port has been taken from */
+	struct mgcp_port_pool *port_pool;
+
+	/* where the sockets have been connect()ed to */
+	struct mgcp_udp_peer rtp_peer;
+	struct mgcp_udp_peer rtcp_peer;
+	/* the RTP socket may return coalesced packets */
+	int rtp_gro;
 };
 
 enum {
@@ -205,15 +215,26 @@ struct mgcp_endpoint {
 			uint32_t chunks;
 			uint32_t octets;
 		} stats;
+		/* (remote addr, CID) lookup, see endpoint_lookup() */
+		bool hashed;
+		struct in_addr hash_addr;
+		struct mgcp_endpoint *hash_next;
 	} osmux;
 
 	/* Jitter buffer */
 	struct osmo_jibuf* bts_jb;
+	/* preallocated messages queued to bts_jb */
+	struct mgcp_jibuf_slots *bts_jb_slots;
 	/* Use a jitterbuffer on the bts-side receiver */
 	bool bts_use_jibuf;
 	/* Minimum and maximum buffer size for the jitter buffer, in ms */
 	uint32_t bts_jitter_delay_min;
 	uint32_t bts_jitter_delay_max;
+
+	/* RTP worker handoff, only used by the main thread */
+	int rtp_hold_depth;
+	/* the sockets polled by the worker, one bit per rtp_worker_fd() */
+	unsigned int rtp_worker_fds;
 };
 
 #define for_each_line(line, save)			\
@@ -269,6 +290,10 @@ int mgcp_bind_net_rtp_port(struct mgcp_endpoint *endp, int rtp_port);
 int mgcp_bind_trans_bts_rtp_port(struct mgcp_endpoint *enp, int rtp_port);
 int mgcp_bind_trans_net_rtp_port(struct mgcp_endpoint *enp, int rtp_port);
 int mgcp_free_rtp_port(struct mgcp_rtp_end *end);
+void mgcp_rtp_end_connect(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end);
+void mgcp_rtp_end_disconnect(struct mgcp_rtp_end *end);
+int mgcp_send_rtp_out(struct mgcp_endpoint *endp, int dest,
+		      struct sockaddr_in *addr, char *buf, int len);
 
 /* For transcoding we need to manage an in and an output that are connected */
 static inline int endp_back_channel(int endpoint)
@@ -316,6 +341,9 @@ enum {
 
 #define MGCP_DUMMY_LOAD 0x23
 
+/* size of the receive buffer of a RTP packet */
+#define RTP_BUF_SIZE		4096
+
 
 /**
  * SDP related information
@@ -350,7 +378,77 @@ static inline const char *mgcp_bts_src_addr(struct mgcp_endpoint *endp)
 	return endp->cfg->source_addr;
 }
 
+/**
+ * Internal RTP worker thread related
+ */
+void mgcp_rtp_worker_hold(struct mgcp_endpoint *endp);
+void mgcp_rtp_worker_release(struct mgcp_endpoint *endp);
+int mgcp_rtp_worker_fd_register(struct mgcp_endpoint *endp, struct osmo_fd *fd);
+void mgcp_rtp_worker_fd_unregister(struct mgcp_endpoint *endp, struct osmo_fd *fd);
+void mgcp_rtp_worker_stats(struct mgcp_config *cfg, int nr, int *sockets,
+			   uint64_t *events, uint64_t *holds, uint64_t *logs_dropped,
+			   uint64_t *wake_failed);
+void mgcp_rtp_stats_sum(struct mgcp_config *cfg, struct mgcp_rtp_stats *sum);
+
+/* the counters of a worker thread, NULL on the main loop */
+extern __thread struct mgcp_rtp_stats *mgcp_thread_rtp_stats;
+
+static inline struct mgcp_rtp_stats *mgcp_rtp_stats(struct mgcp_config *cfg)
+{
+	if (mgcp_thread_rtp_stats)
+		return mgcp_thread_rtp_stats;
+	return &cfg->rtp_stats;
+}
+
+/*
+ * Each counter has a single writer and is read by the VTY on the main
+ * loop, the stores and loads must not tear.
+ */
+static inline void mgcp_rtp_stat_add(uint64_t *ctr, uint64_t n)
+{
+	__atomic_store_n(ctr, *ctr + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t mgcp_rtp_stat_get(const uint64_t *ctr)
+{
+	return __atomic_load_n(ctr, __ATOMIC_RELAXED);
+}
+
+/*
+ * The logging (and inet_ntoa()) is not thread-safe. On a worker thread
+ * the message is only counted, the main loop logs how many have been
+ * lost from time to time.
+ */
+#define LOGP_RTP(ss, level, fmt, args...) \
+	do { \
+		if (mgcp_thread_rtp_stats) \
+			mgcp_rtp_stat_add(&mgcp_thread_rtp_stats->logs_dropped, 1); \
+		else \
+			LOGP(ss, level, fmt, ##args); \
+	} while (0)
+
+#define LOGPC_RTP(ss, level, fmt, args...) \
+	do { \
+		if (!mgcp_thread_rtp_stats) \
+			LOGPC(ss, level, fmt, ##args); \
+	} while (0)
+
+/**
+ * Internal port allocation related
+ */
+struct mgcp_port_pool *mgcp_port_pool_get(struct mgcp_config *cfg,
+					  struct mgcp_port_range *range);
+int mgcp_port_pool_alloc(struct mgcp_port_pool *pool);
+int mgcp_port_pool_take_fds(struct mgcp_port_pool *pool, int port,
+			    int *rtp_fd, int *rtcp_fd);
+void mgcp_port_pool_release(struct mgcp_port_pool *pool, int port,
+			    int rtp_fd, int rtcp_fd);
+void mgcp_port_pool_unusable(struct mgcp_port_pool *pool, int port);
+int mgcp_port_pool_stats(struct mgcp_port_range *range, int *used, int *free,
+			 int *bound, int *unusable);
+
 /**
  * Internal jitter buffer related
  */
 void mgcp_dejitter_udp_send(struct msgb *msg, void *data);
+struct mgcp_jibuf_slots *mgcp_jibuf_slots_alloc(struct mgcp_endpoint *endp);
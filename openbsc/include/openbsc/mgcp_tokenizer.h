@@ -0,0 +1,81 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef OPENBSC_MGCP_TOKENIZER_H
+#define OPENBSC_MGCP_TOKENIZER_H
+
+#include <string.h>
+
+/* a piece of the message, it is not NUL terminated */
+struct mgcp_token {
+	const char *data;
+	int len;
+};
+
+/* line endings reported by mgcp_next_line() */
+enum mgcp_eol {
+	MGCP_EOL_NONE,		/* the data ended */
+	MGCP_EOL_LF,
+	MGCP_EOL_CR,
+	MGCP_EOL_CRLF,
+};
+
+/*
+ * A command or response split up in a single pass without copying or
+ * modifying it. For a response the verb holds the code and there is
+ * no endpoint.
+ */
+struct mgcp_tokenized {
+	/* the first line without the line ending */
+	struct mgcp_token line;
+	enum mgcp_eol line_eol;
+
+	/* the words of the first line */
+	int num_words;
+	struct mgcp_token verb;
+	struct mgcp_token trans;
+	struct mgcp_token endpoint;
+	struct mgcp_token proto;
+	struct mgcp_token version;
+
+	/* the response code or -1 for a command */
+	int code;
+
+	/* everything after the first line, split up at the empty line */
+	struct mgcp_token body;
+	struct mgcp_token params;
+	struct mgcp_token sdp;
+};
+
+int mgcp_tokenize(const char *data, int len, struct mgcp_tokenized *out);
+int mgcp_next_line(struct mgcp_token *rest, struct mgcp_token *line,
+		   enum mgcp_eol *eol);
+int mgcp_next_word(struct mgcp_token *rest, struct mgcp_token *word);
+
+static inline int mgcp_token_equal(const struct mgcp_token *tok, const char *str)
+{
+	return (int) strlen(str) == tok->len && memcmp(tok->data, str, tok->len) == 0;
+}
+
+static inline int mgcp_token_prefix(const struct mgcp_token *tok, const char *str)
+{
+	int len = strlen(str);
+	return tok->len >= len && memcmp(tok->data, str, len) == 0;
+}
+
+#endif /* OPENBSC_MGCP_TOKENIZER_H */
@@ -42,7 +42,13 @@ enum audio_format {
 };
 
 
+struct rtp_hdr;
+
 struct mgcp_process_rtp_state {
+	/* backpointers */
+	struct mgcp_endpoint *endp;
+	struct mgcp_rtp_end *dst_end;
+
 	/* decoding */
 	enum audio_format src_fmt;
 	union {
@@ -91,4 +97,19 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 				 char *data, int *len, int buf_size);
 
 int mgcp_transcoding_get_frame_size(void *state_, int nsamples, int dst);
+
+struct mgcp_process_rtp_state *check_transcode_state(
+				struct mgcp_endpoint *endp,
+				struct mgcp_rtp_end *dst_end,
+				struct rtp_hdr *rtp_hdr);
+int mgcp_transcoding_process_state(struct mgcp_endpoint *endp,
+				   struct mgcp_process_rtp_state *state,
+				   char *data, int *len, int buf_size);
+
+/* transcoding thread pool */
+int mgcp_transcoding_pool_start(struct mgcp_config *cfg);
+void mgcp_transcoding_pool_stop(struct mgcp_config *cfg);
+int mgcp_transcoding_submit(struct mgcp_endpoint *endp, int dest,
+			    struct sockaddr_in *addr, char *data, int len);
+void mgcp_transcoding_pool_cancel(struct mgcp_process_rtp_state *state);
 #endif /* OPENBSC_MGCP_TRANSCODE_H */
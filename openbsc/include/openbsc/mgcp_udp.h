@@ -0,0 +1,62 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef OPENBSC_MGCP_UDP_H
+#define OPENBSC_MGCP_UDP_H
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+/* largest datagram the kernel hands out with UDP_GRO */
+#define MGCP_UDP_GRO_BUF_SIZE	65536
+/* segments per UDP_SEGMENT send, the limit of older kernels */
+#define MGCP_UDP_GSO_MAX_SEGS	64
+/* bytes per UDP_SEGMENT send and the largest segment that fits the MTU */
+#define MGCP_UDP_GSO_MAX_SIZE	60000
+#define MGCP_UDP_GSO_MAX_SEG_SIZE 1200
+
+/* the peer a RTP/RTCP socket has been connect()ed to */
+struct mgcp_udp_peer {
+	struct in_addr addr;
+	/* in network byte order, 0 for none */
+	int port;
+	/* connect() failed, sendto() is used for this peer */
+	int failed;
+};
+
+int mgcp_udp_connect(int fd, struct mgcp_udp_peer *peer,
+		     const struct in_addr *addr, int port);
+void mgcp_udp_disconnect(int fd, struct mgcp_udp_peer *peer);
+
+int mgcp_udp_gso_supported(void);
+int mgcp_udp_send_gso(int fd, const struct iovec *iov, int count, int seg_size);
+
+int mgcp_udp_set_gro(int fd, int on);
+int mgcp_udp_gro_size(struct msghdr *msg);
+
+/* the socket has been connected to addr:port */
+static inline int mgcp_udp_is_connected(const struct mgcp_udp_peer *peer,
+					const struct in_addr *addr, int port)
+{
+	return peer->port == port && !peer->failed &&
+		peer->addr.s_addr == addr->s_addr;
+}
+
+#endif /* OPENBSC_MGCP_UDP_H */
@@ -22,25 +22,58 @@
 
 #include <osmocom/core/linuxrbtree.h>
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct vty;
 
-struct nat_rewrite_rule {
-	/* For digits 0-9 and + */
-	struct nat_rewrite_rule *rules[11];
+/*
+ * The compiled trie is pointer free so that it can be written to a
+ * file once and be mmap()ed by the NAT. The file is the header, the
+ * nodes in breadth first order and then the rules. The integers are
+ * in host byte order, a file from a host with a different order fails
+ * the version check.
+ */
+#define NAT_REWRITE_MAGIC	"NRWT"
+#define NAT_REWRITE_VERSION	1
+
+struct nat_rewrite_file_hdr {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_nodes;
+	uint32_t num_rules;
+};
+
+struct nat_rewrite_node {
+	/* bit n is set when there is a child for 0-9 and + (n = 10) */
+	uint16_t children;
+	uint16_t reserved;
+	/* index of the first child, the others follow it */
+	uint32_t first_child;
+	/* index + 1 into the rules or 0 */
+	uint32_t rule;
+};
 
-	char empty;
+struct nat_rewrite_rule {
 	char prefix[14];
 	char rewrite[6];
 };
 
 struct nat_rewrite {
-	struct nat_rewrite_rule rule;
+	const struct nat_rewrite_file_hdr *hdr;
+	const struct nat_rewrite_node *nodes;
+	const struct nat_rewrite_rule *rules;
 	size_t prefixes;
+
+	/* set when the trie has been mmap()ed from a compiled file */
+	void *map;
+	size_t len;
 };
 
 
 struct nat_rewrite *nat_rewrite_parse(void *ctx, const char *filename);
-struct nat_rewrite_rule *nat_rewrite_lookup(struct nat_rewrite *, const char *prefix);
+int nat_rewrite_write(struct nat_rewrite *rewr, const char *filename);
+const struct nat_rewrite_rule *nat_rewrite_lookup(struct nat_rewrite *, const char *prefix);
 void nat_rewrite_dump(struct nat_rewrite *rewr);
 void nat_rewrite_dump_vty(struct vty *vty, struct nat_rewrite *rewr);
 
@@ -0,0 +1,76 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef NAT_TIMER_WHEEL_H
+#define NAT_TIMER_WHEEL_H
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/timer.h>
+
+#include <stdint.h>
+
+/*
+ * Timers with a resolution of a second for the many connections and
+ * commands of the NAT. Each level has 64 slots, a level covers 64
+ * times the range of the one below it. A tick only looks at the slot
+ * of the current second and moves the timers of a higher level down
+ * once every 64 seconds of that level.
+ */
+#define NAT_WHEEL_BITS		6
+#define NAT_WHEEL_SIZE		(1 << NAT_WHEEL_BITS)
+#define NAT_WHEEL_MASK		(NAT_WHEEL_SIZE - 1)
+#define NAT_WHEEL_LEVELS	4
+/* about 194 days, longer timeouts are cut to it */
+#define NAT_WHEEL_MAX		((1u << (NAT_WHEEL_BITS * NAT_WHEEL_LEVELS)) - 1)
+
+struct nat_wheel_timer {
+	struct llist_head entry;
+	uint32_t expires;
+
+	void (*cb)(void *data);
+	void *data;
+};
+
+struct nat_timer_wheel {
+	struct llist_head slots[NAT_WHEEL_LEVELS][NAT_WHEEL_SIZE];
+
+	/* the time in seconds the wheel has been advanced to */
+	uint32_t now;
+	unsigned int pending;
+
+	/* only runs while there are timers */
+	struct osmo_timer_list tick;
+};
+
+struct nat_timer_wheel *nat_timer_wheel_alloc(void *ctx);
+void nat_timer_wheel_advance(struct nat_timer_wheel *wheel, uint32_t now);
+
+void nat_wheel_timer_setup(struct nat_wheel_timer *timer,
+			   void (*cb)(void *data), void *data);
+void nat_wheel_timer_schedule(struct nat_timer_wheel *wheel,
+			      struct nat_wheel_timer *timer, unsigned int seconds);
+void nat_wheel_timer_del(struct nat_timer_wheel *wheel,
+			 struct nat_wheel_timer *timer);
+
+/* a zeroed timer, e.g. from talloc_zero(), is not pending */
+static inline int nat_wheel_timer_pending(const struct nat_wheel_timer *timer)
+{
+	return timer->entry.next != NULL;
+}
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef OPENBSC_STR_HASH_H
+#define OPENBSC_STR_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* FNV-1a of the first len bytes, for the hash tables keyed by names */
+static inline uint32_t str_hash(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= (uint8_t) str[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+#endif
@@ -884,6 +884,8 @@ static int config_write_net(struct vty *vty)
 		gsmnet->dyn_ts_allow_tch_f ? 1 : 0, VTY_NEWLINE);
 	vty_out(vty, " subscriber-keep-in-ram %d%s",
 		gsmnet->subscr_group->keep_subscr, VTY_NEWLINE);
+	vty_out(vty, " subscriber-cache-size %d%s",
+		gsmnet->subscr_group->cache_size, VTY_NEWLINE);
 	if (gsmnet->tz.override != 0) {
 		if (gsmnet->tz.dst)
 			vty_out(vty, " timezone %d %d %d%s",
@@ -60,6 +60,9 @@ struct gsm_network *gsm_network_init(void *ctx,
 		return NULL;
 
 	net->subscr_group->net = net;
+	net->subscr_group->cache_size = GSM_SUBSCR_CACHE_DEFAULT;
+	net->subscr_write_interval = GSM_SUBSCR_WRITE_INTERVAL_DEFAULT;
+	net->subscr_write_batch = GSM_SUBSCR_WRITE_BATCH_DEFAULT;
 	net->auto_create_subscr = true;
 	net->auto_assign_exten = true;
 
@@ -81,6 +84,12 @@ struct gsm_network *gsm_network_init(void *ctx,
 		talloc_free(net);
 		return NULL;
 	}
+	net->msc_statg = osmo_stat_item_group_alloc(net, &msc_statg_desc, 0);
+	if (!net->msc_statg) {
+		rate_ctr_group_free(net->msc_ctrs);
+		talloc_free(net);
+		return NULL;
+	}
 	net->active_calls = osmo_counter_alloc("msc.active_calls");
 
 	net->mncc_recv = mncc_recv;
@@ -234,6 +234,19 @@ DEFUN(cfg_net_subscr_keep,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_net_subscr_cache,
+      cfg_net_subscr_cache_cmd,
+      "subscriber-cache-size <0-1000000>",
+      "Number of unused subscribers kept in RAM, the least recently used "
+      "are freed first. Changes made to the database by other programs "
+      "are not seen for them.\n"
+      "Number of subscribers, 0 to look them up in the database every time\n")
+{
+	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
+	gsmnet->subscr_group->cache_size = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_net_timezone,
       cfg_net_timezone_cmd,
       "timezone <-19-19> (0|15|30|45)",
@@ -317,6 +330,7 @@ int common_cs_vty_init(struct gsm_network *network,
 	install_element(GSMNET_NODE, &cfg_net_rrlp_mode_cmd);
 	install_element(GSMNET_NODE, &cfg_net_mm_info_cmd);
 	install_element(GSMNET_NODE, &cfg_net_subscr_keep_cmd);
+	install_element(GSMNET_NODE, &cfg_net_subscr_cache_cmd);
 	install_element(GSMNET_NODE, &cfg_net_timezone_cmd);
 	install_element(GSMNET_NODE, &cfg_net_timezone_dst_cmd);
 	install_element(GSMNET_NODE, &cfg_net_no_timezone_cmd);
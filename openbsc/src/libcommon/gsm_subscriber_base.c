@@ -31,16 +31,59 @@
 #include <osmocom/core/utils.h>
 #include <openbsc/gsm_subscriber.h>
 #include <openbsc/debug.h>
+#include <openbsc/str_hash.h>
 
 LLIST_HEAD(active_subscribers);
 void *tall_subscr_ctx;
 
+/*
+ * The VLR cache: the subscribers in RAM are hashed by IMSI, TMSI,
+ * extension and id. The unused ones are kept in the order they were
+ * last used and freed from the front once there are more than the
+ * cache_size of their group.
+ */
+#define SUBSCR_HASH_BITS	15
+#define SUBSCR_HASH_SIZE	(1 << SUBSCR_HASH_BITS)
+
+static struct llist_head subscr_by_imsi[SUBSCR_HASH_SIZE];
+static struct llist_head subscr_by_tmsi[SUBSCR_HASH_SIZE];
+static struct llist_head subscr_by_extension[SUBSCR_HASH_SIZE];
+static struct llist_head subscr_by_id[SUBSCR_HASH_SIZE];
+static LLIST_HEAD(subscr_lru);
+static int subscr_idle;
+
 /* for the gsm_subscriber.c */
 struct llist_head *subscr_bsc_active_subscribers(void)
 {
 	return &active_subscribers;
 }
 
+static void subscr_hash_init(void)
+{
+	static int initialized;
+	int i;
+
+	if (initialized)
+		return;
+
+	for (i = 0; i < SUBSCR_HASH_SIZE; i++) {
+		INIT_LLIST_HEAD(&subscr_by_imsi[i]);
+		INIT_LLIST_HEAD(&subscr_by_tmsi[i]);
+		INIT_LLIST_HEAD(&subscr_by_extension[i]);
+		INIT_LLIST_HEAD(&subscr_by_id[i]);
+	}
+	initialized = 1;
+}
+
+static unsigned int subscr_str_hash(const char *str)
+{
+	return str_hash(str, strlen(str)) & (SUBSCR_HASH_SIZE - 1);
+}
+
+static unsigned int subscr_num_hash(unsigned long long num)
+{
+	return (num ^ (num >> SUBSCR_HASH_BITS)) & (SUBSCR_HASH_SIZE - 1);
+}
 
 char *subscr_name(struct gsm_subscriber *subscr)
 {
@@ -61,11 +104,18 @@ struct gsm_subscriber *subscr_alloc(void)
 	if (!s)
 		return NULL;
 
+	subscr_hash_init();
+
 	llist_add_tail(&s->entry, &active_subscribers);
 	s->use_count = 1;
 	s->tmsi = GSM_RESERVED_TMSI;
 
 	INIT_LLIST_HEAD(&s->requests);
+	INIT_LLIST_HEAD(&s->by_imsi);
+	INIT_LLIST_HEAD(&s->by_tmsi);
+	INIT_LLIST_HEAD(&s->by_extension);
+	INIT_LLIST_HEAD(&s->by_id);
+	INIT_LLIST_HEAD(&s->lru);
 
 	return s;
 }
@@ -73,6 +123,14 @@ struct gsm_subscriber *subscr_alloc(void)
 static void subscr_free(struct gsm_subscriber *subscr)
 {
 	llist_del(&subscr->entry);
+	llist_del(&subscr->by_imsi);
+	llist_del(&subscr->by_tmsi);
+	llist_del(&subscr->by_extension);
+	llist_del(&subscr->by_id);
+	if (!llist_empty(&subscr->lru)) {
+		llist_del(&subscr->lru);
+		subscr_idle -= 1;
+	}
 	talloc_free(subscr);
 }
 
@@ -82,9 +140,151 @@ void subscr_direct_free(struct gsm_subscriber *subscr)
 	subscr_free(subscr);
 }
 
-struct gsm_subscriber *subscr_get(struct gsm_subscriber *subscr)
+static struct gsm_subscriber *find_by_imsi(const char *imsi)
+{
+	struct gsm_subscriber *subscr;
+
+	llist_for_each_entry(subscr, &subscr_by_imsi[subscr_str_hash(imsi)],
+			     by_imsi) {
+		if (strcmp(subscr->imsi, imsi) == 0)
+			return subscr;
+	}
+
+	return NULL;
+}
+
+static struct gsm_subscriber *find_by_tmsi(uint32_t tmsi)
+{
+	struct gsm_subscriber *subscr;
+
+	llist_for_each_entry(subscr, &subscr_by_tmsi[subscr_num_hash(tmsi)],
+			     by_tmsi) {
+		if (subscr->tmsi == tmsi)
+			return subscr;
+	}
+
+	return NULL;
+}
+
+static struct gsm_subscriber *find_by_extension(const char *ext)
+{
+	struct gsm_subscriber *subscr;
+
+	llist_for_each_entry(subscr, &subscr_by_extension[subscr_str_hash(ext)],
+			     by_extension) {
+		if (strcmp(subscr->extension, ext) == 0)
+			return subscr;
+	}
+
+	return NULL;
+}
+
+static struct gsm_subscriber *find_by_id(unsigned long long id)
+{
+	struct gsm_subscriber *subscr;
+
+	llist_for_each_entry(subscr, &subscr_by_id[subscr_num_hash(id)], by_id) {
+		if (subscr->id == id)
+			return subscr;
+	}
+
+	return NULL;
+}
+
+/*
+ * Hash it again after the IMSI, TMSI, extension or id changed. A key
+ * already taken by another subscriber in RAM stays with that one, a
+ * second copy loaded from the database is not found by the lookups.
+ */
+void subscr_cache_index(struct gsm_subscriber *subscr)
+{
+	llist_del_init(&subscr->by_imsi);
+	llist_del_init(&subscr->by_tmsi);
+	llist_del_init(&subscr->by_extension);
+	llist_del_init(&subscr->by_id);
+
+	if (subscr->imsi[0] && !find_by_imsi(subscr->imsi))
+		llist_add(&subscr->by_imsi,
+			  &subscr_by_imsi[subscr_str_hash(subscr->imsi)]);
+	if (subscr->tmsi != GSM_RESERVED_TMSI && !find_by_tmsi(subscr->tmsi))
+		llist_add(&subscr->by_tmsi,
+			  &subscr_by_tmsi[subscr_num_hash(subscr->tmsi)]);
+	if (subscr->extension[0] && !find_by_extension(subscr->extension))
+		llist_add(&subscr->by_extension,
+			  &subscr_by_extension[subscr_str_hash(subscr->extension)]);
+	if (subscr->id && !find_by_id(subscr->id))
+		llist_add(&subscr->by_id,
+			  &subscr_by_id[subscr_num_hash(subscr->id)]);
+}
+
+/* it was deleted from the database, it goes with the last reference */
+void subscr_cache_forget(struct gsm_subscriber *subscr)
+{
+	llist_del_init(&subscr->by_imsi);
+	llist_del_init(&subscr->by_tmsi);
+	llist_del_init(&subscr->by_extension);
+	llist_del_init(&subscr->by_id);
+	subscr->dirty = 0;
+}
+
+static void subscr_cache_evict(int size)
+{
+	struct gsm_subscriber *subscr;
+	struct gsm_network *net;
+
+	while (subscr_idle > size) {
+		subscr = llist_entry(subscr_lru.next, struct gsm_subscriber, lru);
+		net = subscr->group ? subscr->group->net : NULL;
+		if (net && net->msc_ctrs)
+			rate_ctr_inc(&net->msc_ctrs->ctr[MSC_CTR_SUBSCR_CACHE_EVICTED]);
+		subscr_free(subscr);
+	}
+}
+
+/* called for the last reference, the write might take its own */
+static void subscr_write_back(struct gsm_subscriber *subscr)
 {
+	struct gsm_subscriber_group *sgrp = subscr->group;
+
+	subscr->dirty = 0;
+	if (!sgrp || !sgrp->write_back)
+		return;
+
 	subscr->use_count++;
+	if (sgrp->write_back(subscr) != 0)
+		LOGP(DREF, LOGL_ERROR, "Failed to write back subscriber %s\n",
+		     subscr_name(subscr));
+	subscr->use_count--;
+}
+
+/* only while holding a reference, it is written back with the last */
+void subscr_mark_dirty(struct gsm_subscriber *subscr)
+{
+	subscr->dirty = 1;
+}
+
+int subscr_write_back_all(void)
+{
+	struct gsm_subscriber *subscr;
+	int written = 0;
+
+	/* the dirty ones are still referenced, nothing is freed here */
+	llist_for_each_entry(subscr, &active_subscribers, entry) {
+		if (!subscr->dirty)
+			continue;
+		subscr_write_back(subscr);
+		written += 1;
+	}
+
+	return written;
+}
+
+struct gsm_subscriber *subscr_get(struct gsm_subscriber *subscr)
+{
+	if (subscr->use_count++ == 0 && !llist_empty(&subscr->lru)) {
+		llist_del_init(&subscr->lru);
+		subscr_idle -= 1;
+	}
 	DEBUGP(DREF, "subscr %s usage increases usage to: %d\n",
 			subscr->extension, subscr->use_count);
 	return subscr;
@@ -92,13 +292,29 @@ struct gsm_subscriber *subscr_get(struct gsm_subscriber *subscr)
 
 struct gsm_subscriber *subscr_put(struct gsm_subscriber *subscr)
 {
+	struct gsm_subscriber_group *sgrp = subscr->group;
+
 	subscr->use_count--;
 	DEBUGP(DREF, "subscr %s usage decreased usage to: %d\n",
 			subscr->extension, subscr->use_count);
-	if (subscr->use_count <= 0 &&
-	    !((subscr->group && subscr->group->keep_subscr) ||
-	      subscr->keep_in_ram))
-		subscr_free(subscr);
+	if (subscr->use_count > 0)
+		return NULL;
+
+	if (subscr->dirty)
+		subscr_write_back(subscr);
+	if (subscr->use_count > 0 ||
+	    (sgrp && sgrp->keep_subscr) || subscr->keep_in_ram)
+		return NULL;
+
+	/* keep it around for the next lookup */
+	if (sgrp && sgrp->cache_size > 0 && !llist_empty(&subscr->by_imsi)) {
+		llist_add_tail(&subscr->lru, &subscr_lru);
+		subscr_idle += 1;
+		subscr_cache_evict(sgrp->cache_size);
+		return NULL;
+	}
+
+	subscr_free(subscr);
 	return NULL;
 }
 
@@ -107,10 +323,9 @@ struct gsm_subscriber *subscr_get_or_create(struct gsm_subscriber_group *sgrp,
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0 && subscr->group == sgrp)
-			return subscr_get(subscr);
-	}
+	subscr = subscr_cache_by_imsi(sgrp, imsi);
+	if (subscr)
+		return subscr;
 
 	subscr = subscr_alloc();
 	if (!subscr)
@@ -118,33 +333,57 @@ struct gsm_subscriber *subscr_get_or_create(struct gsm_subscriber_group *sgrp,
 
 	osmo_strlcpy(subscr->imsi, imsi, sizeof(subscr->imsi));
 	subscr->group = sgrp;
+	subscr_cache_index(subscr);
 	return subscr;
 }
 
-struct gsm_subscriber *subscr_active_by_tmsi(struct gsm_subscriber_group *sgrp,
-					     uint32_t tmsi)
+/* the lookups return a new reference, sgrp NULL matches any group */
+static struct gsm_subscriber *cache_hit(struct gsm_subscriber_group *sgrp,
+					struct gsm_subscriber *subscr)
 {
-	struct gsm_subscriber *subscr;
+	if (!subscr || (sgrp && subscr->group != sgrp))
+		return NULL;
+	return subscr_get(subscr);
+}
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (subscr->tmsi == tmsi && subscr->group == sgrp)
-			return subscr_get(subscr);
-	}
+struct gsm_subscriber *subscr_cache_by_imsi(struct gsm_subscriber_group *sgrp,
+					    const char *imsi)
+{
+	subscr_hash_init();
+	return cache_hit(sgrp, find_by_imsi(imsi));
+}
 
-	return NULL;
+struct gsm_subscriber *subscr_cache_by_tmsi(struct gsm_subscriber_group *sgrp,
+					    uint32_t tmsi)
+{
+	subscr_hash_init();
+	return cache_hit(sgrp, find_by_tmsi(tmsi));
 }
 
-struct gsm_subscriber *subscr_active_by_imsi(struct gsm_subscriber_group *sgrp,
-					     const char *imsi)
+struct gsm_subscriber *subscr_cache_by_extension(struct gsm_subscriber_group *sgrp,
+						 const char *ext)
 {
-	struct gsm_subscriber *subscr;
+	subscr_hash_init();
+	return cache_hit(sgrp, find_by_extension(ext));
+}
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0 && subscr->group == sgrp)
-			return subscr_get(subscr);
-	}
+struct gsm_subscriber *subscr_cache_by_id(struct gsm_subscriber_group *sgrp,
+					  unsigned long long id)
+{
+	subscr_hash_init();
+	return cache_hit(sgrp, find_by_id(id));
+}
 
-	return NULL;
+struct gsm_subscriber *subscr_active_by_tmsi(struct gsm_subscriber_group *sgrp,
+					     uint32_t tmsi)
+{
+	return subscr_cache_by_tmsi(sgrp, tmsi);
+}
+
+struct gsm_subscriber *subscr_active_by_imsi(struct gsm_subscriber_group *sgrp,
+					     const char *imsi)
+{
+	return subscr_cache_by_imsi(sgrp, imsi);
 }
 
 int subscr_purge_inactive(struct gsm_subscriber_group *sgrp)
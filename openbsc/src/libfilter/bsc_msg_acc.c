@@ -24,6 +24,8 @@
 #include <osmocom/core/rate_ctr.h>
 #include <osmocom/core/stats.h>
 
+#include <ctype.h>
+#include <limits.h>
 #include <string.h>
 
 static const struct rate_ctr_desc acc_list_ctr_description[] = {
@@ -55,18 +57,268 @@ static unsigned int rate_ctr_get_unused_idx(struct llist_head *head)
 }
 
 
-int bsc_msg_acc_lst_check_allow(struct bsc_msg_acc_lst *lst, const char *mi_string)
+/*
+ * The allow and the deny patterns of a list are compiled into a digit
+ * trie for the ones only matching a prefix (^123, ^123.*, ^123[0-9]*),
+ * a whole IMSI (^123$) or a part of it (123, 123.*) and a list of the
+ * remaining ones for regexec(). Every node remembers the position of
+ * the first entry ending there so the first matching entry of the list
+ * is found like before, only the remaining patterns in front of it have
+ * to be tried.
+ */
+#define ACC_NONE	INT_MAX
+#define ACC_ANCHORED	0
+#define ACC_ANYWHERE	1
+
+struct bsc_msg_acc_node {
+	int child[10];
+	/* position of the first entry matching from here on */
+	int prefix;
+	/* position of the first entry matching if the IMSI ends here */
+	int exact;
+};
+
+struct bsc_msg_acc_match {
+	struct bsc_msg_acc_node *nodes;
+	int num_nodes;
+	int alloc_nodes;
+	int anywhere;
+
+	/* the entries with a pattern in the order of the list */
+	struct bsc_msg_acc_lst_entry **entries;
+	int num_entries;
+
+	/* positions of the ones left to regexec() */
+	int *regex;
+	int num_regex;
+};
+
+static int acc_node_alloc(struct bsc_msg_acc_match *match)
+{
+	struct bsc_msg_acc_node *nodes;
+	int i;
+
+	if (match->num_nodes == match->alloc_nodes) {
+		nodes = talloc_realloc(match, match->nodes, struct bsc_msg_acc_node,
+				       match->alloc_nodes * 2);
+		if (!nodes)
+			return -1;
+		match->nodes = nodes;
+		match->alloc_nodes *= 2;
+	}
+
+	for (i = 0; i < 10; ++i)
+		match->nodes[match->num_nodes].child[i] = 0;
+	match->nodes[match->num_nodes].prefix = ACC_NONE;
+	match->nodes[match->num_nodes].exact = ACC_NONE;
+	return match->num_nodes++;
+}
+
+/*
+ * Split a basic regexp into ^, digits and one of .*, [0-9]* or $. The
+ * wildcards match the empty string and do not change the outcome of an
+ * unanchored search. Returns -1 for everything else.
+ */
+static int acc_parse_pattern(const char *re, int *anchored, int *len, int *exact)
+{
+	const char *p = re;
+
+	*anchored = *p == '^';
+	if (*anchored)
+		p += 1;
+
+	for (*len = 0; isdigit((unsigned char) p[*len]); *len += 1)
+		;
+	p += *len;
+
+	*exact = 0;
+	if (strcmp(p, ".*") == 0 || strcmp(p, "[0-9]*") == 0 ||
+	    strcmp(p, ".*$") == 0)
+		return 0;
+	if (strcmp(p, "$") == 0) {
+		/* a suffix match is left to regexec() */
+		*exact = 1;
+		return *anchored ? 0 : -1;
+	}
+	return *p == '\0' ? 0 : -1;
+}
+
+static int acc_match_add(struct bsc_msg_acc_match *match, const char *re, int pos)
+{
+	int anchored, len, exact, i, node, child;
+
+	if (acc_parse_pattern(re, &anchored, &len, &exact) != 0) {
+		match->regex[match->num_regex++] = pos;
+		return 0;
+	}
+
+	/* an empty pattern matches everything */
+	node = anchored || len == 0 ? ACC_ANCHORED : ACC_ANYWHERE;
+	if (node == ACC_ANYWHERE)
+		match->anywhere = 1;
+
+	if (anchored)
+		re += 1;
+	for (i = 0; i < len; ++i) {
+		child = match->nodes[node].child[re[i] - '0'];
+		if (child == 0) {
+			child = acc_node_alloc(match);
+			if (child < 0)
+				return -1;
+			match->nodes[node].child[re[i] - '0'] = child;
+		}
+		node = child;
+	}
+
+	/* the earlier entry wins */
+	if (exact && match->nodes[node].exact == ACC_NONE)
+		match->nodes[node].exact = pos;
+	else if (!exact && match->nodes[node].prefix == ACC_NONE)
+		match->nodes[node].prefix = pos;
+	return 0;
+}
+
+static struct bsc_msg_acc_match *acc_match_compile(struct bsc_msg_acc_lst *lst, int deny)
+{
+	struct bsc_msg_acc_match *match;
+	struct bsc_msg_acc_lst_entry *entry;
+	int count = 0;
+
+	llist_for_each_entry(entry, &lst->fltr_list, list)
+		if (deny ? entry->imsi_deny != NULL : entry->imsi_allow != NULL)
+			count += 1;
+
+	match = talloc_zero(lst, struct bsc_msg_acc_match);
+	if (!match)
+		return NULL;
+	match->entries = talloc_array(match, struct bsc_msg_acc_lst_entry *, count);
+	match->regex = talloc_array(match, int, count);
+	match->nodes = talloc_array(match, struct bsc_msg_acc_node, 64);
+	match->alloc_nodes = 64;
+	if (!match->entries || !match->regex || !match->nodes)
+		goto error;
+
+	/* the roots for the anchored and the unanchored patterns */
+	acc_node_alloc(match);
+	acc_node_alloc(match);
+
+	llist_for_each_entry(entry, &lst->fltr_list, list) {
+		const char *re = deny ? entry->imsi_deny : entry->imsi_allow;
+
+		if (!re)
+			continue;
+		if (acc_match_add(match, re, match->num_entries) != 0)
+			goto error;
+		match->entries[match->num_entries++] = entry;
+	}
+
+	LOGP(DNAT, LOGL_DEBUG, "Compiled %s list %s with %d entries, %d by regexp.\n",
+	     deny ? "deny" : "allow", lst->name, match->num_entries, match->num_regex);
+	return match;
+
+error:
+	LOGP(DNAT, LOGL_ERROR, "Failed to compile access list %s.\n", lst->name);
+	talloc_free(match);
+	return NULL;
+}
+
+static int acc_walk(const struct bsc_msg_acc_match *match, int node,
+		    const char *imsi, int best)
+{
+	const struct bsc_msg_acc_node *nodes = match->nodes;
+
+	for (;; ++imsi) {
+		if (nodes[node].prefix < best)
+			best = nodes[node].prefix;
+		if (*imsi == '\0') {
+			if (nodes[node].exact < best)
+				best = nodes[node].exact;
+			break;
+		}
+		if (!isdigit((unsigned char) *imsi))
+			break;
+		node = nodes[node].child[*imsi - '0'];
+		if (node == 0)
+			break;
+	}
+
+	return best;
+}
+
+static struct bsc_msg_acc_lst_entry *acc_match_first(const struct bsc_msg_acc_match *match,
+						     const char *imsi, int deny)
+{
+	struct bsc_msg_acc_lst_entry *entry;
+	int i, best;
+
+	best = acc_walk(match, ACC_ANCHORED, imsi, ACC_NONE);
+	for (i = 0; match->anywhere && imsi[i] != '\0'; ++i) {
+		int node = isdigit((unsigned char) imsi[i]) ?
+				match->nodes[ACC_ANYWHERE].child[imsi[i] - '0'] : 0;
+		if (node != 0)
+			best = acc_walk(match, node, &imsi[i + 1], best);
+	}
+
+	/* only patterns in front of the best match can change it */
+	for (i = 0; i < match->num_regex && match->regex[i] < best; ++i) {
+		entry = match->entries[match->regex[i]];
+		if (regexec(deny ? &entry->imsi_deny_re : &entry->imsi_allow_re,
+			    imsi, 0, NULL, 0) == 0) {
+			best = match->regex[i];
+			break;
+		}
+	}
+
+	return best == ACC_NONE ? NULL : match->entries[best];
+}
+
+/* the first entry with a matching pattern, without compiling the list */
+static struct bsc_msg_acc_lst_entry *acc_regexec_first(struct bsc_msg_acc_lst *lst,
+						       const char *imsi, int deny)
 {
 	struct bsc_msg_acc_lst_entry *entry;
 
 	llist_for_each_entry(entry, &lst->fltr_list, list) {
-		if (!entry->imsi_allow)
+		if (deny ? !entry->imsi_deny : !entry->imsi_allow)
 			continue;
-		if (regexec(&entry->imsi_allow_re, mi_string, 0, NULL, 0) == 0)
-			return 0;
+		if (regexec(deny ? &entry->imsi_deny_re : &entry->imsi_allow_re,
+			    imsi, 0, NULL, 0) == 0)
+			return entry;
 	}
 
-	return 1;
+	return NULL;
+}
+
+static struct bsc_msg_acc_lst_entry *acc_lst_first(struct bsc_msg_acc_lst *lst,
+						   const char *imsi, int deny)
+{
+	struct bsc_msg_acc_match **match = deny ? &lst->deny_match : &lst->allow_match;
+
+	if (!*match)
+		*match = acc_match_compile(lst, deny);
+	if (!*match)
+		return acc_regexec_first(lst, imsi, deny);
+	return acc_match_first(*match, imsi, deny);
+}
+
+int bsc_msg_acc_lst_check_allow(struct bsc_msg_acc_lst *lst, const char *mi_string)
+{
+	return acc_lst_first(lst, mi_string, 0) ? 0 : 1;
+}
+
+struct bsc_msg_acc_lst_entry *bsc_msg_acc_lst_find_deny(struct bsc_msg_acc_lst *lst,
+							const char *mi_string)
+{
+	return acc_lst_first(lst, mi_string, 1);
+}
+
+/* to be called after the patterns of the entries have been changed */
+void bsc_msg_acc_lst_changed(struct bsc_msg_acc_lst *lst)
+{
+	talloc_free(lst->allow_match);
+	talloc_free(lst->deny_match);
+	lst->allow_match = NULL;
+	lst->deny_match = NULL;
 }
 
 struct bsc_msg_acc_lst *bsc_msg_acc_lst_find(struct llist_head *head, const char *name)
@@ -129,5 +381,6 @@ struct bsc_msg_acc_lst_entry *bsc_msg_acc_lst_entry_create(struct bsc_msg_acc_ls
 	entry->cm_reject_cause = GSM48_REJECT_PLMN_NOT_ALLOWED;
 	entry->lu_reject_cause = GSM48_REJECT_PLMN_NOT_ALLOWED;
 	llist_add_tail(&entry->list, &lst->fltr_list);
+	bsc_msg_acc_lst_changed(lst);
 	return entry;
 }
@@ -125,17 +125,13 @@ static int lst_check_deny(struct bsc_msg_acc_lst *lst, const char *mi_string,
 {
 	struct bsc_msg_acc_lst_entry *entry;
 
-	llist_for_each_entry(entry, &lst->fltr_list, list) {
-		if (!entry->imsi_deny)
-			continue;
-		if (regexec(&entry->imsi_deny_re, mi_string, 0, NULL, 0) == 0) {
-			*cm_cause = entry->cm_reject_cause;
-			*lu_cause = entry->lu_reject_cause;
-			return 0;
-		}
-	}
+	entry = bsc_msg_acc_lst_find_deny(lst, mi_string);
+	if (!entry)
+		return 1;
 
-	return 1;
+	*cm_cause = entry->cm_reject_cause;
+	*lu_cause = entry->lu_reject_cause;
+	return 0;
 }
 
 /* apply white/black list */
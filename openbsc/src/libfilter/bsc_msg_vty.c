@@ -95,6 +95,7 @@ DEFUN(cfg_lst_imsi_allow,
 
 	if (gsm_parse_reg(acc, &entry->imsi_allow_re, &entry->imsi_allow, argc - 1, &argv[1]) != 0)
 		return CMD_WARNING;
+	bsc_msg_acc_lst_changed(acc);
 	return CMD_SUCCESS;
 }
 
@@ -121,6 +122,7 @@ DEFUN(cfg_lst_imsi_deny,
 
 	if (gsm_parse_reg(acc, &entry->imsi_deny_re, &entry->imsi_deny, argc - 1, &argv[1]) != 0)
 		return CMD_WARNING;
+	bsc_msg_acc_lst_changed(acc);
 	if (argc >= 3)
 		entry->cm_reject_cause = atoi(argv[2]);
 	if (argc >= 4)
@@ -0,0 +1,308 @@
+/* G.711 and L16 sample conversion kernels */
+
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "g711common.h"
+
+#include <openbsc/mgcp_g711.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_G711_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * The scalar versions are the reference, every other implementation
+ * has to produce the very same output (see tests/mgcp/mgcp_g711_test).
+ */
+static void scalar_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n)
+		*(buf++) = s16_to_alaw(*(sample++));
+}
+
+static void scalar_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n)
+		*(sample++) = alaw_to_s16(*(buf++));
+}
+
+static void scalar_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n)
+		*(buf++) = s16_to_ulaw(*(sample++));
+}
+
+static void scalar_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n)
+		*(sample++) = ulaw_to_s16(*(buf++));
+}
+
+static void scalar_l16_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n, ++sample, buf += 2) {
+		buf[0] = sample[0] >> 8;
+		buf[1] = sample[0] & 0xff;
+	}
+}
+
+static void scalar_l16_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n, ++sample, buf += 2)
+		sample[0] = ((short)buf[0] << 8) | buf[1];
+}
+
+/*
+ * Lookup tables indexed by the (unsigned) sample or the code word. The
+ * encoder tables have three bytes of padding so the AVX2 gather can
+ * load 32 bits from the last entry.
+ */
+static uint8_t alaw_enc_table[65536 + 3];
+static uint8_t ulaw_enc_table[65536 + 3];
+static int32_t alaw_dec_table[256];
+static int32_t ulaw_dec_table[256];
+
+static void table_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n)
+		*(buf++) = alaw_enc_table[(uint16_t) *(sample++)];
+}
+
+static void table_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n)
+		*(sample++) = alaw_dec_table[*(buf++)];
+}
+
+static void table_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n > 0; --n)
+		*(buf++) = ulaw_enc_table[(uint16_t) *(sample++)];
+}
+
+static void table_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n > 0; --n)
+		*(sample++) = ulaw_dec_table[*(buf++)];
+}
+
+#ifdef HAVE_G711_X86
+/* L16 is big endian, swap the bytes of eight samples at a time */
+__attribute__((target("sse2")))
+static void sse2_l16_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n >= 8; n -= 8, sample += 8, buf += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) sample);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) buf, v);
+	}
+	scalar_l16_encode(sample, buf, n);
+}
+
+__attribute__((target("sse2")))
+static void sse2_l16_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n >= 8; n -= 8, sample += 8, buf += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) buf);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) sample, v);
+	}
+	scalar_l16_decode(buf, sample, n);
+}
+
+__attribute__((target("avx2")))
+static void avx2_l16_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) sample);
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *) buf, v);
+	}
+	scalar_l16_encode(sample, buf, n);
+}
+
+__attribute__((target("avx2")))
+static void avx2_l16_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) buf);
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *) sample, v);
+	}
+	scalar_l16_decode(buf, sample, n);
+}
+
+/* Gather 16 entries of a 256 entry table and narrow them to 16 bit. */
+__attribute__((target("avx2")))
+static void avx2_table_decode(const int32_t *table, const uint8_t *buf,
+			      int16_t *sample, size_t n)
+{
+	for (; n >= 16; n -= 16, sample += 16, buf += 16) {
+		__m128i idx = _mm_loadu_si128((const __m128i *) buf);
+		__m256i lo = _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(idx), 4);
+		__m256i hi = _mm256_i32gather_epi32(table,
+				_mm256_cvtepu8_epi32(_mm_srli_si128(idx, 8)), 4);
+		/* packs works per 128 bit lane, restore the order */
+		__m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+		_mm256_storeu_si256((__m256i *) sample, v);
+	}
+	for (; n > 0; --n)
+		*(sample++) = table[*(buf++)];
+}
+
+/* Gather 16 entries of a 64K entry byte table, the upper bytes are masked. */
+__attribute__((target("avx2")))
+static void avx2_table_encode(const uint8_t *table, const int16_t *sample,
+			      uint8_t *buf, size_t n)
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+
+	for (; n >= 16; n -= 16, sample += 16, buf += 16) {
+		__m128i s_lo = _mm_loadu_si128((const __m128i *) sample);
+		__m128i s_hi = _mm_loadu_si128((const __m128i *) (sample + 8));
+		__m256i lo = _mm256_i32gather_epi32((const int *) table,
+				_mm256_cvtepu16_epi32(s_lo), 1);
+		__m256i hi = _mm256_i32gather_epi32((const int *) table,
+				_mm256_cvtepu16_epi32(s_hi), 1);
+		__m256i v;
+
+		lo = _mm256_and_si256(lo, mask);
+		hi = _mm256_and_si256(hi, mask);
+		v = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+		_mm_storeu_si128((__m128i *) buf,
+				 _mm_packus_epi16(_mm256_castsi256_si128(v),
+						  _mm256_extracti128_si256(v, 1)));
+	}
+	for (; n > 0; --n)
+		*(buf++) = table[(uint16_t) *(sample++)];
+}
+
+static void avx2_alaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	avx2_table_encode(alaw_enc_table, sample, buf, n);
+}
+
+static void avx2_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	avx2_table_decode(alaw_dec_table, buf, sample, n);
+}
+
+static void avx2_ulaw_encode(const int16_t *sample, uint8_t *buf, size_t n)
+{
+	avx2_table_encode(ulaw_enc_table, sample, buf, n);
+}
+
+static void avx2_ulaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	avx2_table_decode(ulaw_dec_table, buf, sample, n);
+}
+#endif
+
+static const struct mgcp_g711_ops g711_impls[_NUM_MGCP_G711_IMPL] = {
+	[MGCP_G711_SCALAR] = {
+		.name = "scalar",
+		.alaw_encode = scalar_alaw_encode,
+		.alaw_decode = scalar_alaw_decode,
+		.ulaw_encode = scalar_ulaw_encode,
+		.ulaw_decode = scalar_ulaw_decode,
+		.l16_encode = scalar_l16_encode,
+		.l16_decode = scalar_l16_decode,
+	},
+	[MGCP_G711_TABLE] = {
+		.name = "table",
+		.alaw_encode = table_alaw_encode,
+		.alaw_decode = table_alaw_decode,
+		.ulaw_encode = table_ulaw_encode,
+		.ulaw_decode = table_ulaw_decode,
+		.l16_encode = scalar_l16_encode,
+		.l16_decode = scalar_l16_decode,
+	},
+#ifdef HAVE_G711_X86
+	[MGCP_G711_SSE2] = {
+		.name = "sse2",
+		.alaw_encode = table_alaw_encode,
+		.alaw_decode = table_alaw_decode,
+		.ulaw_encode = table_ulaw_encode,
+		.ulaw_decode = table_ulaw_decode,
+		.l16_encode = sse2_l16_encode,
+		.l16_decode = sse2_l16_decode,
+	},
+	[MGCP_G711_AVX2] = {
+		.name = "avx2",
+		.alaw_encode = avx2_alaw_encode,
+		.alaw_decode = avx2_alaw_decode,
+		.ulaw_encode = avx2_ulaw_encode,
+		.ulaw_decode = avx2_ulaw_decode,
+		.l16_encode = avx2_l16_encode,
+		.l16_decode = avx2_l16_decode,
+	},
+#endif
+};
+
+const struct mgcp_g711_ops *mgcp_g711 = &g711_impls[MGCP_G711_SCALAR];
+
+const struct mgcp_g711_ops *mgcp_g711_get_impl(enum mgcp_g711_impl impl)
+{
+	switch (impl) {
+	case MGCP_G711_SCALAR:
+	case MGCP_G711_TABLE:
+		return &g711_impls[impl];
+#ifdef HAVE_G711_X86
+	case MGCP_G711_SSE2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("sse2"))
+			return NULL;
+		return &g711_impls[impl];
+	case MGCP_G711_AVX2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return NULL;
+		return &g711_impls[impl];
+#endif
+	default:
+		return NULL;
+	}
+}
+
+static __attribute__((constructor)) void on_dso_load_g711(void)
+{
+	int i;
+
+	for (i = 0; i < 65536; ++i) {
+		alaw_enc_table[i] = s16_to_alaw((int16_t) i);
+		ulaw_enc_table[i] = s16_to_ulaw((int16_t) i);
+	}
+	for (i = 0; i < 256; ++i) {
+		alaw_dec_table[i] = alaw_to_s16(i);
+		ulaw_dec_table[i] = ulaw_to_s16(i);
+	}
+
+	for (i = _NUM_MGCP_G711_IMPL - 1; i > MGCP_G711_SCALAR; --i) {
+		const struct mgcp_g711_ops *ops = mgcp_g711_get_impl(i);
+		if (ops) {
+			mgcp_g711 = ops;
+			break;
+		}
+	}
+}
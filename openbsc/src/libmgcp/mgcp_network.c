@@ -21,6 +21,7 @@
  *
  */
 
+#define _GNU_SOURCE /* recvmmsg/sendmmsg */
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -29,9 +30,11 @@
 #include <limits.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include <osmocom/core/msgb.h>
+#include <osmocom/core/utils.h>
 #include <osmocom/core/select.h>
 
 #include <osmocom/netif/rtp.h>
@@ -47,13 +50,38 @@
 #define RTP_SEQ_MOD		(1 << 16)
 #define RTP_MAX_DROPOUT		3000
 #define RTP_MAX_MISORDER	100
-#define RTP_BUF_SIZE		4096
 
 enum {
 	MGCP_PROTO_RTP,
 	MGCP_PROTO_RTCP,
 };
 
+/**
+ * Batched RTP forwarding. With "rtp batch" configured the RTP sockets
+ * are drained with recvmmsg() and everything forwarded while processing
+ * the batch is collected and handed to sendmmsg() at the end. The data
+ * is copied as the rtp_processing_cb may reuse the buffer for more than
+ * one outgoing packet.
+ */
+struct rtp_batch_tx {
+	int fd;
+	/* the socket is connected to addr */
+	int connected;
+	struct sockaddr_in addr;
+	int len;
+	char buf[RTP_BUF_SIZE];
+};
+
+static __thread struct {
+	/* set while the packets of a batch are processed */
+	struct mgcp_config *cfg;
+	int tx_count;
+	struct rtp_batch_tx tx[MGCP_RTP_BATCH_MAX];
+	char rx_buf[MGCP_RTP_BATCH_MAX][RTP_BUF_SIZE];
+	/* MGCP_RTP_BATCH_MAX buffers for coalesced reads, allocated on use */
+	char *gro_buf;
+} rtp_batch;
+
 /**
  * This does not need to be a precision timestamp and
  * is allowed to wrap quite fast. The returned value is
@@ -69,7 +97,7 @@ static uint32_t get_current_ts(unsigned unit)
 
 	memset(&tp, 0, sizeof(tp));
 	if (clock_gettime(CLOCK_MONOTONIC, &tp) != 0)
-		LOGP(DMGCP, LOGL_NOTICE,
+		LOGP_RTP(DMGCP, LOGL_NOTICE,
 			"Getting the clock failed.\n");
 
 	/* convert it to 1/unit seconds */
@@ -90,6 +118,204 @@ int mgcp_udp_send(int fd, struct in_addr *addr, int port, char *buf, int len)
 	return sendto(fd, buf, len, 0, (struct sockaddr *)&out, sizeof(out));
 }
 
+/*
+ * Packets of the same size to the peer of a connected socket can leave
+ * with a single UDP_SEGMENT send. Returns how many of the packets from
+ * start have been sent that way, 0 when they need to go one by one.
+ */
+static int rtp_batch_send_gso(struct iovec *iov, int start, int end)
+{
+	struct mgcp_rtp_stats *stats = mgcp_rtp_stats(rtp_batch.cfg);
+	int seg_size = rtp_batch.tx[start].len;
+	int i, total = 0;
+
+	if (seg_size > MGCP_UDP_GSO_MAX_SEG_SIZE)
+		return 0;
+
+	for (i = start; i < end && i - start < MGCP_UDP_GSO_MAX_SEGS; ++i) {
+		if (!rtp_batch.tx[i].connected || rtp_batch.tx[i].len > seg_size ||
+		    total + rtp_batch.tx[i].len > MGCP_UDP_GSO_MAX_SIZE)
+			break;
+		total += rtp_batch.tx[i].len;
+		/* only the last one may be shorter */
+		if (rtp_batch.tx[i].len < seg_size) {
+			++i;
+			break;
+		}
+	}
+
+	if (i - start < 2)
+		return 0;
+
+	if (mgcp_udp_send_gso(rtp_batch.tx[start].fd, &iov[start],
+			      i - start, seg_size) < 0)
+		return 0;
+
+	mgcp_rtp_stat_add(&stats->tx_syscalls, 1);
+	mgcp_rtp_stat_add(&stats->tx_packets, i - start);
+	mgcp_rtp_stat_add(&stats->gso_sends, 1);
+	mgcp_rtp_stat_add(&stats->gso_packets, i - start);
+	return i - start;
+}
+
+static void rtp_batch_flush(void)
+{
+	struct mmsghdr msgs[MGCP_RTP_BATCH_MAX];
+	struct iovec iov[MGCP_RTP_BATCH_MAX];
+	struct mgcp_rtp_stats *stats = mgcp_rtp_stats(rtp_batch.cfg);
+	int i, start, end, gso;
+
+	memset(msgs, 0, sizeof(msgs[0]) * rtp_batch.tx_count);
+	for (i = 0; i < rtp_batch.tx_count; ++i) {
+		iov[i].iov_base = rtp_batch.tx[i].buf;
+		iov[i].iov_len = rtp_batch.tx[i].len;
+		/* the connected socket knows where to send to */
+		if (!rtp_batch.tx[i].connected) {
+			msgs[i].msg_hdr.msg_name = &rtp_batch.tx[i].addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(rtp_batch.tx[i].addr);
+		}
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	gso = rtp_batch.tx_count > 1 && mgcp_udp_gso_supported();
+
+	/* sendmmsg() works on one socket, flush each run of the same fd */
+	for (start = 0; start < rtp_batch.tx_count; start = end) {
+		int fd = rtp_batch.tx[start].fd;
+		int rc;
+
+		for (end = start; end < rtp_batch.tx_count; ++end)
+			if (rtp_batch.tx[end].fd != fd)
+				break;
+
+		while (start < end) {
+			if (gso) {
+				rc = rtp_batch_send_gso(iov, start, end);
+				if (rc > 0) {
+					start += rc;
+					continue;
+				}
+				gso = mgcp_udp_gso_supported();
+			}
+
+			rc = sendmmsg(fd, &msgs[start], end - start, 0);
+			mgcp_rtp_stat_add(&stats->tx_syscalls, 1);
+			if (rc <= 0) {
+				/* drop the failing packet like sendto() would */
+				LOGP_RTP(DMGCP, LOGL_ERROR,
+				         "Failed to send RTP batch to %s:%d: %s\n",
+				         inet_ntoa(rtp_batch.tx[start].addr.sin_addr),
+				         ntohs(rtp_batch.tx[start].addr.sin_port),
+				         strerror(errno));
+				rc = 1;
+			} else
+				mgcp_rtp_stat_add(&stats->tx_packets, rc);
+			start += rc;
+		}
+	}
+
+	rtp_batch.tx_count = 0;
+}
+
+/* Send a RTP/RTCP packet or queue it when a batch is being processed. */
+static int rtp_udp_queue(int fd, int connected, struct in_addr *addr, int port,
+			 char *buf, int len)
+{
+	struct rtp_batch_tx *tx;
+
+	if (!rtp_batch.cfg || len > sizeof(tx->buf)) {
+		if (connected)
+			return send(fd, buf, len, 0);
+		return mgcp_udp_send(fd, addr, port, buf, len);
+	}
+
+	if (rtp_batch.tx_count == ARRAY_SIZE(rtp_batch.tx))
+		rtp_batch_flush();
+
+	tx = &rtp_batch.tx[rtp_batch.tx_count++];
+	tx->fd = fd;
+	tx->connected = connected;
+	memset(&tx->addr, 0, sizeof(tx->addr));
+	tx->addr.sin_family = AF_INET;
+	tx->addr.sin_port = port;
+	memcpy(&tx->addr.sin_addr, addr, sizeof(*addr));
+	memcpy(tx->buf, buf, len);
+	tx->len = len;
+	return len;
+}
+
+static int rtp_udp_send(int fd, struct in_addr *addr, int port, char *buf, int len)
+{
+	return rtp_udp_queue(fd, 0, addr, port, buf, len);
+}
+
+/* Osmux endpoints accept RTP from any port, keep their sockets open */
+static int rtp_end_may_connect(struct mgcp_endpoint *endp)
+{
+	return endp->cfg->rtp_connect &&
+		(endp->type == MGCP_RTP_DEFAULT || endp->type == MGCP_RTP_TRANSCODED);
+}
+
+/**
+ * Connect the RTP and RTCP sockets of the end to the peer as far as it
+ * is known. A socket that fails to connect keeps using sendto().
+ */
+void mgcp_rtp_end_connect(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end)
+{
+	if (!rtp_end_may_connect(endp)) {
+		mgcp_rtp_end_disconnect(end);
+		return;
+	}
+
+	mgcp_udp_connect(end->rtp.fd, &end->rtp_peer, &end->addr, end->rtp_port);
+	mgcp_udp_connect(end->rtcp.fd, &end->rtcp_peer, &end->addr, end->rtcp_port);
+}
+
+void mgcp_rtp_end_disconnect(struct mgcp_rtp_end *end)
+{
+	mgcp_udp_disconnect(end->rtp.fd, &end->rtp_peer);
+	mgcp_udp_disconnect(end->rtcp.fd, &end->rtcp_peer);
+}
+
+/*
+ * Connect a socket of the end only once a packet arrived on it from the
+ * address and port the peer announced. Until then, and for peers that
+ * send from other ports, the checks in the callbacks decide.
+ */
+static void rtp_end_connect_seen(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
+				 struct osmo_fd *fd, struct sockaddr_in *addr)
+{
+	int is_rtp = fd == &end->rtp;
+	struct mgcp_udp_peer *peer = is_rtp ? &end->rtp_peer : &end->rtcp_peer;
+	int port = is_rtp ? end->rtp_port : end->rtcp_port;
+
+	if (!rtp_end_may_connect(endp) || peer->port != 0)
+		return;
+	if (addr->sin_port != port ||
+	    memcmp(&addr->sin_addr, &end->addr, sizeof(end->addr)) != 0)
+		return;
+
+	mgcp_udp_connect(fd->fd, peer, &end->addr, port);
+}
+
+/* Send to the peer of the end, through the connected socket if possible. */
+static int rtp_end_send(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
+			int is_rtp, char *buf, int len)
+{
+	struct osmo_fd *ofd = is_rtp ? &end->rtp : &end->rtcp;
+	struct mgcp_udp_peer *peer = is_rtp ? &end->rtp_peer : &end->rtcp_peer;
+	int port = is_rtp ? end->rtp_port : end->rtcp_port;
+	int connected = 0;
+
+	if (rtp_end_may_connect(endp))
+		connected = mgcp_udp_is_connected(peer, &end->addr, port);
+	if (!connected && peer->port != 0)
+		mgcp_udp_disconnect(ofd->fd, peer);
+
+	return rtp_udp_queue(ofd->fd, connected, &end->addr, port, buf, len);
+}
+
 int mgcp_send_dummy(struct mgcp_endpoint *endp)
 {
 	static char buf[] = { MGCP_DUMMY_LOAD };
@@ -154,17 +380,17 @@ static int check_rtp_timestamp(struct mgcp_endpoint *endp,
 	if (seq == sstate->last_seq) {
 		if (timestamp != sstate->last_timestamp) {
 			sstate->err_ts_counter += 1;
-			LOGP(DMGCP, LOGL_ERROR,
-			     "The %s timestamp delta is != 0 but the sequence "
-			     "number %d is the same, "
-			     "TS offset: %d, SeqNo offset: %d "
-			     "on 0x%x SSRC: %u timestamp: %u "
-			     "from %s:%d in %d\n",
-			     text, seq,
-			     state->timestamp_offset, state->seq_offset,
-			     ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(DMGCP, LOGL_ERROR,
+			         "The %s timestamp delta is != 0 but the sequence "
+			         "number %d is the same, "
+			         "TS offset: %d, SeqNo offset: %d "
+			         "on 0x%x SSRC: %u timestamp: %u "
+			         "from %s:%d in %d\n",
+			         text, seq,
+			         state->timestamp_offset, state->seq_offset,
+			         ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
+			         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			         endp->conn_mode);
 		}
 		return 0;
 	}
@@ -175,27 +401,27 @@ static int check_rtp_timestamp(struct mgcp_endpoint *endp,
 
 	if (tsdelta == 0) {
 		/* Don't update *tsdelta_out */
-		LOGP(DMGCP, LOGL_NOTICE,
-		     "The %s timestamp delta is %d "
-		     "on 0x%x SSRC: %u timestamp: %u "
-		     "from %s:%d in %d\n",
-		     text, tsdelta,
-		     ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
-		     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-		     endp->conn_mode);
+		LOGP_RTP(DMGCP, LOGL_NOTICE,
+		         "The %s timestamp delta is %d "
+		         "on 0x%x SSRC: %u timestamp: %u "
+		         "from %s:%d in %d\n",
+		         text, tsdelta,
+		         ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
+		         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+		         endp->conn_mode);
 
 		return 0;
 	}
 
 	if (sstate->last_tsdelta != tsdelta) {
 		if (sstate->last_tsdelta) {
-			LOGP(DMGCP, LOGL_INFO,
-			     "The %s timestamp delta changes from %d to %d "
-			     "on 0x%x SSRC: %u timestamp: %u from %s:%d in %d\n",
-			     text, sstate->last_tsdelta, tsdelta,
-			     ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(DMGCP, LOGL_INFO,
+			         "The %s timestamp delta changes from %d to %d "
+			         "on 0x%x SSRC: %u timestamp: %u from %s:%d in %d\n",
+			         text, sstate->last_tsdelta, tsdelta,
+			         ENDPOINT_NUMBER(endp), sstate->ssrc, timestamp,
+			         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			         endp->conn_mode);
 		}
 	}
 
@@ -208,18 +434,18 @@ static int check_rtp_timestamp(struct mgcp_endpoint *endp,
 
 	if (timestamp_error) {
 		sstate->err_ts_counter += 1;
-		LOGP(DMGCP, LOGL_NOTICE,
-		     "The %s timestamp has an alignment error of %d "
-		     "on 0x%x SSRC: %u "
-		     "SeqNo delta: %d, TS delta: %d, dTS/dSeq: %d "
-		     "from %s:%d in mode %d. ptime: %d\n",
-		     text, timestamp_error,
-		     ENDPOINT_NUMBER(endp), sstate->ssrc,
-		     (int16_t)(seq - sstate->last_seq),
-		     (int32_t)(timestamp - sstate->last_timestamp),
-		     tsdelta,
-		     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-		     endp->conn_mode, state->packet_duration);
+		LOGP_RTP(DMGCP, LOGL_NOTICE,
+		         "The %s timestamp has an alignment error of %d "
+		         "on 0x%x SSRC: %u "
+		         "SeqNo delta: %d, TS delta: %d, dTS/dSeq: %d "
+		         "from %s:%d in mode %d. ptime: %d\n",
+		         text, timestamp_error,
+		         ENDPOINT_NUMBER(endp), sstate->ssrc,
+		         (int16_t)(seq - sstate->last_seq),
+		         (int32_t)(timestamp - sstate->last_timestamp),
+		         tsdelta,
+		         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+		         endp->conn_mode, state->packet_duration);
 	}
 	return 1;
 }
@@ -238,23 +464,23 @@ static int adjust_rtp_timestamp_offset(struct mgcp_endpoint *endp,
 	if (tsdelta == 0) {
 		tsdelta = state->out_stream.last_tsdelta;
 		if (tsdelta != 0) {
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "A fixed packet duration is not available on 0x%x, "
-			     "using last output timestamp delta instead: %d "
-			     "from %s:%d in %d\n",
-			     ENDPOINT_NUMBER(endp), tsdelta,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(DMGCP, LOGL_NOTICE,
+			         "A fixed packet duration is not available on 0x%x, "
+			         "using last output timestamp delta instead: %d "
+			         "from %s:%d in %d\n",
+			         ENDPOINT_NUMBER(endp), tsdelta,
+			         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			         endp->conn_mode);
 		} else {
 			tsdelta = rtp_end->codec.rate * 20 / 1000;
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "Fixed packet duration and last timestamp delta "
-			     "are not available on 0x%x, "
-			     "using fixed 20ms instead: %d "
-			     "from %s:%d in %d\n",
-			     ENDPOINT_NUMBER(endp), tsdelta,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(DMGCP, LOGL_NOTICE,
+			         "Fixed packet duration and last timestamp delta "
+			         "are not available on 0x%x, "
+			         "using fixed 20ms instead: %d "
+			         "from %s:%d in %d\n",
+			         ENDPOINT_NUMBER(endp), tsdelta,
+			         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			         endp->conn_mode);
 		}
 	}
 
@@ -264,14 +490,14 @@ static int adjust_rtp_timestamp_offset(struct mgcp_endpoint *endp,
 	if (state->timestamp_offset != timestamp_offset) {
 		state->timestamp_offset = timestamp_offset;
 
-		LOGP(DMGCP, LOGL_NOTICE,
-		     "Timestamp offset change on 0x%x SSRC: %u "
-		     "SeqNo delta: %d, TS offset: %d, "
-		     "from %s:%d in %d\n",
-		     ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
-		     delta_seq, state->timestamp_offset,
-		     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-		     endp->conn_mode);
+		LOGP_RTP(DMGCP, LOGL_NOTICE,
+		         "Timestamp offset change on 0x%x SSRC: %u "
+		         "SeqNo delta: %d, TS offset: %d, "
+		         "from %s:%d in %d\n",
+		         ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
+		         delta_seq, state->timestamp_offset,
+		         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+		         endp->conn_mode);
 	}
 
 	return timestamp_offset;
@@ -296,14 +522,14 @@ static int align_rtp_timestamp_offset(struct mgcp_endpoint *endp,
 	if (timestamp_error) {
 		state->timestamp_offset += ptime - timestamp_error;
 
-		LOGP(DMGCP, LOGL_NOTICE,
-		     "Corrected timestamp alignment error of %d on 0x%x SSRC: %u "
-		     "new TS offset: %d, "
-		     "from %s:%d in %d\n",
-		     timestamp_error,
-		     ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
-		     state->timestamp_offset, inet_ntoa(addr->sin_addr),
-		     ntohs(addr->sin_port), endp->conn_mode);
+		LOGP_RTP(DMGCP, LOGL_NOTICE,
+		         "Corrected timestamp alignment error of %d on 0x%x SSRC: %u "
+		         "new TS offset: %d, "
+		         "from %s:%d in %d\n",
+		         timestamp_error,
+		         ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
+		         state->timestamp_offset, inet_ntoa(addr->sin_addr),
+		         ntohs(addr->sin_port), endp->conn_mode);
 	}
 
 	OSMO_ASSERT(compute_timestamp_aligment_error(&state->out_stream, ptime,
@@ -371,7 +597,7 @@ void mgcp_rtp_annex_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *sta
 			if (seq < state->stats_max_seq)
 				state->stats_cycles += RTP_SEQ_MOD;
 		} else if (udelta <= RTP_SEQ_MOD - RTP_MAX_MISORDER) {
-			LOGP(DMGCP, LOGL_NOTICE,
+			LOGP_RTP(DMGCP, LOGL_NOTICE,
 				"RTP seqno made a very large jump on 0x%x delta: %u\n",
 				ENDPOINT_NUMBER(endp), udelta);
 		}
@@ -433,7 +659,7 @@ void mgcp_patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *sta
 		state->out_stream = state->in_stream;
 		state->out_stream.last_timestamp = timestamp;
 		state->out_stream.ssrc = ssrc - 1; /* force output SSRC change */
-		LOGP(DMGCP, LOGL_INFO,
+		LOGP_RTP(DMGCP, LOGL_INFO,
 			"Initializing stream on 0x%x SSRC: %u timestamp: %u "
 			"pkt-duration: %d, from %s:%d in %d\n",
 			ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
@@ -442,15 +668,15 @@ void mgcp_patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *sta
 			endp->conn_mode);
 		if (state->packet_duration == 0) {
 			state->packet_duration = rtp_end->codec.rate * 20 / 1000;
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "Fixed packet duration is not available on 0x%x, "
-			     "using fixed 20ms instead: %d from %s:%d in %d\n",
-			     ENDPOINT_NUMBER(endp), state->packet_duration,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(DMGCP, LOGL_NOTICE,
+			         "Fixed packet duration is not available on 0x%x, "
+			         "using fixed 20ms instead: %d from %s:%d in %d\n",
+			         ENDPOINT_NUMBER(endp), state->packet_duration,
+			         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			         endp->conn_mode);
 		}
 	} else if (state->in_stream.ssrc != ssrc) {
-		LOGP(DMGCP, LOGL_NOTICE,
+		LOGP_RTP(DMGCP, LOGL_NOTICE,
 			"The SSRC changed on 0x%x: %u -> %u  "
 			"from %s:%d in %d\n",
 			ENDPOINT_NUMBER(endp),
@@ -480,14 +706,14 @@ void mgcp_patch_and_count(struct mgcp_endpoint *endp, struct mgcp_rtp_state *sta
 			if (rtp_end->force_constant_ssrc != -1)
 				rtp_end->force_constant_ssrc -= 1;
 
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "SSRC patching enabled on 0x%x SSRC: %u "
-			     "SeqNo offset: %d, TS offset: %d "
-			     "from %s:%d in %d\n",
-			     ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
-			     state->seq_offset, state->timestamp_offset,
-			     inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
-			     endp->conn_mode);
+			LOGP_RTP(DMGCP, LOGL_NOTICE,
+			         "SSRC patching enabled on 0x%x SSRC: %u "
+			         "SeqNo offset: %d, TS offset: %d "
+			         "from %s:%d in %d\n",
+			         ENDPOINT_NUMBER(endp), state->in_stream.ssrc,
+			         state->seq_offset, state->timestamp_offset,
+			         inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+			         endp->conn_mode);
 		}
 
 		state->in_stream.last_tsdelta = 0;
@@ -559,74 +785,147 @@ static int mgcp_send_transcoder(struct mgcp_rtp_end *end,
 {
 	int rc;
 	int port;
-	struct sockaddr_in addr;
 
 	port = is_rtp ? end->rtp_port : end->rtcp_port;
 
-	addr.sin_family = AF_INET;
-	addr.sin_addr = cfg->transcoder_in;
-	addr.sin_port = port;
-
-	rc = sendto(is_rtp ?
-		end->rtp.fd :
-		end->rtcp.fd, buf, len, 0,
-		(struct sockaddr *) &addr, sizeof(addr));
+	rc = rtp_udp_send(is_rtp ? end->rtp.fd : end->rtcp.fd,
+			  &cfg->transcoder_in, port, (char *) buf, len);
 
 	if (rc != len)
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_RTP(DMGCP, LOGL_ERROR,
 			"Failed to send data to the transcoder: %s\n",
 			strerror(errno));
 
 	return rc;
 }
 
+/*
+ * The jitter buffer queues msgbs. Instead of allocating one per packet
+ * every endpoint using it gets a stack of preallocated ones, enough for
+ * the maximum delay. Without transcoding the packet is received directly
+ * into such a slot and queued without a copy. The slots are talloc
+ * children of the stack, osmo_jibuf_delete() may free queued ones.
+ */
+#define MGCP_JIBUF_SPARE_SLOTS	4
+
+struct mgcp_jibuf_slots {
+	struct mgcp_config *cfg;
+	/* slot the current packet has been received into */
+	struct msgb *rx;
+	int num_free;
+	int num_slots;
+	struct msgb *free[0];
+};
+
+struct mgcp_jibuf_slots *mgcp_jibuf_slots_alloc(struct mgcp_endpoint *endp)
+{
+	struct mgcp_jibuf_slots *slots;
+	int i, num;
+
+	num = endp->bts_jitter_delay_max / DEFAULT_RTP_AUDIO_PACKET_DURATION_MS
+		+ MGCP_JIBUF_SPARE_SLOTS;
+	slots = talloc_zero_size(endp->tcfg->endpoints,
+				 sizeof(*slots) + num * sizeof(slots->free[0]));
+	if (!slots)
+		return NULL;
+	talloc_set_name_const(slots, "mgcp-jibuf-slots");
+	slots->cfg = endp->cfg;
+	slots->num_slots = num;
+
+	for (i = 0; i < num; ++i) {
+		struct msgb *msg = msgb_alloc(RTP_BUF_SIZE, "mgcp-jibuf");
+		if (!msg)
+			break;
+		talloc_steal(slots, msg);
+		slots->free[slots->num_free++] = msg;
+	}
+
+	return slots;
+}
+
+static struct msgb *jibuf_slot_get(struct mgcp_jibuf_slots *slots)
+{
+	struct msgb *msg;
+
+	if (!slots || slots->num_free == 0)
+		return NULL;
+
+	msg = slots->free[--slots->num_free];
+	msgb_reset(msg);
+	msg->dst = slots;
+	return msg;
+}
+
+static void jibuf_msg_free(struct msgb *msg)
+{
+	struct mgcp_jibuf_slots *slots = msg->dst;
+
+	if (!slots) {
+		msgb_free(msg);
+		return;
+	}
+
+	slots->free[slots->num_free++] = msg;
+}
+
 void mgcp_dejitter_udp_send(struct msgb *msg, void *data)
 {
 	struct mgcp_rtp_end *rtp_end = (struct mgcp_rtp_end *) data;
+	struct mgcp_endpoint *endp = rtp_end->rtp.data;
 
-	int rc = mgcp_udp_send(rtp_end->rtp.fd, &rtp_end->addr,
-			   rtp_end->rtp_port, (char*) msg->data, msg->len);
+	int rc = rtp_end_send(endp, rtp_end, 1, (char *) msg->data, msg->len);
 	if (rc != msg->len)
 		LOGP(DMGCP, LOGL_ERROR,
 			"Failed to send data after jitter buffer: %d\n", rc);
-	msgb_free(msg);
+	jibuf_msg_free(msg);
 }
 
-static int enqueue_dejitter(struct osmo_jibuf *jb, struct mgcp_rtp_end *rtp_end, char *buf, int len)
+static int enqueue_dejitter(struct osmo_jibuf *jb, struct mgcp_jibuf_slots *slots,
+			    struct mgcp_rtp_end *rtp_end, char *buf, int len)
 {
 	struct msgb *msg;
-	msg = msgb_alloc(len, "mgcp-jibuf");
-	if (!msg)
-		return -1;
 
-	memcpy(msg->data, buf, len);
+	if (slots && slots->rx && buf == (char *) slots->rx->data) {
+		/* received into the slot, nothing to copy */
+		msg = slots->rx;
+		slots->rx = NULL;
+		slots->cfg->jibuf_stats.rx_direct += 1;
+	} else {
+		msg = jibuf_slot_get(slots);
+		if (msg) {
+			slots->cfg->jibuf_stats.slot_copies += 1;
+		} else {
+			msg = msgb_alloc(len, "mgcp-jibuf");
+			if (!msg)
+				return -1;
+			if (slots)
+				slots->cfg->jibuf_stats.heap_allocs += 1;
+		}
+		memcpy(msg->data, buf, len);
+	}
+
 	msgb_put(msg, len);
 
 	if (osmo_jibuf_enqueue(jb, msg) < 0) {
 		rtp_end->dropped_packets += 1;
-		msgb_free(msg);
+		jibuf_msg_free(msg);
 	}
 
 	return len;
 }
 
-int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp,
-	      struct sockaddr_in *addr, char *buf, int rc)
+/**
+ * Forward a processed RTP packet. The destination has already been
+ * resolved, the audio loop and loopback mode are not applied again.
+ */
+int mgcp_send_rtp_out(struct mgcp_endpoint *endp, int dest,
+		      struct sockaddr_in *addr, char *buf, int len)
 {
-	struct mgcp_trunk_config *tcfg = endp->tcfg;
 	struct mgcp_rtp_end *rtp_end;
 	struct mgcp_rtp_state *rtp_state;
 	int tap_idx;
 	struct osmo_jibuf *jb;
 
-	/* For loop toggle the destination and then dispatch. */
-	if (tcfg->audio_loop)
-		dest = !dest;
-
-	/* Loop based on the conn_mode, maybe undoing the above */
-	if (endp->conn_mode == MGCP_CONN_LOOPBACK)
-		dest = !dest;
-
 	if (dest == MGCP_DEST_NET) {
 		rtp_end = &endp->net_end;
 		rtp_state = &endp->bts_state;
@@ -639,28 +938,53 @@ int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp,
 		jb = NULL;
 	}
 
+	mgcp_patch_and_count(endp, rtp_state, rtp_end, addr, buf, len);
+	forward_data(rtp_end->rtp.fd, &endp->taps[tap_idx],
+		     buf, len);
+	if (jb)
+		return enqueue_dejitter(jb, endp->bts_jb_slots, rtp_end, buf, len);
+
+	return rtp_end_send(endp, rtp_end, 1, buf, len);
+}
+
+int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp,
+	      struct sockaddr_in *addr, char *buf, int rc)
+{
+	struct mgcp_trunk_config *tcfg = endp->tcfg;
+	struct mgcp_config *cfg = endp->cfg;
+	struct mgcp_rtp_end *rtp_end;
+
+	/* For loop toggle the destination and then dispatch. */
+	if (tcfg->audio_loop)
+		dest = !dest;
+
+	/* Loop based on the conn_mode, maybe undoing the above */
+	if (endp->conn_mode == MGCP_CONN_LOOPBACK)
+		dest = !dest;
+
+	if (dest == MGCP_DEST_NET)
+		rtp_end = &endp->net_end;
+	else
+		rtp_end = &endp->bts_end;
+
 	if (!rtp_end->output_enabled)
 		rtp_end->dropped_packets += 1;
 	else if (is_rtp) {
 		int cont;
 		int nbytes = 0;
 		int len = rc;
+
+		if (cfg->rtp_processing_submit_cb &&
+		    cfg->rtp_processing_submit_cb(endp, dest, addr, buf, len) == 1)
+			return len;
+
 		do {
-			cont = endp->cfg->rtp_processing_cb(endp, rtp_end,
-							buf, &len, RTP_BUF_SIZE);
+			cont = cfg->rtp_processing_cb(endp, rtp_end,
+						      buf, &len, RTP_BUF_SIZE);
 			if (cont < 0)
 				break;
 
-			mgcp_patch_and_count(endp, rtp_state, rtp_end, addr, buf, len);
-			forward_data(rtp_end->rtp.fd, &endp->taps[tap_idx],
-				     buf, len);
-			if (jb)
-				rc = enqueue_dejitter(jb, rtp_end, buf, len);
-			else
-				rc = mgcp_udp_send(rtp_end->rtp.fd,
-						   &rtp_end->addr,
-						   rtp_end->rtp_port, buf, len);
-
+			rc = mgcp_send_rtp_out(endp, dest, addr, buf, len);
 			if (rc <= 0)
 				return rc;
 			nbytes += rc;
@@ -668,9 +992,7 @@ int mgcp_send(struct mgcp_endpoint *endp, int dest, int is_rtp,
 		} while (len > 0);
 		return nbytes;
 	} else if (!tcfg->omit_rtcp) {
-		return mgcp_udp_send(rtp_end->rtcp.fd,
-				     &rtp_end->addr,
-				     rtp_end->rtcp_port, buf, rc);
+		return rtp_end_send(endp, rtp_end, 0, buf, rc);
 	}
 
 	return 0;
@@ -684,8 +1006,11 @@ static int receive_from(struct mgcp_endpoint *endp, int fd, struct sockaddr_in *
 
 	rc = recvfrom(fd, buf, bufsize, 0,
 			    (struct sockaddr *) addr, &slen);
+	/* a connected socket reports the ICMP errors of the peer */
+	if (rc < 0 && errno == ECONNREFUSED)
+		return -1;
 	if (rc < 0) {
-		LOGP(DMGCP, LOGL_ERROR, "Failed to receive message on: 0x%x errno: %d/%s\n",
+		LOGP_RTP(DMGCP, LOGL_ERROR, "Failed to receive message on: 0x%x errno: %d/%s\n",
 			ENDPOINT_NUMBER(endp), errno, strerror(errno));
 		return -1;
 	}
@@ -699,24 +1024,112 @@ static int receive_from(struct mgcp_endpoint *endp, int fd, struct sockaddr_in *
 	return rc;
 }
 
-static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
+typedef int (*rtp_data_process)(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+				struct sockaddr_in *addr, char *buf, int rc);
+
+/*
+ * Drain up to cfg->rtp_batch packets from the socket with a single
+ * recvmmsg(), run each through the normal processing and flush what
+ * has been queued for sending with sendmmsg(). With UDP_GRO enabled a
+ * read may hold several packets of the same size, they are split up
+ * again and each copied out as the processing may grow it in place.
+ */
+static int rtp_data_batch(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+			  struct mgcp_rtp_end *end, rtp_data_process process)
 {
-	char buf[RTP_BUF_SIZE];
-	struct sockaddr_in addr;
-	struct mgcp_endpoint *endp;
-	int rc, proto;
+	struct mgcp_config *cfg = endp->cfg;
+	struct mgcp_rtp_stats *stats = mgcp_rtp_stats(cfg);
+	struct mmsghdr msgs[MGCP_RTP_BATCH_MAX];
+	struct iovec iov[MGCP_RTP_BATCH_MAX];
+	struct sockaddr_in addr[MGCP_RTP_BATCH_MAX];
+	char control[MGCP_RTP_BATCH_MAX][CMSG_SPACE(sizeof(int))];
+	int gro = fd == &end->rtp && end->rtp_gro;
+	int i, rc, nmsgs;
+
+	if (gro && !rtp_batch.gro_buf) {
+		rtp_batch.gro_buf = malloc(MGCP_RTP_BATCH_MAX * MGCP_UDP_GRO_BUF_SIZE);
+		if (!rtp_batch.gro_buf) {
+			/* reads into the small buffers must not be coalesced */
+			end->rtp_gro = mgcp_udp_set_gro(fd->fd, 0);
+			gro = 0;
+		}
+	}
 
-	endp = (struct mgcp_endpoint *) fd->data;
+	nmsgs = OSMO_MAX(1, OSMO_MIN(cfg->rtp_batch, MGCP_RTP_BATCH_MAX));
+	memset(msgs, 0, sizeof(msgs[0]) * nmsgs);
+	for (i = 0; i < nmsgs; ++i) {
+		if (gro) {
+			iov[i].iov_base = &rtp_batch.gro_buf[i * MGCP_UDP_GRO_BUF_SIZE];
+			iov[i].iov_len = MGCP_UDP_GRO_BUF_SIZE;
+			msgs[i].msg_hdr.msg_control = control[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+		} else {
+			iov[i].iov_base = rtp_batch.rx_buf[i];
+			iov[i].iov_len = sizeof(rtp_batch.rx_buf[i]);
+		}
+		msgs[i].msg_hdr.msg_name = &addr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
-	if (rc <= 0)
+	rc = recvmmsg(fd->fd, msgs, nmsgs, MSG_DONTWAIT, NULL);
+	if (rc < 0 && errno == ECONNREFUSED)
+		return -1;
+	if (rc < 0) {
+		LOGP_RTP(DMGCP, LOGL_ERROR, "Failed to receive batch on: 0x%x errno: %d/%s\n",
+			ENDPOINT_NUMBER(endp), errno, strerror(errno));
 		return -1;
+	}
 
-	if (memcmp(&addr.sin_addr, &endp->net_end.addr, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
+	mgcp_rtp_stat_add(&stats->rx_syscalls, 1);
+
+	/* do not forward aynthing... maybe there is a packet from the bts */
+	if (!endp->allocated)
+		return -1;
+
+	rtp_batch.cfg = cfg;
+	for (i = 0; i < rc; ++i) {
+		char *buf = iov[i].iov_base;
+		int len = msgs[i].msg_len;
+		int seg_size = gro ? mgcp_udp_gro_size(&msgs[i].msg_hdr) : 0;
+		int off;
+
+		if (len == 0)
+			continue;
+
+		if (seg_size <= 0 || seg_size >= len) {
+			mgcp_rtp_stat_add(&stats->rx_packets, 1);
+			process(endp, fd, &addr[i], buf, len);
+			continue;
+		}
+
+		mgcp_rtp_stat_add(&stats->gro_reads, 1);
+		for (off = 0; off < len; off += seg_size) {
+			int seg_len = OSMO_MIN(seg_size, len - off);
+
+			mgcp_rtp_stat_add(&stats->rx_packets, 1);
+			mgcp_rtp_stat_add(&stats->gro_packets, 1);
+			memcpy(rtp_batch.rx_buf[0], &buf[off], seg_len);
+			process(endp, fd, &addr[i], rtp_batch.rx_buf[0], seg_len);
+		}
+	}
+	rtp_batch_flush();
+	rtp_batch.cfg = NULL;
+
+	return 0;
+}
+
+static int rtp_data_net_process(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+				struct sockaddr_in *addr, char *buf, int rc)
+{
+	int proto;
+
+	if (memcmp(&addr->sin_addr, &endp->net_end.addr, sizeof(addr->sin_addr)) != 0) {
+		LOGP_RTP(DMGCP, LOGL_ERROR,
 			"Endpoint 0x%x data from wrong address %s vs. ",
-			ENDPOINT_NUMBER(endp), inet_ntoa(addr.sin_addr));
-		LOGPC(DMGCP, LOGL_ERROR,
+			ENDPOINT_NUMBER(endp), inet_ntoa(addr->sin_addr));
+		LOGPC_RTP(DMGCP, LOGL_ERROR,
 			"%s\n", inet_ntoa(endp->net_end.addr));
 		return -1;
 	}
@@ -724,13 +1137,14 @@ static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
 	switch(endp->type) {
 	case MGCP_RTP_DEFAULT:
 	case MGCP_RTP_TRANSCODED:
-		if (endp->net_end.rtp_port != addr.sin_port &&
-		    endp->net_end.rtcp_port != addr.sin_port) {
-			LOGP(DMGCP, LOGL_ERROR,
+		if (endp->net_end.rtp_port != addr->sin_port &&
+		    endp->net_end.rtcp_port != addr->sin_port) {
+			LOGP_RTP(DMGCP, LOGL_ERROR,
 				"Data from wrong source port %d on 0x%x\n",
-				ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
+				ntohs(addr->sin_port), ENDPOINT_NUMBER(endp));
 			return -1;
 		}
+		rtp_end_connect_seen(endp, &endp->net_end, fd, addr);
 		break;
 	case MGCP_OSMUX_BSC:
 	case MGCP_OSMUX_BSC_NAT:
@@ -739,7 +1153,7 @@ static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == MGCP_DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from network on 0x%x\n",
+		LOGP_RTP(DMGCP, LOGL_NOTICE, "Filtered dummy from network on 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return 0;
 	}
@@ -753,7 +1167,7 @@ static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
 	switch (endp->type) {
 	case MGCP_RTP_DEFAULT:
 		return mgcp_send(endp, MGCP_DEST_BTS, proto == MGCP_PROTO_RTP,
-				 &addr, buf, rc);
+				 addr, buf, rc);
 	case MGCP_RTP_TRANSCODED:
 		return mgcp_send_transcoder(&endp->trans_net, endp->cfg,
 					    proto == MGCP_PROTO_RTP, buf, rc);
@@ -763,11 +1177,30 @@ static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
 		break;
 	}
 
-	LOGP(DMGCP, LOGL_ERROR, "Bad MGCP type %u on endpoint 0x%x\n",
-	     endp->type, ENDPOINT_NUMBER(endp));
+	LOGP_RTP(DMGCP, LOGL_ERROR, "Bad MGCP type %u on endpoint 0x%x\n",
+	         endp->type, ENDPOINT_NUMBER(endp));
 	return 0;
 }
 
+static int rtp_data_net(struct osmo_fd *fd, unsigned int what)
+{
+	char buf[RTP_BUF_SIZE];
+	struct sockaddr_in addr;
+	struct mgcp_endpoint *endp;
+	int rc;
+
+	endp = (struct mgcp_endpoint *) fd->data;
+
+	if (endp->cfg->rtp_batch > 1 || endp->net_end.rtp_gro)
+		return rtp_data_batch(endp, fd, &endp->net_end, rtp_data_net_process);
+
+	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
+	if (rc <= 0)
+		return -1;
+
+	return rtp_data_net_process(endp, fd, &addr, buf, rc);
+}
+
 static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_in *addr)
 {
 	struct mgcp_config *cfg = endp->cfg;
@@ -781,8 +1214,9 @@ static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_
 
 			endp->bts_end.rtp_port = addr->sin_port;
 			endp->bts_end.addr = addr->sin_addr;
+			mgcp_rtp_end_connect(endp, &endp->bts_end);
 
-			LOGP(DMGCP, LOGL_NOTICE,
+			LOGP_RTP(DMGCP, LOGL_NOTICE,
 				"Found BTS for endpoint: 0x%x on port: %d/%d of %s\n",
 				ENDPOINT_NUMBER(endp), ntohs(endp->bts_end.rtp_port),
 				ntohs(endp->bts_end.rtcp_port), inet_ntoa(addr->sin_addr));
@@ -791,47 +1225,40 @@ static void discover_bts(struct mgcp_endpoint *endp, int proto, struct sockaddr_
 		if (memcmp(&endp->bts_end.addr, &addr->sin_addr,
 				sizeof(endp->bts_end.addr)) == 0) {
 			endp->bts_end.rtcp_port = addr->sin_port;
+			mgcp_rtp_end_connect(endp, &endp->bts_end);
 		}
 	}
 }
 
-static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
+static int rtp_data_bts_process(struct mgcp_endpoint *endp, struct osmo_fd *fd,
+				struct sockaddr_in *addr, char *buf, int rc)
 {
-	char buf[RTP_BUF_SIZE];
-	struct sockaddr_in addr;
-	struct mgcp_endpoint *endp;
-	int rc, proto;
-
-	endp = (struct mgcp_endpoint *) fd->data;
-
-	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
-	if (rc <= 0)
-		return -1;
+	int proto;
 
 	proto = fd == &endp->bts_end.rtp ? MGCP_PROTO_RTP : MGCP_PROTO_RTCP;
 
 	/* We have no idea who called us, maybe it is the BTS. */
 	/* it was the BTS... */
-	discover_bts(endp, proto, &addr);
+	discover_bts(endp, proto, addr);
 
-	if (memcmp(&endp->bts_end.addr, &addr.sin_addr, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
+	if (memcmp(&endp->bts_end.addr, &addr->sin_addr, sizeof(addr->sin_addr)) != 0) {
+		LOGP_RTP(DMGCP, LOGL_ERROR,
 			"Data from wrong bts %s on 0x%x\n",
-			inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(endp));
+			inet_ntoa(addr->sin_addr), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
-	if (endp->bts_end.rtp_port != addr.sin_port &&
-	    endp->bts_end.rtcp_port != addr.sin_port) {
-		LOGP(DMGCP, LOGL_ERROR,
+	if (endp->bts_end.rtp_port != addr->sin_port &&
+	    endp->bts_end.rtcp_port != addr->sin_port) {
+		LOGP_RTP(DMGCP, LOGL_ERROR,
 			"Data from wrong bts source port %d on 0x%x\n",
-			ntohs(addr.sin_port), ENDPOINT_NUMBER(endp));
+			ntohs(addr->sin_port), ENDPOINT_NUMBER(endp));
 		return -1;
 	}
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == MGCP_DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from bts on 0x%x\n",
+		LOGP_RTP(DMGCP, LOGL_NOTICE, "Filtered dummy from bts on 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return 0;
 	}
@@ -845,7 +1272,7 @@ static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
 	switch (endp->type) {
 	case MGCP_RTP_DEFAULT:
 		return mgcp_send(endp, MGCP_DEST_NET, proto == MGCP_PROTO_RTP,
-				 &addr, buf, rc);
+				 addr, buf, rc);
 	case MGCP_RTP_TRANSCODED:
 		return mgcp_send_transcoder(&endp->trans_bts, endp->cfg,
 					    proto == MGCP_PROTO_RTP, buf, rc);
@@ -856,11 +1283,64 @@ static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
 		break;	/* Should not happen */
 	}
 
-	LOGP(DMGCP, LOGL_ERROR, "Bad MGCP type %u on endpoint 0x%x\n",
-	     endp->type, ENDPOINT_NUMBER(endp));
+	LOGP_RTP(DMGCP, LOGL_ERROR, "Bad MGCP type %u on endpoint 0x%x\n",
+	         endp->type, ENDPOINT_NUMBER(endp));
 	return 0;
 }
 
+/*
+ * Receive into a jitter buffer slot, enqueue_dejitter() takes it when
+ * the packet is forwarded unmodified. Transcoding may reuse the buffer
+ * for further packets after queueing one, it keeps copying.
+ */
+static int rtp_data_bts_jibuf(struct mgcp_endpoint *endp, struct osmo_fd *fd)
+{
+	struct mgcp_jibuf_slots *slots = endp->bts_jb_slots;
+	struct sockaddr_in addr;
+	struct msgb *msg;
+	int rc;
+
+	msg = jibuf_slot_get(slots);
+	if (!msg)
+		return -1;
+
+	rc = receive_from(endp, fd->fd, &addr, (char *) msg->data, RTP_BUF_SIZE);
+	if (rc > 0) {
+		slots->rx = msg;
+		rc = rtp_data_bts_process(endp, fd, &addr, (char *) msg->data, rc);
+	} else
+		rc = -1;
+
+	/* not queued to the jitter buffer */
+	if (slots->rx == msg)
+		jibuf_msg_free(msg);
+	slots->rx = NULL;
+	return rc;
+}
+
+static int rtp_data_bts(struct osmo_fd *fd, unsigned int what)
+{
+	char buf[RTP_BUF_SIZE];
+	struct sockaddr_in addr;
+	struct mgcp_endpoint *endp;
+	int rc;
+
+	endp = (struct mgcp_endpoint *) fd->data;
+
+	if (endp->cfg->rtp_batch > 1 || endp->bts_end.rtp_gro)
+		return rtp_data_batch(endp, fd, &endp->bts_end, rtp_data_bts_process);
+
+	if (endp->bts_jb_slots && endp->bts_jb_slots->num_free > 0 &&
+	    endp->cfg->rtp_processing_cb == &mgcp_rtp_processing_default)
+		return rtp_data_bts_jibuf(endp, fd);
+
+	rc = receive_from(endp, fd->fd, &addr, buf, sizeof(buf));
+	if (rc <= 0)
+		return -1;
+
+	return rtp_data_bts_process(endp, fd, &addr, buf, rc);
+}
+
 static int rtp_data_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_endp,
 			      int dest, struct osmo_fd *fd)
 {
@@ -877,7 +1357,7 @@ static int rtp_data_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_
 	proto = fd == &end->rtp ? MGCP_PROTO_RTP : MGCP_PROTO_RTCP;
 
 	if (memcmp(&addr.sin_addr, &cfg->transcoder_in, sizeof(addr.sin_addr)) != 0) {
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_RTP(DMGCP, LOGL_ERROR,
 			"Data not coming from transcoder dest: %d %s on 0x%x\n",
 			dest, inet_ntoa(addr.sin_addr), ENDPOINT_NUMBER(_endp));
 		return -1;
@@ -885,7 +1365,7 @@ static int rtp_data_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_
 
 	if (end->rtp_port != addr.sin_port &&
 	    end->rtcp_port != addr.sin_port) {
-		LOGP(DMGCP, LOGL_ERROR,
+		LOGP_RTP(DMGCP, LOGL_ERROR,
 			"Data from wrong transcoder dest %d source port %d on 0x%x\n",
 			dest, ntohs(addr.sin_port), ENDPOINT_NUMBER(_endp));
 		return -1;
@@ -893,7 +1373,7 @@ static int rtp_data_transcoder(struct mgcp_rtp_end *end, struct mgcp_endpoint *_
 
 	/* throw away the dummy message */
 	if (rc == 1 && buf[0] == MGCP_DUMMY_LOAD) {
-		LOGP(DMGCP, LOGL_NOTICE, "Filtered dummy from transcoder dest %d on 0x%x\n",
+		LOGP_RTP(DMGCP, LOGL_NOTICE, "Filtered dummy from transcoder dest %d on 0x%x\n",
 			dest, ENDPOINT_NUMBER(_endp));
 		return 0;
 	}
@@ -922,6 +1402,7 @@ int mgcp_create_bind(const char *source_addr, struct osmo_fd *fd, int port)
 {
 	struct sockaddr_in addr;
 	int on = 1;
+	int err;
 
 	fd->fd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (fd->fd < 0) {
@@ -936,8 +1417,11 @@ int mgcp_create_bind(const char *source_addr, struct osmo_fd *fd, int port)
 	inet_aton(source_addr, &addr.sin_addr);
 
 	if (bind(fd->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		/* the caller may want to know why */
+		err = errno;
 		close(fd->fd);
 		fd->fd = -1;
+		errno = err;
 		return -1;
 	}
 
@@ -952,35 +1436,59 @@ int mgcp_set_ip_tos(int fd, int tos)
 	return ret != 0;
 }
 
+/*
+ * Returns -EADDRINUSE or -EACCES when the port can not be bound, any
+ * other negative value when the sockets could not be set up.
+ */
 static int bind_rtp(struct mgcp_config *cfg, const char *source_addr,
-			struct mgcp_rtp_end *rtp_end, int endpno)
+			struct mgcp_rtp_end *rtp_end, int endpno, int gro)
 {
+	int pooled = 0;
+	int rc = -1;
+
+	/* the sockets of a pooled pair may still be bound */
+	if (rtp_end->port_pool &&
+	    mgcp_port_pool_take_fds(rtp_end->port_pool, rtp_end->local_port,
+				    &rtp_end->rtp.fd, &rtp_end->rtcp.fd) == 0) {
+		pooled = 1;
+		goto bound;
+	}
+
 	if (mgcp_create_bind(source_addr, &rtp_end->rtp,
 			     rtp_end->local_port) != 0) {
-		LOGP(DMGCP, LOGL_ERROR, "Failed to create RTP port: %s:%d on 0x%x\n",
-		       source_addr, rtp_end->local_port, endpno);
+		rc = -errno;
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create RTP port: %s:%d on 0x%x: %s\n",
+		       source_addr, rtp_end->local_port, endpno, strerror(-rc));
 		goto cleanup0;
 	}
 
 	if (mgcp_create_bind(source_addr, &rtp_end->rtcp,
 			     rtp_end->local_port + 1) != 0) {
-		LOGP(DMGCP, LOGL_ERROR, "Failed to create RTCP port: %s:%d on 0x%x\n",
-		       source_addr, rtp_end->local_port + 1, endpno);
+		rc = -errno;
+		LOGP(DMGCP, LOGL_ERROR, "Failed to create RTCP port: %s:%d on 0x%x: %s\n",
+		       source_addr, rtp_end->local_port + 1, endpno, strerror(-rc));
 		goto cleanup1;
 	}
 
+bound:
 	mgcp_set_ip_tos(rtp_end->rtp.fd, cfg->endp_dscp);
 	mgcp_set_ip_tos(rtp_end->rtcp.fd, cfg->endp_dscp);
 
+	/* coalesced reads need the batch reader, a pooled socket may have them */
+	gro = gro && cfg->rtp_batch > 1;
+	rtp_end->rtp_gro = 0;
+	if (gro || pooled)
+		rtp_end->rtp_gro = mgcp_udp_set_gro(rtp_end->rtp.fd, gro);
+
 	rtp_end->rtp.when = BSC_FD_READ;
-	if (osmo_fd_register(&rtp_end->rtp) != 0) {
+	if (mgcp_rtp_worker_fd_register(rtp_end->rtp.data, &rtp_end->rtp) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to register RTP port %d on 0x%x\n",
 			rtp_end->local_port, endpno);
 		goto cleanup2;
 	}
 
 	rtp_end->rtcp.when = BSC_FD_READ;
-	if (osmo_fd_register(&rtp_end->rtcp) != 0) {
+	if (mgcp_rtp_worker_fd_register(rtp_end->rtcp.data, &rtp_end->rtcp) != 0) {
 		LOGP(DMGCP, LOGL_ERROR, "Failed to register RTCP port %d on 0x%x\n",
 			rtp_end->local_port + 1, endpno);
 		goto cleanup3;
@@ -989,7 +1497,7 @@ static int bind_rtp(struct mgcp_config *cfg, const char *source_addr,
 	return 0;
 
 cleanup3:
-	osmo_fd_unregister(&rtp_end->rtp);
+	mgcp_rtp_worker_fd_unregister(rtp_end->rtp.data, &rtp_end->rtp);
 cleanup2:
 	close(rtp_end->rtcp.fd);
 	rtp_end->rtcp.fd = -1;
@@ -997,13 +1505,13 @@ cleanup1:
 	close(rtp_end->rtp.fd);
 	rtp_end->rtp.fd = -1;
 cleanup0:
-	return -1;
+	return rc;
 }
 
 static int int_bind(const char *port,
 		    struct mgcp_rtp_end *end, int (*cb)(struct osmo_fd *, unsigned),
 		    struct mgcp_endpoint *_endp,
-		    const char *source_addr, int rtp_port)
+		    const char *source_addr, int rtp_port, int gro)
 {
 	if (end->rtp.fd != -1 || end->rtcp.fd != -1) {
 		LOGP(DMGCP, LOGL_ERROR, "Previous %s was still bound on %d\n",
@@ -1016,49 +1524,68 @@ static int int_bind(const char *port,
 	end->rtp.data = _endp;
 	end->rtcp.data = _endp;
 	end->rtcp.cb = cb;
-	return bind_rtp(_endp->cfg, source_addr, end, ENDPOINT_NUMBER(_endp));
+	return bind_rtp(_endp->cfg, source_addr, end, ENDPOINT_NUMBER(_endp), gro);
 }
 
 int mgcp_bind_bts_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
 	return int_bind("bts-port", &endp->bts_end,
 			rtp_data_bts, endp,
-			mgcp_bts_src_addr(endp), rtp_port);
+			mgcp_bts_src_addr(endp), rtp_port, 1);
 }
 
 int mgcp_bind_net_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
 	return int_bind("net-port", &endp->net_end,
 			rtp_data_net, endp,
-			mgcp_net_src_addr(endp), rtp_port);
+			mgcp_net_src_addr(endp), rtp_port, 1);
 }
 
 int mgcp_bind_trans_net_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
 	return int_bind("trans-net", &endp->trans_net,
 			rtp_data_trans_net, endp,
-			endp->cfg->source_addr, rtp_port);
+			endp->cfg->source_addr, rtp_port, 0);
 }
 
 int mgcp_bind_trans_bts_rtp_port(struct mgcp_endpoint *endp, int rtp_port)
 {
 	return int_bind("trans-bts", &endp->trans_bts,
 			rtp_data_trans_bts, endp,
-			endp->cfg->source_addr, rtp_port);
+			endp->cfg->source_addr, rtp_port, 0);
 }
 
 int mgcp_free_rtp_port(struct mgcp_rtp_end *end)
 {
+	/* the next user of a pooled pair talks to someone else */
+	mgcp_rtp_end_disconnect(end);
+	end->rtp_gro = 0;
+
+	if (end->port_pool) {
+		if (end->rtp.fd != -1)
+			mgcp_rtp_worker_fd_unregister(end->rtp.data, &end->rtp);
+		if (end->rtcp.fd != -1)
+			mgcp_rtp_worker_fd_unregister(end->rtcp.data, &end->rtcp);
+
+		/* the socket pool may keep them bound for the next user */
+		mgcp_port_pool_release(end->port_pool, end->local_port,
+				       end->rtp.fd, end->rtcp.fd);
+		end->port_pool = NULL;
+		end->rtp.fd = -1;
+		end->rtcp.fd = -1;
+		return 0;
+	}
+
 	if (end->rtp.fd != -1) {
+		mgcp_rtp_worker_fd_unregister(end->rtp.data, &end->rtp);
 		close(end->rtp.fd);
 		end->rtp.fd = -1;
-		osmo_fd_unregister(&end->rtp);
 	}
 
 	if (end->rtcp.fd != -1) {
+		mgcp_rtp_worker_fd_unregister(end->rtcp.data, &end->rtcp);
 		close(end->rtcp.fd);
 		end->rtcp.fd = -1;
-		osmo_fd_unregister(&end->rtcp);
 	}
 
 	return 0;
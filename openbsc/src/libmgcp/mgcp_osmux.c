@@ -170,6 +170,80 @@ int osmux_xfrm_to_osmux(int type, char *buf, int rc, struct mgcp_endpoint *endp)
 	return 0;
 }
 
+/*
+ * Enabled endpoints hashed by remote address and CID so that the
+ * demultiplexing of a batch does not depend on the number of endpoints.
+ */
+#define OSMUX_ENDP_HASH_SIZE 256
+
+static struct mgcp_endpoint *osmux_endp_hash[OSMUX_ENDP_HASH_SIZE];
+
+static unsigned int osmux_endp_hash_key(struct in_addr *addr, uint8_t cid)
+{
+	uint32_t key = addr->s_addr;
+
+	key ^= key >> 16;
+	key ^= key >> 8;
+	return (key ^ cid) % OSMUX_ENDP_HASH_SIZE;
+}
+
+static void osmux_endp_hash_del(struct mgcp_endpoint *endp)
+{
+	struct mgcp_endpoint **pos;
+
+	if (!endp->osmux.hashed)
+		return;
+
+	pos = &osmux_endp_hash[osmux_endp_hash_key(&endp->osmux.hash_addr,
+						    endp->osmux.cid)];
+	for (; *pos; pos = &(*pos)->osmux.hash_next) {
+		if (*pos == endp) {
+			*pos = endp->osmux.hash_next;
+			break;
+		}
+	}
+
+	endp->osmux.hashed = false;
+	endp->osmux.hash_next = NULL;
+}
+
+static void osmux_endp_hash_add(struct mgcp_endpoint *endp, struct in_addr *addr)
+{
+	unsigned int key;
+
+	osmux_endp_hash_del(endp);
+
+	key = osmux_endp_hash_key(addr, endp->osmux.cid);
+	endp->osmux.hash_addr = *addr;
+	endp->osmux.hash_next = osmux_endp_hash[key];
+	endp->osmux.hashed = true;
+	osmux_endp_hash[key] = endp;
+}
+
+static int endpoint_match(struct mgcp_endpoint *endp, int cid,
+			  struct in_addr *from_addr, int type)
+{
+	struct in_addr *this;
+
+	if (!endp->allocated)
+		return 0;
+
+	switch(type) {
+	case MGCP_DEST_NET:
+		this = &endp->net_end.addr;
+		break;
+	case MGCP_DEST_BTS:
+		this = &endp->bts_end.addr;
+		break;
+	default:
+		/* Should not ever happen */
+		LOGP(DMGCP, LOGL_ERROR, "Bad type %d. Fix your code.\n", type);
+		return 0;
+	}
+
+	return endp->osmux.cid == cid && this->s_addr == from_addr->s_addr;
+}
+
 static struct mgcp_endpoint *
 endpoint_lookup(struct mgcp_config *cfg, int cid,
 		struct in_addr *from_addr, int type)
@@ -177,30 +251,25 @@ endpoint_lookup(struct mgcp_config *cfg, int cid,
 	struct mgcp_endpoint *tmp = NULL;
 	int i;
 
-	/* Lookup for the endpoint that corresponds to this port */
-	for (i=0; i<cfg->trunk.number_endpoints; i++) {
-		struct in_addr *this;
+	tmp = osmux_endp_hash[osmux_endp_hash_key(from_addr, cid)];
+	for (; tmp; tmp = tmp->osmux.hash_next) {
+		if (tmp->cfg == cfg && endpoint_match(tmp, cid, from_addr, type))
+			return tmp;
+	}
 
+	/*
+	 * Not enabled yet or the address has changed, look for the
+	 * endpoint that corresponds to this port.
+	 */
+	for (i=0; i<cfg->trunk.number_endpoints; i++) {
 		tmp = &cfg->trunk.endpoints[i];
 
-		if (!tmp->allocated)
+		if (!endpoint_match(tmp, cid, from_addr, type))
 			continue;
 
-		switch(type) {
-		case MGCP_DEST_NET:
-			this = &tmp->net_end.addr;
-			break;
-		case MGCP_DEST_BTS:
-			this = &tmp->bts_end.addr;
-			break;
-		default:
-			/* Should not ever happen */
-			LOGP(DMGCP, LOGL_ERROR, "Bad type %d. Fix your code.\n", type);
-			return NULL;
-		}
-
-		if (tmp->osmux.cid == cid && this->s_addr == from_addr->s_addr)
-			return tmp;
+		if (tmp->osmux.state == OSMUX_STATE_ENABLED)
+			osmux_endp_hash_add(tmp, from_addr);
+		return tmp;
 	}
 
 	LOGP(DMGCP, LOGL_ERROR, "Cannot find endpoint with cid=%d\n", cid);
@@ -505,6 +574,7 @@ int osmux_enable_endpoint(struct mgcp_endpoint *endp, struct in_addr *addr, uint
 			break;
 	}
 	endp->osmux.state = OSMUX_STATE_ENABLED;
+	osmux_endp_hash_add(endp, addr);
 
 	return 0;
 }
@@ -519,6 +589,7 @@ void osmux_disable_endpoint(struct mgcp_endpoint *endp)
 	osmux_xfrm_output_flush(&endp->osmux.out);
 
 	osmux_xfrm_input_close_circuit(endp->osmux.in, endp->osmux.cid);
+	osmux_endp_hash_del(endp);
 	endp->osmux.state = OSMUX_STATE_DISABLED;
 	endp->osmux.cid = -1;
 	osmux_handle_put(endp->osmux.in);
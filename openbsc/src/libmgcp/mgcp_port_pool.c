@@ -0,0 +1,421 @@
+/* RTP/RTCP port pair allocation */
+
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Every dynamic port range has a pool of its port pairs. Free pairs are
+ * kept in FIFOs so a released port is reused as late as possible, a
+ * bitmap tells which pairs are free. Pairs that still have their
+ * sockets bound are handed out first.
+ *
+ * Releasing a pair closes its sockets. With "rtp socket-pool" a timer
+ * binds free pairs ahead of demand when fewer than the low watermark
+ * are ready, and released pairs stay bound until the high watermark is
+ * reached. The idle sockets are not registered, what they received is
+ * discarded when the pair is used again.
+ *
+ * A pair that can not be bound (e.g. used by another process) is taken
+ * out of the pool until the range is changed.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/timer.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+
+/* pairs bound per run of the refill timer */
+#define REFILL_BATCH	64
+
+struct pair_fifo {
+	int *idx;
+	int head;
+	int count;
+};
+
+struct mgcp_port_pool {
+	struct mgcp_config *cfg;
+	int first_port;
+	int last_port;
+	char *bind_addr;
+	int num_pairs;
+
+	/* the range has changed, free it once all pairs are released */
+	int retired;
+
+	int num_used;
+	int num_unusable;
+
+	/* one bit per pair, set while the pair is free */
+	uint32_t *free_map;
+
+	/* free pairs with and without bound sockets */
+	struct pair_fifo bound;
+	struct pair_fifo unbound;
+
+	/* sockets of the bound pairs, -1 otherwise */
+	int *rtp_fd;
+	int *rtcp_fd;
+	int *dscp;
+
+	struct osmo_timer_list refill_timer;
+};
+
+#define MAP_WORD(idx)	((idx) / 32)
+#define MAP_BIT(idx)	(1u << ((idx) % 32))
+
+static void fifo_push(struct mgcp_port_pool *pool, struct pair_fifo *fifo, int idx)
+{
+	fifo->idx[(fifo->head + fifo->count) % pool->num_pairs] = idx;
+	fifo->count += 1;
+}
+
+static int fifo_pop(struct mgcp_port_pool *pool, struct pair_fifo *fifo)
+{
+	int idx;
+
+	if (fifo->count == 0)
+		return -1;
+
+	idx = fifo->idx[fifo->head];
+	fifo->head = (fifo->head + 1) % pool->num_pairs;
+	fifo->count -= 1;
+	return idx;
+}
+
+static const char *range_bind_addr(struct mgcp_config *cfg,
+				   struct mgcp_port_range *range)
+{
+	if (range->bind_addr)
+		return range->bind_addr;
+	return cfg->source_addr;
+}
+
+static void close_fd(int *fd)
+{
+	if (*fd == -1)
+		return;
+	close(*fd);
+	*fd = -1;
+}
+
+static void pool_retire(struct mgcp_port_pool *pool)
+{
+	int i;
+
+	osmo_timer_del(&pool->refill_timer);
+	for (i = 0; i < pool->num_pairs; ++i) {
+		close_fd(&pool->rtp_fd[i]);
+		close_fd(&pool->rtcp_fd[i]);
+	}
+	pool->bound.count = 0;
+	pool->retired = 1;
+
+	if (pool->num_used == 0)
+		talloc_free(pool);
+}
+
+/* Returns -EADDRINUSE or -EACCES when the pair can not be bound. */
+static int bind_pair(struct mgcp_port_pool *pool, int idx)
+{
+	struct osmo_fd rtp, rtcp;
+	int port = pool->first_port + idx * 2;
+	int rc;
+
+	if (mgcp_create_bind(pool->bind_addr, &rtp, port) != 0)
+		return -errno;
+	if (mgcp_create_bind(pool->bind_addr, &rtcp, port + 1) != 0) {
+		rc = -errno;
+		close(rtp.fd);
+		return rc;
+	}
+
+	mgcp_set_ip_tos(rtp.fd, pool->cfg->endp_dscp);
+	mgcp_set_ip_tos(rtcp.fd, pool->cfg->endp_dscp);
+	pool->rtp_fd[idx] = rtp.fd;
+	pool->rtcp_fd[idx] = rtcp.fd;
+	pool->dscp[idx] = pool->cfg->endp_dscp;
+	return 0;
+}
+
+static void refill_cb(void *data)
+{
+	struct mgcp_port_pool *pool = data;
+	int high = pool->cfg->rtp_socket_pool_high;
+	int n, idx, rc;
+
+	for (n = 0; n < REFILL_BATCH && pool->bound.count < high; ++n) {
+		idx = fifo_pop(pool, &pool->unbound);
+		if (idx < 0)
+			return;
+
+		rc = bind_pair(pool, idx);
+		if (rc == -EADDRINUSE || rc == -EACCES) {
+			LOGP(DMGCP, LOGL_NOTICE, "Not using RTP port %d of %d-%d anymore.\n",
+			     pool->first_port + idx * 2, pool->first_port, pool->last_port);
+			pool->free_map[MAP_WORD(idx)] &= ~MAP_BIT(idx);
+			pool->num_unusable += 1;
+			continue;
+		}
+		if (rc != 0) {
+			/* out of fds or similar, try again with the next CRCX */
+			LOGP(DMGCP, LOGL_ERROR, "Failed to bind RTP port %d: %s\n",
+			     pool->first_port + idx * 2, strerror(-rc));
+			fifo_push(pool, &pool->unbound, idx);
+			return;
+		}
+		fifo_push(pool, &pool->bound, idx);
+	}
+
+	if (pool->bound.count < high && pool->unbound.count > 0)
+		osmo_timer_schedule(&pool->refill_timer, 0, 0);
+}
+
+static void check_low_watermark(struct mgcp_port_pool *pool)
+{
+	if (pool->bound.count >= pool->cfg->rtp_socket_pool_low)
+		return;
+	if (pool->unbound.count == 0)
+		return;
+	if (!osmo_timer_pending(&pool->refill_timer))
+		osmo_timer_schedule(&pool->refill_timer, 0, 0);
+}
+
+static struct mgcp_port_pool *pool_alloc(struct mgcp_config *cfg,
+					 struct mgcp_port_range *range)
+{
+	struct mgcp_port_pool *pool;
+	int i, num;
+
+	num = 0;
+	if (range->range_end > range->range_start)
+		num = (range->range_end - range->range_start + 1) / 2;
+
+	pool = talloc_zero(cfg, struct mgcp_port_pool);
+	if (!pool)
+		return NULL;
+
+	pool->cfg = cfg;
+	pool->first_port = range->range_start;
+	pool->last_port = range->range_end;
+	pool->bind_addr = talloc_strdup(pool, range_bind_addr(cfg, range));
+	pool->num_pairs = num;
+	pool->free_map = talloc_zero_array(pool, uint32_t, MAP_WORD(num) + 1);
+	pool->bound.idx = talloc_array(pool, int, num + 1);
+	pool->unbound.idx = talloc_array(pool, int, num + 1);
+	pool->rtp_fd = talloc_array(pool, int, num + 1);
+	pool->rtcp_fd = talloc_array(pool, int, num + 1);
+	pool->dscp = talloc_array(pool, int, num + 1);
+	if (!pool->bind_addr || !pool->free_map || !pool->bound.idx
+	    || !pool->unbound.idx || !pool->rtp_fd || !pool->rtcp_fd
+	    || !pool->dscp) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < num; ++i) {
+		pool->free_map[MAP_WORD(i)] |= MAP_BIT(i);
+		pool->rtp_fd[i] = -1;
+		pool->rtcp_fd[i] = -1;
+		fifo_push(pool, &pool->unbound, i);
+	}
+
+	osmo_timer_setup(&pool->refill_timer, refill_cb, pool);
+	check_low_watermark(pool);
+	return pool;
+}
+
+/**
+ * Return the pool of a dynamic port range, it is (re)created when the
+ * range or the address to bind to has been changed.
+ */
+struct mgcp_port_pool *mgcp_port_pool_get(struct mgcp_config *cfg,
+					  struct mgcp_port_range *range)
+{
+	struct mgcp_port_pool *pool = range->pool;
+
+	if (pool && pool->first_port == range->range_start
+	    && pool->last_port == range->range_end
+	    && strcmp(pool->bind_addr, range_bind_addr(cfg, range)) == 0)
+		return pool;
+
+	if (pool)
+		pool_retire(pool);
+
+	range->pool = pool_alloc(cfg, range);
+	return range->pool;
+}
+
+/**
+ * Create the pools of the dynamic ranges so the sockets are bound
+ * before the first CRCX.
+ */
+void mgcp_port_pools_init(struct mgcp_config *cfg)
+{
+	if (cfg->bts_ports.mode == PORT_ALLOC_DYNAMIC)
+		mgcp_port_pool_get(cfg, &cfg->bts_ports);
+	if (cfg->net_ports.mode == PORT_ALLOC_DYNAMIC)
+		mgcp_port_pool_get(cfg, &cfg->net_ports);
+	if (cfg->transcoder_ip && cfg->transcoder_ports.mode == PORT_ALLOC_DYNAMIC)
+		mgcp_port_pool_get(cfg, &cfg->transcoder_ports);
+}
+
+/**
+ * Take a free pair, one with bound sockets when possible. Returns the
+ * RTP port or -1 when all pairs are in use.
+ */
+int mgcp_port_pool_alloc(struct mgcp_port_pool *pool)
+{
+	int idx;
+
+	idx = fifo_pop(pool, &pool->bound);
+	if (idx < 0)
+		idx = fifo_pop(pool, &pool->unbound);
+	if (idx < 0)
+		return -1;
+
+	pool->free_map[MAP_WORD(idx)] &= ~MAP_BIT(idx);
+	pool->num_used += 1;
+	check_low_watermark(pool);
+
+	return pool->first_port + idx * 2;
+}
+
+static int pair_index(struct mgcp_port_pool *pool, int port)
+{
+	int idx = (port - pool->first_port) / 2;
+
+	if (port < pool->first_port || idx >= pool->num_pairs)
+		return -1;
+	return idx;
+}
+
+/* throw away what was received while the sockets were not in use */
+static void drain_socket(int fd)
+{
+	char buf[64];
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0)
+		;
+}
+
+/**
+ * Hand out the bound sockets of an allocated pair. Returns 0 and sets
+ * the fds when there are some, the caller has to bind otherwise.
+ */
+int mgcp_port_pool_take_fds(struct mgcp_port_pool *pool, int port,
+			    int *rtp_fd, int *rtcp_fd)
+{
+	int idx = pair_index(pool, port);
+
+	if (idx < 0 || pool->rtp_fd[idx] == -1)
+		return -1;
+
+	*rtp_fd = pool->rtp_fd[idx];
+	*rtcp_fd = pool->rtcp_fd[idx];
+	pool->rtp_fd[idx] = -1;
+	pool->rtcp_fd[idx] = -1;
+
+	drain_socket(*rtp_fd);
+	drain_socket(*rtcp_fd);
+	if (pool->dscp[idx] != pool->cfg->endp_dscp) {
+		mgcp_set_ip_tos(*rtp_fd, pool->cfg->endp_dscp);
+		mgcp_set_ip_tos(*rtcp_fd, pool->cfg->endp_dscp);
+	}
+	return 0;
+}
+
+/**
+ * Put an allocated pair back. The sockets are kept bound for the next
+ * user of the pair while the socket pool is below its high watermark,
+ * they are closed otherwise.
+ */
+void mgcp_port_pool_release(struct mgcp_port_pool *pool, int port,
+			    int rtp_fd, int rtcp_fd)
+{
+	int high = pool->cfg->rtp_socket_pool_high;
+	int idx = pair_index(pool, port);
+
+	if (idx < 0 || pool->free_map[MAP_WORD(idx)] & MAP_BIT(idx)) {
+		LOGP(DMGCP, LOGL_ERROR, "Port %d was not allocated from %d-%d.\n",
+		     port, pool->first_port, pool->last_port);
+		close_fd(&rtp_fd);
+		close_fd(&rtcp_fd);
+		return;
+	}
+
+	pool->num_used -= 1;
+	if (pool->retired) {
+		close_fd(&rtp_fd);
+		close_fd(&rtcp_fd);
+		if (pool->num_used == 0)
+			talloc_free(pool);
+		return;
+	}
+
+	pool->free_map[MAP_WORD(idx)] |= MAP_BIT(idx);
+	if (rtp_fd == -1 || rtcp_fd == -1 || pool->bound.count >= high) {
+		close_fd(&rtp_fd);
+		close_fd(&rtcp_fd);
+		fifo_push(pool, &pool->unbound, idx);
+		return;
+	}
+
+	pool->rtp_fd[idx] = rtp_fd;
+	pool->rtcp_fd[idx] = rtcp_fd;
+	pool->dscp[idx] = pool->cfg->endp_dscp;
+	fifo_push(pool, &pool->bound, idx);
+}
+
+/* The pair could not be bound, do not hand it out again. */
+void mgcp_port_pool_unusable(struct mgcp_port_pool *pool, int port)
+{
+	int idx = pair_index(pool, port);
+
+	if (idx < 0)
+		return;
+
+	LOGP(DMGCP, LOGL_NOTICE, "Not using RTP port %d of %d-%d anymore.\n",
+	     port, pool->first_port, pool->last_port);
+	pool->num_used -= 1;
+	pool->num_unusable += 1;
+}
+
+int mgcp_port_pool_stats(struct mgcp_port_range *range, int *used, int *free,
+			 int *bound, int *unusable)
+{
+	struct mgcp_port_pool *pool = range->pool;
+
+	if (!pool)
+		return -1;
+
+	*used = pool->num_used;
+	*free = pool->bound.count + pool->unbound.count;
+	*bound = pool->bound.count;
+	*unusable = pool->num_unusable;
+	return 0;
+}
@@ -35,6 +35,8 @@
 
 #include <openbsc/mgcp.h>
 #include <openbsc/mgcp_internal.h>
+#include <openbsc/mgcp_tokenizer.h>
+#include <openbsc/str_hash.h>
 
 #define for_each_non_empty_line(line, save)			\
 	for (line = strtok_r(NULL, "\r\n", &save); line;\
@@ -64,7 +66,8 @@ static void delete_transcoder(struct mgcp_endpoint *endp);
 
 static int setup_rtp_processing(struct mgcp_endpoint *endp);
 
-static int mgcp_analyze_header(struct mgcp_parse_data *parse, char *data);
+static int mgcp_analyze_header(struct mgcp_parse_data *parse,
+			       const struct mgcp_tokenized *tok);
 
 static int mgcp_check_param(const struct mgcp_endpoint *endp, const char *line)
 {
@@ -303,10 +306,13 @@ static struct msgb *create_response_with_sdp(struct mgcp_endpoint *endp,
 
 static void send_dummy(struct mgcp_endpoint *endp)
 {
+	/* the keepalive timer sends on the sockets of the RTP worker */
+	mgcp_rtp_worker_hold(endp);
 	if (endp->osmux.state != OSMUX_STATE_DISABLED)
 		osmux_send_dummy(endp);
 	else
 		mgcp_send_dummy(endp);
+	mgcp_rtp_worker_release(endp);
 }
 
 /*
@@ -317,9 +323,9 @@ static void send_dummy(struct mgcp_endpoint *endp)
 struct msgb *mgcp_handle_message(struct mgcp_config *cfg, struct msgb *msg)
 {
 	struct mgcp_parse_data pdata;
-	int i, code, handled = 0;
+	struct mgcp_tokenized tok;
+	int i, handled = 0;
 	struct msgb *resp = NULL;
-	char *data;
 	unsigned char *tail = msg->l2h + msgb_l2len(msg); /* char after l2 data */
 
 	if (msgb_l2len(msg) < 4) {
@@ -341,9 +347,12 @@ struct msgb *mgcp_handle_message(struct mgcp_config *cfg, struct msgb *msg)
 		return NULL;
 	}
 
-        /* attempt to treat it as a response */
-        if (sscanf((const char *)&msg->l2h[0], "%3d %*s", &code) == 1) {
-		LOGP(DMGCP, LOGL_DEBUG, "Response: Code: %d\n", code);
+	if (mgcp_tokenize((const char *) msg->l2h, msgb_l2len(msg), &tok) < 0)
+		return NULL;
+
+	/* attempt to treat it as a response */
+	if (tok.code >= 0) {
+		LOGP(DMGCP, LOGL_DEBUG, "Response: Code: %d\n", tok.code);
 		return NULL;
 	}
 
@@ -355,14 +364,17 @@ struct msgb *mgcp_handle_message(struct mgcp_config *cfg, struct msgb *msg)
 	 */
 	memset(&pdata, 0, sizeof(pdata));
 	pdata.cfg = cfg;
-	data = strline_r((char *) msg->l3h, &pdata.save);
-	pdata.found = mgcp_analyze_header(&pdata, data);
+	pdata.found = mgcp_analyze_header(&pdata, &tok);
 	if (pdata.endp && pdata.trans
 			&& pdata.endp->last_trans
 			&& strcmp(pdata.endp->last_trans, pdata.trans) == 0) {
 		return do_retransmission(pdata.endp);
 	}
 
+	/* keep the RTP worker away while the endpoint is modified */
+	if (pdata.endp)
+		mgcp_rtp_worker_hold(pdata.endp);
+
 	for (i = 0; i < ARRAY_SIZE(mgcp_requests); ++i) {
 		if (strncmp(mgcp_requests[i].name, (const char *) &msg->l2h[0], 4) == 0) {
 			handled = 1;
@@ -371,6 +383,9 @@ struct msgb *mgcp_handle_message(struct mgcp_config *cfg, struct msgb *msg)
 		}
 	}
 
+	if (pdata.endp)
+		mgcp_rtp_worker_release(pdata.endp);
+
 	if (!handled)
 		LOGP(DMGCP, LOGL_NOTICE, "MSG with type: '%.4s' not handled\n", &msg->l2h[0]);
 
@@ -424,7 +439,7 @@ static struct mgcp_endpoint *find_e1_endpoint(struct mgcp_config *cfg,
 	return &tcfg->endpoints[endp];
 }
 
-static struct mgcp_endpoint *find_endpoint(struct mgcp_config *cfg, const char *mgcp)
+static struct mgcp_endpoint *parse_endpoint(struct mgcp_config *cfg, const char *mgcp)
 {
 	char *endptr = NULL;
 	unsigned int gw = INT_MAX;
@@ -441,57 +456,120 @@ static struct mgcp_endpoint *find_endpoint(struct mgcp_config *cfg, const char *
 }
 
 /**
+ * Endpoint names that have been resolved before. The name up to the '@'
+ * is cached so neither the string is parsed again nor the trunk list is
+ * walked for every command.
+ */
+#define ENDP_CACHE_SIZE		256
+#define ENDP_CACHE_NAME_LEN	24
+
+struct mgcp_endp_cache_entry {
+	char name[ENDP_CACHE_NAME_LEN];
+	struct mgcp_endpoint *endp;
+};
+
+static unsigned int endp_cache_key(const char *name, size_t len)
+{
+	return str_hash(name, len) % ENDP_CACHE_SIZE;
+}
+
+static void endp_cache_flush(struct mgcp_config *cfg)
+{
+	talloc_free(cfg->endp_cache);
+	cfg->endp_cache = NULL;
+}
+
+static struct mgcp_endpoint *find_endpoint(struct mgcp_config *cfg, const char *mgcp)
+{
+	struct mgcp_endp_cache_entry *entry;
+	struct mgcp_endpoint *endp;
+	size_t len = strcspn(mgcp, "@");
+
+	/* only complete names that fit are cached */
+	if (mgcp[len] != '@' || len >= ENDP_CACHE_NAME_LEN)
+		return parse_endpoint(cfg, mgcp);
+
+	if (cfg->endp_cache) {
+		entry = &cfg->endp_cache[endp_cache_key(mgcp, len)];
+		if (entry->endp && strncmp(entry->name, mgcp, len) == 0
+		    && entry->name[len] == '\0')
+			return entry->endp;
+	}
+
+	endp = parse_endpoint(cfg, mgcp);
+	if (!endp)
+		return NULL;
+
+	if (!cfg->endp_cache)
+		cfg->endp_cache = talloc_zero_array(cfg, struct mgcp_endp_cache_entry,
+						    ENDP_CACHE_SIZE);
+	if (cfg->endp_cache) {
+		entry = &cfg->endp_cache[endp_cache_key(mgcp, len)];
+		memcpy(entry->name, mgcp, len);
+		entry->name[len] = '\0';
+		entry->endp = endp;
+	}
+
+	return endp;
+}
+
+/**
+ * The transaction and endpoint are terminated in place, the handlers
+ * continue with the line after the status line.
  * @returns 0 when the status line was complete and transaction_id and
  * endp out parameters are set.
  */
-static int mgcp_analyze_header(struct mgcp_parse_data *pdata, char *data)
+static int mgcp_analyze_header(struct mgcp_parse_data *pdata,
+			       const struct mgcp_tokenized *tok)
 {
-	int i = 0;
-	char *elem, *save = NULL;
+	char *trans, *endp;
 
-	OSMO_ASSERT(data);
 	pdata->trans = "000000";
+	pdata->save = tok->body.len > 0 ? (char *) tok->body.data : NULL;
 
-	for (elem = strtok_r(data, " ", &save); elem;
-	     elem = strtok_r(NULL, " ", &save)) {
-		switch (i) {
-		case 0:
-			pdata->trans = elem;
-			break;
-		case 1:
-			pdata->endp = find_endpoint(pdata->cfg, elem);
-			if (!pdata->endp) {
-				LOGP(DMGCP, LOGL_ERROR,
-				     "Unable to find Endpoint `%s'\n", elem);
-				return -1;
-			}
-			break;
-		case 2:
-			if (strcmp("MGCP", elem)) {
-				LOGP(DMGCP, LOGL_ERROR,
-				     "MGCP header parsing error\n");
-				return -1;
-			}
-			break;
-		case 3:
-			if (strcmp("1.0", elem)) {
-				LOGP(DMGCP, LOGL_ERROR, "MGCP version `%s' "
-					"not supported\n", elem);
-				return -1;
-			}
-			break;
-		}
-		i++;
+	if (tok->num_words < 2)
+		goto too_short;
+
+	trans = (char *) tok->trans.data;
+	trans[tok->trans.len] = '\0';
+	pdata->trans = trans;
+
+	if (tok->num_words < 3)
+		goto too_short;
+
+	endp = (char *) tok->endpoint.data;
+	endp[tok->endpoint.len] = '\0';
+	pdata->endp = find_endpoint(pdata->cfg, endp);
+	if (!pdata->endp) {
+		LOGP(DMGCP, LOGL_ERROR,
+		     "Unable to find Endpoint `%s'\n", endp);
+		return -1;
 	}
 
-	if (i != 4) {
-		LOGP(DMGCP, LOGL_ERROR, "MGCP status line too short.\n");
-		pdata->trans = "000000";
-		pdata->endp = NULL;
+	if (tok->num_words < 4)
+		goto too_short;
+	if (!mgcp_token_equal(&tok->proto, "MGCP")) {
+		LOGP(DMGCP, LOGL_ERROR,
+		     "MGCP header parsing error\n");
 		return -1;
 	}
 
-	return 0;
+	if (tok->num_words < 5)
+		goto too_short;
+	if (!mgcp_token_equal(&tok->version, "1.0")) {
+		LOGP(DMGCP, LOGL_ERROR, "MGCP version `%.*s' "
+			"not supported\n", tok->version.len, tok->version.data);
+		return -1;
+	}
+
+	if (tok->num_words == 5)
+		return 0;
+
+too_short:
+	LOGP(DMGCP, LOGL_ERROR, "MGCP status line too short.\n");
+	pdata->trans = "000000";
+	pdata->endp = NULL;
+	return -1;
 }
 
 static int verify_call_id(const struct mgcp_endpoint *endp,
@@ -556,32 +634,45 @@ static int allocate_port(struct mgcp_endpoint *endp, struct mgcp_rtp_end *end,
 			 struct mgcp_port_range *range,
 			 int (*alloc)(struct mgcp_endpoint *endp, int port))
 {
-	int i;
+	struct mgcp_port_pool *pool;
+	int port, rc;
 
 	if (range->mode == PORT_ALLOC_STATIC) {
 		end->local_alloc = PORT_ALLOC_STATIC;
 		return 0;
 	}
 
-	/* attempt to find a port */
-	for (i = 0; i < 200; ++i) {
-		int rc;
-
-		if (range->last_port >= range->range_end)
-			range->last_port = range->range_start;
+	pool = mgcp_port_pool_get(endp->cfg, range);
+	if (!pool)
+		return -1;
 
-		rc = alloc(endp, range->last_port);
+	/* put a previous pair back into its own pool first */
+	if (end->rtp.fd != -1 || end->rtcp.fd != -1) {
+		LOGP(DMGCP, LOGL_ERROR, "Previous port %d was still bound on 0x%x\n",
+		     end->local_port, ENDPOINT_NUMBER(endp));
+		mgcp_free_rtp_port(end);
+	}
 
-		range->last_port += 2;
+	/* pairs taken by someone else leave the pool, this terminates */
+	while ((port = mgcp_port_pool_alloc(pool)) >= 0) {
+		end->port_pool = pool;
+		rc = alloc(endp, port);
 		if (rc == 0) {
 			end->local_alloc = PORT_ALLOC_DYNAMIC;
 			return 0;
 		}
 
+		end->port_pool = NULL;
+		if (rc != -EADDRINUSE && rc != -EACCES) {
+			/* out of fds or similar, the pair itself is fine */
+			mgcp_port_pool_release(pool, port, -1, -1);
+			return -1;
+		}
+		mgcp_port_pool_unusable(pool, port);
 	}
 
-	LOGP(DMGCP, LOGL_ERROR, "Allocating a RTP/RTCP port failed 200 times 0x%x.\n",
-	     ENDPOINT_NUMBER(endp));
+	LOGP(DMGCP, LOGL_ERROR, "No free RTP/RTCP port in %d-%d for 0x%x.\n",
+	     range->range_start, range->range_end, ENDPOINT_NUMBER(endp));
 	return -1;
 }
 
@@ -712,6 +803,20 @@ static int mgcp_osmux_setup(struct mgcp_endpoint *endp, const char *line)
 	return mgcp_parse_osmux_cid(line);
 }
 
+static void setup_jibuf(struct mgcp_endpoint *endp)
+{
+	if (!endp->bts_use_jibuf)
+		return;
+
+	endp->bts_jb = osmo_jibuf_alloc(endp->tcfg->endpoints);
+	osmo_jibuf_set_min_delay(endp->bts_jb, endp->bts_jitter_delay_min);
+	osmo_jibuf_set_max_delay(endp->bts_jb, endp->bts_jitter_delay_max);
+	osmo_jibuf_set_dequeue_cb(endp->bts_jb, mgcp_dejitter_udp_send, &endp->net_end);
+
+	/* without the slots every packet is allocated on its own */
+	endp->bts_jb_slots = mgcp_jibuf_slots_alloc(endp);
+}
+
 static struct msgb *handle_create_con(struct mgcp_parse_data *p)
 {
 	struct mgcp_trunk_config *tcfg;
@@ -869,12 +974,7 @@ mgcp_header_done:
 			/* stop processing */
 			create_transcoder(endp);
 			/* Set up jitter buffer if required after policy has updated jibuf endp values */
-			if (endp->bts_use_jibuf) {
-				endp->bts_jb = osmo_jibuf_alloc(tcfg->endpoints);
-				osmo_jibuf_set_min_delay(endp->bts_jb, endp->bts_jitter_delay_min);
-				osmo_jibuf_set_max_delay(endp->bts_jb, endp->bts_jitter_delay_max);
-				osmo_jibuf_set_dequeue_cb(endp->bts_jb, mgcp_dejitter_udp_send, &endp->net_end);
-			}
+			setup_jibuf(endp);
 			return NULL;
 			break;
 		case MGCP_POLICY_CONT:
@@ -884,12 +984,7 @@ mgcp_header_done:
 	}
 
 	/* Set up jitter buffer if required after policy has updated jibuf endp values */
-	if (endp->bts_use_jibuf) {
-		endp->bts_jb = osmo_jibuf_alloc(tcfg->endpoints);
-		osmo_jibuf_set_min_delay(endp->bts_jb, endp->bts_jitter_delay_min);
-		osmo_jibuf_set_max_delay(endp->bts_jb, endp->bts_jitter_delay_max);
-		osmo_jibuf_set_dequeue_cb(endp->bts_jb, mgcp_dejitter_udp_send, &endp->net_end);
-	}
+	setup_jibuf(endp);
 
 	LOGP(DMGCP, LOGL_DEBUG, "Creating endpoint on: 0x%x CI: %u port: %u/%u\n",
 		ENDPOINT_NUMBER(endp), endp->ci,
@@ -977,6 +1072,9 @@ static struct msgb *handle_modify_con(struct mgcp_parse_data *p)
 		mgcp_set_audio_info(p->cfg, &endp->net_end.codec,
 			       PTYPE_UNDEFINED, endp->local_options.codec);
 
+	/* the new peer is connected once it has been heard from */
+	mgcp_rtp_end_disconnect(&endp->net_end);
+
 	if (setup_rtp_processing(endp) != 0)
 		goto error3;
 
@@ -1304,6 +1402,7 @@ static void mgcp_rtp_end_reset(struct mgcp_rtp_end *end)
 	end->dropped_packets = 0;
 	memset(&end->addr, 0, sizeof(end->addr));
 	end->rtp_port = end->rtcp_port = 0;
+	mgcp_rtp_end_disconnect(end);
 	end->local_alloc = -1;
 	talloc_free(end->fmtp_extra);
 	end->fmtp_extra = NULL;
@@ -1330,6 +1429,9 @@ int mgcp_endpoints_allocate(struct mgcp_trunk_config *tcfg)
 {
 	int i;
 
+	/* cached names may point to the old endpoints */
+	endp_cache_flush(tcfg->cfg);
+
 	/* Initialize all endpoints */
 	tcfg->endpoints = _talloc_zero_array(tcfg->cfg,
 				       sizeof(struct mgcp_endpoint),
@@ -1354,9 +1456,13 @@ int mgcp_endpoints_allocate(struct mgcp_trunk_config *tcfg)
 void mgcp_release_endp(struct mgcp_endpoint *endp)
 {
 	LOGP(DMGCP, LOGL_DEBUG, "Releasing endpoint on: 0x%x\n", ENDPOINT_NUMBER(endp));
+	mgcp_rtp_worker_hold(endp);
 	if (endp->bts_jb)
 		osmo_jibuf_delete(endp->bts_jb);
 	endp->bts_jb = NULL;
+	/* after the jitter buffer, it may still hold some of the slots */
+	talloc_free(endp->bts_jb_slots);
+	endp->bts_jb_slots = NULL;
 	endp->ci = CI_UNUSED;
 	endp->allocated = 0;
 
@@ -1386,6 +1492,7 @@ void mgcp_release_endp(struct mgcp_endpoint *endp)
 	osmux_release_cid(endp);
 
 	memset(&endp->taps, 0, sizeof(endp->taps));
+	mgcp_rtp_worker_release(endp);
 }
 
 void mgcp_initialize_endp(struct mgcp_endpoint *endp)
@@ -0,0 +1,158 @@
+/* Zero copy splitting of MGCP messages */
+
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include <openbsc/mgcp_tokenizer.h>
+
+static inline int is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/**
+ * Take the next line from rest. Like strline_r() a line ends with "\r",
+ * "\n" or "\r\n" and the line ending is not part of the line. Returns 0
+ * when nothing is left.
+ */
+int mgcp_next_line(struct mgcp_token *rest, struct mgcp_token *line,
+		   enum mgcp_eol *eol)
+{
+	const char *nl, *cr, *next;
+
+	if (rest->len <= 0)
+		return 0;
+
+	line->data = rest->data;
+	nl = memchr(rest->data, '\n', rest->len);
+	cr = memchr(rest->data, '\r', nl ? nl - rest->data : rest->len);
+
+	if (cr) {
+		line->len = cr - rest->data;
+		if (cr + 1 == nl) {
+			*eol = MGCP_EOL_CRLF;
+			next = nl + 1;
+		} else {
+			*eol = MGCP_EOL_CR;
+			next = cr + 1;
+		}
+	} else if (nl) {
+		line->len = nl - rest->data;
+		*eol = MGCP_EOL_LF;
+		next = nl + 1;
+	} else {
+		line->len = rest->len;
+		*eol = MGCP_EOL_NONE;
+		next = rest->data + rest->len;
+	}
+
+	rest->len -= next - rest->data;
+	rest->data = next;
+	return 1;
+}
+
+/**
+ * Take the next word separated by spaces from rest, like strtok() runs
+ * of spaces are skipped. Returns 0 when nothing is left.
+ */
+int mgcp_next_word(struct mgcp_token *rest, struct mgcp_token *word)
+{
+	const char *pos = rest->data;
+	const char *end = rest->data + rest->len;
+
+	while (pos < end && *pos == ' ')
+		++pos;
+	if (pos == end) {
+		rest->data = end;
+		rest->len = 0;
+		return 0;
+	}
+
+	word->data = pos;
+	while (pos < end && *pos != ' ')
+		++pos;
+	word->len = pos - word->data;
+
+	rest->data = pos;
+	rest->len = end - pos;
+	return 1;
+}
+
+/**
+ * Split the message into the words of the first line, the parameter
+ * lines and the SDP. The data ends at len or the first NUL. Returns
+ * -1 when there is not even a first line.
+ */
+int mgcp_tokenize(const char *data, int len, struct mgcp_tokenized *out)
+{
+	struct mgcp_token rest, words, word, line;
+	struct mgcp_token *fields[] = {
+		&out->verb, &out->trans, &out->endpoint,
+		&out->proto, &out->version,
+	};
+	const char *nul;
+	enum mgcp_eol eol;
+
+	memset(out, 0, sizeof(*out));
+
+	nul = memchr(data, '\0', len);
+	if (nul)
+		len = nul - data;
+
+	rest.data = data;
+	rest.len = len;
+	if (!mgcp_next_line(&rest, &out->line, &out->line_eol))
+		return -1;
+
+	words = out->line;
+	while (mgcp_next_word(&words, &word)) {
+		if (out->num_words < sizeof(fields) / sizeof(fields[0]))
+			*fields[out->num_words] = word;
+		out->num_words += 1;
+	}
+
+	/* a response has no endpoint, the rest is a comment */
+	out->code = -1;
+	if (out->verb.len == 3 && is_digit(out->verb.data[0])
+	    && is_digit(out->verb.data[1]) && is_digit(out->verb.data[2])) {
+		out->code = (out->verb.data[0] - '0') * 100
+			+ (out->verb.data[1] - '0') * 10
+			+ (out->verb.data[2] - '0');
+		memset(&out->endpoint, 0, sizeof(out->endpoint));
+		memset(&out->proto, 0, sizeof(out->proto));
+		memset(&out->version, 0, sizeof(out->version));
+	}
+
+	/* parameters up to the empty line, then the SDP */
+	out->body = rest;
+	out->params.data = rest.data;
+	while (mgcp_next_line(&rest, &line, &eol)) {
+		if (line.len == 0) {
+			out->params.len = line.data - out->params.data;
+			out->sdp = rest;
+			return 0;
+		}
+	}
+
+	out->params.len = rest.data - out->params.data;
+	out->sdp.data = rest.data;
+	return 0;
+}
@@ -21,13 +21,11 @@
 #include <string.h>
 #include <errno.h>
 
-
-#include "g711common.h"
-
 #include <openbsc/debug.h>
 #include <openbsc/mgcp.h>
 #include <openbsc/mgcp_internal.h>
 #include <openbsc/mgcp_transcode.h>
+#include <openbsc/mgcp_g711.h>
 
 #include <osmocom/core/talloc.h>
 #include <osmocom/netif/rtp.h>
@@ -80,46 +78,11 @@ static enum audio_format get_audio_format(const struct mgcp_rtp_codec *codec)
 	}
 }
 
-static void l16_encode(short *sample, unsigned char *buf, size_t n)
-{
-	for (; n > 0; --n, ++sample, buf += 2) {
-		buf[0] = sample[0] >> 8;
-		buf[1] = sample[0] & 0xff;
-	}
-}
-
-static void l16_decode(unsigned char *buf, short *sample, size_t n)
-{
-	for (; n > 0; --n, ++sample, buf += 2)
-		sample[0] = ((short)buf[0] << 8) | buf[1];
-}
-
-static void alaw_encode(short *sample, unsigned char *buf, size_t n)
-{
-	for (; n > 0; --n)
-		*(buf++) = s16_to_alaw(*(sample++));
-}
-
-static void alaw_decode(unsigned char *buf, short *sample, size_t n)
-{
-	for (; n > 0; --n)
-		*(sample++) = alaw_to_s16(*(buf++));
-}
-
-static void ulaw_encode(short *sample, unsigned char *buf, size_t n)
-{
-	for (; n > 0; --n)
-		*(buf++) = s16_to_ulaw(*(sample++));
-}
-
-static void ulaw_decode(unsigned char *buf, short *sample, size_t n)
-{
-	for (; n > 0; --n)
-		*(sample++) = ulaw_to_s16(*(buf++));
-}
-
 static int processing_state_destructor(struct mgcp_process_rtp_state *state)
 {
+	/* a transcoding thread might still be busy with it */
+	mgcp_transcoding_pool_cancel(state);
+
 	switch (state->src_fmt) {
 	case AF_GSM:
 		if (state->src.gsm_handle)
@@ -171,7 +134,7 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 	const struct mgcp_rtp_codec *src_codec = &src_end->codec;
 
 	if (endp->tcfg->no_audio_transcoding) {
-		LOGP(DMGCP, LOGL_NOTICE,
+		LOGP_RTP(DMGCP, LOGL_NOTICE,
 			"Transcoding disabled on endpoint 0x%x\n",
 			ENDPOINT_NUMBER(endp));
 		return 0;
@@ -180,10 +143,10 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 	src_fmt = get_audio_format(src_codec);
 	dst_fmt = get_audio_format(dst_codec);
 
-	LOGP(DMGCP, LOGL_ERROR,
-	     "Checking transcoding: %s (%d) -> %s (%d)\n",
-	     src_codec->subtype_name, src_codec->payload_type,
-	     dst_codec->subtype_name, dst_codec->payload_type);
+	LOGP_RTP(DMGCP, LOGL_ERROR,
+	         "Checking transcoding: %s (%d) -> %s (%d)\n",
+	         src_codec->subtype_name, src_codec->payload_type,
+	         dst_codec->subtype_name, dst_codec->payload_type);
 
 	if (src_fmt == AF_INVALID || dst_fmt == AF_INVALID) {
 		if (!src_codec->subtype_name || !dst_codec->subtype_name)
@@ -194,23 +157,25 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 			/* Nothing to do */
 			return 0;
 
-		LOGP(DMGCP, LOGL_ERROR,
-		     "Cannot transcode: %s codec not supported (%s -> %s).\n",
-		     src_fmt != AF_INVALID ? "destination" : "source",
-		     src_codec->audio_name, dst_codec->audio_name);
+		LOGP_RTP(DMGCP, LOGL_ERROR,
+		         "Cannot transcode: %s codec not supported (%s -> %s).\n",
+		         src_fmt != AF_INVALID ? "destination" : "source",
+		         src_codec->audio_name, dst_codec->audio_name);
 		return -EINVAL;
 	}
 
 	if (src_codec->rate && dst_codec->rate && src_codec->rate != dst_codec->rate) {
-		LOGP(DMGCP, LOGL_ERROR,
-		     "Cannot transcode: rate conversion (%d -> %d) not supported.\n",
-		     src_codec->rate, dst_codec->rate);
+		LOGP_RTP(DMGCP, LOGL_ERROR,
+		         "Cannot transcode: rate conversion (%d -> %d) not supported.\n",
+		         src_codec->rate, dst_codec->rate);
 		return -EINVAL;
 	}
 
 	state = talloc_zero(endp->tcfg->cfg, struct mgcp_process_rtp_state);
 	talloc_set_destructor(state, processing_state_destructor);
 	dst_end->rtp_process_data = state;
+	state->endp = endp;
+	state->dst_end = dst_end;
 
 	state->src_fmt = src_fmt;
 
@@ -225,8 +190,8 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 		state->src_samples_per_frame = 160;
 		state->src.gsm_handle = gsm_create();
 		if (!state->src.gsm_handle) {
-			LOGP(DMGCP, LOGL_ERROR,
-			     "Failed to initialize GSM decoder.\n");
+			LOGP_RTP(DMGCP, LOGL_ERROR,
+			         "Failed to initialize GSM decoder.\n");
 			return -EINVAL;
 		}
 		break;
@@ -236,8 +201,8 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 		state->src_samples_per_frame = 80;
 		state->src.g729_dec = initBcg729DecoderChannel();
 		if (!state->src.g729_dec) {
-			LOGP(DMGCP, LOGL_ERROR,
-			     "Failed to initialize G.729 decoder.\n");
+			LOGP_RTP(DMGCP, LOGL_ERROR,
+			         "Failed to initialize G.729 decoder.\n");
 			return -EINVAL;
 		}
 		break;
@@ -264,8 +229,8 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 		state->dst_samples_per_frame = 160;
 		state->dst.gsm_handle = gsm_create();
 		if (!state->dst.gsm_handle) {
-			LOGP(DMGCP, LOGL_ERROR,
-			     "Failed to initialize GSM encoder.\n");
+			LOGP_RTP(DMGCP, LOGL_ERROR,
+			         "Failed to initialize GSM encoder.\n");
 			return -EINVAL;
 		}
 		break;
@@ -275,8 +240,8 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 		state->dst_samples_per_frame = 80;
 		state->dst.g729_enc = initBcg729EncoderChannel();
 		if (!state->dst.g729_enc) {
-			LOGP(DMGCP, LOGL_ERROR,
-			     "Failed to initialize G.729 decoder.\n");
+			LOGP_RTP(DMGCP, LOGL_ERROR,
+			         "Failed to initialize G.729 decoder.\n");
 			return -EINVAL;
 		}
 		break;
@@ -293,12 +258,12 @@ int mgcp_transcoding_setup(struct mgcp_endpoint *endp,
 	if (dst_end->force_output_ptime)
 		state->dst_packet_duration = mgcp_rtp_packet_duration(endp, dst_end);
 
-	LOGP(DMGCP, LOGL_INFO,
-	     "Initialized RTP processing on: 0x%x "
-	     "conv: %d (%d, %d, %s) -> %d (%d, %d, %s)\n",
-	     ENDPOINT_NUMBER(endp),
-	     src_fmt, src_codec->payload_type, src_codec->rate, src_end->fmtp_extra,
-	     dst_fmt, dst_codec->payload_type, dst_codec->rate, dst_end->fmtp_extra);
+	LOGP_RTP(DMGCP, LOGL_INFO,
+	         "Initialized RTP processing on: 0x%x "
+	         "conv: %d (%d, %d, %s) -> %d (%d, %d, %s)\n",
+	         ENDPOINT_NUMBER(endp),
+	         src_fmt, src_codec->payload_type, src_codec->rate, src_end->fmtp_extra,
+	         dst_fmt, dst_codec->payload_type, dst_codec->rate, dst_end->fmtp_extra);
 
 	return 0;
 }
@@ -329,18 +294,18 @@ static int decode_audio(struct mgcp_process_rtp_state *state,
 {
 	while (*nbytes >= state->src_frame_size) {
 		if (state->sample_cnt + state->src_samples_per_frame > ARRAY_SIZE(state->samples)) {
-			LOGP(DMGCP, LOGL_ERROR,
-			     "Sample buffer too small: %zu > %zu.\n",
-			     state->sample_cnt + state->src_samples_per_frame,
-			     ARRAY_SIZE(state->samples));
+			LOGP_RTP(DMGCP, LOGL_ERROR,
+			         "Sample buffer too small: %zu > %zu.\n",
+			         state->sample_cnt + state->src_samples_per_frame,
+			         ARRAY_SIZE(state->samples));
 			return -ENOSPC;
 		}
 		switch (state->src_fmt) {
 		case AF_GSM:
 			if (gsm_decode(state->src.gsm_handle,
 				       (gsm_byte *)*src, state->samples + state->sample_cnt) < 0) {
-				LOGP(DMGCP, LOGL_ERROR,
-				     "Failed to decode GSM.\n");
+				LOGP_RTP(DMGCP, LOGL_ERROR,
+				         "Failed to decode GSM.\n");
 				return -EINVAL;
 			}
 			break;
@@ -350,20 +315,20 @@ static int decode_audio(struct mgcp_process_rtp_state *state,
 			break;
 #endif
 		case AF_PCMU:
-			ulaw_decode(*src, state->samples + state->sample_cnt,
-				    state->src_samples_per_frame);
+			mgcp_g711->ulaw_decode(*src, state->samples + state->sample_cnt,
+					       state->src_samples_per_frame);
 			break;
 		case AF_PCMA:
-			alaw_decode(*src, state->samples + state->sample_cnt,
-				    state->src_samples_per_frame);
+			mgcp_g711->alaw_decode(*src, state->samples + state->sample_cnt,
+					       state->src_samples_per_frame);
 			break;
 		case AF_S16:
 			memmove(state->samples + state->sample_cnt, *src,
 				state->src_frame_size);
 			break;
 		case AF_L16:
-			l16_decode(*src, state->samples + state->sample_cnt,
-				   state->src_samples_per_frame);
+			mgcp_g711->l16_decode(*src, state->samples + state->sample_cnt,
+					      state->src_samples_per_frame);
 			break;
 		default:
 			break;
@@ -387,9 +352,9 @@ static int encode_audio(struct mgcp_process_rtp_state *state,
 				break;
 
 			/* Not even one frame fits into the buffer */
-			LOGP(DMGCP, LOGL_INFO,
-			     "Encoding (RTP) buffer too small: %zu > %zu.\n",
-			     nbytes + state->dst_frame_size, buf_size);
+			LOGP_RTP(DMGCP, LOGL_INFO,
+			         "Encoding (RTP) buffer too small: %zu > %zu.\n",
+			         nbytes + state->dst_frame_size, buf_size);
 			return -ENOSPC;
 		}
 		switch (state->dst_fmt) {
@@ -404,20 +369,20 @@ static int encode_audio(struct mgcp_process_rtp_state *state,
 			break;
 #endif
 		case AF_PCMU:
-			ulaw_encode(state->samples + state->sample_offs, dst,
-				    state->src_samples_per_frame);
+			mgcp_g711->ulaw_encode(state->samples + state->sample_offs, dst,
+					       state->src_samples_per_frame);
 			break;
 		case AF_PCMA:
-			alaw_encode(state->samples + state->sample_offs, dst,
-				    state->src_samples_per_frame);
+			mgcp_g711->alaw_encode(state->samples + state->sample_offs, dst,
+					       state->src_samples_per_frame);
 			break;
 		case AF_S16:
 			memmove(dst, state->samples + state->sample_offs,
 				state->dst_frame_size);
 			break;
 		case AF_L16:
-			l16_encode(state->samples + state->sample_offs, dst,
-				   state->src_samples_per_frame);
+			mgcp_g711->l16_encode(state->samples + state->sample_offs, dst,
+					      state->src_samples_per_frame);
 			break;
 		default:
 			break;
@@ -472,6 +437,11 @@ struct mgcp_process_rtp_state *check_transcode_state(
 	if (rtp_hdr->payload_type == src_end->alt_codec.payload_type) {
 		struct mgcp_config *cfg = endp->cfg;
 		struct mgcp_rtp_codec tmp_codec = src_end->alt_codec;
+
+		/* no transcoding thread may use the states being replaced */
+		mgcp_transcoding_pool_cancel(endp->net_end.rtp_process_data);
+		mgcp_transcoding_pool_cancel(endp->bts_end.rtp_process_data);
+
 		src_end->alt_codec = src_end->codec;
 		src_end->codec = tmp_codec;
 		cfg->setup_rtp_processing_cb(endp, &endp->net_end, &endp->bts_end);
@@ -482,11 +452,14 @@ done:
 	return dst_end->rtp_process_data;
 }
 
-int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
-				struct mgcp_rtp_end *dst_end,
-			     char *data, int *len, int buf_size)
+/*
+ * Transcode the packet with the state already looked up. This only
+ * touches the state, so it can run on a transcoding thread.
+ */
+int mgcp_transcoding_process_state(struct mgcp_endpoint *endp,
+				   struct mgcp_process_rtp_state *state,
+				   char *data, int *len, int buf_size)
 {
-	struct mgcp_process_rtp_state *state;
 	const size_t rtp_hdr_size = sizeof(struct rtp_hdr);
 	struct rtp_hdr *rtp_hdr = (struct rtp_hdr *) data;
 	char *payload_data = (char *) &rtp_hdr->data[0];
@@ -499,10 +472,6 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 	uint32_t ts_no;
 	int rc;
 
-	state = check_transcode_state(endp, dst_end, rtp_hdr);
-	if (!state)
-		return 0;
-
 	if (state->src_fmt == state->dst_fmt) {
 		if (!state->dst_packet_duration)
 			return 0;
@@ -539,16 +508,16 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 				 * TODO: This can be improved by adding silence
 				 * instead if the delta is small enough.
 				 */
-				LOGP(DMGCP, LOGL_NOTICE,
+				LOGP_RTP(DMGCP, LOGL_NOTICE,
 					"0x%x dropping sample buffer due delta=%d sample_cnt=%zu\n",
 					ENDPOINT_NUMBER(endp), delta, state->sample_cnt);
 				state->sample_cnt = 0;
 				state->next_time = ts_no;
 			} else if (delta < 0) {
-				LOGP(DMGCP, LOGL_NOTICE,
-				     "RTP time jumps backwards, delta = %d, "
-				     "discarding buffered samples\n",
-				     delta);
+				LOGP_RTP(DMGCP, LOGL_NOTICE,
+				         "RTP time jumps backwards, delta = %d, "
+				         "discarding buffered samples\n",
+				         delta);
 				state->sample_cnt = 0;
 				state->sample_offs = 0;
 				return -EAGAIN;
@@ -568,9 +537,9 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 		decode_audio(state, &src, &nbytes);
 
 		if (nbytes > 0)
-			LOGP(DMGCP, LOGL_NOTICE,
-			     "Skipped audio frame in RTP packet: %zu octets\n",
-			     nbytes);
+			LOGP_RTP(DMGCP, LOGL_NOTICE,
+			         "Skipped audio frame in RTP packet: %zu octets\n",
+			         nbytes);
 	} else
 		ts_no = state->next_time;
 
@@ -610,3 +579,16 @@ int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
 	 */
 	return nsamples ? rtp_hdr_size : 0;
 }
+
+int mgcp_transcoding_process_rtp(struct mgcp_endpoint *endp,
+				struct mgcp_rtp_end *dst_end,
+			     char *data, int *len, int buf_size)
+{
+	struct mgcp_process_rtp_state *state;
+
+	state = check_transcode_state(endp, dst_end, (struct rtp_hdr *) data);
+	if (!state)
+		return 0;
+
+	return mgcp_transcoding_process_state(endp, state, data, len, buf_size);
+}
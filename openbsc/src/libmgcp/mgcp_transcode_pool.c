@@ -0,0 +1,444 @@
+/* Transcoding on a pool of threads */
+
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The packets of an endpoint are always queued to the same thread, so
+ * they are transcoded in order. Each thread has a fixed ring of slots,
+ * a packet is dropped when the ring is full. The transcoded frames stay
+ * in the slot until the main loop has been woken up through an eventfd
+ * and sent them, in the order they were queued. Nothing is allocated
+ * after the pool has been started. Like the RTP workers the threads do
+ * not log, the main loop reports how many messages they dropped.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+#include <osmocom/core/select.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/netif/rtp.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+#include <openbsc/mgcp_transcode.h>
+
+#define TRANSCODE_QUEUE_LEN	64
+#define TRANSCODE_MAX_FRAMES	8
+/* seconds between reporting the messages the threads did not log */
+#define TRANSCODE_LOG_INTERVAL	10
+
+struct transcode_slot {
+	/* NULL when the state has been freed in the meantime */
+	struct mgcp_process_rtp_state *state;
+	struct mgcp_endpoint *endp;
+	int dest;
+	struct sockaddr_in addr;
+	struct timespec queued;
+
+	/* the received packet, transcoded in place */
+	int len;
+	char buf[RTP_BUF_SIZE];
+
+	/* the resulting packets back to back */
+	int num_frames;
+	int frame_len[TRANSCODE_MAX_FRAMES];
+	char frames[RTP_BUF_SIZE];
+};
+
+struct transcode_worker {
+	struct mgcp_transcode_pool *pool;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* new work or the busy state changed */
+	pthread_cond_t cond;
+
+	/* state being transcoded right now */
+	struct mgcp_process_rtp_state *busy;
+	/* set by mgcp_transcoding_pool_stop() */
+	int stop;
+
+	/* only written by the thread */
+	struct mgcp_rtp_stats stats;
+	/* failed completion wakeups, protected by lock */
+	uint64_t wake_failed;
+	/* only touched by the main thread */
+	uint64_t logs_reported;
+
+	/*
+	 * Slots between complete and process are done, between process
+	 * and submit they are queued. submit and complete are only
+	 * written by the main thread, process by the worker.
+	 */
+	unsigned int submit;
+	unsigned int process;
+	unsigned int complete;
+	struct transcode_slot slots[TRANSCODE_QUEUE_LEN];
+};
+
+struct mgcp_transcode_pool {
+	struct mgcp_config *cfg;
+	struct osmo_fd done_fd;
+	int num_workers;
+	struct transcode_worker *workers;
+	time_t logs_report_time;
+};
+
+static void transcode_slot(struct transcode_slot *slot,
+			   struct mgcp_process_rtp_state *state)
+{
+	int len = slot->len;
+	int used = 0;
+	int cont;
+
+	slot->num_frames = 0;
+	do {
+		cont = mgcp_transcoding_process_state(slot->endp, state,
+						      slot->buf, &len,
+						      sizeof(slot->buf));
+		if (cont < 0)
+			break;
+
+		if (slot->num_frames == TRANSCODE_MAX_FRAMES
+		    || used + len > sizeof(slot->frames))
+			break;
+
+		memcpy(&slot->frames[used], slot->buf, len);
+		slot->frame_len[slot->num_frames++] = len;
+		used += len;
+		len = cont;
+	} while (len > 0);
+}
+
+static void *transcode_worker_main(void *data)
+{
+	struct transcode_worker *worker = data;
+	struct transcode_slot *slot;
+	struct mgcp_process_rtp_state *state;
+	uint64_t one = 1;
+
+	mgcp_thread_rtp_stats = &worker->stats;
+
+	pthread_mutex_lock(&worker->lock);
+	while (1) {
+		while (worker->process == worker->submit && !worker->stop)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		if (worker->stop)
+			break;
+
+		slot = &worker->slots[worker->process % TRANSCODE_QUEUE_LEN];
+		state = slot->state;
+		worker->busy = state;
+		pthread_mutex_unlock(&worker->lock);
+
+		if (state)
+			transcode_slot(slot, state);
+
+		pthread_mutex_lock(&worker->lock);
+		worker->busy = NULL;
+		worker->process += 1;
+		pthread_cond_broadcast(&worker->cond);
+
+		if (write(worker->pool->done_fd.fd, &one, sizeof(one)) != sizeof(one))
+			worker->wake_failed += 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+static uint32_t elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Log what the threads had to drop, at most once per interval. */
+static void transcode_report_logs(struct mgcp_transcode_pool *pool)
+{
+	time_t now = time(NULL);
+	int i;
+
+	if (now - pool->logs_report_time < TRANSCODE_LOG_INTERVAL)
+		return;
+	pool->logs_report_time = now;
+
+	for (i = 0; i < pool->num_workers; ++i) {
+		struct transcode_worker *worker = &pool->workers[i];
+		uint64_t dropped;
+
+		dropped = mgcp_rtp_stat_get(&worker->stats.logs_dropped);
+		if (dropped == worker->logs_reported)
+			continue;
+
+		LOGP(DMGCP, LOGL_NOTICE,
+		     "Transcoding thread %d did not log %"PRIu64" messages.\n",
+		     i, dropped - worker->logs_reported);
+		worker->logs_reported = dropped;
+	}
+}
+
+/* Send what has been transcoded, runs on the main loop. */
+static int transcode_done_cb(struct osmo_fd *fd, unsigned int what)
+{
+	struct mgcp_transcode_pool *pool = fd->data;
+	struct mgcp_config *cfg = pool->cfg;
+	uint64_t val, wake_failed = 0;
+	int i, j;
+
+	if (read(fd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -1;
+
+	for (i = 0; i < pool->num_workers; ++i) {
+		struct transcode_worker *worker = &pool->workers[i];
+		unsigned int process;
+
+		pthread_mutex_lock(&worker->lock);
+		process = worker->process;
+		wake_failed += worker->wake_failed;
+		pthread_mutex_unlock(&worker->lock);
+
+		for (; worker->complete != process; worker->complete += 1) {
+			struct transcode_slot *slot;
+			uint32_t latency;
+			int offset = 0;
+
+			slot = &worker->slots[worker->complete % TRANSCODE_QUEUE_LEN];
+			cfg->transcode_stats.queue_depth -= 1;
+			if (!slot->state) {
+				cfg->transcode_stats.cancelled += 1;
+				continue;
+			}
+
+			for (j = 0; j < slot->num_frames; ++j) {
+				mgcp_send_rtp_out(slot->endp, slot->dest, &slot->addr,
+						  &slot->frames[offset], slot->frame_len[j]);
+				offset += slot->frame_len[j];
+			}
+
+			latency = elapsed_us(&slot->queued);
+			cfg->transcode_stats.transcoded += 1;
+			cfg->transcode_stats.frames += slot->num_frames;
+			cfg->transcode_stats.latency_sum_us += latency;
+			if (latency > cfg->transcode_stats.latency_max_us)
+				cfg->transcode_stats.latency_max_us = latency;
+		}
+	}
+
+	cfg->transcode_stats.wake_failed = wake_failed;
+	transcode_report_logs(pool);
+	return 0;
+}
+
+int mgcp_transcoding_submit(struct mgcp_endpoint *endp, int dest,
+			    struct sockaddr_in *addr, char *data, int len)
+{
+	struct mgcp_config *cfg = endp->cfg;
+	struct mgcp_transcode_pool *pool = cfg->transcode_pool;
+	struct mgcp_process_rtp_state *state;
+	struct mgcp_rtp_end *rtp_end;
+	struct transcode_worker *worker;
+	struct transcode_slot *slot;
+
+	if (!pool || len > RTP_BUF_SIZE)
+		return 0;
+
+	rtp_end = dest == MGCP_DEST_NET ? &endp->net_end : &endp->bts_end;
+	state = check_transcode_state(endp, rtp_end, (struct rtp_hdr *) data);
+	if (!state)
+		return 0;
+
+	/* nothing to transcode or repacketize, just forward it */
+	if (state->src_fmt == state->dst_fmt && !state->dst_packet_duration)
+		return 0;
+
+	worker = &pool->workers[ENDPOINT_NUMBER(endp) % pool->num_workers];
+	if (worker->submit - worker->complete >= TRANSCODE_QUEUE_LEN) {
+		cfg->transcode_stats.dropped += 1;
+		rtp_end->dropped_packets += 1;
+		return 1;
+	}
+
+	/* the worker does not look at the slot before submit moves */
+	slot = &worker->slots[worker->submit % TRANSCODE_QUEUE_LEN];
+	slot->state = state;
+	slot->endp = endp;
+	slot->dest = dest;
+	slot->addr = *addr;
+	slot->len = len;
+	memcpy(slot->buf, data, len);
+	clock_gettime(CLOCK_MONOTONIC, &slot->queued);
+
+	pthread_mutex_lock(&worker->lock);
+	worker->submit += 1;
+	pthread_cond_broadcast(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	cfg->transcode_stats.submitted += 1;
+	cfg->transcode_stats.queue_depth += 1;
+	if (cfg->transcode_stats.queue_depth > cfg->transcode_stats.queue_max)
+		cfg->transcode_stats.queue_max = cfg->transcode_stats.queue_depth;
+	return 1;
+}
+
+/**
+ * Forget the queued packets of a state that is about to be freed or
+ * changed and wait until no thread is using it anymore.
+ */
+void mgcp_transcoding_pool_cancel(struct mgcp_process_rtp_state *state)
+{
+	struct mgcp_transcode_pool *pool;
+	unsigned int idx;
+	int i;
+
+	if (!state || !state->endp || !state->endp->cfg->transcode_pool)
+		return;
+
+	pool = state->endp->cfg->transcode_pool;
+	for (i = 0; i < pool->num_workers; ++i) {
+		struct transcode_worker *worker = &pool->workers[i];
+
+		pthread_mutex_lock(&worker->lock);
+		for (idx = worker->complete; idx != worker->submit; ++idx) {
+			struct transcode_slot *slot;
+
+			slot = &worker->slots[idx % TRANSCODE_QUEUE_LEN];
+			if (slot->state == state)
+				slot->state = NULL;
+		}
+		while (worker->busy == state)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		pthread_mutex_unlock(&worker->lock);
+	}
+}
+
+/**
+ * Start the configured number of transcoding threads. Like the RTP
+ * workers this has to happen after forking into the background.
+ */
+int mgcp_transcoding_pool_start(struct mgcp_config *cfg)
+{
+	struct mgcp_transcode_pool *pool;
+	int i;
+
+	if (cfg->transcoding_threads == 0)
+		return 0;
+
+	if (cfg->rtp_workers_count) {
+		LOGP(DMGCP, LOGL_NOTICE,
+		     "Transcoding on the RTP worker threads, no transcoding threads started.\n");
+		return 0;
+	}
+
+	pool = talloc_zero(cfg, struct mgcp_transcode_pool);
+	if (!pool)
+		return -1;
+	pool->cfg = cfg;
+	pool->workers = talloc_zero_array(pool, struct transcode_worker,
+					  cfg->transcoding_threads);
+	if (!pool->workers)
+		goto error;
+
+	pool->done_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool->done_fd.fd < 0)
+		goto error;
+	pool->done_fd.when = BSC_FD_READ;
+	pool->done_fd.cb = transcode_done_cb;
+	pool->done_fd.data = pool;
+	if (osmo_fd_register(&pool->done_fd) != 0) {
+		close(pool->done_fd.fd);
+		goto error;
+	}
+
+	for (i = 0; i < cfg->transcoding_threads; ++i) {
+		struct transcode_worker *worker = &pool->workers[i];
+
+		worker->pool = pool;
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		if (pthread_create(&worker->thread, NULL,
+				   transcode_worker_main, worker) != 0) {
+			LOGP(DMGCP, LOGL_ERROR, "Failed to start transcoding thread %d\n", i);
+			break;
+		}
+		pool->num_workers += 1;
+	}
+
+	if (pool->num_workers == 0) {
+		osmo_fd_unregister(&pool->done_fd);
+		close(pool->done_fd.fd);
+		goto error;
+	}
+
+	cfg->transcode_pool = pool;
+	cfg->rtp_processing_submit_cb = mgcp_transcoding_submit;
+
+	LOGP(DMGCP, LOGL_NOTICE, "Started %d transcoding threads.\n",
+	     pool->num_workers);
+	return 0;
+
+error:
+	LOGP(DMGCP, LOGL_FATAL, "Failed to set up the transcoding threads.\n");
+	talloc_free(pool);
+	return -1;
+}
+
+/**
+ * Stop and join the transcoding threads, what is still queued is not
+ * sent anymore.
+ */
+void mgcp_transcoding_pool_stop(struct mgcp_config *cfg)
+{
+	struct mgcp_transcode_pool *pool = cfg->transcode_pool;
+	int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < pool->num_workers; ++i) {
+		struct transcode_worker *worker = &pool->workers[i];
+
+		pthread_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		pthread_cond_broadcast(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+		pthread_join(worker->thread, NULL);
+
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->lock);
+	}
+
+	osmo_fd_unregister(&pool->done_fd);
+	close(pool->done_fd.fd);
+
+	cfg->rtp_processing_submit_cb = NULL;
+	cfg->transcode_pool = NULL;
+	talloc_free(pool);
+}
@@ -0,0 +1,177 @@
+/* Connected UDP sockets and segmentation offload for the RTP relay */
+
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include <openbsc/mgcp_udp.h>
+
+/* not known to older C libraries */
+#ifndef SOL_UDP
+#define SOL_UDP		17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+
+/* 0 not probed yet, 1 supported, -1 not supported */
+static int gso_state;
+static int gro_state;
+
+/**
+ * Connect the socket to addr:port unless it already is. The kernel then
+ * skips the route lookup on every send and only delivers packets from
+ * this peer. Returns 1 when send() can be used, 0 to keep using sendto().
+ */
+int mgcp_udp_connect(int fd, struct mgcp_udp_peer *peer,
+		     const struct in_addr *addr, int port)
+{
+	struct sockaddr_in sin;
+
+	if (fd < 0 || port == 0 || addr->s_addr == INADDR_ANY) {
+		mgcp_udp_disconnect(fd, peer);
+		return 0;
+	}
+
+	if (peer->port == port && peer->addr.s_addr == addr->s_addr)
+		return !peer->failed;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = port;
+	sin.sin_addr = *addr;
+
+	peer->addr = *addr;
+	peer->port = port;
+	peer->failed = connect(fd, (struct sockaddr *) &sin, sizeof(sin)) != 0;
+	return !peer->failed;
+}
+
+/* accept packets from everyone again, the bound port is kept */
+void mgcp_udp_disconnect(int fd, struct mgcp_udp_peer *peer)
+{
+	struct sockaddr_in sin;
+
+	if (fd >= 0 && peer->port != 0 && !peer->failed) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_UNSPEC;
+		connect(fd, (struct sockaddr *) &sin, sizeof(sin));
+	}
+
+	memset(peer, 0, sizeof(*peer));
+}
+
+/*
+ * Kernels before 4.18 ignore the UDP_SEGMENT cmsg and would send one
+ * big datagram, check for the socket option before using it.
+ */
+int mgcp_udp_gso_supported(void)
+{
+	int fd, val = 0;
+
+	if (gso_state != 0)
+		return gso_state > 0;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return 0;
+	gso_state = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) == 0 ? 1 : -1;
+	close(fd);
+	return gso_state > 0;
+}
+
+/**
+ * Send count packets of seg_size bytes, the last one may be shorter, to
+ * the peer of a connected socket with a single UDP_SEGMENT sendmsg().
+ * When the route can not segment the support is switched off and the
+ * caller has to send the packets one by one.
+ */
+int mgcp_udp_send_gso(int fd, const struct iovec *iov, int count, int seg_size)
+{
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	uint16_t gso_size = seg_size;
+	int rc;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = count;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+	memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+	rc = sendmsg(fd, &msg, 0);
+	if (rc < 0 && (errno == EIO || errno == EOPNOTSUPP ||
+		       errno == ENOPROTOOPT))
+		gso_state = -1;
+	return rc;
+}
+
+/**
+ * Let the kernel coalesce packets of a flow into one read. Returns 1
+ * when it has been enabled, on older kernels nothing changes.
+ */
+int mgcp_udp_set_gro(int fd, int on)
+{
+	if (gro_state < 0)
+		return 0;
+
+	if (setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0) {
+		if (errno == ENOPROTOOPT)
+			gro_state = -1;
+		return 0;
+	}
+
+	gro_state = 1;
+	return on;
+}
+
+/* the size of the coalesced segments or 0 for a single packet */
+int mgcp_udp_gro_size(struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	int gso_size;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+			continue;
+		memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+		return gso_size;
+	}
+
+	return 0;
+}
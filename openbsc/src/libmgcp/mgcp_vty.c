@@ -91,6 +91,9 @@ static int config_write_mgcp(struct vty *vty)
 		vty_out(vty, "  rtp net-bind-ip %s%s", g_cfg->net_ports.bind_addr, VTY_NEWLINE);
 
 	vty_out(vty, "  rtp ip-dscp %d%s", g_cfg->endp_dscp, VTY_NEWLINE);
+	if (g_cfg->rtp_socket_pool_high)
+		vty_out(vty, "  rtp socket-pool %d %d%s", g_cfg->rtp_socket_pool_low,
+			g_cfg->rtp_socket_pool_high, VTY_NEWLINE);
 	if (g_cfg->trunk.keepalive_interval == MGCP_KEEPALIVE_ONCE)
 		vty_out(vty, "  rtp keep-alive once%s", VTY_NEWLINE);
 	else if (g_cfg->trunk.keepalive_interval)
@@ -171,6 +174,14 @@ static int config_write_mgcp(struct vty *vty)
 		vty_out(vty, "  bts-jitter-buffer-delay-min %"PRIu32"%s", g_cfg->bts_jitter_delay_min, VTY_NEWLINE);
 	if (g_cfg->bts_jitter_delay_max)
 		vty_out(vty, "  bts-jitter-buffer-delay-max %"PRIu32"%s", g_cfg->bts_jitter_delay_max, VTY_NEWLINE);
+	if (g_cfg->rtp_batch)
+		vty_out(vty, "  rtp batch %d%s", g_cfg->rtp_batch, VTY_NEWLINE);
+	if (g_cfg->rtp_connect)
+		vty_out(vty, "  rtp connected-sockets%s", VTY_NEWLINE);
+	if (g_cfg->rtp_worker_threads)
+		vty_out(vty, "  rtp worker-threads %d%s", g_cfg->rtp_worker_threads, VTY_NEWLINE);
+	if (g_cfg->transcoding_threads)
+		vty_out(vty, "  transcoding-threads %d%s", g_cfg->transcoding_threads, VTY_NEWLINE);
 
 	return CMD_SUCCESS;
 }
@@ -233,6 +244,83 @@ static void dump_trunk(struct vty *vty, struct mgcp_trunk_config *cfg, int verbo
 	}
 }
 
+static void dump_rtp_batch(struct vty *vty, struct mgcp_config *cfg)
+{
+	struct mgcp_rtp_stats stats;
+
+	mgcp_rtp_stats_sum(cfg, &stats);
+
+	vty_out(vty, "RTP batching: up to %d packets per syscall%s",
+		cfg->rtp_batch, VTY_NEWLINE);
+	vty_out(vty, " Received %"PRIu64" packets in %"PRIu64" recvmmsg "
+		"(avg batch %.2f)%s",
+		stats.rx_packets, stats.rx_syscalls,
+		stats.rx_syscalls ? (double) stats.rx_packets / stats.rx_syscalls : 0.0,
+		VTY_NEWLINE);
+	vty_out(vty, " Sent %"PRIu64" packets in %"PRIu64" sendmmsg "
+		"(avg batch %.2f)%s",
+		stats.tx_packets, stats.tx_syscalls,
+		stats.tx_syscalls ? (double) stats.tx_packets / stats.tx_syscalls : 0.0,
+		VTY_NEWLINE);
+	vty_out(vty, " UDP_SEGMENT: %"PRIu64" packets in %"PRIu64" sends, "
+		"UDP_GRO: %"PRIu64" packets in %"PRIu64" reads%s",
+		stats.gso_packets, stats.gso_sends,
+		stats.gro_packets, stats.gro_reads,
+		VTY_NEWLINE);
+}
+
+static void dump_rtp_workers(struct vty *vty, struct mgcp_config *cfg)
+{
+	int i;
+
+	vty_out(vty, "RTP worker threads: %d%s", cfg->rtp_workers_count, VTY_NEWLINE);
+	for (i = 0; i < cfg->rtp_workers_count; ++i) {
+		uint64_t events, holds, logs_dropped, wake_failed;
+		int sockets;
+
+		mgcp_rtp_worker_stats(cfg, i, &sockets, &events, &holds,
+				      &logs_dropped, &wake_failed);
+		vty_out(vty, " Worker %d: sockets %d events %"PRIu64" holds %"PRIu64
+			" not logged %"PRIu64" wakeup failures %"PRIu64"%s",
+			i, sockets, events, holds, logs_dropped, wake_failed,
+			VTY_NEWLINE);
+	}
+}
+
+static void dump_port_pool(struct vty *vty, const char *name,
+			   struct mgcp_port_range *range)
+{
+	int used, free, bound, unusable;
+
+	if (range->mode != PORT_ALLOC_DYNAMIC)
+		return;
+	if (mgcp_port_pool_stats(range, &used, &free, &bound, &unusable) != 0)
+		return;
+
+	vty_out(vty, "RTP %s ports %d-%d: used %d free %d (bound %d) unusable %d%s",
+		name, range->range_start, range->range_end,
+		used, free, bound, unusable, VTY_NEWLINE);
+}
+
+static void dump_transcode_stats(struct vty *vty, struct mgcp_config *cfg)
+{
+	uint64_t done = cfg->transcode_stats.transcoded;
+
+	vty_out(vty, "Transcoding threads: %d queued: %d (max %d)%s",
+		cfg->transcoding_threads, cfg->transcode_stats.queue_depth,
+		cfg->transcode_stats.queue_max, VTY_NEWLINE);
+	vty_out(vty, " Packets submitted: %"PRIu64" dropped: %"PRIu64
+		" cancelled: %"PRIu64" frames sent: %"PRIu64"%s",
+		cfg->transcode_stats.submitted, cfg->transcode_stats.dropped,
+		cfg->transcode_stats.cancelled, cfg->transcode_stats.frames,
+		VTY_NEWLINE);
+	vty_out(vty, " Latency avg: %"PRIu64" us max: %"PRIu32" us%s",
+		done ? cfg->transcode_stats.latency_sum_us / done : 0,
+		cfg->transcode_stats.latency_max_us, VTY_NEWLINE);
+	vty_out(vty, " Wakeup failures: %"PRIu64"%s",
+		cfg->transcode_stats.wake_failed, VTY_NEWLINE);
+}
+
 DEFUN(show_mcgp, show_mgcp_cmd,
       "show mgcp [stats]",
       SHOW_STR
@@ -254,6 +342,20 @@ DEFUN(show_mcgp, show_mgcp_cmd,
 	if (g_cfg->bts_use_jibuf)
 		vty_out(vty, "Jitter Buffer delays: min=%"PRIu32" max=%"PRIu32"%s",
 		g_cfg->bts_jitter_delay_min, g_cfg->bts_jitter_delay_max, VTY_NEWLINE);
+	if (show_stats)
+		vty_out(vty, "Jitter Buffer packets received into slots: %"PRIu64
+			" copied into slots: %"PRIu64" allocated: %"PRIu64"%s",
+			g_cfg->jibuf_stats.rx_direct, g_cfg->jibuf_stats.slot_copies,
+			g_cfg->jibuf_stats.heap_allocs, VTY_NEWLINE);
+	if (g_cfg->rtp_batch)
+		dump_rtp_batch(vty, g_cfg);
+	if (g_cfg->rtp_workers_count)
+		dump_rtp_workers(vty, g_cfg);
+	dump_port_pool(vty, "bts", &g_cfg->bts_ports);
+	dump_port_pool(vty, "net", &g_cfg->net_ports);
+	dump_port_pool(vty, "transcoder", &g_cfg->transcoder_ports);
+	if (g_cfg->transcode_pool)
+		dump_transcode_stats(vty, g_cfg);
 
 	return CMD_SUCCESS;
 }
@@ -337,7 +439,6 @@ static void parse_range(struct mgcp_port_range *range, const char **argv)
 	range->mode = PORT_ALLOC_DYNAMIC;
 	range->range_start = atoi(argv[0]);
 	range->range_end = atoi(argv[1]);
-	range->last_port = g_cfg->bts_ports.range_start;
 }
 
 
@@ -486,6 +587,118 @@ DEFUN(cfg_mgcp_no_rtp_force_ptime,
 	return CMD_SUCCESS;
 }
 
+#define RTP_BATCH_STR "Batch RTP forwarding with recvmmsg/sendmmsg\n"
+DEFUN(cfg_mgcp_rtp_batch,
+      cfg_mgcp_rtp_batch_cmd,
+      "rtp batch <2-32>",
+      RTP_STR RTP_BATCH_STR
+      "Maximum number of packets per syscall\n")
+{
+	g_cfg->rtp_batch = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_batch,
+      cfg_mgcp_no_rtp_batch_cmd,
+      "no rtp batch",
+      NO_STR RTP_STR RTP_BATCH_STR)
+{
+	g_cfg->rtp_batch = 0;
+	return CMD_SUCCESS;
+}
+
+#define RTP_CONNECT_STR "Connect the RTP sockets to the remote end once it has been heard " \
+	"from, the kernel then drops RTP/RTCP sent from other ports (NAT, asymmetric RTCP)\n"
+DEFUN(cfg_mgcp_rtp_connect,
+      cfg_mgcp_rtp_connect_cmd,
+      "rtp connected-sockets",
+      RTP_STR RTP_CONNECT_STR)
+{
+	g_cfg->rtp_connect = 1;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_connect,
+      cfg_mgcp_no_rtp_connect_cmd,
+      "no rtp connected-sockets",
+      NO_STR RTP_STR RTP_CONNECT_STR)
+{
+	g_cfg->rtp_connect = 0;
+	return CMD_SUCCESS;
+}
+
+#define RTP_SOCKET_POOL_STR "Keep sockets of free dynamic ports bound\n"
+DEFUN(cfg_mgcp_rtp_socket_pool,
+      cfg_mgcp_rtp_socket_pool_cmd,
+      "rtp socket-pool <0-32767> <1-32767>",
+      RTP_STR RTP_SOCKET_POOL_STR
+      "Bind more when fewer port pairs per range are ready\n"
+      "Close the sockets of released pairs above this number\n")
+{
+	int low = atoi(argv[0]);
+	int high = atoi(argv[1]);
+
+	if (low > high) {
+		vty_out(vty, "%% The low watermark must not exceed the high one%s",
+			VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	g_cfg->rtp_socket_pool_low = low;
+	g_cfg->rtp_socket_pool_high = high;
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_socket_pool,
+      cfg_mgcp_no_rtp_socket_pool_cmd,
+      "no rtp socket-pool",
+      NO_STR RTP_STR "Close the sockets of every released port pair\n")
+{
+	g_cfg->rtp_socket_pool_low = 0;
+	g_cfg->rtp_socket_pool_high = 0;
+	return CMD_SUCCESS;
+}
+
+#define RTP_WORKER_STR "Forward RTP on worker threads (applied on restart)\n"
+DEFUN(cfg_mgcp_rtp_worker_threads,
+      cfg_mgcp_rtp_worker_threads_cmd,
+      "rtp worker-threads <1-64>",
+      RTP_STR RTP_WORKER_STR
+      "Number of threads the endpoints are distributed over\n")
+{
+	g_cfg->rtp_worker_threads = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_rtp_worker_threads,
+      cfg_mgcp_no_rtp_worker_threads_cmd,
+      "no rtp worker-threads",
+      NO_STR RTP_STR RTP_WORKER_STR)
+{
+	g_cfg->rtp_worker_threads = 0;
+	return CMD_SUCCESS;
+}
+
+#define TRANSCODING_THREADS_STR "Transcode on a pool of threads (applied on restart)\n"
+DEFUN(cfg_mgcp_transcoding_threads,
+      cfg_mgcp_transcoding_threads_cmd,
+      "transcoding-threads <1-32>",
+      TRANSCODING_THREADS_STR
+      "Number of threads the endpoints are distributed over\n")
+{
+	g_cfg->transcoding_threads = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_mgcp_no_transcoding_threads,
+      cfg_mgcp_no_transcoding_threads_cmd,
+      "no transcoding-threads",
+      NO_STR TRANSCODING_THREADS_STR)
+{
+	g_cfg->transcoding_threads = 0;
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_mgcp_sdp_fmtp_extra,
       cfg_mgcp_sdp_fmtp_extra_cmd,
       "sdp audio fmtp-extra .NAME",
@@ -1294,6 +1507,12 @@ DEFUN(cfg_mgcp_osmux,
 		return CMD_SUCCESS;
 	}
 
+	if (g_cfg->rtp_workers_count) {
+		vty_out(vty, "Cannot use `osmux' with RTP worker threads.%s",
+			VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
 	if (strcmp(argv[0], "on") == 0)
 		g_cfg->osmux = OSMUX_USAGE_ON;
 	else if (strcmp(argv[0], "only") == 0)
@@ -1363,6 +1582,12 @@ DEFUN(cfg_mgcp_bts_use_jibuf,
       "bts-jitter-buffer",
       DEJITTER_STR "\n")
 {
+	if (g_cfg->rtp_workers_count) {
+		vty_out(vty, "Cannot use the jitter buffer with RTP worker threads.%s",
+			VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
 	g_cfg->bts_use_jibuf = true;
 	return CMD_SUCCESS;
 }
@@ -1446,6 +1671,16 @@ int mgcp_vty_init(void)
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_ip_tos_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_force_ptime_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_force_ptime_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_batch_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_batch_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_connect_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_connect_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_socket_pool_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_socket_pool_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_rtp_worker_threads_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_worker_threads_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_transcoding_threads_cmd);
+	install_element(MGCP_NODE, &cfg_mgcp_no_transcoding_threads_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_keepalive_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_rtp_keepalive_once_cmd);
 	install_element(MGCP_NODE, &cfg_mgcp_no_rtp_keepalive_cmd);
@@ -0,0 +1,477 @@
+/* RTP forwarding on worker threads */
+
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The endpoints are sharded across the workers and each worker runs
+ * its own epoll loop for the RTP/RTCP sockets of its endpoints. The
+ * MGCP handling stays on the main thread. Before the main thread
+ * touches an endpoint it takes the endpoint over: it disarms the
+ * sockets of that endpoint and puts a hold message on the single
+ * producer/single consumer ring of the owning worker. The worker
+ * acknowledges once the events it has collected are done and goes on
+ * with its other endpoints. Releasing arms the sockets again. No locks
+ * are taken on the RTP path.
+ *
+ * Only the socket callbacks run on the workers. Everything that relies
+ * on osmo_timer (jitter buffer, Osmux) has to stay on the main loop.
+ * The workers do not log and keep their own counters, a timer on the
+ * main loop reports the messages they had to drop.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <osmocom/core/select.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+
+#include <openbsc/debug.h>
+#include <openbsc/mgcp.h>
+#include <openbsc/mgcp_internal.h>
+
+#define RTP_WORKER_RING		8
+#define RTP_WORKER_EVENTS	64
+/* seconds between reporting the messages the workers did not log */
+#define RTP_WORKER_LOG_INTERVAL	10
+
+enum rtp_worker_cmd {
+	RTP_WORKER_HOLD,
+	RTP_WORKER_STOP,
+};
+
+/* number of sockets of an endpoint, see rtp_worker_fd() */
+#define RTP_WORKER_ENDP_FDS	8
+
+struct mgcp_rtp_worker {
+	int nr;
+	pthread_t thread;
+	int epoll_fd;
+	/* eventfd to wake up the worker, eventfd for the hold ack */
+	int wake_fd;
+	int ack_fd;
+
+	/* commands from the main thread */
+	enum rtp_worker_cmd cmds[RTP_WORKER_RING];
+	atomic_uint cmd_head;
+	atomic_uint cmd_tail;
+
+	/* only touched by the main thread */
+	int sockets;
+	uint64_t logs_reported;
+
+	/* only written by the worker, use mgcp_rtp_stat_get() */
+	uint64_t events;
+	uint64_t holds;
+	uint64_t wake_failed;
+	struct mgcp_rtp_stats stats;
+};
+
+__thread struct mgcp_rtp_stats *mgcp_thread_rtp_stats;
+
+/* stands in for the sockets of an endpoint that is held */
+static char rtp_worker_disarmed;
+
+static struct mgcp_rtp_worker *rtp_worker_for(struct mgcp_endpoint *endp)
+{
+	struct mgcp_config *cfg = endp->cfg;
+	int nr;
+
+	if (cfg->rtp_workers_count == 0)
+		return NULL;
+
+	nr = ENDPOINT_NUMBER(endp) + endp->tcfg->trunk_nr;
+	return &cfg->rtp_workers[nr % cfg->rtp_workers_count];
+}
+
+static struct osmo_fd *rtp_worker_fd(struct mgcp_endpoint *endp, int i)
+{
+	struct mgcp_rtp_end *ends[] = {
+		&endp->bts_end, &endp->net_end, &endp->trans_bts, &endp->trans_net,
+	};
+
+	return i & 1 ? &ends[i / 2]->rtcp : &ends[i / 2]->rtp;
+}
+
+static int rtp_worker_fd_index(struct mgcp_endpoint *endp, struct osmo_fd *fd)
+{
+	int i;
+
+	for (i = 0; i < RTP_WORKER_ENDP_FDS; ++i)
+		if (rtp_worker_fd(endp, i) == fd)
+			return i;
+	return -1;
+}
+
+/*
+ * A disarmed socket reports at most one error and only to the
+ * placeholder, the worker will not run its callback.
+ */
+static int rtp_worker_epoll(struct mgcp_rtp_worker *worker, int op,
+			    struct osmo_fd *fd, int armed)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	if (armed) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = fd;
+	} else {
+		ev.events = EPOLLONESHOT;
+		ev.data.ptr = &rtp_worker_disarmed;
+	}
+
+	return epoll_ctl(worker->epoll_fd, op, fd->fd, &ev);
+}
+
+static void rtp_worker_post(struct mgcp_rtp_worker *worker, enum rtp_worker_cmd cmd)
+{
+	unsigned int head = atomic_load_explicit(&worker->cmd_head, memory_order_relaxed);
+	uint64_t one = 1;
+
+	/* holding is synchronous so the ring can not fill up */
+	OSMO_ASSERT(head - atomic_load_explicit(&worker->cmd_tail,
+				memory_order_acquire) < RTP_WORKER_RING);
+
+	worker->cmds[head % RTP_WORKER_RING] = cmd;
+	atomic_store_explicit(&worker->cmd_head, head + 1, memory_order_release);
+
+	if (write(worker->wake_fd, &one, sizeof(one)) != sizeof(one))
+		LOGP(DMGCP, LOGL_ERROR, "Failed to wake RTP worker %d: %s\n",
+		     worker->nr, strerror(errno));
+}
+
+static int rtp_worker_pop(struct mgcp_rtp_worker *worker, enum rtp_worker_cmd *cmd)
+{
+	unsigned int tail = atomic_load_explicit(&worker->cmd_tail, memory_order_relaxed);
+
+	if (tail == atomic_load_explicit(&worker->cmd_head, memory_order_acquire))
+		return 0;
+
+	*cmd = worker->cmds[tail % RTP_WORKER_RING];
+	atomic_store_explicit(&worker->cmd_tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+static void rtp_worker_wait_wake(struct mgcp_rtp_worker *worker)
+{
+	uint64_t val;
+
+	if (read(worker->wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		mgcp_rtp_stat_add(&worker->wake_failed, 1);
+}
+
+/* Nothing collected before the hold is pending, hand the endpoint over. */
+static void rtp_worker_ack(struct mgcp_rtp_worker *worker)
+{
+	uint64_t one = 1;
+
+	mgcp_rtp_stat_add(&worker->holds, 1);
+	if (write(worker->ack_fd, &one, sizeof(one)) != sizeof(one))
+		mgcp_rtp_stat_add(&worker->wake_failed, 1);
+}
+
+static void *rtp_worker_main(void *data)
+{
+	struct mgcp_rtp_worker *worker = data;
+	struct epoll_event events[RTP_WORKER_EVENTS];
+	enum rtp_worker_cmd cmd;
+	int i, rc;
+
+	mgcp_thread_rtp_stats = &worker->stats;
+
+	while (1) {
+		rc = epoll_wait(worker->epoll_fd, events, ARRAY_SIZE(events), -1);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			mgcp_rtp_stat_add(&worker->wake_failed, 1);
+			break;
+		}
+
+		for (i = 0; i < rc; ++i) {
+			struct osmo_fd *ofd = events[i].data.ptr;
+
+			/* the wakeup, commands are handled below */
+			if (!ofd) {
+				rtp_worker_wait_wake(worker);
+				continue;
+			}
+			if (ofd == (void *) &rtp_worker_disarmed)
+				continue;
+
+			ofd->cb(ofd, BSC_FD_READ);
+			mgcp_rtp_stat_add(&worker->events, 1);
+		}
+
+		/* nothing of this batch is pending anymore */
+		while (rtp_worker_pop(worker, &cmd)) {
+			if (cmd == RTP_WORKER_HOLD)
+				rtp_worker_ack(worker);
+			else if (cmd == RTP_WORKER_STOP)
+				return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Make sure the worker owning the endpoint is not running its RTP
+ * callbacks until mgcp_rtp_worker_release() is called. The worker
+ * keeps forwarding for its other endpoints. Calls can be nested and
+ * must only be made from the main thread.
+ */
+void mgcp_rtp_worker_hold(struct mgcp_endpoint *endp)
+{
+	struct mgcp_rtp_worker *worker = rtp_worker_for(endp);
+	uint64_t val;
+	int i;
+
+	if (!worker)
+		return;
+	if (endp->rtp_hold_depth++ > 0)
+		return;
+
+	for (i = 0; i < RTP_WORKER_ENDP_FDS; ++i)
+		if (endp->rtp_worker_fds & (1 << i))
+			rtp_worker_epoll(worker, EPOLL_CTL_MOD,
+					 rtp_worker_fd(endp, i), 0);
+
+	/* events of the endpoint collected before might still run */
+	rtp_worker_post(worker, RTP_WORKER_HOLD);
+	while (read(worker->ack_fd, &val, sizeof(val)) < 0 && errno == EINTR)
+		;
+}
+
+void mgcp_rtp_worker_release(struct mgcp_endpoint *endp)
+{
+	struct mgcp_rtp_worker *worker = rtp_worker_for(endp);
+	int i;
+
+	if (!worker)
+		return;
+
+	OSMO_ASSERT(endp->rtp_hold_depth > 0);
+	if (--endp->rtp_hold_depth > 0)
+		return;
+
+	for (i = 0; i < RTP_WORKER_ENDP_FDS; ++i)
+		if (endp->rtp_worker_fds & (1 << i))
+			rtp_worker_epoll(worker, EPOLL_CTL_MOD,
+					 rtp_worker_fd(endp, i), 1);
+}
+
+int mgcp_rtp_worker_fd_register(struct mgcp_endpoint *endp, struct osmo_fd *fd)
+{
+	struct mgcp_rtp_worker *worker = rtp_worker_for(endp);
+	int i, rc;
+
+	if (!worker)
+		return osmo_fd_register(fd);
+
+	i = rtp_worker_fd_index(endp, fd);
+	OSMO_ASSERT(i >= 0);
+
+	/* armed by the release when the endpoint is held */
+	rc = rtp_worker_epoll(worker, EPOLL_CTL_ADD, fd, endp->rtp_hold_depth == 0);
+	if (rc == 0) {
+		endp->rtp_worker_fds |= 1 << i;
+		worker->sockets += 1;
+	}
+
+	return rc;
+}
+
+void mgcp_rtp_worker_fd_unregister(struct mgcp_endpoint *endp, struct osmo_fd *fd)
+{
+	struct mgcp_rtp_worker *worker = rtp_worker_for(endp);
+	int i;
+
+	if (!worker) {
+		osmo_fd_unregister(fd);
+		return;
+	}
+
+	i = rtp_worker_fd_index(endp, fd);
+	OSMO_ASSERT(i >= 0);
+
+	mgcp_rtp_worker_hold(endp);
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd->fd, NULL) == 0) {
+		endp->rtp_worker_fds &= ~(1 << i);
+		worker->sockets -= 1;
+	}
+	mgcp_rtp_worker_release(endp);
+}
+
+/* Log what the workers had to drop, at most once per interval. */
+static void rtp_workers_timer_cb(void *data)
+{
+	struct mgcp_config *cfg = data;
+	int i;
+
+	for (i = 0; i < cfg->rtp_workers_count; ++i) {
+		struct mgcp_rtp_worker *worker = &cfg->rtp_workers[i];
+		uint64_t dropped = mgcp_rtp_stat_get(&worker->stats.logs_dropped);
+
+		if (dropped == worker->logs_reported)
+			continue;
+
+		LOGP(DMGCP, LOGL_NOTICE,
+		     "RTP worker %d did not log %"PRIu64" messages.\n",
+		     worker->nr, dropped - worker->logs_reported);
+		worker->logs_reported = dropped;
+	}
+
+	osmo_timer_schedule(&cfg->rtp_workers_timer, RTP_WORKER_LOG_INTERVAL, 0);
+}
+
+static int rtp_worker_init(struct mgcp_rtp_worker *worker, int nr)
+{
+	struct epoll_event ev;
+
+	worker->nr = nr;
+	atomic_init(&worker->cmd_head, 0);
+	atomic_init(&worker->cmd_tail, 0);
+
+	worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+	worker->ack_fd = eventfd(0, EFD_CLOEXEC);
+	if (worker->epoll_fd < 0 || worker->wake_fd < 0 || worker->ack_fd < 0)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev) != 0)
+		return -1;
+
+	return pthread_create(&worker->thread, NULL, rtp_worker_main, worker);
+}
+
+/**
+ * Start the configured number of RTP workers. This needs to be called
+ * once after the config has been read and before the first endpoint
+ * is bound.
+ */
+int mgcp_rtp_workers_start(struct mgcp_config *cfg)
+{
+	int i;
+
+	if (cfg->rtp_worker_threads == 0)
+		return 0;
+
+	if (cfg->osmux != OSMUX_USAGE_OFF || cfg->bts_use_jibuf) {
+		LOGP(DMGCP, LOGL_ERROR,
+		     "RTP worker threads can not be used with Osmux or the jitter buffer.\n");
+		return -1;
+	}
+
+	cfg->rtp_workers = talloc_zero_array(cfg, struct mgcp_rtp_worker,
+					     cfg->rtp_worker_threads);
+	if (!cfg->rtp_workers)
+		return -1;
+
+	for (i = 0; i < cfg->rtp_worker_threads; ++i) {
+		if (rtp_worker_init(&cfg->rtp_workers[i], i) != 0) {
+			LOGP(DMGCP, LOGL_FATAL, "Failed to start RTP worker %d: %s\n",
+			     i, strerror(errno));
+			return -1;
+		}
+		cfg->rtp_workers_count += 1;
+	}
+
+	osmo_timer_setup(&cfg->rtp_workers_timer, rtp_workers_timer_cb, cfg);
+	osmo_timer_schedule(&cfg->rtp_workers_timer, RTP_WORKER_LOG_INTERVAL, 0);
+
+	LOGP(DMGCP, LOGL_NOTICE, "Started %d RTP worker threads.\n",
+	     cfg->rtp_workers_count);
+	return 0;
+}
+
+/**
+ * Stop and join the RTP workers. This needs to be called after all
+ * endpoints have been released.
+ */
+void mgcp_rtp_workers_stop(struct mgcp_config *cfg)
+{
+	int i;
+
+	if (!cfg->rtp_workers)
+		return;
+
+	osmo_timer_del(&cfg->rtp_workers_timer);
+
+	for (i = 0; i < cfg->rtp_workers_count; ++i) {
+		struct mgcp_rtp_worker *worker = &cfg->rtp_workers[i];
+
+		rtp_worker_post(worker, RTP_WORKER_STOP);
+		pthread_join(worker->thread, NULL);
+
+		close(worker->epoll_fd);
+		close(worker->wake_fd);
+		close(worker->ack_fd);
+	}
+
+	talloc_free(cfg->rtp_workers);
+	cfg->rtp_workers = NULL;
+	cfg->rtp_workers_count = 0;
+}
+
+void mgcp_rtp_worker_stats(struct mgcp_config *cfg, int nr, int *sockets,
+			   uint64_t *events, uint64_t *holds, uint64_t *logs_dropped,
+			   uint64_t *wake_failed)
+{
+	struct mgcp_rtp_worker *worker = &cfg->rtp_workers[nr];
+
+	*sockets = worker->sockets;
+	*events = mgcp_rtp_stat_get(&worker->events);
+	*holds = mgcp_rtp_stat_get(&worker->holds);
+	*logs_dropped = mgcp_rtp_stat_get(&worker->stats.logs_dropped);
+	*wake_failed = mgcp_rtp_stat_get(&worker->wake_failed);
+}
+
+/* The RTP counters of the main loop and all workers added up. */
+void mgcp_rtp_stats_sum(struct mgcp_config *cfg, struct mgcp_rtp_stats *sum)
+{
+	int i;
+
+	*sum = cfg->rtp_stats;
+	for (i = 0; i < cfg->rtp_workers_count; ++i) {
+		const struct mgcp_rtp_stats *stats = &cfg->rtp_workers[i].stats;
+
+		sum->rx_syscalls += mgcp_rtp_stat_get(&stats->rx_syscalls);
+		sum->rx_packets += mgcp_rtp_stat_get(&stats->rx_packets);
+		sum->tx_syscalls += mgcp_rtp_stat_get(&stats->tx_syscalls);
+		sum->tx_packets += mgcp_rtp_stat_get(&stats->tx_packets);
+		sum->gso_sends += mgcp_rtp_stat_get(&stats->gso_sends);
+		sum->gso_packets += mgcp_rtp_stat_get(&stats->gso_packets);
+		sum->gro_reads += mgcp_rtp_stat_get(&stats->gro_reads);
+		sum->gro_packets += mgcp_rtp_stat_get(&stats->gro_packets);
+		sum->logs_dropped += mgcp_rtp_stat_get(&stats->logs_dropped);
+	}
+}
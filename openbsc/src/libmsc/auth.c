@@ -40,15 +40,23 @@ const struct value_string auth_action_names[] = {
 	{ 0, NULL }
 };
 
+/* It runs on the database thread, osmo_hexdump() is not thread-safe. */
+static char *auth_hexdump(char *buf, size_t len, struct gsm_auth_info *ainfo)
+{
+	return osmo_hexdump_buf(buf, len, ainfo->a3a8_ki, ainfo->a3a8_ki_len,
+				" ", true);
+}
+
 static int
 _use_xor(struct gsm_auth_info *ainfo, struct gsm_auth_tuple *atuple)
 {
 	int i, l = ainfo->a3a8_ki_len;
+	char hex[3 * sizeof(ainfo->a3a8_ki) + 1];
 
 	if ((l > A38_XOR_MAX_KEY_LEN) || (l < A38_XOR_MIN_KEY_LEN)) {
-		LOGP(DMM, LOGL_ERROR, "Invalid XOR key (len=%d) %s\n",
+		LOGP_DB(DMM, LOGL_ERROR, "Invalid XOR key (len=%d) %s\n",
 			ainfo->a3a8_ki_len,
-			osmo_hexdump(ainfo->a3a8_ki, ainfo->a3a8_ki_len));
+			auth_hexdump(hex, sizeof(hex), ainfo));
 		return -1;
 	}
 
@@ -64,10 +72,12 @@ static int
 _use_comp128(struct gsm_auth_info *ainfo, struct gsm_auth_tuple *atuple,
 	enum gsm_auth_algo algo)
 {
+	char hex[3 * sizeof(ainfo->a3a8_ki) + 1];
+
 	if (ainfo->a3a8_ki_len != A38_COMP128_KEY_LEN) {
-		LOGP(DMM, LOGL_ERROR, "Invalid COMP128v1 key (len=%d) %s\n",
+		LOGP_DB(DMM, LOGL_ERROR, "Invalid COMP128v1 key (len=%d) %s\n",
 			ainfo->a3a8_ki_len,
-			osmo_hexdump(ainfo->a3a8_ki, ainfo->a3a8_ki_len));
+			auth_hexdump(hex, sizeof(hex), ainfo));
 		return -1;
 	}
 
@@ -107,9 +117,9 @@ int auth_get_tuple_for_subscr(struct gsm_auth_tuple *atuple,
 	/* Get subscriber info (if any) */
 	rc = db_get_authinfo_for_subscr(&ainfo, subscr);
 	if (rc < 0) {
-		LOGP(DMM, LOGL_NOTICE,
-		     "No retrievable Ki for subscriber %s, skipping auth\n",
-		     subscr_name(subscr));
+		LOGP_DB(DMM, LOGL_NOTICE,
+			"No retrievable Ki for subscriber %s, skipping auth\n",
+			subscr->imsi);
 		return rc == -ENOENT ? AUTH_NOT_AVAIL : AUTH_ERROR;
 	}
 
@@ -122,7 +132,7 @@ int auth_get_tuple_for_subscr(struct gsm_auth_tuple *atuple,
 	{
 		atuple->use_count++;
 		db_sync_lastauthtuple_for_subscr(atuple, subscr);
-		DEBUGP(DMM, "Auth tuple use < 3, just doing ciphering\n");
+		DEBUGP_DB(DMM, "Auth tuple use < 3, just doing ciphering\n");
 		return AUTH_DO_CIPH;
 	}
 
@@ -141,14 +151,14 @@ int auth_get_tuple_for_subscr(struct gsm_auth_tuple *atuple,
 
 	rc = osmo_get_rand_id(atuple->vec.rand, sizeof(atuple->vec.rand));
 	if (rc < 0) {
-		LOGP(DMM, LOGL_NOTICE, "osmo_get_rand_id failed, can't generate new auth tuple: %s\n",
-		     strerror(-rc));
+		LOGP_DB(DMM, LOGL_NOTICE, "osmo_get_rand_id failed, can't generate new auth tuple: %s\n",
+			strerror(-rc));
 		return AUTH_ERROR;
 	}
 
 	switch (ainfo.auth_algo) {
 	case AUTH_ALGO_NONE:
-		DEBUGP(DMM, "No authentication for subscriber\n");
+		DEBUGP_DB(DMM, "No authentication for subscriber\n");
 		return AUTH_NOT_AVAIL;
 
 	case AUTH_ALGO_XOR:
@@ -164,14 +174,14 @@ int auth_get_tuple_for_subscr(struct gsm_auth_tuple *atuple,
 		break;
 
 	default:
-		DEBUGP(DMM, "Unsupported auth type algo_id=%d\n",
+		DEBUGP_DB(DMM, "Unsupported auth type algo_id=%d\n",
 			ainfo.auth_algo);
 		return AUTH_NOT_AVAIL;
 	}
 
         db_sync_lastauthtuple_for_subscr(atuple, subscr);
 
-	DEBUGP(DMM, "Need to do authentication and ciphering\n");
+	DEBUGP_DB(DMM, "Need to do authentication and ciphering\n");
 	return AUTH_DO_AUTH_THEN_CIPH;
 }
 
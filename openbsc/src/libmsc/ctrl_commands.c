@@ -24,6 +24,7 @@
 #include <openbsc/gsm_data.h>
 #include <openbsc/gsm_subscriber.h>
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 #include <openbsc/debug.h>
 
 #include <stdbool.h>
@@ -103,10 +104,10 @@ static int set_subscriber_modify(struct ctrl_cmd *cmd, void *data)
 
 	subscr->authorized = 1;
 	osmo_strlcpy(subscr->extension, msisdn, sizeof(subscr->extension));
+	subscr_cache_index(subscr);
 
 	/* put it back to the db */
-	rc = db_sync_subscriber(subscr);
-	db_subscriber_update(subscr);
+	rc = db_async_sync_subscriber(subscr, NULL, NULL);
 
 	/* handle optional ciphering */
 	if (alg) {
@@ -180,6 +181,8 @@ static int set_subscriber_delete(struct ctrl_cmd *cmd, void *data)
 	}
 
 	rc = db_subscriber_delete(subscr);
+	if (rc == 0)
+		subscr_cache_forget(subscr);
 	subscr_put(subscr);
 
 	if (rc != 0) {
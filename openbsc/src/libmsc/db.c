@@ -25,9 +25,11 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <dbi/dbi.h>
+#include <sqlite3.h>
 
 #include <openbsc/gsm_data.h>
 #include <openbsc/gsm_subscriber.h>
@@ -46,9 +48,18 @@ void subscr_direct_free(struct gsm_subscriber *subscr);
 
 static char *db_basename = NULL;
 static char *db_dirname = NULL;
-static dbi_conn conn;
+static char *db_path;
+static const char *db_dir;
+static const char *db_file;
+/* every thread talking to the database has its own connection */
+static __thread dbi_conn conn;
 
-#define SCHEMA_REVISION "5"
+__thread struct db_log *db_thread_log;
+
+/* how long to wait for the lock held by another connection */
+#define DB_BUSY_TIMEOUT_MS	5000
+
+#define SCHEMA_REVISION "6"
 
 enum {
 	SCHEMA_META,
@@ -181,6 +192,164 @@ static const char *create_stmts[] = {
 		")",
 };
 
+/* created after migrating, not every revision had these columns */
+static const char *create_index_stmts[] = {
+	/* the unsent SMS of a subscriber */
+	"CREATE INDEX IF NOT EXISTS SMS_dest_sent "
+		"ON SMS (dest_addr, sent, deliver_attempts)",
+	/* the unsent SMS in the order they were stored */
+	"CREATE INDEX IF NOT EXISTS SMS_sent ON SMS (sent)",
+	/* the subscribers whose location updating expired */
+	"CREATE INDEX IF NOT EXISTS Subscriber_expire_lu "
+		"ON Subscriber (expire_lu, lac)",
+};
+
+/*
+ * libdbi has no prepared statements, the hot queries are prepared once
+ * on a SQLite handle of each thread and reused.
+ */
+enum db_stmt {
+	DB_STMT_TMSI_USED,
+	DB_STMT_SUBSCR_EXPIRED,
+	DB_STMT_SUBSCR_DETACH,
+	DB_STMT_SUBSCR_SYNC,
+	DB_STMT_SMS_UNSENT,
+	DB_STMT_SMS_UNSENT_BY_SUBSCR,
+	DB_STMT_SMS_UNSENT_FOR_SUBSCR,
+	DB_STMT_SMS_DELIVERED,
+	DB_STMT_SMS_INC_ATTEMPTS,
+	_NUM_DB_STMT
+};
+
+static const char *stmt_sql[] = {
+	[DB_STMT_TMSI_USED] = "SELECT id FROM Subscriber WHERE tmsi = ?",
+	/* the order by id would make it scan all of them otherwise */
+	[DB_STMT_SUBSCR_EXPIRED] = "SELECT id "
+		"FROM Subscriber INDEXED BY Subscriber_expire_lu "
+		"WHERE id > ? AND expire_lu < datetime('now') AND lac != 0 "
+		"ORDER BY id LIMIT ?",
+	/* unless it was updated since it was selected */
+	[DB_STMT_SUBSCR_DETACH] = "UPDATE Subscriber "
+		"SET updated = datetime('now'), lac = 0 "
+		"WHERE id = ? AND expire_lu < datetime('now') AND lac != 0",
+	[DB_STMT_SUBSCR_SYNC] = "UPDATE Subscriber "
+		"SET updated = datetime('now'), "
+			"name = ?, extension = ?, authorized = ?, "
+			"tmsi = ?, lac = ?, "
+			"expire_lu = datetime(?, 'unixepoch') "
+		"WHERE imsi = ?",
+	[DB_STMT_SMS_UNSENT] = "SELECT SMS.id "
+		"FROM SMS JOIN Subscriber ON "
+			"SMS.dest_addr = Subscriber.extension "
+		"WHERE SMS.id >= ? AND SMS.sent IS NULL "
+			"AND Subscriber.lac > 0 "
+		"ORDER BY SMS.id LIMIT 1",
+	/* walk the subscribers, SQLite would go through all unsent SMS */
+	[DB_STMT_SMS_UNSENT_BY_SUBSCR] = "SELECT SMS.id "
+		"FROM Subscriber CROSS JOIN SMS ON "
+			"SMS.dest_addr = Subscriber.extension "
+		"WHERE Subscriber.id >= ? AND SMS.sent IS NULL "
+			"AND Subscriber.lac > 0 AND SMS.deliver_attempts < ? "
+		"ORDER BY Subscriber.id, SMS.id LIMIT 1",
+	[DB_STMT_SMS_UNSENT_FOR_SUBSCR] = "SELECT id "
+		"FROM SMS "
+		"WHERE dest_addr = ? AND sent IS NULL "
+		"ORDER BY id LIMIT 1",
+	[DB_STMT_SMS_DELIVERED] = "UPDATE SMS "
+		"SET sent = datetime('now') "
+		"WHERE id = ?",
+	[DB_STMT_SMS_INC_ATTEMPTS] = "UPDATE SMS "
+		"SET deliver_attempts = deliver_attempts + 1 "
+		"WHERE id = ?",
+};
+
+static __thread sqlite3 *stmt_db;
+static __thread sqlite3_stmt *stmt_cache[_NUM_DB_STMT];
+
+static sqlite3_stmt *db_stmt(enum db_stmt idx)
+{
+	sqlite3_stmt *stmt = stmt_cache[idx];
+	int rc;
+
+	if (stmt)
+		return stmt;
+
+	if (!stmt_db) {
+		rc = sqlite3_open_v2(db_path, &stmt_db,
+				     SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,
+				     NULL);
+		if (rc != SQLITE_OK) {
+			LOGP_DB(DDB, LOGL_ERROR, "Failed to open %s: %s\n",
+			        db_path, sqlite3_errstr(rc));
+			sqlite3_close(stmt_db);
+			stmt_db = NULL;
+			return NULL;
+		}
+		sqlite3_busy_timeout(stmt_db, DB_BUSY_TIMEOUT_MS);
+	}
+
+	rc = sqlite3_prepare_v2(stmt_db, stmt_sql[idx], -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		LOGP_DB(DDB, LOGL_ERROR, "Failed to prepare statement %d: %s\n",
+		        idx, sqlite3_errmsg(stmt_db));
+		return NULL;
+	}
+
+	stmt_cache[idx] = stmt;
+	return stmt;
+}
+
+/*
+ * Run a statement, the first column of the first row is returned in id.
+ * Returns 1 for a row, 0 for none and < 0 on error. The statement is
+ * reset right away so it does not keep a read transaction open.
+ */
+static int db_stmt_step(sqlite3_stmt *stmt, unsigned long long *id)
+{
+	int rc;
+
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW) {
+		if (id)
+			*id = sqlite3_column_int64(stmt, 0);
+		rc = 1;
+	} else if (rc == SQLITE_DONE) {
+		rc = 0;
+	} else {
+		LOGP_DB(DDB, LOGL_ERROR, "Failed to run statement: %s\n",
+		        sqlite3_errmsg(stmt_db));
+		rc = -EIO;
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return rc;
+}
+
+/* for the transactions on the handle of the statements */
+static int db_stmt_exec(const char *sql)
+{
+	if (sqlite3_exec(stmt_db, sql, NULL, NULL, NULL) == SQLITE_OK)
+		return 0;
+
+	LOGP_DB(DDB, LOGL_ERROR, "Failed to run '%s': %s\n",
+	        sql, sqlite3_errmsg(stmt_db));
+	return -EIO;
+}
+
+static void db_stmt_close(void)
+{
+	int i;
+
+	for (i = 0; i < _NUM_DB_STMT; i++) {
+		sqlite3_finalize(stmt_cache[i]);
+		stmt_cache[i] = NULL;
+	}
+
+	sqlite3_close(stmt_db);
+	stmt_db = NULL;
+}
+
 static inline int next_row(dbi_result result)
 {
 	if (!dbi_result_has_next_row(result))
@@ -188,10 +357,30 @@ static inline int next_row(dbi_result result)
 	return dbi_result_next_row(result);
 }
 
+/* Keep the message for the main loop, the first one of a level wins. */
+void db_log_record(int subsys, int level, const char *fmt, ...)
+{
+	struct db_log *log = db_thread_log;
+	va_list ap;
+
+	if (log->text[0] && level <= log->level)
+		return;
+
+	log->subsys = subsys;
+	log->level = level;
+	va_start(ap, fmt);
+	vsnprintf(log->text, sizeof(log->text), fmt, ap);
+	va_end(ap);
+}
+
 void db_error_func(dbi_conn conn, void *data)
 {
 	const char *msg;
 	dbi_conn_error(conn, &msg);
+	if (db_thread_log) {
+		db_log_record(DDB, LOGL_ERROR, "DBI: %s\n", msg);
+		return;
+	}
 	LOGP(DDB, LOGL_ERROR, "DBI: %s\n", msg);
 	osmo_log_backtrace(DDB, LOGL_ERROR);
 }
@@ -523,6 +712,77 @@ rollback:
 	return -EINVAL;
 }
 
+static int db_create_indexes(void)
+{
+	dbi_result result;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(create_index_stmts); i++) {
+		result = dbi_conn_query(conn, create_index_stmts[i]);
+		if (!result) {
+			LOGP(DDB, LOGL_ERROR,
+			     "Failed to create some index.\n");
+			return -EINVAL;
+		}
+		dbi_result_free(result);
+	}
+
+	return 0;
+}
+
+static int update_db_revision_5(void)
+{
+	dbi_result result;
+
+	LOGP(DDB, LOGL_NOTICE, "Going to migrate from revision 5\n");
+
+	result = dbi_conn_query(conn, "BEGIN EXCLUSIVE TRANSACTION");
+	if (!result) {
+		LOGP(DDB, LOGL_ERROR,
+			"Failed to begin transaction (upgrade from rev 5)\n");
+		return -EINVAL;
+	}
+	dbi_result_free(result);
+
+	if (db_create_indexes() < 0) {
+		LOGP(DDB, LOGL_ERROR,
+		     "Failed to create the indexes (upgrade from rev 5).\n");
+		goto rollback;
+	}
+
+	/* We're done. Bump DB Meta revision to 6 */
+	result = dbi_conn_query(conn,
+				"UPDATE Meta "
+				"SET value = '6' "
+				"WHERE key = 'revision'");
+	if (!result) {
+		LOGP(DDB, LOGL_ERROR,
+		     "Failed to update DB schema revision (upgrade from rev 5).\n");
+		goto rollback;
+	}
+	dbi_result_free(result);
+
+	result = dbi_conn_query(conn, "COMMIT TRANSACTION");
+	if (!result) {
+		LOGP(DDB, LOGL_ERROR,
+			"Failed to commit the transaction (upgrade from rev 5)\n");
+		return -EINVAL;
+	} else {
+		dbi_result_free(result);
+	}
+
+	return 0;
+
+rollback:
+	result = dbi_conn_query(conn, "ROLLBACK TRANSACTION");
+	if (!result)
+		LOGP(DDB, LOGL_ERROR,
+			"Rollback failed (upgrade from rev 5).\n");
+	else
+		dbi_result_free(result);
+	return -EINVAL;
+}
+
 static int check_db_revision(void)
 {
 	dbi_result result;
@@ -569,6 +829,9 @@ static int check_db_revision(void)
 	case 4:
 		if (update_db_revision_4())
 			goto error;
+	case 5:
+		if (update_db_revision_5())
+			goto error;
 
 	/* The end of waterfall */
 	break;
@@ -586,11 +849,17 @@ error:
 	return -EINVAL;
 }
 
-static int db_configure(void)
+static int db_configure(dbi_conn db)
 {
 	dbi_result result;
 
-	result = dbi_conn_query(conn,
+	/* readers are not blocked by the writing thread */
+	result = dbi_conn_query(db, "PRAGMA journal_mode = WAL");
+	if (!result)
+		return -EINVAL;
+	dbi_result_free(result);
+
+	result = dbi_conn_query(db,
 				"PRAGMA synchronous = FULL");
 	if (!result)
 		return -EINVAL;
@@ -599,44 +868,92 @@ static int db_configure(void)
 	return 0;
 }
 
-int db_init(const char *name)
+static dbi_conn db_connect(void)
 {
-	dbi_initialize(NULL);
+	dbi_conn db;
 
-	conn = dbi_conn_new("sqlite3");
-	if (conn == NULL) {
+	db = dbi_conn_new("sqlite3");
+	if (db == NULL) {
 		LOGP(DDB, LOGL_FATAL, "Failed to create connection.\n");
-		return 1;
+		return NULL;
 	}
 
-	dbi_conn_error_handler( conn, db_error_func, NULL );
+	dbi_conn_error_handler( db, db_error_func, NULL );
 
 	/* MySQL
-	dbi_conn_set_option(conn, "host", "localhost");
-	dbi_conn_set_option(conn, "username", "your_name");
-	dbi_conn_set_option(conn, "password", "your_password");
-	dbi_conn_set_option(conn, "dbname", "your_dbname");
-	dbi_conn_set_option(conn, "encoding", "UTF-8");
+	dbi_conn_set_option(db, "host", "localhost");
+	dbi_conn_set_option(db, "username", "your_name");
+	dbi_conn_set_option(db, "password", "your_password");
+	dbi_conn_set_option(db, "dbname", "your_dbname");
+	dbi_conn_set_option(db, "encoding", "UTF-8");
 	*/
 
 	/* SqLite 3 */
+	dbi_conn_set_option(db, "sqlite3_dbdir", db_dir);
+	dbi_conn_set_option(db, "dbname", db_file);
+	dbi_conn_set_option_numeric(db, "sqlite3_timeout", DB_BUSY_TIMEOUT_MS);
+
+	if (dbi_conn_connect(db) < 0) {
+		dbi_conn_close(db);
+		return NULL;
+	}
+
+	return db;
+}
+
+int db_init(const char *name)
+{
+	dbi_initialize(NULL);
+
+	db_path = strdup(name);
 	db_basename = strdup(name);
 	db_dirname = strdup(name);
-	dbi_conn_set_option(conn, "sqlite3_dbdir", dirname(db_dirname));
-	dbi_conn_set_option(conn, "dbname", basename(db_basename));
+	db_dir = dirname(db_dirname);
+	db_file = basename(db_basename);
 
-	if (dbi_conn_connect(conn) < 0)
+	conn = db_connect();
+	if (!conn)
 		goto out_err;
 
 	return 0;
 
 out_err:
+	free(db_path);
 	free(db_dirname);
 	free(db_basename);
-	db_dirname = db_basename = NULL;
+	db_path = db_dirname = db_basename = NULL;
 	return -1;
 }
 
+/*
+ * Open another connection to the database for a thread, only to be
+ * used after db_prepare(). The thread uses it after db_thread_attach().
+ */
+void *db_thread_connect(void)
+{
+	dbi_conn db;
+
+	db = db_connect();
+	if (!db)
+		return NULL;
+
+	if (db_configure(db) < 0) {
+		dbi_conn_close(db);
+		return NULL;
+	}
+
+	return db;
+}
+
+void db_thread_attach(void *db)
+{
+	conn = db;
+}
+
+void db_thread_disconnect(void *db)
+{
+	dbi_conn_close(db);
+}
 
 int db_prepare(void)
 {
@@ -659,16 +976,22 @@ int db_prepare(void)
                 return -1;
 	}
 
-	db_configure();
+	/* the schema is at the latest revision now, created or migrated */
+	if (db_create_indexes() < 0)
+		return 1;
+
+	db_configure(conn);
 
 	return 0;
 }
 
 int db_fini(void)
 {
+	db_stmt_close();
 	dbi_conn_close(conn);
 	dbi_shutdown();
 
+	free(db_path);
 	free(db_dirname);
 	free(db_basename);
 	return 0;
@@ -681,7 +1004,9 @@ struct gsm_subscriber *db_create_subscriber(const char *imsi, uint64_t smin,
 	struct gsm_subscriber *subscr;
 
 	/* Is this subscriber known in the db? */
-	subscr = db_get_subscriber(GSM_SUBSCRIBER_IMSI, imsi);
+	subscr = subscr_cache_by_imsi(NULL, imsi);
+	if (!subscr)
+		subscr = db_get_subscriber(GSM_SUBSCRIBER_IMSI, imsi);
 	if (subscr) {
 		subscr_put(subscr);
 		return NULL;
@@ -709,6 +1034,7 @@ struct gsm_subscriber *db_create_subscriber(const char *imsi, uint64_t smin,
 	LOGP(DDB, LOGL_INFO, "New Subscriber: ID %llu, IMSI %s\n", subscr->id, subscr->imsi);
 	if (alloc_exten)
 		db_subscriber_alloc_exten(subscr, smin, smax);
+	subscr_cache_index(subscr);
 	return subscr;
 }
 
@@ -1072,6 +1398,7 @@ struct gsm_subscriber *db_get_subscriber(enum gsm_subscriber_field field,
 	dbi_result_free(result);
 
 	get_equipment_by_subscr(subscr);
+	subscr_cache_index(subscr);
 
 	return subscr;
 }
@@ -1101,6 +1428,7 @@ int db_subscriber_update(struct gsm_subscriber *subscr)
 	db_set_from_query(subscr, result);
 	dbi_result_free(result);
 	get_equipment_by_subscr(subscr);
+	subscr_cache_index(subscr);
 
 	return 0;
 }
@@ -1169,7 +1497,7 @@ int db_sync_subscriber(struct gsm_subscriber *subscriber)
 	free(q_extension);
 
 	if (!result) {
-		LOGP(DDB, LOGL_ERROR, "Failed to update Subscriber (by IMSI).\n");
+		LOGP_DB(DDB, LOGL_ERROR, "Failed to update Subscriber (by IMSI).\n");
 		return 1;
 	}
 
@@ -1178,6 +1506,52 @@ int db_sync_subscriber(struct gsm_subscriber *subscriber)
 	return 0;
 }
 
+/*
+ * Write the subscribers in a single transaction, either all of them
+ * are stored or none. The fields are the ones of db_sync_subscriber().
+ */
+int db_sync_subscribers(const struct gsm_subscriber *subscrs, int num)
+{
+	const struct gsm_subscriber *subscr;
+	sqlite3_stmt *stmt = db_stmt(DB_STMT_SUBSCR_SYNC);
+	char tmsi[14];
+	int i, rc = 0;
+
+	if (!stmt)
+		return -EIO;
+
+	if (db_stmt_exec("BEGIN IMMEDIATE TRANSACTION") < 0)
+		return -EIO;
+
+	for (i = 0; i < num && rc >= 0; i++) {
+		subscr = &subscrs[i];
+
+		/* the unbound ones are NULL */
+		sqlite3_bind_text(stmt, 1, subscr->name, -1, SQLITE_STATIC);
+		if (subscr->extension[0])
+			sqlite3_bind_text(stmt, 2, subscr->extension, -1,
+					  SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 3, subscr->authorized);
+		if (subscr->tmsi != GSM_RESERVED_TMSI) {
+			snprintf(tmsi, sizeof(tmsi), "%u", subscr->tmsi);
+			sqlite3_bind_text(stmt, 4, tmsi, -1, SQLITE_TRANSIENT);
+		}
+		sqlite3_bind_int(stmt, 5, subscr->lac);
+		if (subscr->expire_lu != GSM_SUBSCRIBER_NO_EXPIRATION)
+			sqlite3_bind_int64(stmt, 6, subscr->expire_lu);
+		sqlite3_bind_text(stmt, 7, subscr->imsi, -1, SQLITE_STATIC);
+
+		rc = db_stmt_step(stmt, NULL);
+	}
+
+	if (rc >= 0 && db_stmt_exec("COMMIT TRANSACTION") == 0)
+		return 0;
+
+	LOGP_DB(DDB, LOGL_ERROR, "Failed to write %d subscribers.\n", num);
+	db_stmt_exec("ROLLBACK TRANSACTION");
+	return -EIO;
+}
+
 int db_subscriber_delete(struct gsm_subscriber *subscr)
 {
 	dbi_result result;
@@ -1306,17 +1680,21 @@ int db_sync_equipment(struct gsm_equipment *equip)
 	unsigned char *cm2, *cm3;
 	char *q_imei;
 	uint8_t classmark1;
+	/* not the static buffer of osmo_hexdump(), it runs on a thread */
+	char hex2[3 * sizeof(equip->classmark2) + 1] = "";
+	char hex3[3 * sizeof(equip->classmark3) + 1] = "";
 
 	memcpy(&classmark1, &equip->classmark1, sizeof(classmark1));
-	DEBUGP(DDB, "Sync Equipment IMEI=%s, classmark1=%02x",
-		equip->imei, classmark1);
 	if (equip->classmark2_len)
-		DEBUGPC(DDB, ", classmark2=%s",
-			osmo_hexdump(equip->classmark2, equip->classmark2_len));
+		osmo_hexdump_buf(hex2, sizeof(hex2), equip->classmark2,
+				 equip->classmark2_len, " ", true);
 	if (equip->classmark3_len)
-		DEBUGPC(DDB, ", classmark3=%s",
-			osmo_hexdump(equip->classmark3, equip->classmark3_len));
-	DEBUGPC(DDB, "\n");
+		osmo_hexdump_buf(hex3, sizeof(hex3), equip->classmark3,
+				 equip->classmark3_len, " ", true);
+	DEBUGP_DB(DDB, "Sync Equipment IMEI=%s, classmark1=%02x%s%s%s%s\n",
+		  equip->imei, classmark1,
+		  hex2[0] ? ", classmark2=" : "", hex2,
+		  hex3[0] ? ", classmark3=" : "", hex3);
 
 	dbi_conn_quote_binary_copy(conn, equip->classmark2,
 				   equip->classmark2_len, &cm2);
@@ -1338,7 +1716,7 @@ int db_sync_equipment(struct gsm_equipment *equip)
 	free(q_imei);
 
 	if (!result) {
-		LOGP(DDB, LOGL_ERROR, "Failed to update Equipment\n");
+		LOGP_DB(DDB, LOGL_ERROR, "Failed to update Equipment\n");
 		return -EIO;
 	}
 
@@ -1346,69 +1724,99 @@ int db_sync_equipment(struct gsm_equipment *equip)
 	return 0;
 }
 
-int db_subscriber_expire(void *priv, void (*callback)(void *priv, long long unsigned int id))
+/*
+ * The ids of up to max subscribers whose location updating expired,
+ * in ascending order and starting after the id given.
+ * Returns how many were found or < 0 on error.
+ */
+int db_subscriber_expired(unsigned long long after,
+			  unsigned long long *ids, int max)
 {
-	dbi_result result;
+	sqlite3_stmt *stmt;
+	int rc = SQLITE_DONE, num = 0;
 
-	result = dbi_conn_query(conn,
-			"SELECT id "
-			"FROM Subscriber "
-			"WHERE lac != 0 AND "
-				"( expire_lu is NOT NULL "
-				"AND expire_lu < datetime('now') ) "
-			"LIMIT 1");
-	if (!result) {
-		LOGP(DDB, LOGL_ERROR, "Failed to get expired subscribers\n");
+	stmt = db_stmt(DB_STMT_SUBSCR_EXPIRED);
+	if (!stmt)
 		return -EIO;
+
+	sqlite3_bind_int64(stmt, 1, after);
+	sqlite3_bind_int(stmt, 2, max);
+	while (num < max && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		ids[num++] = sqlite3_column_int64(stmt, 0);
+	if (num < max && rc != SQLITE_DONE) {
+		LOGP_DB(DDB, LOGL_ERROR, "Failed to get expired subscribers: %s\n",
+		        sqlite3_errmsg(stmt_db));
+		num = -EIO;
 	}
 
-	while (next_row(result))
-		callback(priv, dbi_result_get_ulonglong(result, "id"));
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return num;
+}
 
-	dbi_result_free(result);
-	return 0;
+/*
+ * Detach the subscribers in one transaction, the ones updated since
+ * they were selected are left alone. Returns how many were detached
+ * or < 0 on error.
+ */
+int db_subscriber_detach(const unsigned long long *ids, int num)
+{
+	sqlite3_stmt *stmt = db_stmt(DB_STMT_SUBSCR_DETACH);
+	int i, rc = 0, detached = 0;
+
+	if (!stmt)
+		return -EIO;
+
+	if (db_stmt_exec("BEGIN IMMEDIATE TRANSACTION") < 0)
+		return -EIO;
+
+	for (i = 0; i < num && rc >= 0; i++) {
+		sqlite3_bind_int64(stmt, 1, ids[i]);
+		rc = db_stmt_step(stmt, NULL);
+		if (rc >= 0)
+			detached += sqlite3_changes(stmt_db);
+	}
+
+	if (rc >= 0 && db_stmt_exec("COMMIT TRANSACTION") == 0)
+		return detached;
+
+	LOGP_DB(DDB, LOGL_ERROR, "Failed to detach %d subscribers.\n", num);
+	db_stmt_exec("ROLLBACK TRANSACTION");
+	return -EIO;
 }
 
 int db_subscriber_alloc_tmsi(struct gsm_subscriber *subscriber)
 {
-	dbi_result result = NULL;
+	sqlite3_stmt *stmt;
 	char tmsi[14];
-	char *tmsi_quoted;
 
 	for (;;) {
 		int rc = osmo_get_rand_id((uint8_t *) &subscriber->tmsi, sizeof(subscriber->tmsi));
 		if (rc < 0) {
-			LOGP(DDB, LOGL_ERROR, "osmo_get_rand_id() failed: %s\n", strerror(-rc));
+			LOGP_DB(DDB, LOGL_ERROR, "osmo_get_rand_id() failed: %s\n", strerror(-rc));
 			return 1;
 		}
 		if (subscriber->tmsi == GSM_RESERVED_TMSI)
 			continue;
 
-		sprintf(tmsi, "%u", subscriber->tmsi);
-		dbi_conn_quote_string_copy(conn, tmsi, &tmsi_quoted);
-		result = dbi_conn_queryf(conn,
-			"SELECT * FROM Subscriber "
-			"WHERE tmsi = %s ",
-			tmsi_quoted);
-
-		free(tmsi_quoted);
+		stmt = db_stmt(DB_STMT_TMSI_USED);
+		if (!stmt)
+			return 1;
 
-		if (!result) {
-			LOGP(DDB, LOGL_ERROR, "Failed to query Subscriber "
+		sprintf(tmsi, "%u", subscriber->tmsi);
+		sqlite3_bind_text(stmt, 1, tmsi, -1, SQLITE_TRANSIENT);
+		rc = db_stmt_step(stmt, NULL);
+		if (rc < 0) {
+			LOGP_DB(DDB, LOGL_ERROR, "Failed to query Subscriber "
 				"while allocating new TMSI.\n");
 			return 1;
 		}
-		if (dbi_result_get_numrows(result)) {
-			dbi_result_free(result);
+		if (rc > 0)
 			continue;
-		}
-		if (!next_row(result)) {
-			dbi_result_free(result);
-			DEBUGP(DDB, "Allocated TMSI %u for IMSI %s.\n",
-				subscriber->tmsi, subscriber->imsi);
-			return db_sync_subscriber(subscriber);
-		}
-		dbi_result_free(result);
+
+		DEBUGP_DB(DDB, "Allocated TMSI %u for IMSI %s.\n",
+			subscriber->tmsi, subscriber->imsi);
+		return db_sync_subscriber(subscriber);
 	}
 	return 0;
 }
@@ -1515,7 +1923,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM230
 		"(%s, datetime('now'), datetime('now')) ",
 		imei);
 	if (!result) {
-		LOGP(DDB, LOGL_ERROR, "Failed to create Equipment by IMEI.\n");
+		LOGP_DB(DDB, LOGL_ERROR, "Failed to create Equipment by IMEI.\n");
 		return 1;
 	}
 
@@ -1526,7 +1934,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM230
 	dbi_result_free(result);
 
 	if (equipment_id)
-		DEBUGP(DDB, "New Equipment: ID %llu, IMEI %s\n", equipment_id, imei);
+		DEBUGP_DB(DDB, "New Equipment: ID %llu, IMEI %s\n", equipment_id, imei);
 	else {
 		result = dbi_conn_queryf(conn,
 			"SELECT id FROM Equipment "
@@ -1534,11 +1942,11 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM230
 			imei
 		);
 		if (!result) {
-			LOGP(DDB, LOGL_ERROR, "Failed to query Equipment by IMEI.\n");
+			LOGP_DB(DDB, LOGL_ERROR, "Failed to query Equipment by IMEI.\n");
 			return 1;
 		}
 		if (!next_row(result)) {
-			LOGP(DDB, LOGL_ERROR, "Failed to find the Equipment.\n");
+			LOGP_DB(DDB, LOGL_ERROR, "Failed to find the Equipment.\n");
 			dbi_result_free(result);
 			return 1;
 		}
@@ -1553,7 +1961,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM230
 		"(%llu, %llu, datetime('now'), datetime('now')) ",
 		subscriber->id, equipment_id);
 	if (!result) {
-		LOGP(DDB, LOGL_ERROR, "Failed to create EquipmentWatch.\n");
+		LOGP_DB(DDB, LOGL_ERROR, "Failed to create EquipmentWatch.\n");
 		return 1;
 	}
 
@@ -1563,7 +1971,7 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM230
 
 	dbi_result_free(result);
 	if (watch_id)
-		DEBUGP(DDB, "New EquipmentWatch: ID %llu, IMSI %s, IMEI %s\n",
+		DEBUGP_DB(DDB, "New EquipmentWatch: ID %llu, IMSI %s, IMEI %s\n",
 			equipment_id, subscriber->imsi, imei);
 	else {
 		result = dbi_conn_queryf(conn,
@@ -1572,11 +1980,11 @@ int db_subscriber_assoc_imei(struct gsm_subscriber *subscriber, char imei[GSM230
 			"WHERE subscriber_id = %llu AND equipment_id = %llu ",
 			subscriber->id, equipment_id);
 		if (!result) {
-			LOGP(DDB, LOGL_ERROR, "Failed to update EquipmentWatch.\n");
+			LOGP_DB(DDB, LOGL_ERROR, "Failed to update EquipmentWatch.\n");
 			return 1;
 		}
 		dbi_result_free(result);
-		DEBUGP(DDB, "Updated EquipmentWatch: ID %llu, IMSI %s, IMEI %s\n",
+		DEBUGP_DB(DDB, "Updated EquipmentWatch: ID %llu, IMSI %s, IMEI %s\n",
 			equipment_id, subscriber->imsi, imei);
 	}
 
@@ -1705,128 +2113,95 @@ struct gsm_sms *db_sms_get(struct gsm_network *net, unsigned long long id)
 	return sms;
 }
 
-/* retrieve the next unsent SMS with ID >= min_id */
-struct gsm_sms *db_sms_get_unsent(struct gsm_network *net, unsigned long long min_id)
+/* load the SMS whose id the statement selected */
+static struct gsm_sms *sms_from_stmt(struct gsm_network *net,
+				     sqlite3_stmt *stmt)
 {
-	dbi_result result;
-	struct gsm_sms *sms;
+	unsigned long long id;
 
-	result = dbi_conn_queryf(conn,
-		"SELECT SMS.* "
-			"FROM SMS JOIN Subscriber ON "
-				"SMS.dest_addr = Subscriber.extension "
-			"WHERE SMS.id >= %llu AND SMS.sent IS NULL "
-				"AND Subscriber.lac > 0 "
-			"ORDER BY SMS.id LIMIT 1",
-		min_id);
-	if (!result)
+	if (db_stmt_step(stmt, &id) <= 0)
 		return NULL;
 
-	if (!next_row(result)) {
-		dbi_result_free(result);
-		return NULL;
-	}
+	return db_sms_get(net, id);
+}
 
-	sms = sms_from_result(net, result);
+/* retrieve the next unsent SMS with ID >= min_id */
+struct gsm_sms *db_sms_get_unsent(struct gsm_network *net, unsigned long long min_id)
+{
+	sqlite3_stmt *stmt;
 
-	dbi_result_free(result);
+	stmt = db_stmt(DB_STMT_SMS_UNSENT);
+	if (!stmt)
+		return NULL;
 
-	return sms;
+	sqlite3_bind_int64(stmt, 1, min_id);
+	return sms_from_stmt(net, stmt);
 }
 
 struct gsm_sms *db_sms_get_unsent_by_subscr(struct gsm_network *net,
 					    unsigned long long min_subscr_id,
 					    unsigned int failed)
 {
-	dbi_result result;
-	struct gsm_sms *sms;
-
-	result = dbi_conn_queryf(conn,
-		"SELECT SMS.* "
-			"FROM SMS JOIN Subscriber ON "
-				"SMS.dest_addr = Subscriber.extension "
-			"WHERE Subscriber.id >= %llu AND SMS.sent IS NULL "
-				"AND Subscriber.lac > 0 AND SMS.deliver_attempts < %u "
-			"ORDER BY Subscriber.id, SMS.id LIMIT 1",
-		min_subscr_id, failed);
-	if (!result)
-		return NULL;
+	sqlite3_stmt *stmt;
 
-	if (!next_row(result)) {
-		dbi_result_free(result);
+	stmt = db_stmt(DB_STMT_SMS_UNSENT_BY_SUBSCR);
+	if (!stmt)
 		return NULL;
-	}
-
-	sms = sms_from_result(net, result);
-
-	dbi_result_free(result);
 
-	return sms;
+	sqlite3_bind_int64(stmt, 1, min_subscr_id);
+	sqlite3_bind_int64(stmt, 2, failed);
+	return sms_from_stmt(net, stmt);
 }
 
-/* retrieve the next unsent SMS for a given subscriber */
+/*
+ * Retrieve the next unsent SMS for a given subscriber. It is attached
+ * according to the subscriber in RAM, its row might not be written yet.
+ */
 struct gsm_sms *db_sms_get_unsent_for_subscr(struct gsm_subscriber *subscr)
 {
-	dbi_result result;
-	struct gsm_sms *sms;
+	sqlite3_stmt *stmt;
 
-	result = dbi_conn_queryf(conn,
-		"SELECT SMS.* "
-			"FROM SMS JOIN Subscriber ON "
-				"SMS.dest_addr = Subscriber.extension "
-			"WHERE Subscriber.id = %llu AND SMS.sent IS NULL "
-				"AND Subscriber.lac > 0 "
-			"ORDER BY SMS.id LIMIT 1",
-		subscr->id);
-	if (!result)
+	if (subscr->lac == GSM_LAC_RESERVED_DETACHED || !subscr->extension[0])
 		return NULL;
 
-	if (!next_row(result)) {
-		dbi_result_free(result);
+	stmt = db_stmt(DB_STMT_SMS_UNSENT_FOR_SUBSCR);
+	if (!stmt)
 		return NULL;
-	}
-
-	sms = sms_from_result(subscr->group->net, result);
-
-	dbi_result_free(result);
 
-	return sms;
+	sqlite3_bind_text(stmt, 1, subscr->extension, -1, SQLITE_TRANSIENT);
+	return sms_from_stmt(subscr->group->net, stmt);
 }
 
 /* mark a given SMS as delivered */
 int db_sms_mark_delivered(struct gsm_sms *sms)
 {
-	dbi_result result;
+	sqlite3_stmt *stmt;
 
-	result = dbi_conn_queryf(conn,
-		"UPDATE SMS "
-		"SET sent = datetime('now') "
-		"WHERE id = %llu", sms->id);
-	if (!result) {
+	stmt = db_stmt(DB_STMT_SMS_DELIVERED);
+	if (stmt)
+		sqlite3_bind_int64(stmt, 1, sms->id);
+	if (!stmt || db_stmt_step(stmt, NULL) < 0) {
 		LOGP(DDB, LOGL_ERROR, "Failed to mark SMS %llu as sent.\n", sms->id);
 		return 1;
 	}
 
-	dbi_result_free(result);
 	return 0;
 }
 
 /* increase the number of attempted deliveries */
 int db_sms_inc_deliver_attempts(struct gsm_sms *sms)
 {
-	dbi_result result;
+	sqlite3_stmt *stmt;
 
-	result = dbi_conn_queryf(conn,
-		"UPDATE SMS "
-		"SET deliver_attempts = deliver_attempts + 1 "
-		"WHERE id = %llu", sms->id);
-	if (!result) {
+	stmt = db_stmt(DB_STMT_SMS_INC_ATTEMPTS);
+	if (stmt)
+		sqlite3_bind_int64(stmt, 1, sms->id);
+	if (!stmt || db_stmt_step(stmt, NULL) < 0) {
 		LOGP(DDB, LOGL_ERROR, "Failed to inc deliver attempts for "
 			"SMS %llu.\n", sms->id);
 		return 1;
 	}
 
-	dbi_result_free(result);
 	return 0;
 }
 
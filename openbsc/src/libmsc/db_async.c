@@ -0,0 +1,636 @@
+/* Running the database queries on a thread of their own */
+
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * There is a single thread so the requests are executed in the order
+ * they were queued. It has a connection of its own, with the database
+ * in WAL mode the lookups still done on the main loop are not blocked
+ * by its writes. The requests are allocated and freed on the main
+ * loop, the thread only touches the copy of the subscriber and the
+ * SMS handed over to it. It does not log either, the message of a
+ * request is kept in it and logged by the main loop.
+ *
+ * The subscribers written back by the cache are collected in a journal
+ * instead, it is written in one transaction once the write interval
+ * of the network has passed or the batch is full.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/rate_ctr.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/stat_item.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/timer.h>
+
+#include <openbsc/auth.h>
+#include <openbsc/db.h>
+#include <openbsc/db_async.h>
+#include <openbsc/debug.h>
+#include <openbsc/gsm_data.h>
+#include <openbsc/gsm_subscriber.h>
+#include <openbsc/gsm_04_11.h>
+
+enum db_async_type {
+	DB_ASYNC_SYNC_SUBSCR,
+	DB_ASYNC_ALLOC_TMSI,
+	DB_ASYNC_ASSOC_IMEI,
+	DB_ASYNC_SYNC_EQUIP,
+	DB_ASYNC_AUTH_TUPLE,
+	DB_ASYNC_SMS_STORE,
+	DB_ASYNC_SYNC_BATCH,
+	DB_ASYNC_DETACH,
+};
+
+struct db_async_req {
+	struct llist_head entry;
+	enum db_async_type type;
+	int rc;
+	/* the caller is gone, do not call back */
+	int cancelled;
+	/* the message logged while executing it on the thread */
+	struct db_log log;
+
+	/* the subscriber of the caller and the copy the thread works on */
+	struct gsm_subscriber *subscr;
+	struct gsm_subscriber copy;
+
+	char imei[GSM23003_IMEISV_NUM_DIGITS+1];
+	int key_seq;
+	struct gsm_auth_tuple atuple;
+	struct gsm_sms *sms;
+
+	/* the journal, the subscribers and the copies written */
+	struct gsm_network *net;
+	struct gsm_subscriber **batch;
+	struct gsm_subscriber *batch_copy;
+	int batch_len;
+	int latency_ms;
+
+	/* the expired subscribers to detach */
+	unsigned long long *ids;
+	int num_ids;
+
+	union {
+		db_async_cb *plain;
+		db_async_auth_cb *auth;
+		db_async_sms_cb *sms;
+	} cb;
+	void *data;
+};
+
+static struct {
+	int running;
+	pthread_t thread;
+	void *conn;
+	struct osmo_fd done_fd;
+
+	pthread_mutex_t lock;
+	/* new requests have been queued */
+	pthread_cond_t cond;
+	struct llist_head queue;
+	struct db_async_req *busy;
+	struct llist_head done;
+} db_async = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.queue = LLIST_HEAD_INIT(db_async.queue),
+	.done = LLIST_HEAD_INIT(db_async.done),
+};
+
+static void db_journal_timer_cb(void *unused);
+
+/* only used on the main loop, each entry holds a reference */
+static struct {
+	struct gsm_network *net;
+	struct gsm_subscriber **subscr;
+	int num;
+	int size;
+	struct osmo_timer_list timer;
+} db_journal = {
+	.timer = { .cb = db_journal_timer_cb },
+};
+
+static int elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void db_async_execute(struct db_async_req *req)
+{
+	struct timespec start;
+
+	switch (req->type) {
+	case DB_ASYNC_SYNC_SUBSCR:
+		req->rc = db_sync_subscriber(&req->copy);
+		break;
+	case DB_ASYNC_ALLOC_TMSI:
+		req->rc = db_subscriber_alloc_tmsi(&req->copy);
+		break;
+	case DB_ASYNC_ASSOC_IMEI:
+		db_subscriber_assoc_imei(&req->copy, req->imei);
+		req->rc = db_sync_equipment(&req->copy.equipment);
+		break;
+	case DB_ASYNC_SYNC_EQUIP:
+		req->rc = db_sync_equipment(&req->copy.equipment);
+		break;
+	case DB_ASYNC_AUTH_TUPLE:
+		req->rc = auth_get_tuple_for_subscr(&req->atuple, &req->copy,
+						    req->key_seq);
+		break;
+	case DB_ASYNC_SMS_STORE:
+		req->rc = db_sms_store(req->sms);
+		break;
+	case DB_ASYNC_SYNC_BATCH:
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		req->rc = db_sync_subscribers(req->batch_copy, req->batch_len);
+		req->latency_ms = elapsed_ms(&start);
+		break;
+	case DB_ASYNC_DETACH:
+		req->rc = db_subscriber_detach(req->ids, req->num_ids);
+		break;
+	}
+}
+
+/* Add a subscriber to the journal, the reference is handed over. */
+static int db_journal_append(struct gsm_subscriber *subscr)
+{
+	struct gsm_subscriber **subscrs;
+	int size;
+
+	if (db_journal.num == db_journal.size) {
+		size = db_journal.size ? db_journal.size * 2 : 64;
+		subscrs = talloc_realloc(tall_bsc_ctx, db_journal.subscr,
+					 struct gsm_subscriber *, size);
+		if (!subscrs)
+			return -ENOMEM;
+		db_journal.subscr = subscrs;
+		db_journal.size = size;
+	}
+
+	db_journal.subscr[db_journal.num++] = subscr;
+	return 0;
+}
+
+static void db_journal_schedule(void)
+{
+	int interval = db_journal.net->subscr_write_interval;
+
+	if (!osmo_timer_pending(&db_journal.timer))
+		osmo_timer_schedule(&db_journal.timer, interval / 1000,
+				    (interval % 1000) * 1000);
+}
+
+/* The batch has been written, runs on the main loop. */
+static void db_journal_done(struct db_async_req *req)
+{
+	struct gsm_network *net = req->net;
+	int i;
+
+	if (req->rc == 0) {
+		rate_ctr_inc(&net->msc_ctrs->ctr[MSC_CTR_SUBSCR_JOURNAL_FLUSHED]);
+		rate_ctr_add(&net->msc_ctrs->ctr[MSC_CTR_SUBSCR_JOURNAL_WRITTEN],
+			     req->batch_len);
+		osmo_stat_item_set(net->msc_statg->items[MSC_STAT_SUBSCR_JOURNAL_BATCH],
+				   req->batch_len);
+		osmo_stat_item_set(net->msc_statg->items[MSC_STAT_SUBSCR_JOURNAL_LATENCY],
+				   req->latency_ms);
+
+		for (i = 0; i < req->batch_len; i++)
+			subscr_put(req->batch[i]);
+		return;
+	}
+
+	/* try again with the next batch, keeping the references */
+	LOGP(DDB, LOGL_ERROR, "Failed to write %d subscribers, retrying.\n",
+	     req->batch_len);
+	db_journal.net = net;
+	for (i = 0; i < req->batch_len; i++) {
+		if (db_journal_append(req->batch[i]) != 0) {
+			LOGP(DDB, LOGL_ERROR, "Dropping the changes of "
+			     "subscriber %s.\n", subscr_name(req->batch[i]));
+			subscr_put(req->batch[i]);
+		}
+	}
+	db_journal_schedule();
+}
+
+/* Call back and free the request, runs on the main loop. */
+static void db_async_complete(struct db_async_req *req)
+{
+	if (req->log.text[0])
+		LOGP(req->log.subsys, req->log.level, "%s", req->log.text);
+
+	if (req->type == DB_ASYNC_ALLOC_TMSI) {
+		req->subscr->tmsi = req->copy.tmsi;
+		subscr_cache_index(req->subscr);
+	}
+	if (req->type == DB_ASYNC_SYNC_BATCH)
+		db_journal_done(req);
+
+	if (!req->cancelled) {
+		switch (req->type) {
+		case DB_ASYNC_AUTH_TUPLE:
+			req->cb.auth(req->rc, &req->atuple, req->data);
+			break;
+		case DB_ASYNC_SMS_STORE:
+			req->cb.sms(req->rc, req->sms, req->data);
+			break;
+		default:
+			if (req->cb.plain)
+				req->cb.plain(req->rc, req->data);
+			break;
+		}
+	}
+
+	if (req->subscr)
+		subscr_put(req->subscr);
+	if (req->sms)
+		sms_free(req->sms);
+	talloc_free(req);
+}
+
+static void *db_async_main(void *unused)
+{
+	struct db_async_req *req;
+	uint64_t one = 1;
+
+	db_thread_attach(db_async.conn);
+
+	pthread_mutex_lock(&db_async.lock);
+	while (1) {
+		while (llist_empty(&db_async.queue))
+			pthread_cond_wait(&db_async.cond, &db_async.lock);
+
+		req = llist_first_entry(&db_async.queue, struct db_async_req, entry);
+		llist_del(&req->entry);
+		db_async.busy = req;
+		pthread_mutex_unlock(&db_async.lock);
+
+		db_thread_log = &req->log;
+		db_async_execute(req);
+		db_thread_log = NULL;
+
+		pthread_mutex_lock(&db_async.lock);
+		db_async.busy = NULL;
+		llist_add_tail(&req->entry, &db_async.done);
+
+		/* it can only fail once the counter overflows, the main
+		 * loop is woken up all the same then */
+		if (write(db_async.done_fd.fd, &one, sizeof(one)) != sizeof(one))
+			continue;
+	}
+
+	return NULL;
+}
+
+static int db_async_done_cb(struct osmo_fd *fd, unsigned int what)
+{
+	struct db_async_req *req;
+	uint64_t val;
+
+	if (read(fd->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -1;
+
+	/* one by one, a callback might cancel the requests still done */
+	while (1) {
+		pthread_mutex_lock(&db_async.lock);
+		req = NULL;
+		if (!llist_empty(&db_async.done)) {
+			req = llist_first_entry(&db_async.done,
+						struct db_async_req, entry);
+			llist_del(&req->entry);
+		}
+		pthread_mutex_unlock(&db_async.lock);
+
+		if (!req)
+			break;
+		db_async_complete(req);
+	}
+
+	return 0;
+}
+
+static struct db_async_req *db_async_alloc(enum db_async_type type,
+					   struct gsm_subscriber *subscr,
+					   void *data)
+{
+	struct db_async_req *req;
+
+	req = talloc_zero(tall_bsc_ctx, struct db_async_req);
+	if (!req)
+		return NULL;
+
+	req->type = type;
+	req->data = data;
+	if (subscr) {
+		req->subscr = subscr_get(subscr);
+		memcpy(&req->copy, subscr, sizeof(req->copy));
+	}
+	return req;
+}
+
+static int db_async_queue(struct db_async_req *req)
+{
+	if (!db_async.running) {
+		db_async_execute(req);
+		db_async_complete(req);
+		return 0;
+	}
+
+	pthread_mutex_lock(&db_async.lock);
+	llist_add_tail(&req->entry, &db_async.queue);
+	pthread_cond_signal(&db_async.cond);
+	pthread_mutex_unlock(&db_async.lock);
+	return 0;
+}
+
+/**
+ * Do not call back for the requests queued with this data, e.g. as
+ * the operation waiting for them is about to be freed.
+ */
+void db_async_cancel(void *data)
+{
+	struct db_async_req *req;
+
+	if (!data || !db_async.running)
+		return;
+
+	pthread_mutex_lock(&db_async.lock);
+	llist_for_each_entry(req, &db_async.queue, entry)
+		if (req->data == data)
+			req->cancelled = 1;
+	if (db_async.busy && db_async.busy->data == data)
+		db_async.busy->cancelled = 1;
+	llist_for_each_entry(req, &db_async.done, entry)
+		if (req->data == data)
+			req->cancelled = 1;
+	pthread_mutex_unlock(&db_async.lock);
+}
+
+int db_async_sync_subscriber(struct gsm_subscriber *subscr,
+			     db_async_cb *cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc(DB_ASYNC_SYNC_SUBSCR, subscr, data);
+	if (!req)
+		return -ENOMEM;
+	req->cb.plain = cb;
+	return db_async_queue(req);
+}
+
+/* The new TMSI is set on the subscriber before calling back. */
+int db_async_alloc_tmsi(struct gsm_subscriber *subscr,
+			db_async_cb *cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc(DB_ASYNC_ALLOC_TMSI, subscr, data);
+	if (!req)
+		return -ENOMEM;
+	req->cb.plain = cb;
+	return db_async_queue(req);
+}
+
+/* Associate the IMEI and store the classmarks of the equipment. */
+int db_async_assoc_imei(struct gsm_subscriber *subscr, const char *imei,
+			db_async_cb *cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc(DB_ASYNC_ASSOC_IMEI, subscr, data);
+	if (!req)
+		return -ENOMEM;
+	req->cb.plain = cb;
+	osmo_strlcpy(req->imei, imei, sizeof(req->imei));
+	return db_async_queue(req);
+}
+
+int db_async_sync_equipment(struct gsm_subscriber *subscr,
+			    db_async_cb *cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc(DB_ASYNC_SYNC_EQUIP, subscr, data);
+	if (!req)
+		return -ENOMEM;
+	req->cb.plain = cb;
+	return db_async_queue(req);
+}
+
+/* The callback gets the result of auth_get_tuple_for_subscr(). */
+int db_async_auth_tuple(struct gsm_subscriber *subscr, int key_seq,
+			db_async_auth_cb *cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc(DB_ASYNC_AUTH_TUPLE, subscr, data);
+	if (!req)
+		return -ENOMEM;
+	req->cb.auth = cb;
+	req->key_seq = key_seq;
+	return db_async_queue(req);
+}
+
+/* The SMS is owned by the request, it is freed after calling back. */
+int db_async_sms_store(struct gsm_sms *sms, db_async_sms_cb *cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc(DB_ASYNC_SMS_STORE, NULL, data);
+	if (!req)
+		return -ENOMEM;
+	req->cb.sms = cb;
+	req->sms = sms;
+	return db_async_queue(req);
+}
+
+/*
+ * Detach the expired subscribers, the ids are owned by the request.
+ * The callback gets the number of subscribers detached.
+ */
+int db_async_detach(unsigned long long *ids, int num,
+		    db_async_cb *cb, void *data)
+{
+	struct db_async_req *req;
+
+	req = db_async_alloc(DB_ASYNC_DETACH, NULL, data);
+	if (!req) {
+		talloc_free(ids);
+		return -ENOMEM;
+	}
+	req->cb.plain = cb;
+	req->ids = talloc_steal(req, ids);
+	req->num_ids = num;
+	return db_async_queue(req);
+}
+
+/**
+ * The write_back of the subscriber cache. The subscriber is kept in
+ * the journal until it is written with the others, within the
+ * subscr_write_interval of the network or once subscr_write_batch of
+ * them are waiting. Without an interval it is written right away.
+ */
+int db_async_journal_add(struct gsm_subscriber *subscr)
+{
+	struct gsm_network *net = subscr->group ? subscr->group->net : NULL;
+
+	if (!net || net->subscr_write_interval <= 0)
+		return db_async_sync_subscriber(subscr, NULL, NULL);
+
+	if (db_journal_append(subscr_get(subscr)) != 0) {
+		subscr_put(subscr);
+		return db_async_sync_subscriber(subscr, NULL, NULL);
+	}
+
+	db_journal.net = net;
+	if (db_journal.num >= net->subscr_write_batch)
+		return db_async_journal_flush();
+
+	db_journal_schedule();
+	return 0;
+}
+
+/* Queue the subscribers of the journal as one transaction. */
+int db_async_journal_flush(void)
+{
+	struct db_async_req *req;
+	int i;
+
+	osmo_timer_del(&db_journal.timer);
+	if (db_journal.num == 0)
+		return 0;
+
+	req = db_async_alloc(DB_ASYNC_SYNC_BATCH, NULL, NULL);
+	if (!req)
+		return -ENOMEM;
+
+	/* the fields are taken as they are now */
+	req->batch_copy = talloc_array(req, struct gsm_subscriber,
+				       db_journal.num);
+	if (!req->batch_copy) {
+		talloc_free(req);
+		return -ENOMEM;
+	}
+	for (i = 0; i < db_journal.num; i++)
+		memcpy(&req->batch_copy[i], db_journal.subscr[i],
+		       sizeof(req->batch_copy[i]));
+
+	req->net = db_journal.net;
+	req->batch = talloc_steal(req, db_journal.subscr);
+	req->batch_len = db_journal.num;
+
+	db_journal.subscr = NULL;
+	db_journal.num = 0;
+	db_journal.size = 0;
+
+	return db_async_queue(req);
+}
+
+static void db_journal_timer_cb(void *unused)
+{
+	db_async_journal_flush();
+}
+
+/**
+ * Flush the journal and wait up to timeout_ms for the thread to have
+ * done all requests, for the shutdown from the main loop.
+ */
+int db_async_drain(int timeout_ms)
+{
+	int idle;
+
+	db_async_journal_flush();
+	if (!db_async.running)
+		return 0;
+
+	for (; timeout_ms > 0; timeout_ms -= 10) {
+		pthread_mutex_lock(&db_async.lock);
+		idle = llist_empty(&db_async.queue) && !db_async.busy;
+		pthread_mutex_unlock(&db_async.lock);
+		if (idle)
+			return 0;
+		usleep(10000);
+	}
+
+	LOGP(DDB, LOGL_ERROR, "Database requests still pending on shutdown.\n");
+	return -ETIMEDOUT;
+}
+
+/**
+ * Start the database thread, it has to be done after db_prepare() and
+ * after forking into the background.
+ */
+int db_async_start(void)
+{
+	sigset_t all, old;
+	int rc;
+
+	db_async.conn = db_thread_connect();
+	if (!db_async.conn) {
+		LOGP(DDB, LOGL_FATAL, "Failed to connect the database thread.\n");
+		return -1;
+	}
+
+	db_async.done_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (db_async.done_fd.fd < 0)
+		goto error;
+	db_async.done_fd.when = BSC_FD_READ;
+	db_async.done_fd.cb = db_async_done_cb;
+	if (osmo_fd_register(&db_async.done_fd) != 0) {
+		close(db_async.done_fd.fd);
+		goto error;
+	}
+
+	/* the signals are handled on the main loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	rc = pthread_create(&db_async.thread, NULL, db_async_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc != 0) {
+		osmo_fd_unregister(&db_async.done_fd);
+		close(db_async.done_fd.fd);
+		goto error;
+	}
+
+	db_async.running = 1;
+	LOGP(DDB, LOGL_NOTICE, "Started the database thread.\n");
+	return 0;
+
+error:
+	LOGP(DDB, LOGL_FATAL, "Failed to set up the database thread.\n");
+	db_thread_disconnect(db_async.conn);
+	db_async.conn = NULL;
+	return -1;
+}
@@ -36,6 +36,7 @@
 
 #include <openbsc/auth.h>
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 #include <openbsc/debug.h>
 #include <openbsc/gsm_data.h>
 #include <openbsc/gsm_subscriber.h>
@@ -169,6 +170,7 @@ void release_security_operation(struct gsm_subscriber_connection *conn)
 	if (!conn->sec_operation)
 		return;
 
+	db_async_cancel(conn->sec_operation);
 	talloc_free(conn->sec_operation);
 	conn->sec_operation = NULL;
 	msc_release_connection(conn);
@@ -180,14 +182,49 @@ void allocate_security_operation(struct gsm_subscriber_connection *conn)
 	                                  struct gsm_security_operation);
 }
 
+/* The auth tuple has been looked up, continue securing the channel. */
+static void secure_channel_tuple_cb(int rc, struct gsm_auth_tuple *atuple,
+				    void *data)
+{
+	struct gsm_security_operation *op = data;
+	struct gsm_subscriber_connection *conn = op->conn;
+	struct gsm_network *net = conn->network;
+	gsm_cbfn *cb = op->cb;
+	void *cb_data = op->cb_data;
+
+	if (rc <= 0) {
+		/* Nothing to do, the operation is not needed */
+		conn->sec_operation = NULL;
+		talloc_free(op);
+		if (cb)
+			cb(GSM_HOOK_RR_SECURITY, GSM_SECURITY_NOAVAIL,
+			   NULL, conn, cb_data);
+		return;
+	}
+
+	memcpy(&op->atuple, atuple, sizeof(struct gsm_auth_tuple));
+
+	/* FIXME: Should start a timer for completion ... */
+
+	/* Then do whatever is needed ... */
+	if (rc == AUTH_DO_AUTH_THEN_CIPH) {
+		/* Start authentication */
+		gsm48_tx_mm_auth_req(conn, op->atuple.vec.rand, NULL,
+				     op->atuple.key_seq);
+	} else if (rc == AUTH_DO_CIPH) {
+		/* Start ciphering directly */
+		gsm0808_cipher_mode(conn, net->a5_encryption,
+				    op->atuple.vec.kc, 8, 0);
+	}
+}
+
 int gsm48_secure_channel(struct gsm_subscriber_connection *conn, int key_seq,
                          gsm_cbfn *cb, void *cb_data)
 {
 	struct gsm_network *net = conn->network;
 	struct gsm_subscriber *subscr = conn->subscr;
 	struct gsm_security_operation *op;
-	struct gsm_auth_tuple atuple;
-	int status = -1, rc;
+	int status = -1;
 
 	/* Check if we _can_ enable encryption. Cases where we can't:
 	 *  - Encryption disabled in config
@@ -205,13 +242,6 @@ int gsm48_secure_channel(struct gsm_subscriber_connection *conn, int key_seq,
 		status = GSM_SECURITY_NOAVAIL;
 	}
 
-	/* If not done yet, try to get info for this user */
-	if (status < 0) {
-		rc = auth_get_tuple_for_subscr(&atuple, subscr, key_seq);
-		if (rc <= 0)
-			status = GSM_SECURITY_NOAVAIL;
-	}
-
 	/* Are we done yet ? */
 	if (status >= 0)
 		return cb ?
@@ -224,24 +254,15 @@ int gsm48_secure_channel(struct gsm_subscriber_connection *conn, int key_seq,
 
 	allocate_security_operation(conn);
 	op = conn->sec_operation;
+	op->conn = conn;
 	op->cb = cb;
 	op->cb_data = cb_data;
-	memcpy(&op->atuple, &atuple, sizeof(struct gsm_auth_tuple));
-
-		/* FIXME: Should start a timer for completion ... */
 
-	/* Then do whatever is needed ... */
-	if (rc == AUTH_DO_AUTH_THEN_CIPH) {
-		/* Start authentication */
-		return gsm48_tx_mm_auth_req(conn, op->atuple.vec.rand, NULL,
-					    op->atuple.key_seq);
-	} else if (rc == AUTH_DO_CIPH) {
-		/* Start ciphering directly */
-		return gsm0808_cipher_mode(conn, net->a5_encryption,
-		                           op->atuple.vec.kc, 8, 0);
-	}
+	/* Try to get info for this user, continued once it is there */
+	if (db_async_auth_tuple(subscr, key_seq, secure_channel_tuple_cb, op) < 0)
+		secure_channel_tuple_cb(AUTH_ERROR, NULL, op);
 
-	return -EINVAL; /* not reached */
+	return 0;
 }
 
 static bool subscr_regexp_check(const struct gsm_network *net, const char *imsi)
@@ -298,6 +319,7 @@ static void _release_loc_updating_req(struct gsm_subscriber_connection *conn, in
 	/* No need to keep the connection up */
 	release_anchor(conn);
 
+	db_async_cancel(conn->loc_operation);
 	osmo_timer_del(&conn->loc_operation->updating_timer);
 	talloc_free(conn->loc_operation);
 	conn->loc_operation = NULL;
@@ -333,21 +355,15 @@ static void allocate_loc_updating_req(struct gsm_subscriber_connection *conn)
 
 	conn->loc_operation = talloc_zero(tall_locop_ctx,
 					   struct gsm_loc_updating_operation);
+	if (conn->loc_operation)
+		conn->loc_operation->conn = conn;
 }
 
-static int finish_lu(struct gsm_subscriber_connection *conn)
+static int finish_lu_accept(struct gsm_subscriber_connection *conn)
 {
 	int rc = 0;
 	int avoid_tmsi = conn->network->avoid_tmsi;
 
-	/* We're all good */
-	if (avoid_tmsi) {
-		conn->subscr->tmsi = GSM_RESERVED_TMSI;
-		db_sync_subscriber(conn->subscr);
-	} else {
-		db_subscriber_alloc_tmsi(conn->subscr);
-	}
-
 	rc = gsm0408_loc_upd_acc(conn);
 	if (conn->network->send_mm_info) {
 		/* send MM INFO with network name */
@@ -373,6 +389,33 @@ static int finish_lu(struct gsm_subscriber_connection *conn)
 	return rc;
 }
 
+static void finish_lu_tmsi_cb(int rc, void *data)
+{
+	struct gsm_loc_updating_operation *loc = data;
+
+	finish_lu_accept(loc->conn);
+}
+
+static int finish_lu(struct gsm_subscriber_connection *conn)
+{
+	/* The LU has been given up in the meantime */
+	if (!conn->loc_operation)
+		return 0;
+
+	/* We're all good, subscr_update() stores the reserved TMSI */
+	if (conn->network->avoid_tmsi) {
+		conn->subscr->tmsi = GSM_RESERVED_TMSI;
+		subscr_cache_index(conn->subscr);
+		return finish_lu_accept(conn);
+	}
+
+	/* The accept carries the new TMSI, send it once it is stored */
+	if (db_async_alloc_tmsi(conn->subscr, finish_lu_tmsi_cb,
+				conn->loc_operation) < 0)
+		return finish_lu_accept(conn);
+	return 0;
+}
+
 static int _gsm0408_authorize_sec_cb(unsigned int hooknum, unsigned int event,
                                      struct msgb *msg, void *data, void *param)
 {
@@ -587,8 +630,9 @@ static int mm_rx_id_resp(struct gsm_subscriber_connection *conn, struct msgb *ms
 	case GSM_MI_TYPE_IMEISV:
 		/* update subscribe <-> IMEI mapping */
 		if (conn->subscr) {
-			db_subscriber_assoc_imei(conn->subscr, mi_string);
-			db_sync_equipment(&conn->subscr->equipment);
+			osmo_strlcpy(conn->subscr->equipment.imei, mi_string,
+				     sizeof(conn->subscr->equipment.imei));
+			db_async_assoc_imei(conn->subscr, mi_string, NULL, NULL);
 		}
 		if (conn->loc_operation)
 			conn->loc_operation->waiting_for_imei = 0;
@@ -1069,7 +1113,7 @@ static int gsm48_rx_mm_serv_req(struct gsm_subscriber_connection *conn, struct m
 
 	subscr->equipment.classmark2_len = classmark2_len;
 	memcpy(subscr->equipment.classmark2, classmark2, classmark2_len);
-	db_sync_equipment(&subscr->equipment);
+	db_async_sync_equipment(subscr, NULL, NULL);
 
 	/* we will send a MM message soon */
 	conn->expire_timer_stopped = 1;
@@ -1121,7 +1165,7 @@ static int gsm48_rx_mm_imsi_detach_ind(struct gsm_subscriber_connection *conn, s
 		DEBUGP(DMM, "Subscriber: %s\n", subscr_name(subscr));
 
 		subscr->equipment.classmark1 = idi->classmark1;
-		db_sync_equipment(&subscr->equipment);
+		db_async_sync_equipment(subscr, NULL, NULL);
 
 		subscr_put(subscr);
 	} else
@@ -1496,7 +1540,7 @@ static int gsm48_rx_rr_pag_resp(struct gsm_subscriber_connection *conn, struct m
 
 	subscr->equipment.classmark2_len = *classmark2_lv;
 	memcpy(subscr->equipment.classmark2, classmark2_lv+1, *classmark2_lv);
-	db_sync_equipment(&subscr->equipment);
+	db_async_sync_equipment(subscr, NULL, NULL);
 
 	/* TODO MSC split -- creating a BSC subscriber directly from MSC data
 	 * structures in RAM. At some point the MSC will send a message to the
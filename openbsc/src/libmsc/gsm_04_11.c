@@ -46,6 +46,7 @@
 #include <openbsc/debug.h>
 #include <openbsc/gsm_data.h>
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 #include <openbsc/gsm_subscriber.h>
 #include <openbsc/gsm_04_08.h>
 #include <openbsc/abis_rsl.h>
@@ -187,16 +188,62 @@ int gsm411_mn_send(struct gsm411_smr_inst *inst, int msg_type,
 	return gsm411_smc_send(&trans->sms.smc_inst, msg_type, msg);
 }
 
-static int gsm340_rx_sms_submit(struct gsm_sms *gsms)
+static void gsm340_sms_stored_cb(int rc, struct gsm_sms *gsms, void *data)
 {
-	if (db_sms_store(gsms) != 0) {
+	struct gsm_subscriber *subscr = data;
+	struct gsm_subscriber_connection *conn;
+	struct gsm_trans *trans;
+
+	if (rc != 0)
+		LOGP(DLSMS, LOGL_ERROR, "Failed to store SMS in Database\n");
+	else
+		/* dispatch a signal to tell higher level about it */
+		send_signal(S_SMS_SUBMITTED, NULL, gsms, 0);
+
+	/* Status reports are not acked */
+	if (!subscr)
+		return;
+
+	/* the RP-ACK was held back until the SMS has been stored */
+	conn = connection_for_subscr(subscr);
+	subscr_put(subscr);
+	if (!conn) {
+		LOGP(DLSMS, LOGL_ERROR, "No connection to subscriber anymore\n");
+		return;
+	}
+
+	trans = trans_find_by_id(conn, GSM48_PDISC_SMS,
+				 gsms->gsm411.transaction_id);
+	if (!trans) {
+		LOGP(DLSMS, LOGL_ERROR, "GSM transaction %u is gone\n",
+		     gsms->gsm411.transaction_id);
+		return;
+	}
+
+	if (rc != 0)
+		gsm411_send_rp_error(trans, gsms->gsm411.msg_ref,
+				     GSM411_RP_CAUSE_MO_NET_OUT_OF_ORDER);
+	else
+		gsm411_send_rp_ack(trans, gsms->gsm411.msg_ref);
+}
+
+/*
+ * The SMS is stored by the database thread and acked on the connection
+ * later on, it is freed afterwards.
+ */
+static int gsm340_rx_sms_submit(struct gsm_subscriber_connection *conn,
+				struct gsm_sms *gsms)
+{
+	struct gsm_subscriber *subscr = conn ? subscr_get(conn->subscr) : NULL;
+
+	if (db_async_sms_store(gsms, gsm340_sms_stored_cb, subscr) != 0) {
+		if (subscr)
+			subscr_put(subscr);
 		LOGP(DLSMS, LOGL_ERROR, "Failed to store SMS in Database\n");
 		return GSM411_RP_CAUSE_MO_NET_OUT_OF_ORDER;
 	}
-	/* dispatch a signal to tell higher level about it */
-	send_signal(S_SMS_SUBMITTED, NULL, gsms, 0);
 
-	return 0;
+	return -EINPROGRESS;
 }
 
 /* generate a TPDU address field compliant with 03.40 sec. 9.1.2.5 */
@@ -530,7 +577,10 @@ static int gsm340_rx_tpdu(struct gsm_trans *trans, struct msgb *msg,
 	switch (sms_mti) {
 	case GSM340_SMS_SUBMIT_MS2SC:
 		/* MS is submitting a SMS */
-		rc = gsm340_rx_sms_submit(gsms);
+		rc = gsm340_rx_sms_submit(conn, gsms);
+		/* The SMS belongs to the database request now */
+		if (rc == -EINPROGRESS)
+			return rc;
 		break;
 	case GSM340_SMS_COMMAND_MS2SC:
 	case GSM340_SMS_DELIVER_REP_MS2SC:
@@ -697,12 +747,14 @@ static void sms_status_report(struct gsm_sms *gsms,
 	}
 
 	/* No route via SMPP, send the GSM 03.40 status-report now. */
-	if (sms_report->receiver)
-		gsm340_rx_sms_submit(sms_report);
+	if (sms_report->receiver &&
+	    gsm340_rx_sms_submit(NULL, sms_report) == -EINPROGRESS)
+		sms_report = NULL;
 
 	LOGP(DLSMS, LOGL_NOTICE, "Status report has been sent\n");
 
-	sms_free(sms_report);
+	if (sms_report)
+		sms_free(sms_report);
 }
 
 /* Receive a 04.11 RP-ACK message (response to RP-DATA from us) */
@@ -38,12 +38,11 @@
 #include <openbsc/paging.h>
 #include <openbsc/signal.h>
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 #include <openbsc/chan_alloc.h>
 
 void *tall_sub_req_ctx;
 
-extern struct llist_head *subscr_bsc_active_subscribers(void);
-
 int gsm48_secure_channel(struct gsm_subscriber_connection *conn, int key_seq,
                          gsm_cbfn *cb, void *cb_data);
 
@@ -62,10 +61,27 @@ struct subscr_request {
 	void *param;
 };
 
+static void count_lookup(struct gsm_subscriber_group *sgrp, int ctr)
+{
+	if (sgrp->net && sgrp->net->msc_ctrs)
+		rate_ctr_inc(&sgrp->net->msc_ctrs->ctr[ctr]);
+}
+
+/* a subscriber found in RAM, NULL goes to the database */
+static struct gsm_subscriber *cache_hit(struct gsm_subscriber_group *sgrp,
+					struct gsm_subscriber *subscr)
+{
+	if (subscr)
+		count_lookup(sgrp, MSC_CTR_SUBSCR_CACHE_HIT);
+	return subscr;
+}
+
 static struct gsm_subscriber *get_subscriber(struct gsm_subscriber_group *sgrp,
 						int type, const char *ident)
 {
 	struct gsm_subscriber *subscr = db_get_subscriber(type, ident);
+
+	count_lookup(sgrp, MSC_CTR_SUBSCR_CACHE_MISS);
 	if (subscr)
 		subscr->group = sgrp;
 	return subscr;
@@ -244,10 +260,9 @@ struct gsm_subscriber *subscr_get_by_tmsi(struct gsm_subscriber_group *sgrp,
 	struct gsm_subscriber *subscr;
 
 	/* we might have a record in memory already */
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (tmsi == subscr->tmsi)
-			return subscr_get(subscr);
-	}
+	subscr = cache_hit(sgrp, subscr_cache_by_tmsi(NULL, tmsi));
+	if (subscr)
+		return subscr;
 
 	sprintf(tmsi_string, "%u", tmsi);
 	return get_subscriber(sgrp, GSM_SUBSCRIBER_TMSI, tmsi_string);
@@ -258,10 +273,9 @@ struct gsm_subscriber *subscr_get_by_imsi(struct gsm_subscriber_group *sgrp,
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->imsi, imsi) == 0)
-			return subscr_get(subscr);
-	}
+	subscr = cache_hit(sgrp, subscr_cache_by_imsi(NULL, imsi));
+	if (subscr)
+		return subscr;
 
 	return get_subscriber(sgrp, GSM_SUBSCRIBER_IMSI, imsi);
 }
@@ -271,10 +285,9 @@ struct gsm_subscriber *subscr_get_by_extension(struct gsm_subscriber_group *sgrp
 {
 	struct gsm_subscriber *subscr;
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (strcmp(subscr->extension, ext) == 0)
-			return subscr_get(subscr);
-	}
+	subscr = cache_hit(sgrp, subscr_cache_by_extension(NULL, ext));
+	if (subscr)
+		return subscr;
 
 	return get_subscriber(sgrp, GSM_SUBSCRIBER_EXTENSION, ext);
 }
@@ -286,18 +299,15 @@ struct gsm_subscriber *subscr_get_by_id(struct gsm_subscriber_group *sgrp,
 	char buf[32];
 	sprintf(buf, "%llu", id);
 
-	llist_for_each_entry(subscr, subscr_bsc_active_subscribers(), entry) {
-		if (subscr->id == id)
-			return subscr_get(subscr);
-	}
+	subscr = cache_hit(sgrp, subscr_cache_by_id(NULL, id));
+	if (subscr)
+		return subscr;
 
 	return get_subscriber(sgrp, GSM_SUBSCRIBER_ID, buf);
 }
 
 int subscr_update_expire_lu(struct gsm_subscriber *s, struct gsm_bts *bts)
 {
-	int rc;
-
 	if (!s) {
 		LOGP(DMM, LOGL_ERROR, "LU Expiration but NULL subscriber\n");
 		return -1;
@@ -321,9 +331,8 @@ int subscr_update_expire_lu(struct gsm_subscriber *s, struct gsm_bts *bts)
 		s->expire_lu = time(NULL) +
 			(bts->si_common.chan_desc.t3212 * 60 * 6 * 2) + 60;
 
-	rc = db_sync_subscriber(s);
-	db_subscriber_update(s);
-	return rc;
+	subscr_mark_dirty(s);
+	return 0;
 }
 
 int subscr_update(struct gsm_subscriber *s, struct gsm_bts *bts, int reason)
@@ -352,15 +361,14 @@ int subscr_update(struct gsm_subscriber *s, struct gsm_bts *bts, int reason)
 		if (bts->location_area_code == s->lac)
 			s->lac = GSM_LAC_RESERVED_DETACHED;
 		LOGP(DMM, LOGL_INFO, "Subscriber %s DETACHED\n", subscr_name(s));
-		rc = db_sync_subscriber(s);
-		db_subscriber_update(s);
+		subscr_mark_dirty(s);
+		rc = 0;
 		osmo_signal_dispatch(SS_SUBSCR, S_SUBSCR_DETACHED, s);
 		break;
 	default:
 		fprintf(stderr, "subscr_update with unknown reason: %d\n",
 			reason);
-		rc = db_sync_subscriber(s);
-		db_subscriber_update(s);
+		rc = db_async_sync_subscriber(s, NULL, NULL);
 		break;
 	};
 
@@ -372,11 +380,37 @@ void subscr_update_from_db(struct gsm_subscriber *sub)
 	db_subscriber_update(sub);
 }
 
-static void subscr_expire_callback(void *data, long long unsigned int id)
+/* the write_back of the subscriber group, through the journal */
+int subscr_write_back_db(struct gsm_subscriber *subscr)
 {
-	struct gsm_network *net = data;
-	struct gsm_subscriber *s = subscr_get_by_id(net->subscr_group, id);
-	struct gsm_subscriber_connection *conn = connection_for_subscr(s);
+	return db_async_journal_add(subscr);
+}
+
+/* the expired subscribers are detached this many at a time */
+#define SUBSCR_EXPIRE_CHUNK	1000
+
+static struct {
+	/* a chunk is being detached on the database thread */
+	int running;
+	/* the last chunk was full, there might be more */
+	int more;
+	/* the chunks go through the ids in order, starting after this */
+	unsigned long long cursor;
+} subscr_expiry;
+
+/*
+ * Only the subscribers in RAM are looked at, the state there is newer
+ * than the one in the database. Returns 1 to leave it attached.
+ */
+static int subscr_expire_keep(struct gsm_subscriber_group *sgrp,
+			      unsigned long long id)
+{
+	struct gsm_subscriber *s = subscr_cache_by_id(sgrp, id);
+	struct gsm_subscriber_connection *conn;
+	int keep = 0;
+
+	if (!s)
+		return 0;
 
 	/*
 	 * The subscriber is active and the phone stopped the timer. As
@@ -385,26 +419,88 @@ static void subscr_expire_callback(void *data, long long unsigned int id)
 	 * for expiration. This way on the next around another subscriber
 	 * will be selected.
 	 */
+	conn = connection_for_subscr(s);
 	if (conn && conn->expire_timer_stopped) {
 		LOGP(DMM, LOGL_DEBUG, "Not expiring subscriber %s (ID %llu)\n",
 			subscr_name(s), id);
 		subscr_update_expire_lu(s, conn->bts);
-		subscr_put(s);
-		return;
+		keep = 1;
+	} else if (s->lac != GSM_LAC_RESERVED_DETACHED &&
+		   (s->expire_lu == GSM_SUBSCRIBER_NO_EXPIRATION ||
+		    s->expire_lu > time(NULL))) {
+		/* updated since, the journal has not written it yet */
+		keep = 1;
+	} else {
+		LOGP(DMM, LOGL_NOTICE, "Expiring inactive subscriber %s (ID %llu)\n",
+			subscr_name(s), id);
+		s->lac = GSM_LAC_RESERVED_DETACHED;
 	}
 
+	subscr_put(s);
+	return keep;
+}
 
-	LOGP(DMM, LOGL_NOTICE, "Expiring inactive subscriber %s (ID %llu)\n",
-			subscr_name(s), id);
-	s->lac = GSM_LAC_RESERVED_DETACHED;
-	db_sync_subscriber(s);
+static void subscr_expire_done(int rc, void *data)
+{
+	struct gsm_subscriber_group *sgrp = data;
+	struct gsm_network *net = sgrp->net;
 
-	subscr_put(s);
+	subscr_expiry.running = 0;
+	if (rc <= 0)
+		return;
+
+	LOGP(DMM, LOGL_INFO, "Expired %d inactive subscribers.\n", rc);
+	rate_ctr_add(&net->msc_ctrs->ctr[MSC_CTR_SUBSCR_EXPIRED], rc);
+
+	/* go on with the next chunk instead of waiting for the interval */
+	if (subscr_expiry.more && osmo_timer_pending(&net->subscr_expire_timer))
+		osmo_timer_schedule(&net->subscr_expire_timer, 0, 0);
 }
 
+/*
+ * Detach a chunk of the subscribers whose location updating expired
+ * in a single transaction. Only the ones in RAM are looked up.
+ */
 void subscr_expire(struct gsm_subscriber_group *sgrp)
 {
-	db_subscriber_expire(sgrp->net, subscr_expire_callback);
+	unsigned long long *ids;
+	int i, num, detach = 0;
+
+	if (subscr_expiry.running)
+		return;
+
+	ids = talloc_array(tall_bsc_ctx, unsigned long long,
+			   SUBSCR_EXPIRE_CHUNK);
+	if (!ids)
+		return;
+
+	num = db_subscriber_expired(subscr_expiry.cursor, ids,
+				    SUBSCR_EXPIRE_CHUNK);
+	if (num < 0) {
+		talloc_free(ids);
+		return;
+	}
+
+	/*
+	 * Go on after this chunk next time, so the ones kept attached
+	 * can not hold back the others. Start over after a short one.
+	 */
+	subscr_expiry.more = num == SUBSCR_EXPIRE_CHUNK;
+	subscr_expiry.cursor = subscr_expiry.more ? ids[num - 1] : 0;
+
+	for (i = 0; i < num; i++) {
+		if (!subscr_expire_keep(sgrp, ids[i]))
+			ids[detach++] = ids[i];
+	}
+
+	if (detach <= 0) {
+		talloc_free(ids);
+		return;
+	}
+
+	subscr_expiry.running = 1;
+	if (db_async_detach(ids, detach, subscr_expire_done, sgrp) < 0)
+		subscr_expiry.running = 0;
 }
 
 struct gsm_subscriber_connection *connection_for_subscr(struct gsm_subscriber *subscr)
@@ -25,6 +25,7 @@
 #include <openbsc/debug.h>
 #include <openbsc/transaction.h>
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 
 #include <openbsc/gsm_04_11.h>
 
@@ -95,7 +96,7 @@ static void msc_classmark_chg(struct gsm_subscriber_connection *conn,
 			subscr->equipment.classmark3_len = cm3_len;
 			memcpy(subscr->equipment.classmark3, cm3, cm3_len);
 		}
-		db_sync_equipment(&subscr->equipment);
+		db_async_sync_equipment(subscr, NULL, NULL);
 	}
 }
 
@@ -28,6 +28,7 @@
 #include <openbsc/gsm_subscriber.h>
 #include <openbsc/chan_alloc.h>
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 
 #define TOKEN_SMS_TEXT "HAR 2009 GSM.  Register at http://har2009.gnumonks.org/ " \
 			"Your IMSI is %s, auth token is %08X, phone no is %s."
@@ -100,7 +101,7 @@ unauth:
 
 		/* make sure we don't allow him in again unless he clicks the web UI */
 		subscr->authorized = 0;
-		db_sync_subscriber(subscr);
+		db_async_sync_subscriber(subscr, NULL, NULL);
 		if (rc) {
 			struct gsm_subscriber_connection *conn = connection_for_subscr(subscr);
 			if (conn) {
@@ -42,6 +42,7 @@
 #include <osmocom/gsm/gsm_utils.h>
 #include <osmocom/core/utils.h>
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 #include <osmocom/core/talloc.h>
 #include <openbsc/signal.h>
 #include <openbsc/debug.h>
@@ -243,7 +244,7 @@ DEFUN(subscriber_create,
 
 	subscr = subscr_get_by_imsi(gsmnet->subscr_group, argv[0]);
 	if (subscr)
-		db_sync_subscriber(subscr);
+		db_async_sync_subscriber(subscr, NULL, NULL);
 	else {
 		subscr = subscr_create_subscriber(gsmnet->subscr_group, argv[0]);
 
@@ -595,6 +596,8 @@ DEFUN(ena_subscr_delete,
 	}
 
 	rc = db_subscriber_delete(subscr);
+	if (rc == 0)
+		subscr_cache_forget(subscr);
 	subscr_put(subscr);
 
 	if (rc != 0) {
@@ -621,7 +624,7 @@ DEFUN(ena_subscr_expire,
 	}
 
 	subscr->expire_lu = time(0);
-	db_sync_subscriber(subscr);
+	db_async_sync_subscriber(subscr, NULL, NULL);
 	subscr_put(subscr);
 
 	return CMD_SUCCESS;
@@ -645,7 +648,7 @@ DEFUN(ena_subscr_authorized,
 	}
 
 	subscr->authorized = atoi(argv[2]);
-	db_sync_subscriber(subscr);
+	db_async_sync_subscriber(subscr, NULL, NULL);
 
 	subscr_put(subscr);
 
@@ -685,7 +688,7 @@ DEFUN(ena_subscr_name,
 
 	osmo_strlcpy(subscr->name, name, sizeof(subscr->name));
 	talloc_free(name);
-	db_sync_subscriber(subscr);
+	db_async_sync_subscriber(subscr, NULL, NULL);
 
 	subscr_put(subscr);
 
@@ -717,7 +720,8 @@ DEFUN(ena_subscr_extension,
 	}
 
 	osmo_strlcpy(subscr->extension, ext, sizeof(subscr->extension));
-	db_sync_subscriber(subscr);
+	subscr_cache_index(subscr);
+	db_async_sync_subscriber(subscr, NULL, NULL);
 
 	subscr_put(subscr);
 
@@ -956,6 +960,21 @@ DEFUN(show_stats,
 		net->msc_ctrs->ctr[MSC_CTR_CALL_MT_SETUP].current,
 		net->msc_ctrs->ctr[MSC_CTR_CALL_MT_CONNECT].current,
 		VTY_NEWLINE);
+	vty_out(vty, "Subscriber Cache        : %lu hit, %lu miss, %lu evicted%s",
+		net->msc_ctrs->ctr[MSC_CTR_SUBSCR_CACHE_HIT].current,
+		net->msc_ctrs->ctr[MSC_CTR_SUBSCR_CACHE_MISS].current,
+		net->msc_ctrs->ctr[MSC_CTR_SUBSCR_CACHE_EVICTED].current,
+		VTY_NEWLINE);
+	vty_out(vty, "Subscribers Expired     : %lu%s",
+		net->msc_ctrs->ctr[MSC_CTR_SUBSCR_EXPIRED].current,
+		VTY_NEWLINE);
+	vty_out(vty, "Subscriber Journal      : %lu flushed, %lu written, "
+		"last %d in %d ms%s",
+		net->msc_ctrs->ctr[MSC_CTR_SUBSCR_JOURNAL_FLUSHED].current,
+		net->msc_ctrs->ctr[MSC_CTR_SUBSCR_JOURNAL_WRITTEN].current,
+		osmo_stat_item_get_last(net->msc_statg->items[MSC_STAT_SUBSCR_JOURNAL_BATCH]),
+		osmo_stat_item_get_last(net->msc_statg->items[MSC_STAT_SUBSCR_JOURNAL_LATENCY]),
+		VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
@@ -1230,6 +1249,26 @@ DEFUN(cfg_nitb_no_assign_tmsi, cfg_nitb_no_assign_tmsi_cmd,
 	return CMD_SUCCESS;
 }
 
+DEFUN(cfg_nitb_subscr_write_interval, cfg_nitb_subscr_write_interval_cmd,
+      "subscriber-write-interval <0-60000>",
+      "Time changed subscribers are collected before writing them.\n"
+      "Milliseconds, 0 to write each of them right away\n")
+{
+	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
+	gsmnet->subscr_write_interval = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
+DEFUN(cfg_nitb_subscr_write_batch, cfg_nitb_subscr_write_batch_cmd,
+      "subscriber-write-batch <1-100000>",
+      "Write the changed subscribers once this many are collected.\n"
+      "Number of subscribers\n")
+{
+	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
+	gsmnet->subscr_write_batch = atoi(argv[0]);
+	return CMD_SUCCESS;
+}
+
 static int config_write_nitb(struct vty *vty)
 {
 	struct gsm_network *gsmnet = gsmnet_from_vty(vty);
@@ -1248,6 +1287,10 @@ static int config_write_nitb(struct vty *vty)
 			VTY_NEWLINE);
 	vty_out(vty, " %sassign-tmsi%s",
 		gsmnet->avoid_tmsi ? "no " : "", VTY_NEWLINE);
+	vty_out(vty, " subscriber-write-interval %d%s",
+		gsmnet->subscr_write_interval, VTY_NEWLINE);
+	vty_out(vty, " subscriber-write-batch %d%s",
+		gsmnet->subscr_write_batch, VTY_NEWLINE);
 	return CMD_SUCCESS;
 }
 
@@ -1306,6 +1349,8 @@ int bsc_vty_init_extra(void)
 	install_element(NITB_NODE, &cfg_nitb_no_subscr_create_cmd);
 	install_element(NITB_NODE, &cfg_nitb_assign_tmsi_cmd);
 	install_element(NITB_NODE, &cfg_nitb_no_assign_tmsi_cmd);
+	install_element(NITB_NODE, &cfg_nitb_subscr_write_interval_cmd);
+	install_element(NITB_NODE, &cfg_nitb_subscr_write_batch_cmd);
 
 	return 0;
 }
@@ -295,6 +295,9 @@ int main(int argc, char **argv)
 	/* initialisation */
 	srand(time(NULL));
 
+	/* bind the RTP sockets ahead of the first CRCX */
+	mgcp_port_pools_init(cfg);
+
 	if (daemonize) {
 		rc = osmo_daemonize();
 		if (rc < 0) {
@@ -303,6 +306,17 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* threads do not survive the fork of osmo_daemonize() */
+	rc = mgcp_rtp_workers_start(cfg);
+	if (rc < 0)
+		return rc;
+
+#ifdef BUILD_MGCP_TRANSCODING
+	rc = mgcp_transcoding_pool_start(cfg);
+	if (rc < 0)
+		return rc;
+#endif
+
 	/* main loop */
 	while (1) {
 		osmo_select_main(0);
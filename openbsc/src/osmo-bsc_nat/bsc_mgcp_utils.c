@@ -50,6 +50,7 @@
 #include <openbsc/ipaccess.h>
 #include <openbsc/mgcp.h>
 #include <openbsc/mgcp_internal.h>
+#include <openbsc/mgcp_tokenizer.h>
 #include <openbsc/osmux.h>
 
 #include <osmocom/ctrl/control_cmd.h>
@@ -63,6 +64,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 
@@ -170,7 +172,7 @@ static uint16_t create_cic(int endpoint)
 
 int bsc_mgcp_assign_patch(struct nat_sccp_connection *con, struct msgb *msg)
 {
-	struct nat_sccp_connection *mcon;
+	struct nat_sccp_connection *mcon, *tmp;
 	struct tlv_parsed tp;
 	uint16_t cic;
 	uint8_t timeslot;
@@ -208,7 +210,9 @@ int bsc_mgcp_assign_patch(struct nat_sccp_connection *con, struct msgb *msg)
 	}
 
 	/* find stale connections using that endpoint */
-	llist_for_each_entry(mcon, &con->bsc->nat->sccp_connections, list_entry) {
+	llist_for_each_entry_safe(mcon, tmp,
+			&con->bsc->nat->sccp_by_msc_endp[endp & (NAT_SCCP_HASH_SIZE - 1)],
+			msc_endp_entry) {
 		if (mcon->msc_endp == endp) {
 			LOGP(DNAT, LOGL_ERROR,
 			     "Endpoint 0x%x was assigned to 0x%x and now 0x%x\n",
@@ -219,7 +223,7 @@ int bsc_mgcp_assign_patch(struct nat_sccp_connection *con, struct msgb *msg)
 		}
 	}
 
-	con->msc_endp = endp;
+	sccp_connection_set_msc_endp(con, endp);
 	if (bsc_init_endps_if_needed(con->bsc) != 0)
 		return -1;
 	if (bsc_assign_endpoint(con->bsc, con) != 0)
@@ -303,7 +307,7 @@ static void bsc_mgcp_send_dlcx(struct bsc_connection *bsc, int endpoint, int tra
 
 void bsc_mgcp_init(struct nat_sccp_connection *con)
 {
-	con->msc_endp = -1;
+	sccp_connection_set_msc_endp(con, -1);
 	con->bsc_endp = -1;
 }
 
@@ -466,8 +470,9 @@ static void handle_dlcx_response(struct bsc_connection *bsc, struct msgb *msg,
 			sccp_src_ref_to_int(&stat->src_ref),
 			sccp_src_ref_to_int(&stat->remote_ref));
 
-	/* send it and be done */
-	ctrl_cmd_send_to_all(bsc->nat->ctrl, cmd);
+	/* send it and be done, workers have no control interface */
+	if (bsc->nat->ctrl)
+		ctrl_cmd_send_to_all(bsc->nat->ctrl, cmd);
 	talloc_free(cmd);
 
 free_stat:
@@ -482,7 +487,9 @@ struct nat_sccp_connection *bsc_mgcp_find_con(struct bsc_nat *nat, int endpoint)
 	struct nat_sccp_connection *con = NULL;
 	struct nat_sccp_connection *sccp;
 
-	llist_for_each_entry(sccp, &nat->sccp_connections, list_entry) {
+	llist_for_each_entry(sccp,
+			&nat->sccp_by_msc_endp[endpoint & (NAT_SCCP_HASH_SIZE - 1)],
+			msc_endp_entry) {
 		if (sccp->msc_endp == -1)
 			continue;
 		if (sccp->msc_endp != endpoint)
@@ -823,19 +830,17 @@ uint32_t bsc_mgcp_extract_ci(const char *str)
 /**
  * Create a new MGCPCommand based on the input and endpoint from a message
  */
-static void patch_mgcp(struct msgb *output, const char *op, const char *tok,
-		       int endp, int len, int cr, int osmux_cid)
+static void patch_mgcp(struct msgb *output, const char *op,
+		       const struct mgcp_token *line, int endp, int cr,
+		       int osmux_cid)
 {
+	struct mgcp_token rest = *line, verb, trans;
 	int slen;
-	int ret;
-	char buf[40];
 	char osmux_extension[strlen("\nX-Osmux: 255") + 1];
 
-	buf[0] = buf[39] = '\0';
-	ret = sscanf(tok, "%*s %s", buf);
-	if (ret != 1) {
+	if (!mgcp_next_word(&rest, &verb) || !mgcp_next_word(&rest, &trans)) {
 		LOGP(DMGCP, LOGL_ERROR,
-			"Failed to find Endpoint in: %s\n", tok);
+			"Failed to find Endpoint in: %.*s\n", line->len, line->data);
 		return;
 	}
 
@@ -844,26 +849,42 @@ static void patch_mgcp(struct msgb *output, const char *op, const char *tok,
 	else
 		osmux_extension[0] = '\0';
 
-	slen = sprintf((char *) output->l3h, "%s %s %x@mgw MGCP 1.0%s%s",
-			op, buf, endp, osmux_extension, cr ? "\r\n" : "\n");
+	slen = sprintf((char *) output->l3h, "%s %.*s %x@mgw MGCP 1.0%s%s",
+			op, trans.len, trans.data, endp, osmux_extension,
+			cr ? "\r\n" : "\n");
 	output->l3h = msgb_put(output, slen);
 }
 
+/* parse "m=audio <port> RTP/AVP <payload>..." and find the payloads */
+static int parse_audio_line(const struct mgcp_token *raw, int *payload,
+			    struct mgcp_token *payloads)
+{
+	struct mgcp_token rest = *raw, word;
+
+	/* skip "m=audio" and the port */
+	if (!mgcp_next_word(&rest, &word) || !mgcp_next_word(&rest, &word))
+		return -1;
+	if (!mgcp_next_word(&rest, &word) || !mgcp_token_equal(&word, "RTP/AVP"))
+		return -1;
+	if (!mgcp_next_word(&rest, &word) || !isdigit(word.data[0]))
+		return -1;
+
+	payloads->data = word.data;
+	payloads->len = raw->data + raw->len - word.data;
+	*payload = strtoul(word.data, NULL, 10);
+	return 0;
+}
+
 /* we need to replace some strings... */
-struct msgb *bsc_mgcp_rewrite(char *input, int length, int endpoint,
+struct msgb *bsc_mgcp_rewrite(const char *input, int length, int endpoint,
 			      const char *ip, int port, int osmux_cid,
 			      int *first_payload_type, int ensure_mode_set)
 {
-	static const char crcx_str[] = "CRCX ";
-	static const char dlcx_str[] = "DLCX ";
-	static const char mdcx_str[] = "MDCX ";
-
 	static const char ip_str[] = "c=IN IP4 ";
-	static const char aud_str[] = "m=audio ";
-	static const char fmt_str[] = "a=fmtp:";
 
 	char buf[128];
-	char *running, *token;
+	struct mgcp_token rest, line, raw, payloads;
+	enum mgcp_eol eol;
 	struct msgb *output;
 
 	/* keep state to add the a=fmtp line */
@@ -882,20 +903,27 @@ struct msgb *bsc_mgcp_rewrite(char *input, int length, int endpoint,
 		return NULL;
 	}
 
-	running = input;
+	rest.data = input;
+	rest.len = strnlen(input, length);
 	output->l2h = output->data;
 	output->l3h = output->l2h;
-	for (token = strsep(&running, "\n"); running; token = strsep(&running, "\n")) {
-		int len = strlen(token);
-		cr = len > 0 && token[len - 1] == '\r';
-
-		if (strncmp(crcx_str, token, (sizeof crcx_str) - 1) == 0) {
-			patch_mgcp(output, "CRCX", token, endpoint, len, cr, osmux_cid);
-		} else if (strncmp(dlcx_str, token, (sizeof dlcx_str) - 1) == 0) {
-			patch_mgcp(output, "DLCX", token, endpoint, len, cr, -1);
-		} else if (strncmp(mdcx_str, token, (sizeof mdcx_str) - 1) == 0) {
-			patch_mgcp(output, "MDCX", token, endpoint, len, cr, -1);
-		} else if (strncmp(ip_str, token, (sizeof ip_str) - 1) == 0) {
+	while (mgcp_next_line(&rest, &line, &eol)) {
+		/* an unterminated last line is dropped */
+		if (eol == MGCP_EOL_NONE)
+			break;
+		cr = eol != MGCP_EOL_LF;
+
+		/* the line including its line ending */
+		raw.data = line.data;
+		raw.len = rest.data - line.data;
+
+		if (mgcp_token_prefix(&line, "CRCX ")) {
+			patch_mgcp(output, "CRCX", &line, endpoint, cr, osmux_cid);
+		} else if (mgcp_token_prefix(&line, "DLCX ")) {
+			patch_mgcp(output, "DLCX", &line, endpoint, cr, -1);
+		} else if (mgcp_token_prefix(&line, "MDCX ")) {
+			patch_mgcp(output, "MDCX", &line, endpoint, cr, -1);
+		} else if (mgcp_token_prefix(&line, ip_str)) {
 			output->l3h = msgb_put(output, strlen(ip_str));
 			memcpy(output->l3h, ip_str, strlen(ip_str));
 			output->l3h = msgb_put(output, strlen(ip));
@@ -909,28 +937,26 @@ struct msgb *bsc_mgcp_rewrite(char *input, int length, int endpoint,
 				output->l3h = msgb_put(output, 1);
 				output->l3h[0] = '\n';
 			}
-		} else if (strncmp(aud_str, token, (sizeof aud_str) - 1) == 0) {
-			int offset;
-			if (sscanf(token, "m=audio %*d RTP/AVP %n%d", &offset, &payload) != 1) {
+		} else if (mgcp_token_prefix(&line, "m=audio ")) {
+			if (parse_audio_line(&raw, &payload, &payloads) != 0) {
 				LOGP(DMGCP, LOGL_ERROR, "Could not parsed audio line.\n");
 				msgb_free(output);
 				return NULL;
 			}
 
-			snprintf(buf, sizeof(buf)-1, "m=audio %d RTP/AVP %s\n",
-				 port, &token[offset]);
+			snprintf(buf, sizeof(buf)-1, "m=audio %d RTP/AVP %.*s",
+				 port, payloads.len, payloads.data);
 			buf[sizeof(buf)-1] = '\0';
 
 			output->l3h = msgb_put(output, strlen(buf));
 			memcpy(output->l3h, buf, strlen(buf));
-		} else if (strncmp(fmt_str, token, (sizeof fmt_str) - 1) == 0) {
+		} else if (mgcp_token_prefix(&line, "a=fmtp:")) {
 			found_fmtp = 1;
 			goto copy;
 		} else {
 copy:
-			output->l3h = msgb_put(output, len + 1);
-			memcpy(output->l3h, token, len);
-			output->l3h[len] = '\n';
+			output->l3h = msgb_put(output, raw.len);
+			memcpy(output->l3h, raw.data, raw.len);
 		}
 	}
 
@@ -42,6 +42,7 @@
 #include <openbsc/debug.h>
 #include <openbsc/bsc_msc.h>
 #include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_mux.h>
 #include <openbsc/bsc_nat_sccp.h>
 #include <openbsc/bsc_msg_filter.h>
 #include <openbsc/ipaccess.h>
@@ -76,15 +77,15 @@
 
 #include "../../bscconfig.h"
 
-#define SCCP_CLOSE_TIME 20
-#define SCCP_CLOSE_TIME_TIMEOUT 19
+/* seconds a SCCP connection may stay unconfirmed */
+#define SCCP_CLOSE_TIME_TIMEOUT (19 * 60)
 
 static const char *config_file = "bsc-nat.cfg";
 static struct in_addr local_addr;
 static struct osmo_fd bsc_listen;
 static const char *msc_ip = NULL;
-static struct osmo_timer_list sccp_close;
 static int daemonize = 0;
+static int workers = 1;
 
 const char *openbsc_copyright =
 	"Copyright (C) 2010 Holger Hans Peter Freyther and On-Waves\r\n"
@@ -97,17 +98,6 @@ static void bsc_send_data(struct bsc_connection *bsc, const uint8_t *data, unsig
 static void msc_send_reset(struct bsc_msc_connection *con);
 static void bsc_stat_reject(int filter, struct bsc_connection *bsc, int normal);
 
-struct bsc_config *bsc_config_num(struct bsc_nat *nat, int num)
-{
-	struct bsc_config *conf;
-
-	llist_for_each_entry(conf, &nat->bsc_configs, entry)
-		if (conf->nr == num)
-			return conf;
-
-	return NULL;
-}
-
 static void queue_for_msc(struct bsc_msc_connection *con, struct msgb *msg)
 {
 	if (!con) {
@@ -539,7 +529,8 @@ static void bsc_send_con_refuse(struct bsc_connection *bsc,
 		con->filter_state.con_type = FLT_CON_TYPE_LOCAL_REJECT;
 		con->con_local = NAT_CON_END_LOCAL;
 		con->has_remote_ref = 1;
-		con->remote_ref = con->patched_ref;
+		nat_wheel_timer_del(nat->timers, &con->unconfirmed);
+		sccp_connection_set_remote_ref(con, &con->patched_ref);
 
 		/* 1. create a confirmation */
 		cc = sccp_create_cc(&con->remote_ref, &con->real_ref);
@@ -607,11 +598,16 @@ static void bsc_nat_send_paging(struct bsc_connection *bsc, struct msgb *msg)
 	bsc_send_data(bsc, msg->l2h, msgb_l2len(msg), IPAC_PROTO_SCCP);
 }
 
+static void send_paging_cb(struct bsc_connection *bsc, void *data)
+{
+	bsc_nat_send_paging(bsc, data);
+}
+
 static void bsc_nat_handle_paging(struct bsc_nat *nat, struct msgb *msg)
 {
 	struct bsc_connection *bsc;
 	const uint8_t *paging_start;
-	int paging_length, i, discrim;
+	int paging_length, discrim;
 
 	discrim = bsc_nat_find_paging(msg, &paging_start, &paging_length);
 	if (discrim < 0) {
@@ -633,26 +629,9 @@ static void bsc_nat_handle_paging(struct bsc_nat *nat, struct msgb *msg)
 		return;
 	}
 
-	/* This is quite expensive now */
-	for (i = 0; i < paging_length; i += 2) {
-		unsigned int _lac = ntohs(*(unsigned int *) &paging_start[i]);
-		unsigned int paged = 0;
-		llist_for_each_entry(bsc, &nat->bsc_connections, list_entry) {
-			if (!bsc->cfg)
-				continue;
-			if (!bsc->authenticated)
-				continue;
-			if (!bsc_config_handles_lac(bsc->cfg, _lac))
-				continue;
-			bsc_nat_send_paging(bsc, msg);
-			paged += 1;
-		}
-
-		/* highlight a possible config issue */
-		if (paged == 0)
-			LOGP(DNAT, LOGL_ERROR, "No BSC for LAC %d/0x%d\n", _lac, _lac);
-
-	}
+	/* Only the BSCs handling one of the LACs, each of them once */
+	bsc_nat_paging_fan_out(nat, paging_start, paging_length,
+			       send_paging_cb, msg);
 }
 
 
@@ -799,7 +778,7 @@ exit:
 	return 0;
 }
 
-static void msc_connection_was_lost(struct bsc_msc_connection *con)
+static void close_downstream(void)
 {
 	struct bsc_connection *bsc, *tmp;
 
@@ -808,12 +787,51 @@ static void msc_connection_was_lost(struct bsc_msc_connection *con)
 		bsc_close_connection(bsc);
 
 	bsc_mgcp_free_endpoints(nat);
+}
+
+static void msc_connection_was_lost(struct bsc_msc_connection *con)
+{
+	/* the BSCs are connected to the workers */
+	if (nat->mux)
+		bsc_nat_mux_msc_state(nat->mux, 0);
+	else
+		close_downstream();
+
 	bsc_msc_schedule_connect(con);
 }
 
 static void msc_connection_connected(struct bsc_msc_connection *con)
 {
 	osmo_counter_inc(nat->stats.msc.reconn);
+	if (nat->mux)
+		bsc_nat_mux_msc_state(nat->mux, 1);
+}
+
+static void worker_lost_mux(struct bsc_msc_connection *con)
+{
+	LOGP(DNAT, LOGL_FATAL, "Worker %d lost the MSC multiplexer, exiting.\n",
+	     nat->worker_nr);
+	exit(1);
+}
+
+/* the multiplexer tells the workers about the state of the MSC link */
+static void worker_handle_mux(struct bsc_msc_connection *msc_con, struct msgb *msg)
+{
+	if (msgb_l2len(msg) < 1)
+		return;
+
+	switch (msg->l2h[0]) {
+	case NAT_MUX_MSGT_MSC_UP:
+		msc_con->is_connected = 1;
+		break;
+	case NAT_MUX_MSGT_MSC_DOWN:
+		msc_con->is_connected = 0;
+		close_downstream();
+		break;
+	default:
+		ipa_ccm_rcvmsg_base(msg, &msc_con->write_queue.bfd);
+		break;
+	}
 }
 
 static void msc_send_reset(struct bsc_msc_connection *msc_con)
@@ -875,12 +893,16 @@ static int ipaccess_msc_read_cb(struct osmo_fd *bfd)
 	hh = (struct ipaccess_head *) msg->data;
 
 	/* initialize the networking. This includes sending a GSM08.08 message */
-	if (hh->proto == IPAC_PROTO_IPACCESS) {
+	if (hh->proto == IPAC_PROTO_IPACCESS && nat->worker_nr >= 0) {
+		worker_handle_mux(msc_con, msg);
+	} else if (hh->proto == IPAC_PROTO_IPACCESS) {
 		ipa_ccm_rcvmsg_base(msg, bfd);
 		if (msg->l2h[0] == IPAC_MSGT_ID_ACK)
 			initialize_msc_if_needed(msc_con);
 		else if (msg->l2h[0] == IPAC_MSGT_ID_GET)
 			send_id_get_response(msc_con);
+	} else if (nat->mux) {
+		bsc_nat_mux_route(nat->mux, msg);
 	} else if (hh->proto == IPAC_PROTO_SCCP) {
 		forward_sccp_to_bts(msc_con, msg);
 	} else if (hh->proto == IPAC_PROTO_MGCP_OLD) {
@@ -893,10 +915,14 @@ static int ipaccess_msc_read_cb(struct osmo_fd *bfd)
 
 static int ipaccess_msc_write_cb(struct osmo_fd *bfd, struct msgb *msg)
 {
+	unsigned int frames;
 	int rc;
-	rc = write(bfd->fd, msg->data, msg->len);
 
-	if (rc != msg->len) {
+	rc = bsc_nat_writev(bfd, msg, &frames);
+	rate_ctr_inc(&nat->stats.msc.ctrg->ctr[NAT_MSC_CTR_WRITE_CALLS]);
+	rate_ctr_add(&nat->stats.msc.ctrg->ctr[NAT_MSC_CTR_WRITE_FRAMES], frames);
+
+	if (rc < msg->len) {
 		LOGP(DNAT, LOGL_ERROR, "Failed to write MSG to MSC.\n");
 		return -1;
 	}
@@ -926,14 +952,14 @@ void bsc_close_connection(struct bsc_connection *connection)
 	osmo_timer_del(&connection->ping_timeout);
 	osmo_timer_del(&connection->pong_timeout);
 
+	/* no more paging for this BSC */
+	bsc_nat_paging_clear(connection);
+
 	if (connection->cfg)
 		ctr = &connection->cfg->stats.ctrg->ctr[BCFG_CTR_DROPPED_SCCP];
 
 	/* remove all SCCP connections */
-	llist_for_each_entry_safe(sccp_patch, tmp, &nat->sccp_connections, list_entry) {
-		if (sccp_patch->bsc != connection)
-			continue;
-
+	llist_for_each_entry_safe(sccp_patch, tmp, &connection->sccp_connections, bsc_entry) {
 		if (ctr)
 			rate_ctr_inc(ctr);
 		if (sccp_patch->has_remote_ref) {
@@ -975,14 +1001,12 @@ void bsc_close_connection(struct bsc_connection *connection)
 /* Returns true if bsc_close_connection() was called, false otherwise */
 static bool bsc_maybe_close(struct bsc_connection *bsc)
 {
-	struct nat_sccp_connection *sccp;
 	if (!bsc->nat->blocked)
 		return false;
 
 	/* are there any connections left */
-	llist_for_each_entry(sccp, &bsc->nat->sccp_connections, list_entry)
-		if (sccp->bsc == bsc)
-			return false;
+	if (bsc->sccp_count > 0)
+		return false;
 
 	/* nothing left, close the BSC */
 	LOGP(DNAT, LOGL_NOTICE, "Cleaning up BSC %d in blocking mode.\n",
@@ -991,6 +1015,23 @@ static bool bsc_maybe_close(struct bsc_connection *bsc)
 	return true;
 }
 
+/* the MSC never confirmed the connection, see SCCP_CLOSE_TIME_TIMEOUT */
+static void sccp_close_unconfirmed(void *data)
+{
+	struct nat_sccp_connection *conn = data;
+	struct bsc_connection *bsc = conn->bsc;
+
+	LOGP(DNAT, LOGL_ERROR,
+		"SCCP connection 0x%x/0x%x was never confirmed on bsc nr. %d\n",
+		sccp_src_ref_to_int(&conn->real_ref),
+		sccp_src_ref_to_int(&conn->patched_ref),
+		bsc->cfg->nr);
+	sccp_connection_destroy(conn);
+
+	/* now close out the BSC */
+	bsc_maybe_close(bsc);
+}
+
 static void ipaccess_close_bsc(void *data)
 {
 	struct sockaddr_in sock;
@@ -1041,6 +1082,7 @@ static int verify_key(struct bsc_connection *conn, struct bsc_config *conf, cons
 static bool ipaccess_auth_bsc(struct tlv_parsed *tvp, struct bsc_connection *bsc)
 {
 	struct bsc_config *conf;
+	struct timespec now;
 	const char *token = (const char *) TLVP_VAL(tvp, IPAC_IDTAG_UNITNAME);
 	int len = TLVP_LEN(tvp, IPAC_IDTAG_UNITNAME);
 	const uint8_t *xres = TLVP_VAL(tvp, 0x24);
@@ -1090,7 +1132,10 @@ static bool ipaccess_auth_bsc(struct tlv_parsed *tvp, struct bsc_connection *bsc
 	rate_ctr_inc(&conf->stats.ctrg->ctr[BCFG_CTR_NET_RECONN]);
 	bsc->authenticated = 1;
 	bsc->cfg = conf;
+	bsc_nat_paging_update(bsc);
 	osmo_timer_del(&bsc->id_timeout);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bsc_nat_stat_auth(bsc->nat, &bsc->accept_time, &now);
 	LOGP(DNAT, LOGL_NOTICE, "Authenticated bsc nr: %d on fd %d\n",
 		conf->nr, bsc->write_queue.bfd.fd);
 	start_ping_pong(bsc);
@@ -1170,8 +1215,15 @@ static int forward_sccp_to_msc(struct bsc_connection *bsc, struct msgb *msg, boo
 				goto exit2;
 			}
 
-			if (!create_sccp_src_ref(bsc, parsed))
+			con = create_sccp_src_ref(bsc, parsed);
+			if (!con)
 				goto exit2;
+			if (!con->has_remote_ref) {
+				nat_wheel_timer_setup(&con->unconfirmed,
+						      sccp_close_unconfirmed, con);
+				nat_wheel_timer_schedule(nat->timers, &con->unconfirmed,
+							 SCCP_CLOSE_TIME_TIMEOUT);
+			}
 			con = patch_sccp_src_ref_to_msc(msg, parsed, bsc);
 			OSMO_ASSERT(con);
 			con->msc_con = bsc->nat->msc_con;
@@ -1378,6 +1430,28 @@ close_fd:
 	return -EBADF;
 }
 
+static int ipaccess_bsc_write_cb(struct osmo_fd *bfd, struct msgb *msg)
+{
+	struct bsc_connection *bsc = bfd->data;
+	unsigned int frames;
+	int rc;
+
+	/* msg has already been taken off the queue */
+	if (bsc->write_queue.current_length + 1 > bsc->queue_peak)
+		bsc->queue_peak = bsc->write_queue.current_length + 1;
+
+	rc = bsc_nat_writev(bfd, msg, &frames);
+	if (bsc->cfg) {
+		rate_ctr_inc(&bsc->cfg->stats.ctrg->ctr[BCFG_CTR_WRITE_CALLS]);
+		rate_ctr_add(&bsc->cfg->stats.ctrg->ctr[BCFG_CTR_WRITE_FRAMES], frames);
+	}
+
+	if (rc < msg->len)
+		LOGP(DNAT, LOGL_ERROR, "Failed to write message to the BSC.\n");
+
+	return rc;
+}
+
 static int ipaccess_listen_bsc_cb(struct osmo_fd *bfd, unsigned int what)
 {
 	struct bsc_connection *bsc;
@@ -1434,7 +1508,7 @@ static int ipaccess_listen_bsc_cb(struct osmo_fd *bfd, unsigned int what)
 	bsc->write_queue.bfd.data = bsc;
 	bsc->write_queue.bfd.fd = fd;
 	bsc->write_queue.read_cb = ipaccess_bsc_read_cb;
-	bsc->write_queue.write_cb = bsc_write_cb;
+	bsc->write_queue.write_cb = ipaccess_bsc_write_cb;
 	bsc->write_queue.bfd.when = BSC_FD_READ;
 	if (osmo_fd_register(&bsc->write_queue.bfd) < 0) {
 		LOGP(DNAT, LOGL_ERROR, "Failed to register BSC fd.\n");
@@ -1448,6 +1522,7 @@ static int ipaccess_listen_bsc_cb(struct osmo_fd *bfd, unsigned int what)
 
 	llist_add(&bsc->list_entry, &nat->bsc_connections);
 	bsc->last_id = 0;
+	clock_gettime(CLOCK_MONOTONIC, &bsc->accept_time);
 
 	send_id_ack(bsc);
 	send_id_req(nat, bsc);
@@ -1478,6 +1553,7 @@ static void print_help()
 	printf("  -c --config-file filename The config file to use.\n");
 	printf("  -m --msc=IP. The address of the MSC.\n");
 	printf("  -l --local=IP. The local address of this BSC.\n");
+	printf("  -w --workers=N. Spread the BSCs over N processes.\n");
 }
 
 static void handle_options(int argc, char **argv)
@@ -1494,10 +1570,11 @@ static void handle_options(int argc, char **argv)
 			{"version", 0, 0, 'V' },
 			{"msc", 1, 0, 'm'},
 			{"local", 1, 0, 'l'},
+			{"workers", 1, 0, 'w'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "hd:sTVPc:m:l:D",
+		c = getopt_long(argc, argv, "hd:sTVPc:m:l:Dw:",
 				long_options, &option_index);
 		if (c == -1)
 			break;
@@ -1532,6 +1609,9 @@ static void handle_options(int argc, char **argv)
 		case 'l':
 			inet_aton(optarg, &local_addr);
 			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
 		default:
 			/* ignore */
 			break;
@@ -1553,42 +1633,6 @@ static void signal_handler(int signal)
 	}
 }
 
-static void sccp_close_unconfirmed(void *_data)
-{
-	int destroyed = 0;
-	struct bsc_connection *bsc, *bsc_tmp;
-	struct nat_sccp_connection *conn, *tmp1;
-	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
-
-	llist_for_each_entry_safe(conn, tmp1, &nat->sccp_connections, list_entry) {
-		if (conn->has_remote_ref)
-			continue;
-
-		int diff = (now.tv_sec - conn->creation_time.tv_sec) / 60;
-		if (diff < SCCP_CLOSE_TIME_TIMEOUT)
-			continue;
-
-		LOGP(DNAT, LOGL_ERROR,
-			"SCCP connection 0x%x/0x%x was never confirmed on bsc nr. %d\n",
-			sccp_src_ref_to_int(&conn->real_ref),
-			sccp_src_ref_to_int(&conn->patched_ref),
-			conn->bsc->cfg->nr);
-		sccp_connection_destroy(conn);
-		destroyed = 1;
-	}
-
-	if (!destroyed)
-		goto out;
-
-	/* now close out any BSC */
-	llist_for_each_entry_safe(bsc, bsc_tmp, &nat->bsc_connections, list_entry)
-		bsc_maybe_close(bsc);
-
-out:
-	osmo_timer_schedule(&sccp_close, SCCP_CLOSE_TIME, 0);
-}
-
 extern void *tall_ctr_ctx;
 static void talloc_init_ctx()
 {
@@ -1609,7 +1653,7 @@ static struct vty_app_info vty_info = {
 
 int main(int argc, char **argv)
 {
-	int rc;
+	int rc, mux_fd = -1;
 
 	talloc_init_ctx();
 
@@ -1656,8 +1700,35 @@ int main(int argc, char **argv)
 		return -3;
 	}
 
+	/* before the workers are forked, they stay children of the daemon */
+	if (daemonize) {
+		rc = osmo_daemonize();
+		if (rc < 0) {
+			perror("Error during daemonize");
+			exit(1);
+		}
+	}
+
+	/*
+	 * The workers are forked before anything is bound, only the
+	 * multiplexer has the VTY and the control interface.
+	 */
+	if (workers > 1) {
+		if (!nat->mgcp_ipa) {
+			fprintf(stderr, "The workers need use-msc-ipa-for-mgcp.\n");
+			return -6;
+		}
+
+		rc = bsc_nat_mux_fork(nat, workers, &mux_fd);
+		if (rc != 0) {
+			fprintf(stderr, "Failed to start %d workers.\n", workers);
+			exit(1);
+		}
+	}
+
 	/* start telnet after reading config for vty_get_bind_addr() */
-	if (telnet_init_dynif(tall_bsc_ctx, NULL, vty_get_bind_addr(),
+	if (nat->worker_nr < 0 &&
+	    telnet_init_dynif(tall_bsc_ctx, NULL, vty_get_bind_addr(),
 			      OSMO_VTY_PORT_BSC_NAT)) {
 		fprintf(stderr, "Creating VTY telnet line failed\n");
 		return -5;
@@ -1675,7 +1746,7 @@ int main(int argc, char **argv)
 	/*
 	 * Setup the MGCP code..
 	 */
-	if (bsc_mgcp_nat_init(nat) != 0)
+	if (!nat->mux && bsc_mgcp_nat_init(nat) != 0)
 		return -4;
 
 	/* connect to the MSC */
@@ -1687,11 +1758,13 @@ int main(int argc, char **argv)
 
 	/* start control interface after reading config for
 	 * ctrl_vty_get_bind_addr() */
-	nat->ctrl = bsc_nat_controlif_setup(nat, ctrl_vty_get_bind_addr(),
-					    OSMO_CTRL_PORT_BSC_NAT);
-	if (!nat->ctrl) {
-		fprintf(stderr, "Creating the control interface failed.\n");
-		exit(1);
+	if (nat->worker_nr < 0) {
+		nat->ctrl = bsc_nat_controlif_setup(nat, ctrl_vty_get_bind_addr(),
+						    OSMO_CTRL_PORT_BSC_NAT);
+		if (!nat->ctrl) {
+			fprintf(stderr, "Creating the control interface failed.\n");
+			exit(1);
+		}
 	}
 
 	nat->msc_con->name = "main MSC";
@@ -1700,38 +1773,46 @@ int main(int argc, char **argv)
 	nat->msc_con->write_queue.read_cb = ipaccess_msc_read_cb;
 	nat->msc_con->write_queue.write_cb = ipaccess_msc_write_cb;
 	nat->msc_con->write_queue.bfd.data = nat->msc_con;
-	bsc_msc_connect(nat->msc_con);
 
-	/* wait for the BSC */
-	rc = make_sock(&bsc_listen, IPPROTO_TCP, ntohl(local_addr.s_addr),
-		       5000, 0, ipaccess_listen_bsc_cb, nat);
+	/* a worker talks to the MSC through the multiplexer */
+	if (nat->worker_nr >= 0) {
+		nat->msc_con->connection_loss = worker_lost_mux;
+		nat->msc_con->write_queue.bfd.fd = mux_fd;
+		nat->msc_con->write_queue.bfd.when = BSC_FD_READ;
+		if (osmo_fd_register(&nat->msc_con->write_queue.bfd) != 0) {
+			fprintf(stderr, "Failed to register the multiplexer.\n");
+			exit(1);
+		}
+	} else
+		bsc_msc_connect(nat->msc_con);
+
+	/* wait for the BSC, the multiplexer does not talk to any */
+	rc = 0;
+	if (nat->worker_nr >= 0)
+		rc = bsc_nat_worker_listen(&bsc_listen, local_addr, 5000,
+					   ipaccess_listen_bsc_cb, nat);
+	else if (!nat->mux)
+		rc = make_sock(&bsc_listen, IPPROTO_TCP, ntohl(local_addr.s_addr),
+			       5000, 0, ipaccess_listen_bsc_cb, nat);
 	if (rc != 0) {
 		fprintf(stderr, "Failed to listen for BSC.\n");
 		exit(1);
 	}
 
-	rc = bsc_ussd_init(nat);
-	if (rc != 0) {
-		LOGP(DNAT, LOGL_ERROR, "Failed to bind the USSD socket.\n");
-		exit(1);
+	/* the USSD side-channel is only served by the first worker */
+	if (nat->worker_nr <= 0 && !nat->mux) {
+		rc = bsc_ussd_init(nat);
+		if (rc != 0) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to bind the USSD socket.\n");
+			exit(1);
+		}
 	}
 
 	signal(SIGABRT, &signal_handler);
 	signal(SIGUSR1, &signal_handler);
 	osmo_init_ignore_signals();
 
-	if (daemonize) {
-		rc = osmo_daemonize();
-		if (rc < 0) {
-			perror("Error during daemonize");
-			exit(1);
-		}
-	}
-
-	/* recycle timer */
 	sccp_set_log_area(DSCCP);
-	osmo_timer_setup(&sccp_close, sccp_close_unconfirmed, NULL);
-	osmo_timer_schedule(&sccp_close, SCCP_CLOSE_TIME, 0);
 
 	while (1) {
 		osmo_select_main(0);
@@ -29,6 +29,7 @@
 
 #include <openbsc/ctrl.h>
 #include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_sccp.h>
 #include <openbsc/bsc_msg_filter.h>
 #include <openbsc/vty.h>
 #include <openbsc/gsm_data.h>
@@ -79,7 +80,7 @@ static int get_next_free_bsc_id(struct bsc_connection *bsc)
 void bsc_nat_ctrl_del_pending(struct bsc_cmd_list *pending)
 {
 	llist_del(&pending->list_entry);
-	osmo_timer_del(&pending->timeout);
+	nat_wheel_timer_del(g_nat->timers, &pending->timeout);
 	talloc_free(pending);
 }
 
@@ -136,7 +137,8 @@ int bsc_nat_handle_ctrlif_msg(struct bsc_connection *bsc, struct msgb *msg)
 
 		/* We have to handle TRAPs before matching pending */
 		if (cmd->type == CTRL_TYPE_TRAP) {
-			ctrl_cmd_send_to_all(bsc->nat->ctrl, cmd);
+			if (bsc->nat->ctrl)
+				ctrl_cmd_send_to_all(bsc->nat->ctrl, cmd);
 			talloc_free(cmd);
 			return 0;
 		}
@@ -291,10 +293,10 @@ static int forward_to_bsc(struct ctrl_cmd *cmd)
 		pending->cmd->ccon = cmd->ccon;
 
 		/* Setup the timeout */
-		osmo_timer_setup(&pending->timeout, pending_timeout_cb,
-				 pending);
+		nat_wheel_timer_setup(&pending->timeout, pending_timeout_cb,
+				      pending);
 		/* TODO: Make timeout configurable */
-		osmo_timer_schedule(&pending->timeout, 10, 0);
+		nat_wheel_timer_schedule(g_nat->timers, &pending->timeout, 10);
 		llist_add_tail(&pending->list_entry, &bsc->cmd_pending);
 
 		goto done;
@@ -440,6 +442,7 @@ static int set_net_cfg_acc_cmd(struct ctrl_cmd *cmd, void *data)
 		cmd->reply = "Failed to compile expression";
 		return CTRL_CMD_ERROR;
 	}
+	bsc_msg_acc_lst_changed(acc);
 
 	cmd->reply = "IMSI allow added to access list";
 	return CTRL_CMD_REPLY;
@@ -472,6 +475,42 @@ static int set_net_save_cmd(struct ctrl_cmd *cmd, void *data)
 	return CTRL_CMD_REPLY;
 }
 
+CTRL_CMD_DEFINE_RO(net_sccp_refs, "net 0 sccp-references");
+
+/* used,free,peak of the local references handed out to the MSC */
+static int get_net_sccp_refs(struct ctrl_cmd *cmd, void *data)
+{
+	struct nat_sccp_ref_pool *pool = g_nat->sccp_refs;
+
+	cmd->reply = talloc_asprintf(cmd, "%u,%u,%u", pool->num_used,
+				     pool->usable - pool->num_used,
+				     pool->peak_used);
+	if (!cmd->reply) {
+		cmd->reply = "OOM";
+		return CTRL_CMD_ERROR;
+	}
+
+	return CTRL_CMD_REPLY;
+}
+
+CTRL_CMD_DEFINE_RO(net_bsc_auth_latency, "net 0 bsc-auth-latency");
+
+/* count,avg,max in microseconds from accept() to the authentication */
+static int get_net_bsc_auth_latency(struct ctrl_cmd *cmd, void *data)
+{
+	unsigned long count = g_nat->stats.bsc.auth_count;
+
+	cmd->reply = talloc_asprintf(cmd, "%lu,%llu,%lu", count,
+				     count ? g_nat->stats.bsc.auth_total_us / count : 0,
+				     g_nat->stats.bsc.auth_max_us);
+	if (!cmd->reply) {
+		cmd->reply = "OOM";
+		return CTRL_CMD_ERROR;
+	}
+
+	return CTRL_CMD_REPLY;
+}
+
 struct ctrl_handle *bsc_nat_controlif_setup(struct bsc_nat *nat,
 					    const char *bind_addr, int port)
 {
@@ -505,6 +544,16 @@ struct ctrl_handle *bsc_nat_controlif_setup(struct bsc_nat *nat,
 		fprintf(stderr, "Failed to install the net save command. Exiting.\n");
 		goto error;
 	}
+	rc = ctrl_cmd_install(CTRL_NODE_ROOT, &cmd_net_sccp_refs);
+	if (rc) {
+		fprintf(stderr, "Failed to install the net sccp references command. Exiting.\n");
+		goto error;
+	}
+	rc = ctrl_cmd_install(CTRL_NODE_ROOT, &cmd_net_bsc_auth_latency);
+	if (rc) {
+		fprintf(stderr, "Failed to install the net bsc auth latency command. Exiting.\n");
+		goto error;
+	}
 
 	g_nat = nat;
 	return ctrl;
@@ -531,6 +580,7 @@ void bsc_nat_inform_reject(struct bsc_connection *conn, const char *imsi)
 					conn->cfg->nr);
 	cmd->reply = talloc_asprintf(cmd, "imsi=%s", imsi);
 
-	ctrl_cmd_send_to_all(conn->cfg->nat->ctrl, cmd);
+	if (conn->cfg->nat->ctrl)
+		ctrl_cmd_send_to_all(conn->cfg->nat->ctrl, cmd);
 	talloc_free(cmd);
 }
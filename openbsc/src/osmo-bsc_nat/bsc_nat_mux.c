@@ -0,0 +1,434 @@
+/* Share the MSC link between the worker processes of the NAT */
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/bsc_msc.h>
+#include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_mux.h>
+#include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/debug.h>
+#include <openbsc/ipaccess.h>
+#include <openbsc/mgcp.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/gsm/gsm0808.h>
+#include <osmocom/gsm/tlv.h>
+#include <osmocom/gsm/protocol/gsm_08_08.h>
+#include <osmocom/sccp/sccp.h>
+#include <osmocom/abis/ipa.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* not known to older C libraries */
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT	15
+#endif
+
+static int mux_worker_read_cb(struct osmo_fd *bfd)
+{
+	struct nat_mux_worker *worker = bfd->data;
+	struct bsc_msc_connection *msc_con = worker->mux->nat->msc_con;
+	struct msgb *msg = NULL;
+	int ret;
+
+	ret = ipa_msg_recv_buffered(bfd->fd, &msg, &worker->pending_msg);
+	if (ret <= 0) {
+		if (ret == -EAGAIN)
+			return 0;
+		LOGP(DNAT, LOGL_FATAL, "Lost worker %d (pid %d), exiting.\n",
+		     worker->nr, (int) worker->pid);
+		exit(1);
+	}
+
+	/* the frames are complete, they go to the MSC as they are */
+	if (!msc_con->is_connected) {
+		LOGP(DNAT, LOGL_DEBUG, "MSC not connected, dropping msg of worker %d.\n",
+		     worker->nr);
+		msgb_free(msg);
+		return 0;
+	}
+
+	if (osmo_wqueue_enqueue(&msc_con->write_queue, msg) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to enqueue msg of worker %d.\n",
+		     worker->nr);
+		msgb_free(msg);
+	}
+
+	return 0;
+}
+
+static int mux_worker_write_cb(struct osmo_fd *bfd, struct msgb *msg)
+{
+	struct nat_mux_worker *worker = bfd->data;
+	unsigned int frames;
+	int rc;
+
+	rc = bsc_nat_writev(bfd, msg, &frames);
+	if (rc < msg->len)
+		LOGP(DNAT, LOGL_ERROR, "Failed to write msg to worker %d.\n",
+		     worker->nr);
+
+	return rc;
+}
+
+static void mux_send(struct nat_mux_worker *worker, struct msgb *msg)
+{
+	struct msgb *copy;
+
+	copy = msgb_alloc(msg->len, "nat mux");
+	if (!copy) {
+		LOGP(DNAT, LOGL_ERROR, "Allocation failed, not forwarding.\n");
+		return;
+	}
+
+	memcpy(msgb_put(copy, msg->len), msg->data, msg->len);
+	if (osmo_wqueue_enqueue(&worker->queue, copy) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to enqueue msg for worker %d.\n",
+		     worker->nr);
+		msgb_free(copy);
+	}
+}
+
+static int mux_worker_init(struct bsc_nat_mux *mux, int nr, int fd)
+{
+	struct nat_mux_worker *worker = &mux->workers[nr];
+
+	worker->mux = mux;
+	worker->nr = nr;
+
+	osmo_wqueue_init(&worker->queue, NAT_MUX_QUEUE_LEN);
+	worker->queue.bfd.fd = fd;
+	worker->queue.bfd.data = worker;
+	worker->queue.bfd.when = BSC_FD_READ;
+	worker->queue.read_cb = mux_worker_read_cb;
+	worker->queue.write_cb = mux_worker_write_cb;
+	return osmo_fd_register(&worker->queue.bfd);
+}
+
+/*
+ * Undo a failed bsc_nat_mux_fork(): stop and reap the workers that
+ * were started, close the ends of the socketpairs still open here and
+ * free the mux. None of the fds may be registered anymore.
+ */
+static void mux_fork_failed(struct bsc_nat_mux *mux, int started,
+			    int fds[][2], int workers)
+{
+	int i;
+
+	for (i = 0; i < started; ++i)
+		kill(mux->workers[i].pid, SIGTERM);
+	for (i = 0; i < started; ++i)
+		waitpid(mux->workers[i].pid, NULL, 0);
+
+	for (i = 0; i < workers; ++i) {
+		close(fds[i][0]);
+		if (i >= started)
+			close(fds[i][1]);
+	}
+
+	talloc_free(mux);
+}
+
+/**
+ * Fork the workers. In a worker nat->worker_nr is set, its SCCP
+ * references are restricted to its part and fd is its end of the
+ * socketpair to the multiplexer. In the process that called this
+ * nat->mux is set and fd is -1.
+ */
+int bsc_nat_mux_fork(struct bsc_nat *nat, int workers, int *fd)
+{
+	struct bsc_nat_mux *mux;
+	int fds[NAT_MUX_MAX_WORKERS][2];
+	int i, j;
+	pid_t pid;
+
+	if (workers < 2 || workers > NAT_MUX_MAX_WORKERS)
+		return -EINVAL;
+
+	mux = talloc_zero(nat, struct bsc_nat_mux);
+	if (!mux)
+		return -ENOMEM;
+
+	mux->nat = nat;
+	mux->num_workers = workers;
+	mux->num_endp = nat->mgcp_cfg->trunk.number_endpoints;
+	mux->endp_owner = talloc_zero_array(mux, uint8_t, mux->num_endp);
+	if (!mux->endp_owner) {
+		talloc_free(mux);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < workers; ++i) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) != 0) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to create the socketpair: %s\n",
+			     strerror(errno));
+			while (--i >= 0) {
+				close(fds[i][0]);
+				close(fds[i][1]);
+			}
+			talloc_free(mux);
+			return -EIO;
+		}
+		fcntl(fds[i][0], F_SETFL, O_NONBLOCK);
+		fcntl(fds[i][1], F_SETFL, O_NONBLOCK);
+	}
+
+	for (i = 0; i < workers; ++i) {
+		pid = fork();
+		if (pid < 0) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to fork worker %d: %s\n",
+			     i, strerror(errno));
+			mux_fork_failed(mux, i, fds, workers);
+			return -EIO;
+		}
+
+		if (pid == 0) {
+			for (j = 0; j < workers; ++j) {
+				close(fds[j][0]);
+				if (j != i)
+					close(fds[j][1]);
+			}
+			talloc_free(mux);
+
+			nat->num_workers = workers;
+			nat->worker_nr = i;
+			nat_sccp_ref_pool_restrict(nat->sccp_refs, i, workers);
+			*fd = fds[i][1];
+			return 0;
+		}
+
+		mux->workers[i].pid = pid;
+		close(fds[i][1]);
+	}
+
+	for (i = 0; i < workers; ++i) {
+		if (mux_worker_init(mux, i, fds[i][0]) != 0) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to register worker %d.\n", i);
+			while (--i >= 0)
+				osmo_fd_unregister(&mux->workers[i].queue.bfd);
+			mux_fork_failed(mux, workers, fds, workers);
+			return -EIO;
+		}
+	}
+
+	nat->num_workers = workers;
+	nat->mux = mux;
+	*fd = -1;
+	return 0;
+}
+
+/* remember which worker handles the endpoint of an assignment */
+static void mux_learn_endp(struct bsc_nat_mux *mux, struct msgb *msg, int nr)
+{
+	struct tlv_parsed tp;
+	uint16_t cic;
+	int endp;
+
+	if (!msg->l3h || msgb_l3len(msg) < 3)
+		return;
+
+	tlv_parse(&tp, gsm0808_att_tlvdef(), msg->l3h + 3, msgb_l3len(msg) - 3, 0, 0);
+	if (!TLVP_PRESENT(&tp, GSM0808_IE_CIRCUIT_IDENTITY_CODE))
+		return;
+
+	cic = ntohs(tlvp_val16_unal(&tp, GSM0808_IE_CIRCUIT_IDENTITY_CODE));
+	endp = mgcp_timeslot_to_endpoint((cic & ~0x1f) >> 5, cic & 0x1f);
+	if (endp < mux->num_endp)
+		mux->endp_owner[endp] = nr;
+}
+
+/* the endpoint number of a MGCP command, -1 for anything else */
+int bsc_nat_mux_mgcp_endp(const uint8_t *data, int len)
+{
+	int i, fields = 0, endp = 0, digits = 0;
+
+	/* verb, transaction id, endpoint */
+	for (i = 0; i < len && fields < 2; ++i) {
+		if (data[i] == '\r' || data[i] == '\n')
+			return -1;
+		if (data[i] == ' ')
+			fields += 1;
+	}
+
+	for (; i < len && data[i] != '@'; ++i) {
+		if (!isxdigit(data[i]) || ++digits > 6)
+			return -1;
+		endp = endp * 16 + (isdigit(data[i]) ? data[i] - '0'
+					: tolower(data[i]) - 'a' + 10);
+	}
+
+	if (i == len || digits == 0)
+		return -1;
+	return endp;
+}
+
+/**
+ * The worker for a frame of the MSC, -1 when it goes to all of them.
+ * Connection oriented messages carry the reference handed out by a
+ * worker, connectionless ones are for the BSCs of all workers. The
+ * MGCP of the call agent goes to the worker the endpoint was assigned
+ * on, anything else to the first worker.
+ */
+int bsc_nat_mux_worker_for(struct bsc_nat_mux *mux, struct msgb *msg,
+			   struct bsc_nat_parsed *parsed)
+{
+	int nr, endp;
+
+	if (parsed->ipa_proto == IPAC_PROTO_MGCP_OLD) {
+		endp = bsc_nat_mux_mgcp_endp(msg->l2h, msgb_l2len(msg));
+		if (endp > 0 && endp < mux->num_endp)
+			return mux->endp_owner[endp];
+		return 0;
+	}
+
+	if (parsed->ipa_proto != IPAC_PROTO_SCCP)
+		return 0;
+
+	switch (parsed->sccp_type) {
+	case SCCP_MSG_TYPE_UDT:
+		return -1;
+	case SCCP_MSG_TYPE_CC:
+	case SCCP_MSG_TYPE_CREF:
+	case SCCP_MSG_TYPE_DT1:
+	case SCCP_MSG_TYPE_IT:
+	case SCCP_MSG_TYPE_RLSD:
+	case SCCP_MSG_TYPE_RLC:
+		break;
+	default:
+		return 0;
+	}
+
+	if (!parsed->dest_local_ref)
+		return 0;
+
+	nr = nat_sccp_ref_part(sccp_src_ref_to_int(parsed->dest_local_ref),
+			       mux->num_workers);
+	if (parsed->gsm_type == BSS_MAP_MSG_ASSIGMENT_RQST)
+		mux_learn_endp(mux, msg, nr);
+	return nr;
+}
+
+void bsc_nat_mux_route(struct bsc_nat_mux *mux, struct msgb *msg)
+{
+	struct bsc_nat_parsed *parsed;
+	int i, nr;
+
+	parsed = bsc_nat_parse(msg);
+	if (!parsed) {
+		LOGP(DNAT, LOGL_ERROR, "Can not parse msg from MSC.\n");
+		return;
+	}
+
+	nr = bsc_nat_mux_worker_for(mux, msg, parsed);
+	talloc_free(parsed);
+
+	if (nr >= 0) {
+		mux_send(&mux->workers[nr], msg);
+		return;
+	}
+
+	for (i = 0; i < mux->num_workers; ++i)
+		mux_send(&mux->workers[i], msg);
+}
+
+/* the workers only accept BSCs while the MSC is connected */
+void bsc_nat_mux_msc_state(struct bsc_nat_mux *mux, int connected)
+{
+	struct msgb *msg;
+	int i;
+
+	for (i = 0; i < mux->num_workers; ++i) {
+		msg = msgb_alloc_headroom(32, 8, "nat mux state");
+		if (!msg) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to allocate the MSC state.\n");
+			continue;
+		}
+
+		msg->l2h = msgb_put(msg, 1);
+		msg->l2h[0] = connected ? NAT_MUX_MSGT_MSC_UP : NAT_MUX_MSGT_MSC_DOWN;
+		ipa_prepend_header(msg, IPAC_PROTO_IPACCESS);
+
+		if (osmo_wqueue_enqueue(&mux->workers[i].queue, msg) != 0) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to enqueue the MSC state.\n");
+			msgb_free(msg);
+		}
+	}
+}
+
+/**
+ * Listen for the BSCs on a port shared with the other workers, the
+ * kernel spreads the new connections over them.
+ */
+int bsc_nat_worker_listen(struct osmo_fd *bfd, struct in_addr addr, int port,
+			  int (*cb)(struct osmo_fd *fd, unsigned int what),
+			  void *data)
+{
+	struct sockaddr_in sin;
+	int on = 1;
+
+	bfd->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (bfd->fd < 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to create the BSC socket.\n");
+		return -EIO;
+	}
+
+	bfd->cb = cb;
+	bfd->data = data;
+	bfd->when = BSC_FD_READ;
+
+	setsockopt(bfd->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (setsockopt(bfd->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to set SO_REUSEPORT: %s\n",
+		     strerror(errno));
+		goto error;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr = addr;
+
+	if (bind(bfd->fd, (struct sockaddr *) &sin, sizeof(sin)) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to bind the BSC socket: %s\n",
+		     strerror(errno));
+		goto error;
+	}
+
+	if (listen(bfd->fd, 10) != 0 || osmo_fd_register(bfd) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to listen for the BSCs.\n");
+		goto error;
+	}
+
+	return 0;
+
+error:
+	close(bfd->fd);
+	bfd->fd = -1;
+	return -EIO;
+}
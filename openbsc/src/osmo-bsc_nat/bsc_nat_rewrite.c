@@ -43,7 +43,7 @@
 static char *trie_lookup(struct nat_rewrite *trie, const char *number,
 			regoff_t off, void *ctx)
 {
-	struct nat_rewrite_rule *rule;
+	const struct nat_rewrite_rule *rule;
 
 	if (!trie) {
 		LOGP(DCC, LOGL_ERROR,
@@ -65,31 +65,22 @@ static char *match_and_rewrite_number(void *ctx, const char *number,
 				const char *imsi, struct llist_head *list,
 				struct nat_rewrite *trie)
 {
-	struct bsc_nat_num_rewr_entry *entry;
+	struct bsc_nat_num_rewr_entry *entry = NULL;
 	char *new_number = NULL;
+	int off;
 
 	/* need to find a replacement and then fix it */
-	llist_for_each_entry(entry, list, list) {
-		regmatch_t matches[2];
-
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
-
-		/* this regexp matches... */
-		if (regexec(&entry->num_reg, number, 2, matches, 0) == 0
-			&& matches[1].rm_eo != -1) {
-			if (entry->is_prefix_lookup)
-				new_number = trie_lookup(trie, number,
-						matches[1].rm_so, ctx);
-			else
-				new_number = talloc_asprintf(ctx, "%s%s",
-					entry->replace,
-					&number[matches[1].rm_so]);
-		}
+	while ((entry = bsc_nat_num_rewr_find(list, entry, imsi, number, &off))) {
+		if (entry->is_prefix_lookup)
+			new_number = trie_lookup(trie, number, off, ctx);
+		else
+			new_number = talloc_asprintf(ctx, "%s%s",
+					entry->replace, &number[off]);
 
-		if (new_number)
+		if (new_number) {
+			entry->hits += 1;
 			break;
+		}
 	}
 
 	return new_number;
@@ -258,40 +249,25 @@ static char *find_new_smsc(struct bsc_nat *nat, void *ctx, const char *imsi,
 	struct bsc_nat_num_rewr_entry *entry;
 	char *new_number = NULL;
 	uint8_t dest_match = llist_empty(&nat->tpdest_match);
+	int off;
 
 	/* We will find a new number now */
-	llist_for_each_entry(entry, &nat->smsc_rewr, list) {
-		regmatch_t matches[2];
-
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
-
-		/* this regexp matches... */
-		if (regexec(&entry->num_reg, smsc_addr, 2, matches, 0) == 0 &&
-		    matches[1].rm_eo != -1)
-			new_number = talloc_asprintf(ctx, "%s%s",
-					entry->replace,
-					&smsc_addr[matches[1].rm_so]);
-		if (new_number)
-			break;
-	}
+	entry = bsc_nat_num_rewr_find(&nat->smsc_rewr, NULL, imsi, smsc_addr, &off);
+	if (!entry)
+		return NULL;
 
+	new_number = talloc_asprintf(ctx, "%s%s", entry->replace, &smsc_addr[off]);
 	if (!new_number)
 		return NULL;
+	entry->hits += 1;
 
 	/*
 	 * now match the number against another list
 	 */
-	llist_for_each_entry(entry, &nat->tpdest_match, list) {
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
-
-		if (regexec(&entry->num_reg, dest_nr, 0, NULL, 0) == 0) {
-			dest_match = 1;
-			break;
-		}
+	entry = bsc_nat_num_rewr_find(&nat->tpdest_match, NULL, imsi, dest_nr, NULL);
+	if (entry) {
+		entry->hits += 1;
+		dest_match = 1;
 	}
 
 	if (!dest_match) {
@@ -310,19 +286,13 @@ static uint8_t sms_new_tpdu_hdr(struct bsc_nat *nat, const char *imsi,
 {
 	struct bsc_nat_num_rewr_entry *entry;
 
-	/* We will find a new number now */
-	llist_for_each_entry(entry, &nat->sms_clear_tp_srr, list) {
-		/* check the IMSI match */
-		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
-			continue;
-		if (regexec(&entry->num_reg, dest_nr, 0, NULL, 0) != 0)
-			continue;
-
-		/* matched phone number and imsi */
-		return hdr & ~0x20;
-	}
+	/* matched phone number and imsi */
+	entry = bsc_nat_num_rewr_find(&nat->sms_clear_tp_srr, NULL, imsi, dest_nr, NULL);
+	if (!entry)
+		return hdr;
 
-	return hdr;
+	entry->hits += 1;
+	return hdr & ~0x20;
 }
 
 /**
@@ -635,9 +605,14 @@ void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
 				  const struct osmo_config_list *list)
 {
 	struct bsc_nat_num_rewr_entry *entry, *tmp;
+	struct bsc_nat_num_rewr_match *match;
 	struct osmo_config_entry *cfg_entry;
 
 	/* free the old data */
+	if (!llist_empty(head)) {
+		entry = llist_first_entry(head, struct bsc_nat_num_rewr_entry, list);
+		talloc_free(entry->match);
+	}
 	llist_for_each_entry_safe(entry, tmp, head, list) {
 		num_rewr_free_data(entry);
 		llist_del(&entry->list);
@@ -699,7 +674,7 @@ void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
 			continue;
 		}
 
-		talloc_free(regexp);
+		entry->msisdn_pattern = regexp;
 		if (regcomp(&entry->num_reg, cfg_entry->option, REG_EXTENDED) != 0) {
 			LOGP(DNAT, LOGL_ERROR,
 				"Failed to compile regexp '%s'\n", cfg_entry->option);
@@ -708,7 +683,22 @@ void bsc_nat_num_rewr_entry_adapt(void *ctx, struct llist_head *head,
 			continue;
 		}
 
+		entry->num_pattern = talloc_strdup(entry, cfg_entry->option);
+		if (!entry->num_pattern) {
+			LOGP(DNAT, LOGL_ERROR, "Failed to copy the regexp.\n");
+			num_rewr_free_data(entry);
+			talloc_free(entry);
+			continue;
+		}
+
 		/* we have copied the number */
 		llist_add_tail(&entry->list, head);
 	}
+
+	/* all rules of the list are matched at once */
+	if (llist_empty(head))
+		return;
+	match = bsc_nat_num_rewr_compile(ctx, head);
+	llist_for_each_entry(entry, head, list)
+		entry->match = match;
 }
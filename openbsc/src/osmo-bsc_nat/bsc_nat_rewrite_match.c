@@ -0,0 +1,499 @@
+/*
+ * Compiled matching of the number rewrite rules
+ */
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/bsc_nat.h>
+#include <openbsc/debug.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+/*
+ * The rules of a list are put into a trie of the IMSI prefixes. Each
+ * IMSI prefix has a trie of the number prefixes with the rules in the
+ * order of the list. The IMSI and number patterns are made of single
+ * characters, character classes and one repeated character at the end
+ * and are checked without regexec(). Rules with other patterns are
+ * left to regexec(), but only the ones in front of the first compiled
+ * rule that matches.
+ */
+#define REWR_MAX_ATOMS	24
+#define REWR_PLUS	(1 << 10)
+#define REWR_ANY	(1 << 11)
+
+/* children for 0-9, + and a wildcard */
+#define REWR_CHILD_PLUS	10
+#define REWR_CHILD_ANY	11
+
+struct rewr_pattern {
+	/* the characters accepted at each position */
+	uint16_t atoms[REWR_MAX_ATOMS];
+	int num_atoms;
+	/* the last atom is repeated, 0, '*' or '+' */
+	char repeat;
+	int anchored_end;
+	/* the offset of the first group or -1 */
+	int group;
+};
+
+struct rewr_rule {
+	struct bsc_nat_num_rewr_entry *entry;
+	int compiled;
+	struct rewr_pattern imsi;
+	struct rewr_pattern num;
+	/* the next rule in the same node */
+	int next;
+};
+
+struct rewr_node {
+	int child[12];
+	/* the number trie of an IMSI prefix */
+	int numbers;
+	/* the rules ending here */
+	int first;
+	int last;
+};
+
+struct bsc_nat_num_rewr_match {
+	struct rewr_rule *rules;
+	int num_rules;
+
+	struct rewr_node *nodes;
+	int num_nodes;
+	int alloc_nodes;
+
+	/* the rules left to regexec() */
+	int *regex;
+	int num_regex;
+};
+
+static int atom_accepts(uint16_t atom, char c)
+{
+	if (c == '\0')
+		return 0;
+	if (c >= '0' && c <= '9')
+		return (atom & (1 << (c - '0'))) != 0;
+	if (c == '+')
+		return (atom & (REWR_PLUS | REWR_ANY)) != 0;
+	return (atom & REWR_ANY) != 0;
+}
+
+/* the trie child of an atom matching a single character or -1 */
+static int atom_child(uint16_t atom)
+{
+	int i;
+
+	if (atom == REWR_PLUS)
+		return REWR_CHILD_PLUS;
+	for (i = 0; i < 10; ++i)
+		if (atom == (1 << i))
+			return i;
+	return -1;
+}
+
+static int parse_class(const char **re, uint16_t *atom)
+{
+	const char *p = *re + 1;
+
+	*atom = 0;
+	while (*p != ']') {
+		if (!isdigit((unsigned char) p[0]))
+			return -1;
+		if (p[1] == '-' && isdigit((unsigned char) p[2])) {
+			int c;
+
+			if (p[2] < p[0])
+				return -1;
+			for (c = p[0]; c <= p[2]; ++c)
+				*atom |= 1 << (c - '0');
+			p += 3;
+		} else {
+			*atom |= 1 << (p[0] - '0');
+			p += 1;
+		}
+	}
+
+	if (*atom == 0)
+		return -1;
+	*re = p + 1;
+	return 0;
+}
+
+/*
+ * Parse an anchored pattern like ^274[0-9][0-9] or ^\+49([1-9].*) into
+ * single character atoms. A basic regexp has no groups and a literal
+ * plus, for an extended one it has to be escaped. Returns -1 when
+ * regexec() is needed.
+ */
+static int rewr_parse(const char *re, int extended, struct rewr_pattern *pat)
+{
+	int group_open = 0, group_closed = 0;
+	uint16_t atom;
+
+	memset(pat, 0, sizeof(*pat));
+	pat->group = -1;
+
+	if (*re++ != '^')
+		return -1;
+
+	while (*re) {
+		if (*re == '$' && re[1] == '\0') {
+			pat->anchored_end = 1;
+			break;
+		}
+		if (extended && *re == '(' && !group_open) {
+			group_open = 1;
+			pat->group = pat->num_atoms;
+			re += 1;
+			continue;
+		}
+		if (extended && *re == ')' && group_open && !group_closed) {
+			group_closed = 1;
+			re += 1;
+			continue;
+		}
+
+		/* nothing but the end after the group or a repetition */
+		if (group_closed || pat->repeat || pat->num_atoms == REWR_MAX_ATOMS)
+			return -1;
+
+		if (isdigit((unsigned char) *re)) {
+			atom = 1 << (*re - '0');
+			re += 1;
+		} else if (*re == '.') {
+			atom = REWR_ANY;
+			re += 1;
+		} else if (*re == '[') {
+			if (parse_class(&re, &atom) != 0)
+				return -1;
+		} else if (extended && re[0] == '\\' && re[1] == '+') {
+			atom = REWR_PLUS;
+			re += 2;
+		} else if (!extended && *re == '+') {
+			atom = REWR_PLUS;
+			re += 1;
+		} else {
+			return -1;
+		}
+
+		pat->atoms[pat->num_atoms++] = atom;
+		if (*re == '*' || (extended && *re == '+')) {
+			pat->repeat = *re;
+			re += 1;
+		}
+	}
+
+	if (group_open && !group_closed)
+		return -1;
+	/* the group has to start at a fixed offset */
+	if (pat->repeat && pat->group == pat->num_atoms)
+		return -1;
+	return 0;
+}
+
+static int rewr_pattern_match(const struct rewr_pattern *pat, const char *str)
+{
+	int i, fixed = pat->num_atoms - (pat->repeat ? 1 : 0);
+
+	for (i = 0; i < fixed; ++i)
+		if (!atom_accepts(pat->atoms[i], str[i]))
+			return 0;
+
+	str += fixed;
+	if (pat->repeat) {
+		uint16_t last = pat->atoms[fixed];
+
+		if (pat->repeat == '+' && !atom_accepts(last, *str))
+			return 0;
+		while (atom_accepts(last, *str))
+			str += 1;
+	}
+
+	return !pat->anchored_end || *str == '\0';
+}
+
+static int rewr_node_alloc(struct bsc_nat_num_rewr_match *match)
+{
+	struct rewr_node *nodes;
+	int i;
+
+	if (match->num_nodes == match->alloc_nodes) {
+		nodes = talloc_realloc(match, match->nodes, struct rewr_node,
+				       match->alloc_nodes * 2);
+		if (!nodes)
+			return -1;
+		match->nodes = nodes;
+		match->alloc_nodes *= 2;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(match->nodes[0].child); ++i)
+		match->nodes[match->num_nodes].child[i] = 0;
+	match->nodes[match->num_nodes].numbers = 0;
+	match->nodes[match->num_nodes].first = -1;
+	match->nodes[match->num_nodes].last = -1;
+	return match->num_nodes++;
+}
+
+static int rewr_node_child(struct bsc_nat_num_rewr_match *match, int node, int idx)
+{
+	int child = match->nodes[node].child[idx];
+
+	if (child != 0)
+		return child;
+
+	child = rewr_node_alloc(match);
+	if (child > 0)
+		match->nodes[node].child[idx] = child;
+	return child;
+}
+
+static int rewr_add(struct bsc_nat_num_rewr_match *match, int pos)
+{
+	struct rewr_rule *rule = &match->rules[pos];
+	int i, idx, node = 0, fixed;
+
+	/* the IMSI prefix, classes are checked later */
+	fixed = rule->imsi.num_atoms - (rule->imsi.repeat ? 1 : 0);
+	for (i = 0; i < fixed && node >= 0; ++i) {
+		idx = atom_child(rule->imsi.atoms[i]);
+		node = rewr_node_child(match, node, idx < 0 ? REWR_CHILD_ANY : idx);
+	}
+	if (node < 0)
+		return -1;
+
+	if (match->nodes[node].numbers == 0) {
+		int numbers = rewr_node_alloc(match);
+		if (numbers < 0)
+			return -1;
+		match->nodes[node].numbers = numbers;
+	}
+	node = match->nodes[node].numbers;
+
+	/* the number up to the first class */
+	fixed = rule->num.num_atoms - (rule->num.repeat ? 1 : 0);
+	for (i = 0; i < fixed && node >= 0; ++i) {
+		idx = atom_child(rule->num.atoms[i]);
+		if (idx < 0)
+			break;
+		node = rewr_node_child(match, node, idx);
+	}
+	if (node < 0)
+		return -1;
+
+	/* keep the order of the list */
+	rule->next = -1;
+	if (match->nodes[node].last >= 0)
+		match->rules[match->nodes[node].last].next = pos;
+	else
+		match->nodes[node].first = pos;
+	match->nodes[node].last = pos;
+	return 0;
+}
+
+struct bsc_nat_num_rewr_match *bsc_nat_num_rewr_compile(void *ctx, struct llist_head *head)
+{
+	struct bsc_nat_num_rewr_match *match;
+	struct bsc_nat_num_rewr_entry *entry;
+	int count = llist_count(head);
+
+	match = talloc_zero(ctx, struct bsc_nat_num_rewr_match);
+	if (!match)
+		return NULL;
+
+	match->rules = talloc_zero_array(match, struct rewr_rule, count);
+	match->regex = talloc_array(match, int, count);
+	match->nodes = talloc_array(match, struct rewr_node, 64);
+	match->alloc_nodes = 64;
+	if (!match->rules || !match->regex || !match->nodes)
+		goto error;
+
+	/* the root of the IMSI trie */
+	rewr_node_alloc(match);
+
+	llist_for_each_entry(entry, head, list) {
+		int pos = match->num_rules++;
+		struct rewr_rule *rule = &match->rules[pos];
+
+		entry->pos = pos;
+		rule->entry = entry;
+		rule->compiled =
+			rewr_parse(entry->msisdn_pattern, 0, &rule->imsi) == 0 &&
+			rewr_parse(entry->num_pattern, 1, &rule->num) == 0;
+
+		if (!rule->compiled)
+			match->regex[match->num_regex++] = pos;
+		else if (rewr_add(match, pos) != 0)
+			goto error;
+	}
+
+	LOGP(DNAT, LOGL_DEBUG, "Compiled %d rewrite rules, %d by regexp.\n",
+	     match->num_rules, match->num_regex);
+	return match;
+
+error:
+	LOGP(DNAT, LOGL_ERROR, "Failed to compile the rewrite rules.\n");
+	talloc_free(match);
+	return NULL;
+}
+
+struct rewr_lookup {
+	const struct bsc_nat_num_rewr_match *match;
+	const char *imsi;
+	const char *number;
+	int after;
+	int need_group;
+	int best;
+};
+
+static int rewr_rule_matches(const struct rewr_lookup *lookup, const struct rewr_rule *rule)
+{
+	if (lookup->need_group && rule->num.group < 0)
+		return 0;
+	return rewr_pattern_match(&rule->imsi, lookup->imsi) &&
+		rewr_pattern_match(&rule->num, lookup->number);
+}
+
+static void rewr_walk_numbers(struct rewr_lookup *lookup, int node)
+{
+	const struct rewr_node *nodes = lookup->match->nodes;
+	const char *number = lookup->number;
+	int pos, idx;
+
+	while (node != 0) {
+		for (pos = nodes[node].first; pos >= 0 && pos < lookup->best;
+		     pos = lookup->match->rules[pos].next) {
+			if (pos <= lookup->after)
+				continue;
+			if (rewr_rule_matches(lookup, &lookup->match->rules[pos])) {
+				lookup->best = pos;
+				break;
+			}
+		}
+
+		if (*number >= '0' && *number <= '9')
+			idx = *number - '0';
+		else if (*number == '+')
+			idx = REWR_CHILD_PLUS;
+		else
+			break;
+		node = nodes[node].child[idx];
+		number += 1;
+	}
+}
+
+static void rewr_walk_imsi(struct rewr_lookup *lookup, int node, int depth)
+{
+	const struct rewr_node *nodes = lookup->match->nodes;
+	char c = lookup->imsi[depth];
+
+	if (nodes[node].numbers)
+		rewr_walk_numbers(lookup, nodes[node].numbers);
+	if (c == '\0')
+		return;
+
+	if (c >= '0' && c <= '9' && nodes[node].child[c - '0'])
+		rewr_walk_imsi(lookup, nodes[node].child[c - '0'], depth + 1);
+	if (nodes[node].child[REWR_CHILD_ANY])
+		rewr_walk_imsi(lookup, nodes[node].child[REWR_CHILD_ANY], depth + 1);
+}
+
+/* an entry matching IMSI and number, the group offset is returned */
+static int rewr_regexec(struct bsc_nat_num_rewr_entry *entry,
+			const char *imsi, const char *number, int *group)
+{
+	regmatch_t matches[2];
+
+	if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
+		return 0;
+	if (regexec(&entry->num_reg, number, 2, matches, 0) != 0)
+		return 0;
+	if (group && matches[1].rm_eo == -1)
+		return 0;
+	if (group)
+		*group = matches[1].rm_so;
+	return 1;
+}
+
+/**
+ * Find the first entry of the list after the given one matching the
+ * IMSI and the number. If group is set the number pattern needs to
+ * have a group and its offset is returned.
+ */
+struct bsc_nat_num_rewr_entry *bsc_nat_num_rewr_find(struct llist_head *head,
+						     struct bsc_nat_num_rewr_entry *after,
+						     const char *imsi, const char *number,
+						     int *group)
+{
+	const struct bsc_nat_num_rewr_match *match;
+	struct bsc_nat_num_rewr_entry *entry;
+	struct rewr_lookup lookup;
+	int i, skip = after != NULL;
+
+	if (llist_empty(head))
+		return NULL;
+
+	/* the list could not be compiled */
+	match = llist_first_entry(head, struct bsc_nat_num_rewr_entry, list)->match;
+	if (!match) {
+		llist_for_each_entry(entry, head, list) {
+			if (skip) {
+				skip = entry != after;
+				continue;
+			}
+			if (rewr_regexec(entry, imsi, number, group))
+				return entry;
+		}
+		return NULL;
+	}
+
+	lookup.match = match;
+	lookup.imsi = imsi;
+	lookup.number = number;
+	lookup.after = after ? after->pos : -1;
+	lookup.need_group = group != NULL;
+	lookup.best = INT_MAX;
+	rewr_walk_imsi(&lookup, 0, 0);
+
+	/* only the rules in front of the best one can change it */
+	for (i = 0; i < match->num_regex && match->regex[i] < lookup.best; ++i) {
+		if (match->regex[i] <= lookup.after)
+			continue;
+		entry = match->rules[match->regex[i]].entry;
+		if (rewr_regexec(entry, imsi, number, group))
+			return entry;
+	}
+
+	if (lookup.best == INT_MAX)
+		return NULL;
+	if (group)
+		*group = match->rules[lookup.best].num.group;
+	return match->rules[lookup.best].entry;
+}
+
+/* compiled or left to regexec() */
+int bsc_nat_num_rewr_is_compiled(struct bsc_nat_num_rewr_entry *entry)
+{
+	return entry->match && entry->match->rules[entry->pos].compiled;
+}
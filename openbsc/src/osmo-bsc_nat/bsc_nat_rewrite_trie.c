@@ -27,9 +27,15 @@
 #include <osmocom/core/utils.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define CHECK_IS_DIGIT_OR_FAIL(prefix, pos)						\
 	if (!isdigit(prefix[pos]) && prefix[pos] != '+') {				\
@@ -41,11 +47,29 @@
 #define TO_INT(c) \
 	((c) == '+' ? 10 : ((c - '0') % 10))
 
-static void insert_rewrite_node(struct nat_rewrite_rule *rule, struct nat_rewrite *root)
+/*
+ * The CSV file is first parsed into a tree with one allocation per
+ * node. It is compiled into the flat format and given up afterwards.
+ */
+struct rewrite_build_node {
+	/* For digits 0-9 and + */
+	struct rewrite_build_node *rules[11];
+
+	char empty;
+	struct nat_rewrite_rule rule;
+};
+
+struct rewrite_build {
+	struct rewrite_build_node root;
+	size_t prefixes;
+	size_t nodes;
+};
+
+static void insert_rewrite_node(struct rewrite_build_node *rule, struct rewrite_build *root)
 {
-	struct nat_rewrite_rule *new = &root->rule;
+	struct rewrite_build_node *new = &root->root;
 
-	const int len = strlen(rule->prefix);
+	const int len = strlen(rule->rule.prefix);
 	int i;
 
 	if (len <= 0) {
@@ -57,12 +81,12 @@ static void insert_rewrite_node(struct nat_rewrite_rule *rule, struct nat_rewrit
 		int pos;
 
 		/* check if the input is valid */
-		CHECK_IS_DIGIT_OR_FAIL(rule->prefix, i);
+		CHECK_IS_DIGIT_OR_FAIL(rule->rule.prefix, i);
 
 		/* check if the next node is already valid */
-		pos = TO_INT(rule->prefix[i]);
+		pos = TO_INT(rule->rule.prefix[i]);
 		if (!new->rules[pos]) {
-			new->rules[pos] = talloc_zero(root, struct nat_rewrite_rule);
+			new->rules[pos] = talloc_zero(root, struct rewrite_build_node);
 			if (!new->rules[pos]) {
 				LOGP(DNAT, LOGL_ERROR,
 					"Failed to allocate memory.\n");
@@ -70,6 +94,7 @@ static void insert_rewrite_node(struct nat_rewrite_rule *rule, struct nat_rewrit
 			}
 
 			new->rules[pos]->empty = 1;
+			root->nodes += 1;
 		}
 
 		/* we continue here */
@@ -80,21 +105,21 @@ static void insert_rewrite_node(struct nat_rewrite_rule *rule, struct nat_rewrit
 	int pos;
 
 	/* check if the input is valid */
-	CHECK_IS_DIGIT_OR_FAIL(rule->prefix, (len - 1));
+	CHECK_IS_DIGIT_OR_FAIL(rule->rule.prefix, (len - 1));
 
 	/* check if the next node is already valid */
-	pos = TO_INT(rule->prefix[len - 1]);
-	if (!new->rules[pos])
+	pos = TO_INT(rule->rule.prefix[len - 1]);
+	if (!new->rules[pos]) {
 		new->rules[pos] = rule;
-	else if (new->rules[pos]->empty) {
+		root->nodes += 1;
+	} else if (new->rules[pos]->empty) {
 		/* copy over entries */
 		new->rules[pos]->empty = 0;
-		memcpy(new->rules[pos]->prefix, rule->prefix, sizeof(rule->prefix));
-		memcpy(new->rules[pos]->rewrite, rule->rewrite, sizeof(rule->rewrite));
+		memcpy(&new->rules[pos]->rule, &rule->rule, sizeof(rule->rule));
 		talloc_free(rule);
 	} else {
 		LOGP(DNAT, LOGL_ERROR,
-			"Prefix(%s) is already installed\n", rule->prefix);
+			"Prefix(%s) is already installed\n", rule->rule.prefix);
 		goto fail;
 	}
 
@@ -106,10 +131,10 @@ fail:
 	return;
 }
 
-static void handle_line(struct nat_rewrite *rewrite, char *line)
+static void handle_line(struct rewrite_build *rewrite, char *line)
 {
 	char *split;
-	struct nat_rewrite_rule *rule;
+	struct rewrite_build_node *rule;
 	size_t size_prefix, size_end, len;
 
 
@@ -133,13 +158,13 @@ static void handle_line(struct nat_rewrite *rewrite, char *line)
 	size_end = strlen(split) - 1;
 
 	/* Check if both strings can fit into the static array */
-	if (size_prefix > sizeof(rule->prefix) - 1) {
+	if (size_prefix > sizeof(rule->rule.prefix) - 1) {
 		LOGP(DNAT, LOGL_ERROR,
 			"Prefix is too long with %zu\n", size_prefix);
 		return;
 	}
 
-	if (size_end > sizeof(rule->rewrite) - 1) {
+	if (size_end > sizeof(rule->rule.rewrite) - 1) {
 		LOGP(DNAT, LOGL_ERROR,
 			"Rewrite is too long with %zu on %s\n",
 			size_end, &line[size_prefix + 1]);
@@ -147,72 +172,315 @@ static void handle_line(struct nat_rewrite *rewrite, char *line)
 	}
 
 	/* Now create the entry and insert it into the trie */
-	rule = talloc_zero(rewrite, struct nat_rewrite_rule);
+	rule = talloc_zero(rewrite, struct rewrite_build_node);
 	if (!rule) {
 		LOGP(DNAT, LOGL_ERROR, "Can not allocate memory\n");
 		return;
 	}
 
-	memcpy(rule->prefix, line, size_prefix);
-	assert(size_prefix < sizeof(rule->prefix));
-	rule->prefix[size_prefix] = '\0';
+	memcpy(rule->rule.prefix, line, size_prefix);
+	assert(size_prefix < sizeof(rule->rule.prefix));
+	rule->rule.prefix[size_prefix] = '\0';
 
-	memcpy(rule->rewrite, split, size_end);
-	assert(size_end < sizeof(rule->rewrite));
-	rule->rewrite[size_end] = '\0';
+	memcpy(rule->rule.rewrite, split, size_end);
+	assert(size_end < sizeof(rule->rule.rewrite));
+	rule->rule.rewrite[size_end] = '\0';
 
 	/* now insert and balance the tree */
 	insert_rewrite_node(rule, rewrite);
 }
 
-struct nat_rewrite *nat_rewrite_parse(void *ctx, const char *filename)
+/* point rewr at the compiled trie in data, only sizes are checked here */
+static int rewrite_attach(struct nat_rewrite *rewr, const void *data, size_t len)
+{
+	const struct nat_rewrite_file_hdr *hdr = data;
+	size_t left;
+
+	if (len < sizeof(*hdr)
+	    || memcmp(hdr->magic, NAT_REWRITE_MAGIC, sizeof(hdr->magic)) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Not a compiled prefix tree.\n");
+		return -1;
+	}
+
+	if (hdr->version != NAT_REWRITE_VERSION) {
+		LOGP(DNAT, LOGL_ERROR,
+			"Unsupported prefix tree version %u.\n", hdr->version);
+		return -1;
+	}
+
+	left = len - sizeof(*hdr);
+	if (hdr->num_nodes == 0
+	    || hdr->num_nodes > left / sizeof(struct nat_rewrite_node)
+	    || hdr->num_rules > (left - hdr->num_nodes * sizeof(struct nat_rewrite_node))
+					/ sizeof(struct nat_rewrite_rule)
+	    || left != hdr->num_nodes * sizeof(struct nat_rewrite_node)
+			+ hdr->num_rules * sizeof(struct nat_rewrite_rule)) {
+		LOGP(DNAT, LOGL_ERROR,
+			"Prefix tree with %u nodes and %u rules is truncated.\n",
+			hdr->num_nodes, hdr->num_rules);
+		return -1;
+	}
+
+	rewr->hdr = hdr;
+	rewr->nodes = (const struct nat_rewrite_node *) &hdr[1];
+	rewr->rules = (const struct nat_rewrite_rule *) &rewr->nodes[hdr->num_nodes];
+	rewr->prefixes = hdr->num_rules;
+	rewr->len = len;
+	return 0;
+}
+
+static int rewrite_destructor(struct nat_rewrite *rewr)
+{
+	if (rewr->map)
+		munmap(rewr->map, rewr->len);
+	return 0;
+}
+
+/* lay out the nodes breadth first, the children of a node are adjacent */
+static struct nat_rewrite *rewrite_compile(void *ctx, struct rewrite_build *build)
+{
+	struct rewrite_build_node **queue;
+	struct nat_rewrite_file_hdr *hdr;
+	struct nat_rewrite_node *nodes;
+	struct nat_rewrite_rule *rules;
+	struct nat_rewrite *res;
+	size_t head, tail = 1, num_rules = 0, len;
+	int i;
+
+	len = sizeof(*hdr) + build->nodes * sizeof(*nodes)
+		+ build->prefixes * sizeof(*rules);
+	res = talloc_zero(ctx, struct nat_rewrite);
+	if (!res)
+		return NULL;
+	hdr = talloc_zero_size(res, len);
+	queue = talloc_array(build, struct rewrite_build_node *, build->nodes);
+	if (!hdr || !queue) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate memory.\n");
+		talloc_free(res);
+		return NULL;
+	}
+
+	nodes = (struct nat_rewrite_node *) &hdr[1];
+	rules = (struct nat_rewrite_rule *) &nodes[build->nodes];
+	queue[0] = &build->root;
+
+	for (head = 0; head < tail; ++head) {
+		struct rewrite_build_node *bnode = queue[head];
+
+		for (i = 0; i < ARRAY_SIZE(bnode->rules); ++i) {
+			if (!bnode->rules[i])
+				continue;
+			if (!nodes[head].children)
+				nodes[head].first_child = tail;
+			nodes[head].children |= 1 << i;
+			assert(tail < build->nodes);
+			queue[tail++] = bnode->rules[i];
+		}
+
+		if (!bnode->empty) {
+			rules[num_rules++] = bnode->rule;
+			nodes[head].rule = num_rules;
+		}
+	}
+
+	assert(tail == build->nodes && num_rules == build->prefixes);
+	memcpy(hdr->magic, NAT_REWRITE_MAGIC, sizeof(hdr->magic));
+	hdr->version = NAT_REWRITE_VERSION;
+	hdr->num_nodes = build->nodes;
+	hdr->num_rules = build->prefixes;
+
+	rewrite_attach(res, hdr, len);
+	return res;
+}
+
+static struct nat_rewrite *rewrite_parse_csv(void *ctx, FILE *file)
 {
-	FILE *file;
 	char *line = NULL;
 	size_t n = 0;
+	struct rewrite_build *build;
 	struct nat_rewrite *res;
 
-	file = fopen(filename, "r");
-	if (!file)
+	build = talloc_zero(NULL, struct rewrite_build);
+	if (!build)
+		return NULL;
+
+	/* mark the root as empty */
+	build->root.empty = 1;
+	build->nodes = 1;
+
+	while (getline(&line, &n, file) != -1) {
+		handle_line(build, line);
+	}
+
+	free(line);
+	res = rewrite_compile(ctx, build);
+	talloc_free(build);
+	return res;
+}
+
+static struct nat_rewrite *rewrite_map(void *ctx, int fd)
+{
+	struct nat_rewrite *res;
+	struct stat st;
+	void *map;
+
+	if (fstat(fd, &st) != 0)
+		return NULL;
+
+	/* read only and shared, all processes use the same pages */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		LOGP(DNAT, LOGL_ERROR,
+			"Failed to map the prefix tree: %s\n", strerror(errno));
 		return NULL;
+	}
 
 	res = talloc_zero(ctx, struct nat_rewrite);
 	if (!res) {
-		fclose(file);
+		munmap(map, st.st_size);
 		return NULL;
 	}
 
-	/* mark the root as empty */
-	res->rule.empty = 1;
+	res->map = map;
+	res->len = st.st_size;
+	talloc_set_destructor(res, rewrite_destructor);
 
-	while (getline(&line, &n, file) != -1) {
-		handle_line(res, line);
+	if (rewrite_attach(res, map, st.st_size) != 0) {
+		talloc_free(res);
+		return NULL;
+	}
+
+	return res;
+}
+
+/**
+ * Load a CSV file or a file written by nat_rewrite_write. The latter
+ * is mmap()ed and only its header is looked at, it must be replaced
+ * with rename() and not be rewritten in place while it is in use.
+ */
+struct nat_rewrite *nat_rewrite_parse(void *ctx, const char *filename)
+{
+	FILE *file;
+	char magic[4];
+	struct nat_rewrite *res;
+
+	file = fopen(filename, "r");
+	if (!file)
+		return NULL;
+
+	if (fread(magic, sizeof(magic), 1, file) == 1
+	    && memcmp(magic, NAT_REWRITE_MAGIC, sizeof(magic)) == 0) {
+		res = rewrite_map(ctx, fileno(file));
+	} else {
+		rewind(file);
+		res = rewrite_parse_csv(ctx, file);
 	}
 
-	free(line);
 	fclose(file);
 	return res;
 }
 
+/**
+ * Store the compiled trie. It is written to a temporary file that
+ * is renamed so that a NAT never maps a partial file.
+ */
+int nat_rewrite_write(struct nat_rewrite *rewr, const char *filename)
+{
+	const char *data = (const char *) rewr->hdr;
+	size_t written = 0;
+	char *tmp;
+	int fd, rc = -1;
+
+	tmp = talloc_asprintf(NULL, "%s.tmp", filename);
+	if (!tmp)
+		return -1;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+
+	while (written < rewr->len) {
+		ssize_t len = write(fd, data + written, rewr->len - written);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		written += len;
+	}
+
+	if (close(fd) == 0 && written == rewr->len
+	    && rename(tmp, filename) == 0)
+		rc = 0;
+	else
+		unlink(tmp);
+
+out:
+	if (rc != 0)
+		LOGP(DNAT, LOGL_ERROR, "Failed to write the prefix tree %s: %s\n",
+			filename, strerror(errno));
+	talloc_free(tmp);
+	return rc;
+}
+
+/*
+ * The accessors check every index as the file is not walked on load.
+ * Children always come after their parent so a walk ends.
+ */
+static const struct nat_rewrite_rule *node_rule(const struct nat_rewrite *rewr,
+						uint32_t idx)
+{
+	const struct nat_rewrite_node *node = &rewr->nodes[idx];
+	const struct nat_rewrite_rule *rule;
+
+	if (node->rule == 0 || node->rule > rewr->hdr->num_rules)
+		return NULL;
+
+	rule = &rewr->rules[node->rule - 1];
+	if (!memchr(rule->prefix, '\0', sizeof(rule->prefix))
+	    || !memchr(rule->rewrite, '\0', sizeof(rule->rewrite)))
+		return NULL;
+	return rule;
+}
+
+/* the index of the child for pos, 0 when there is none */
+static uint32_t node_child(const struct nat_rewrite *rewr, uint32_t idx, int pos)
+{
+	const struct nat_rewrite_node *node = &rewr->nodes[idx];
+	uint32_t child;
+
+	if (!(node->children & (1 << pos)))
+		return 0;
+
+	child = node->first_child
+		+ __builtin_popcount(node->children & ((1 << pos) - 1));
+	if (child <= idx || child >= rewr->hdr->num_nodes)
+		return 0;
+	return child;
+}
+
 /**
  * Simple find that tries to do a longest match...
  */
-struct nat_rewrite_rule *nat_rewrite_lookup(struct nat_rewrite *rewrite,
+const struct nat_rewrite_rule *nat_rewrite_lookup(struct nat_rewrite *rewrite,
 					const char *prefix)
 {
-	struct nat_rewrite_rule *rule = &rewrite->rule;
-	struct nat_rewrite_rule *last = NULL;
+	const struct nat_rewrite_rule *rule, *last = NULL;
 	const int len = OSMO_MIN(strlen(prefix), (sizeof(rule->prefix) - 1));
+	uint32_t idx = 0;
 	int i;
 
-	for (i = 0; rule && i < len; ++i) {
+	for (i = 0; i < len; ++i) {
 		int pos;
 
 		CHECK_IS_DIGIT_OR_FAIL(prefix, i);
 		pos = TO_INT(prefix[i]);
 
-		rule = rule->rules[pos];
-		if (rule && !rule->empty)
+		idx = node_child(rewrite, idx, pos);
+		if (!idx)
+			break;
+
+		rule = node_rule(rewrite, idx);
+		if (rule)
 			last = rule;
 	}
 
@@ -222,38 +490,35 @@ fail:
 	return NULL;
 }
 
-static void nat_rewrite_dump_rec(struct nat_rewrite_rule *rule)
+static void nat_rewrite_dump_rec(struct vty *vty, const struct nat_rewrite *rewr,
+				 uint32_t idx, int depth)
 {
+	const struct nat_rewrite_rule *rule = node_rule(rewr, idx);
+	uint32_t child;
 	int i;
-	if (!rule->empty)
+
+	if (rule && vty)
+		vty_out(vty, "%s,%s%s", rule->prefix, rule->rewrite, VTY_NEWLINE);
+	else if (rule)
 		printf("%s,%s\n", rule->prefix, rule->rewrite);
 
-	for (i = 0; i < ARRAY_SIZE(rule->rules); ++i) {
-		if (!rule->rules[i])
-			continue;
-		nat_rewrite_dump_rec(rule->rules[i]);
+	/* a lookup never goes deeper than the longest prefix */
+	if (depth == sizeof(rule->prefix) - 1)
+		return;
+
+	for (i = 0; i < 11; ++i) {
+		child = node_child(rewr, idx, i);
+		if (child)
+			nat_rewrite_dump_rec(vty, rewr, child, depth + 1);
 	}
 }
 
 void nat_rewrite_dump(struct nat_rewrite *rewrite)
 {
-	nat_rewrite_dump_rec(&rewrite->rule);
-}
-
-static void nat_rewrite_dump_rec_vty(struct vty *vty, struct nat_rewrite_rule *rule)
-{
-	int i;
-	if (!rule->empty)
-		vty_out(vty, "%s,%s%s", rule->prefix, rule->rewrite, VTY_NEWLINE);
-
-	for (i = 0; i < ARRAY_SIZE(rule->rules); ++i) {
-		if (!rule->rules[i])
-			continue;
-		nat_rewrite_dump_rec_vty(vty, rule->rules[i]);
-	}
+	nat_rewrite_dump_rec(NULL, rewrite, 0, 0);
 }
 
 void nat_rewrite_dump_vty(struct vty *vty, struct nat_rewrite *rewrite)
 {
-	nat_rewrite_dump_rec_vty(vty, &rewrite->rule);
+	nat_rewrite_dump_rec(vty, rewrite, 0, 0);
 }
@@ -0,0 +1,175 @@
+/* Hierarchical timer wheel for the NAT */
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/nat_timer_wheel.h>
+
+#include <osmocom/core/talloc.h>
+
+#include <time.h>
+
+static uint32_t wheel_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/* the timer goes to the lowest level whose range covers it */
+static void wheel_add(struct nat_timer_wheel *wheel, struct nat_wheel_timer *timer)
+{
+	uint32_t delta = timer->expires - wheel->now;
+	int level, slot;
+
+	for (level = 0; level < NAT_WHEEL_LEVELS - 1; ++level)
+		if (delta < (1u << (NAT_WHEEL_BITS * (level + 1))))
+			break;
+
+	slot = (timer->expires >> (NAT_WHEEL_BITS * level)) & NAT_WHEEL_MASK;
+	llist_add_tail(&timer->entry, &wheel->slots[level][slot]);
+}
+
+static void wheel_unlink(struct nat_timer_wheel *wheel, struct nat_wheel_timer *timer)
+{
+	llist_del(&timer->entry);
+	timer->entry.next = timer->entry.prev = NULL;
+	wheel->pending -= 1;
+}
+
+/* move the timers of a slot down, they expire within its range */
+static void wheel_cascade(struct nat_timer_wheel *wheel, int level)
+{
+	struct nat_wheel_timer *timer, *tmp;
+	struct llist_head list;
+	int slot = (wheel->now >> (NAT_WHEEL_BITS * level)) & NAT_WHEEL_MASK;
+
+	INIT_LLIST_HEAD(&list);
+	llist_splice_init(&wheel->slots[level][slot], &list);
+	llist_for_each_entry_safe(timer, tmp, &list, entry)
+		wheel_add(wheel, timer);
+}
+
+static void wheel_tick(struct nat_timer_wheel *wheel)
+{
+	struct llist_head *slot;
+	struct nat_wheel_timer *timer;
+	int level;
+
+	wheel->now += 1;
+
+	/* the highest level first, its timers might end up one below */
+	for (level = 1; level < NAT_WHEEL_LEVELS; ++level)
+		if (wheel->now & ((1u << (NAT_WHEEL_BITS * level)) - 1))
+			break;
+	while (--level > 0)
+		wheel_cascade(wheel, level);
+
+	/* the callbacks may add and remove timers */
+	slot = &wheel->slots[0][wheel->now & NAT_WHEEL_MASK];
+	while (!llist_empty(slot)) {
+		timer = llist_entry(slot->next, struct nat_wheel_timer, entry);
+		wheel_unlink(wheel, timer);
+		timer->cb(timer->data);
+	}
+}
+
+/**
+ * Run the timers up to now. An empty wheel jumps there, otherwise
+ * every second in between is a tick.
+ */
+void nat_timer_wheel_advance(struct nat_timer_wheel *wheel, uint32_t now)
+{
+	while ((int32_t) (now - wheel->now) > 0) {
+		if (!wheel->pending) {
+			wheel->now = now;
+			break;
+		}
+		wheel_tick(wheel);
+	}
+}
+
+static void wheel_tick_cb(void *data)
+{
+	struct nat_timer_wheel *wheel = data;
+
+	nat_timer_wheel_advance(wheel, wheel_clock());
+	if (wheel->pending)
+		osmo_timer_schedule(&wheel->tick, 1, 0);
+}
+
+struct nat_timer_wheel *nat_timer_wheel_alloc(void *ctx)
+{
+	struct nat_timer_wheel *wheel;
+	int level, slot;
+
+	wheel = talloc_zero(ctx, struct nat_timer_wheel);
+	if (!wheel)
+		return NULL;
+
+	for (level = 0; level < NAT_WHEEL_LEVELS; ++level)
+		for (slot = 0; slot < NAT_WHEEL_SIZE; ++slot)
+			INIT_LLIST_HEAD(&wheel->slots[level][slot]);
+
+	wheel->now = wheel_clock();
+	osmo_timer_setup(&wheel->tick, wheel_tick_cb, wheel);
+	return wheel;
+}
+
+/* the timer has to be zeroed or not be pending */
+void nat_wheel_timer_setup(struct nat_wheel_timer *timer,
+			   void (*cb)(void *data), void *data)
+{
+	timer->cb = cb;
+	timer->data = data;
+}
+
+/* (re)start the timer, it expires in one second at the earliest */
+void nat_wheel_timer_schedule(struct nat_timer_wheel *wheel,
+			      struct nat_wheel_timer *timer, unsigned int seconds)
+{
+	uint32_t now;
+
+	if (nat_wheel_timer_pending(timer))
+		wheel_unlink(wheel, timer);
+
+	/* an idle wheel is not ticking, catch up with the clock */
+	now = wheel_clock();
+	if (!wheel->pending && (int32_t) (now - wheel->now) > 0)
+		wheel->now = now;
+
+	if (seconds < 1)
+		seconds = 1;
+	if (seconds > NAT_WHEEL_MAX)
+		seconds = NAT_WHEEL_MAX;
+
+	timer->expires = wheel->now + seconds;
+	wheel_add(wheel, timer);
+	wheel->pending += 1;
+
+	if (!osmo_timer_pending(&wheel->tick))
+		osmo_timer_schedule(&wheel->tick, 1, 0);
+}
+
+void nat_wheel_timer_del(struct nat_timer_wheel *wheel,
+			 struct nat_wheel_timer *timer)
+{
+	if (nat_wheel_timer_pending(timer))
+		wheel_unlink(wheel, timer);
+}
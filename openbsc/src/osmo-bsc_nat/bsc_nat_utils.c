@@ -29,6 +29,7 @@
 #include <openbsc/debug.h>
 #include <openbsc/ipaccess.h>
 #include <openbsc/vty.h>
+#include <openbsc/str_hash.h>
 
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/talloc.h>
@@ -43,6 +44,7 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 static const struct rate_ctr_desc bsc_cfg_ctr_description[] = {
@@ -59,6 +61,8 @@ static const struct rate_ctr_desc bsc_cfg_ctr_description[] = {
 	[BCFG_CTR_CON_PAG_RESP]  = { "conn:pag",       "Conn Paging Response     "},
 	[BCFG_CTR_CON_SSA]       = { "conn:ssa",       "Conn USSD                "},
 	[BCFG_CTR_CON_OTHER]     = { "conn:other",     "Conn Other               "},
+	[BCFG_CTR_WRITE_CALLS]   = { "write:calls",    "Write system calls       "},
+	[BCFG_CTR_WRITE_FRAMES]  = { "write:frames",   "Frames written           "},
 };
 
 static const struct rate_ctr_group_desc bsc_cfg_ctrg_desc = {
@@ -69,8 +73,22 @@ static const struct rate_ctr_group_desc bsc_cfg_ctrg_desc = {
 	.class_id = OSMO_STATS_CLASS_PEER,
 };
 
+static const struct rate_ctr_desc nat_msc_ctr_description[] = {
+	[NAT_MSC_CTR_WRITE_CALLS]  = { "write:calls",    "Write system calls       "},
+	[NAT_MSC_CTR_WRITE_FRAMES] = { "write:frames",   "Frames written           "},
+};
+
+static const struct rate_ctr_group_desc nat_msc_ctrg_desc = {
+	.group_name_prefix = "nat:msc",
+	.group_description = "NAT MSC Statistics",
+	.num_ctr = ARRAY_SIZE(nat_msc_ctr_description),
+	.ctr_desc = nat_msc_ctr_description,
+	.class_id = OSMO_STATS_CLASS_GLOBAL,
+};
+
 struct bsc_nat *bsc_nat_alloc(void)
 {
+	int i;
 	struct bsc_nat *nat = talloc_zero(tall_bsc_ctx, struct bsc_nat);
 	if (!nat)
 		return NULL;
@@ -81,7 +99,36 @@ struct bsc_nat *bsc_nat_alloc(void)
 		return NULL;
 	}
 
+	nat->sccp_by_real = talloc_array(nat, struct llist_head, NAT_SCCP_HASH_SIZE);
+	nat->sccp_by_patched = talloc_array(nat, struct llist_head, NAT_SCCP_HASH_SIZE);
+	nat->sccp_by_remote = talloc_array(nat, struct llist_head, NAT_SCCP_HASH_SIZE);
+	nat->sccp_by_msc_endp = talloc_array(nat, struct llist_head, NAT_SCCP_HASH_SIZE);
+	nat->sccp_refs = nat_sccp_ref_pool_alloc(nat, 0x50000);
+	nat->paging_by_lac = talloc_array(nat, struct llist_head, NAT_PAGING_HASH_SIZE);
+	nat->bsc_by_token = talloc_array(nat, struct llist_head, NAT_BSC_HASH_SIZE);
+	nat->bsc_by_nr = talloc_array(nat, struct llist_head, NAT_BSC_HASH_SIZE);
+	nat->timers = nat_timer_wheel_alloc(nat);
+	if (!nat->sccp_by_real || !nat->sccp_by_patched ||
+	    !nat->sccp_by_remote || !nat->sccp_by_msc_endp || !nat->sccp_refs ||
+	    !nat->paging_by_lac || !nat->bsc_by_token || !nat->bsc_by_nr ||
+	    !nat->timers) {
+		talloc_free(nat);
+		return NULL;
+	}
+	for (i = 0; i < NAT_PAGING_HASH_SIZE; ++i)
+		INIT_LLIST_HEAD(&nat->paging_by_lac[i]);
+	for (i = 0; i < NAT_BSC_HASH_SIZE; ++i) {
+		INIT_LLIST_HEAD(&nat->bsc_by_token[i]);
+		INIT_LLIST_HEAD(&nat->bsc_by_nr[i]);
+	}
+
 	INIT_LLIST_HEAD(&nat->sccp_connections);
+	for (i = 0; i < NAT_SCCP_HASH_SIZE; ++i) {
+		INIT_LLIST_HEAD(&nat->sccp_by_real[i]);
+		INIT_LLIST_HEAD(&nat->sccp_by_patched[i]);
+		INIT_LLIST_HEAD(&nat->sccp_by_remote[i]);
+		INIT_LLIST_HEAD(&nat->sccp_by_msc_endp[i]);
+	}
 	INIT_LLIST_HEAD(&nat->bsc_connections);
 	INIT_LLIST_HEAD(&nat->paging_groups);
 	INIT_LLIST_HEAD(&nat->bsc_configs);
@@ -99,10 +146,13 @@ struct bsc_nat *bsc_nat_alloc(void)
 	nat->stats.bsc.reconn = osmo_counter_alloc("nat.bsc.conn");
 	nat->stats.bsc.auth_fail = osmo_counter_alloc("nat.bsc.auth_fail");
 	nat->stats.msc.reconn = osmo_counter_alloc("nat.msc.conn");
+	nat->stats.msc.ctrg = rate_ctr_group_alloc(nat, &nat_msc_ctrg_desc, 0);
 	nat->stats.ussd.reconn = osmo_counter_alloc("nat.ussd.conn");
 	nat->auth_timeout = 2;
 	nat->ping_timeout = 20;
 	nat->pong_timeout = 5;
+	nat->num_workers = 1;
+	nat->worker_nr = -1;
 
 	llist_add(&nat->main_dest->list, &nat->dests);
 	nat->main_dest->ip = talloc_strdup(nat, "127.0.0.1");
@@ -132,11 +182,29 @@ void bsc_nat_free(struct bsc_nat *nat)
 	osmo_counter_free(nat->stats.bsc.reconn);
 	osmo_counter_free(nat->stats.bsc.auth_fail);
 	osmo_counter_free(nat->stats.msc.reconn);
+	rate_ctr_group_free(nat->stats.msc.ctrg);
 	osmo_counter_free(nat->stats.ussd.reconn);
 	talloc_free(nat->mgcp_cfg);
 	talloc_free(nat);
 }
 
+/* account the time from accept() until the BSC was authenticated */
+void bsc_nat_stat_auth(struct bsc_nat *nat, const struct timespec *start,
+		       const struct timespec *end)
+{
+	long long us;
+
+	us = (end->tv_sec - start->tv_sec) * 1000000LL +
+		(end->tv_nsec - start->tv_nsec) / 1000;
+	if (us < 0)
+		us = 0;
+
+	nat->stats.bsc.auth_count += 1;
+	nat->stats.bsc.auth_total_us += us;
+	if (us > nat->stats.bsc.auth_max_us)
+		nat->stats.bsc.auth_max_us = us;
+}
+
 void bsc_nat_set_msc_ip(struct bsc_nat *nat, const char *ip)
 {
 	osmo_talloc_replace_string(nat, &nat->main_dest->ip, ip);
@@ -152,9 +220,22 @@ struct bsc_connection *bsc_connection_alloc(struct bsc_nat *nat)
 	osmo_wqueue_init(&con->write_queue, 100);
 	INIT_LLIST_HEAD(&con->cmd_pending);
 	INIT_LLIST_HEAD(&con->pending_dlcx);
+	INIT_LLIST_HEAD(&con->paging_lacs);
+	INIT_LLIST_HEAD(&con->sccp_connections);
 	return con;
 }
 
+/* the token without the '\0' */
+static unsigned int bsc_token_hash(const char *token, int len)
+{
+	return str_hash(token, len) % NAT_BSC_HASH_SIZE;
+}
+
+static struct llist_head *bsc_nr_bucket(struct bsc_nat *nat, int nr)
+{
+	return &nat->bsc_by_nr[(unsigned int) nr % NAT_BSC_HASH_SIZE];
+}
+
 struct bsc_config *bsc_config_alloc(struct bsc_nat *nat, const char *token,
 				    unsigned int number)
 {
@@ -170,24 +251,41 @@ struct bsc_config *bsc_config_alloc(struct bsc_nat *nat, const char *token,
 
 	INIT_LLIST_HEAD(&conf->lac_list);
 
-	llist_add_tail(&conf->entry, &nat->bsc_configs);
-	++nat->num_bsc;
-
 	conf->stats.ctrg = rate_ctr_group_alloc(conf, &bsc_cfg_ctrg_desc, conf->nr);
 	if (!conf->stats.ctrg) {
-		llist_del(&conf->entry);
 		talloc_free(conf);
 		return NULL;
 	}
 
+	llist_add_tail(&conf->entry, &nat->bsc_configs);
+	llist_add_tail(&conf->token_entry,
+		       &nat->bsc_by_token[bsc_token_hash(token, strlen(token))]);
+	llist_add_tail(&conf->nr_entry, bsc_nr_bucket(nat, conf->nr));
+	++nat->num_bsc;
+
 	return conf;
 }
 
+struct bsc_config *bsc_config_num(struct bsc_nat *nat, int num)
+{
+	struct bsc_config *conf;
+
+	llist_for_each_entry(conf, bsc_nr_bucket(nat, num), nr_entry)
+		if (conf->nr == num)
+			return conf;
+
+	return NULL;
+}
+
 struct bsc_config *bsc_config_by_token(struct bsc_nat *nat, const char *token, int len)
 {
 	struct bsc_config *conf;
 
-	llist_for_each_entry(conf, &nat->bsc_configs, entry) {
+	if (len <= 0)
+		return NULL;
+
+	llist_for_each_entry(conf, &nat->bsc_by_token[bsc_token_hash(token, len - 1)],
+			     token_entry) {
 		/*
 		 * Add the '\0' of the token for the memcmp, the IPA messages
 		 * for some reason added null termination.
@@ -201,9 +299,20 @@ struct bsc_config *bsc_config_by_token(struct bsc_nat *nat, const char *token, i
 	return NULL;
 }
 
+/* the token may only be changed here to keep the index up to date */
+void bsc_config_set_token(struct bsc_config *cfg, const char *token)
+{
+	osmo_talloc_replace_string(cfg, &cfg->token, token);
+	llist_del(&cfg->token_entry);
+	llist_add_tail(&cfg->token_entry,
+		       &cfg->nat->bsc_by_token[bsc_token_hash(cfg->token, strlen(cfg->token))]);
+}
+
 void bsc_config_free(struct bsc_config *cfg)
 {
 	llist_del(&cfg->entry);
+	llist_del(&cfg->token_entry);
+	llist_del(&cfg->nr_entry);
 	rate_ctr_group_free(cfg->stats.ctrg);
 	cfg->nat->num_bsc--;
 	OSMO_ASSERT(cfg->nat->num_bsc >= 0)
@@ -243,11 +352,13 @@ static void _del_lac(struct llist_head *list, int _lac)
 void bsc_config_add_lac(struct bsc_config *cfg, int _lac)
 {
 	_add_lac(cfg, &cfg->lac_list, _lac);
+	bsc_nat_paging_update_cfg(cfg);
 }
 
 void bsc_config_del_lac(struct bsc_config *cfg, int _lac)
 {
 	_del_lac(&cfg->lac_list, _lac);
+	bsc_nat_paging_update_cfg(cfg);
 }
 
 struct bsc_nat_paging_group *bsc_nat_paging_group_create(struct bsc_nat *nat, int group)
@@ -261,6 +372,7 @@ struct bsc_nat_paging_group *bsc_nat_paging_group_create(struct bsc_nat *nat, in
 	}
 
 	pgroup->nr = group;
+	pgroup->nat = nat;
 	INIT_LLIST_HEAD(&pgroup->lists);
 	llist_add_tail(&pgroup->entry, &nat->paging_groups);
 	return pgroup;
@@ -268,8 +380,12 @@ struct bsc_nat_paging_group *bsc_nat_paging_group_create(struct bsc_nat *nat, in
 
 void bsc_nat_paging_group_delete(struct bsc_nat_paging_group *pgroup)
 {
+	struct bsc_nat *nat = pgroup->nat;
+	int group = pgroup->nr;
+
 	llist_del(&pgroup->entry);
 	talloc_free(pgroup);
+	bsc_nat_paging_update_group(nat, group);
 }
 
 struct bsc_nat_paging_group *bsc_nat_paging_group_num(struct bsc_nat *nat, int group)
@@ -286,11 +402,13 @@ struct bsc_nat_paging_group *bsc_nat_paging_group_num(struct bsc_nat *nat, int g
 void bsc_nat_paging_group_add_lac(struct bsc_nat_paging_group *pgroup, int lac)
 {
 	_add_lac(pgroup, &pgroup->lists, lac);
+	bsc_nat_paging_update_group(pgroup->nat, pgroup->nr);
 }
 
 void bsc_nat_paging_group_del_lac(struct bsc_nat_paging_group *pgroup, int lac)
 {
 	_del_lac(&pgroup->lists, lac);
+	bsc_nat_paging_update_group(pgroup->nat, pgroup->nr);
 }
 
 int bsc_config_handles_lac(struct bsc_config *cfg, int lac_nr)
@@ -314,13 +432,129 @@ int bsc_config_handles_lac(struct bsc_config *cfg, int lac_nr)
 	return 0;
 }
 
+/*
+ * The paging index maps each LAC to the authenticated BSCs handling
+ * it. It is kept per BSC and redone for the BSCs affected whenever
+ * the authentication, the LACs of a config or of a paging group or
+ * the paging group of a config change.
+ */
+static void paging_add_lac(struct bsc_connection *bsc, uint16_t lac)
+{
+	struct bsc_paging_lac *entry;
+
+	/* a LAC of the config might be in the paging group too */
+	llist_for_each_entry(entry, &bsc->paging_lacs, bsc_entry)
+		if (entry->lac == lac)
+			return;
+
+	entry = talloc_zero(bsc, struct bsc_paging_lac);
+	if (!entry) {
+		LOGP(DNAT, LOGL_ERROR, "Failed to allocate a paging entry.\n");
+		return;
+	}
+
+	entry->bsc = bsc;
+	entry->lac = lac;
+	llist_add_tail(&entry->bsc_entry, &bsc->paging_lacs);
+	llist_add_tail(&entry->lac_entry,
+		       &bsc->nat->paging_by_lac[lac % NAT_PAGING_HASH_SIZE]);
+}
+
+void bsc_nat_paging_clear(struct bsc_connection *bsc)
+{
+	struct bsc_paging_lac *entry, *tmp;
+
+	llist_for_each_entry_safe(entry, tmp, &bsc->paging_lacs, bsc_entry) {
+		llist_del(&entry->lac_entry);
+		llist_del(&entry->bsc_entry);
+		talloc_free(entry);
+	}
+}
+
+void bsc_nat_paging_update(struct bsc_connection *bsc)
+{
+	struct bsc_nat_paging_group *pgroup;
+	struct bsc_lac_entry *lac;
+
+	bsc_nat_paging_clear(bsc);
+	if (!bsc->authenticated || !bsc->cfg)
+		return;
+
+	llist_for_each_entry(lac, &bsc->cfg->lac_list, entry)
+		paging_add_lac(bsc, lac->lac);
+
+	pgroup = bsc_nat_paging_group_num(bsc->nat, bsc->cfg->paging_group);
+	if (!pgroup)
+		return;
+
+	llist_for_each_entry(lac, &pgroup->lists, entry)
+		paging_add_lac(bsc, lac->lac);
+}
+
+void bsc_nat_paging_update_cfg(struct bsc_config *cfg)
+{
+	struct bsc_connection *bsc;
+
+	llist_for_each_entry(bsc, &cfg->nat->bsc_connections, list_entry)
+		if (bsc->cfg == cfg)
+			bsc_nat_paging_update(bsc);
+}
+
+void bsc_nat_paging_update_group(struct bsc_nat *nat, int group)
+{
+	struct bsc_connection *bsc;
+
+	llist_for_each_entry(bsc, &nat->bsc_connections, list_entry)
+		if (bsc->cfg && bsc->cfg->paging_group == group)
+			bsc_nat_paging_update(bsc);
+}
+
+/**
+ * Call send for every BSC handling one of the LACs in the cell
+ * identifier list. A BSC handling several of them is only called
+ * once. Returns the number of BSCs.
+ */
+int bsc_nat_paging_fan_out(struct bsc_nat *nat, const uint8_t *cell_list, int len,
+			   void (*send)(struct bsc_connection *bsc, void *data),
+			   void *data)
+{
+	struct bsc_paging_lac *entry;
+	unsigned int seq = ++nat->paging_seq;
+	int i, sent = 0;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		uint16_t lac = cell_list[i] << 8 | cell_list[i + 1];
+		unsigned int paged = 0;
+
+		llist_for_each_entry(entry, &nat->paging_by_lac[lac % NAT_PAGING_HASH_SIZE],
+				     lac_entry) {
+			if (entry->lac != lac)
+				continue;
+
+			paged += 1;
+			if (entry->bsc->paging_seq == seq)
+				continue;
+
+			entry->bsc->paging_seq = seq;
+			send(entry->bsc, data);
+			sent += 1;
+		}
+
+		/* highlight a possible config issue */
+		if (paged == 0)
+			LOGP(DNAT, LOGL_ERROR, "No BSC for LAC %d/0x%d\n", lac, lac);
+	}
+
+	return sent;
+}
+
 void sccp_connection_destroy(struct nat_sccp_connection *conn)
 {
 	LOGP(DNAT, LOGL_DEBUG, "Destroy 0x%x <-> 0x%x mapping for con %p\n",
 	     sccp_src_ref_to_int(&conn->real_ref),
 	     sccp_src_ref_to_int(&conn->patched_ref), conn->bsc);
 	bsc_mgcp_dlcx(conn);
-	llist_del(&conn->list_entry);
+	sccp_connection_del(conn);
 	talloc_free(conn);
 }
 
@@ -476,12 +710,64 @@ int bsc_conn_type_to_ctr(struct nat_sccp_connection *conn)
 	return con_to_ctr[conn->filter_state.con_type];
 }
 
+/**
+ * Write the message handed out by the write queue together with the
+ * ones queued behind it with a single writev(). The write queue frees
+ * msg, the other messages are taken off the queue here once they are
+ * written. What did not fit stays at the head of the queue.
+ */
+int bsc_nat_writev(struct osmo_fd *bfd, struct msgb *msg, unsigned int *frames)
+{
+	struct osmo_wqueue *queue = container_of(bfd, struct osmo_wqueue, bfd);
+	struct iovec iov[NAT_WRITEV_MAX_FRAMES];
+	struct msgb *next;
+	size_t bytes = msg->len;
+	ssize_t rc, left;
+	int count = 1;
+
+	iov[0].iov_base = msg->data;
+	iov[0].iov_len = msg->len;
+	llist_for_each_entry(next, &queue->msg_queue, list) {
+		if (count == ARRAY_SIZE(iov)
+		    || bytes + next->len > NAT_WRITEV_MAX_BYTES)
+			break;
+		iov[count].iov_base = next->data;
+		iov[count].iov_len = next->len;
+		bytes += next->len;
+		count += 1;
+	}
+
+	*frames = 0;
+	rc = writev(bfd->fd, iov, count);
+	if (rc < msg->len)
+		return rc;
+
+	*frames = 1;
+	left = rc - msg->len;
+	while (left > 0) {
+		next = llist_entry(queue->msg_queue.next, struct msgb, list);
+		if (left < next->len) {
+			msgb_pull(next, left);
+			break;
+		}
+
+		left -= next->len;
+		msgb_dequeue(&queue->msg_queue);
+		queue->current_length -= 1;
+		*frames += 1;
+		msgb_free(next);
+	}
+
+	return rc;
+}
+
 int bsc_write_cb(struct osmo_fd *bfd, struct msgb *msg)
 {
+	unsigned int frames;
 	int rc;
 
-	rc = write(bfd->fd, msg->data, msg->len);
-	if (rc != msg->len)
+	rc = bsc_nat_writev(bfd, msg, &frames);
+	if (rc < msg->len)
 		LOGP(DNAT, LOGL_ERROR, "Failed to write message to the BSC.\n");
 
 	return rc;
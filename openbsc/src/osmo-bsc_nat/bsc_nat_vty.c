@@ -243,10 +243,12 @@ DEFUN(show_bsc, show_bsc_cmd, "show bsc connections",
 
 	llist_for_each_entry(con, &_nat->bsc_connections, list_entry) {
 		getpeername(con->write_queue.bfd.fd, (struct sockaddr *) &sock, &len);
-		vty_out(vty, "BSC nr: %d auth: %d fd: %d peername: %s pending-stats: %u%s",
+		vty_out(vty, "BSC nr: %d auth: %d fd: %d peername: %s pending-stats: %u "
+			"write-queue: %u peak: %u%s",
 			con->cfg ? con->cfg->nr : -1,
 			con->authenticated, con->write_queue.bfd.fd,
 			inet_ntoa(sock.sin_addr), con->pending_dlcx_count,
+			con->write_queue.current_length, con->queue_peak,
 			VTY_NEWLINE);
 	}
 
@@ -294,13 +296,26 @@ static void dump_stat_total(struct vty *vty, struct bsc_nat *nat)
 	vty_out(vty, " SCCP Connections %lu total, %lu calls%s",
 		osmo_counter_get(nat->stats.sccp.conn),
 		osmo_counter_get(nat->stats.sccp.calls), VTY_NEWLINE);
+	vty_out(vty, " SCCP References %u used, %u free, %u peak%s",
+		nat->sccp_refs->num_used,
+		nat->sccp_refs->usable - nat->sccp_refs->num_used,
+		nat->sccp_refs->peak_used, VTY_NEWLINE);
+	vty_out(vty, " Timers %u pending%s", nat->timers->pending, VTY_NEWLINE);
 	vty_out(vty, " MSC Connections %lu%s",
 		osmo_counter_get(nat->stats.msc.reconn), VTY_NEWLINE);
 	vty_out(vty, " MSC Connected: %d%s",
 		bsc_nat_msc_is_connected(nat), VTY_NEWLINE);
+	vty_out(vty, " MSC Writes %"PRIu64" calls, %"PRIu64" frames%s",
+		nat->stats.msc.ctrg->ctr[NAT_MSC_CTR_WRITE_CALLS].current,
+		nat->stats.msc.ctrg->ctr[NAT_MSC_CTR_WRITE_FRAMES].current, VTY_NEWLINE);
 	vty_out(vty, " BSC Connections %lu total, %lu auth failed.%s",
 		osmo_counter_get(nat->stats.bsc.reconn),
 		osmo_counter_get(nat->stats.bsc.auth_fail), VTY_NEWLINE);
+	vty_out(vty, " BSC Auth %lu done, %lu us avg, %lu us max latency%s",
+		nat->stats.bsc.auth_count, nat->stats.bsc.auth_count ?
+			(unsigned long) (nat->stats.bsc.auth_total_us /
+					 nat->stats.bsc.auth_count) : 0,
+		nat->stats.bsc.auth_max_us, VTY_NEWLINE);
 }
 
 static void dump_bsc_status(struct vty *vty, struct bsc_config *conf)
@@ -748,15 +763,34 @@ DEFUN(cfg_nat_no_sms_number_rewrite,
 	return CMD_SUCCESS;
 }
 
+/*
+ * The new trie is loaded before the old one is given up, lookups never
+ * see a partial trie and a broken file keeps the old one in place. A
+ * compiled file is only mapped which keeps the reload cheap.
+ */
+static int load_prefix_trie(struct vty *vty, const char *filename)
+{
+	struct nat_rewrite *trie;
+
+	trie = nat_rewrite_parse(_nat, filename);
+	if (!trie) {
+		vty_out(vty, "%% prefix-tree parsing has failed.%s", VTY_NEWLINE);
+		return CMD_WARNING;
+	}
+
+	talloc_free(_nat->num_rewr_trie);
+	_nat->num_rewr_trie = trie;
+
+	vty_out(vty, "%% prefix-tree loaded %zu rules.%s",
+		_nat->num_rewr_trie->prefixes, VTY_NEWLINE);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_nat_prefix_trie,
       cfg_nat_prefix_trie_cmd,
       "prefix-tree FILENAME",
       "Prefix tree for number rewriting\n" "File to load\n")
 {
-	/* give up the old data */
-	talloc_free(_nat->num_rewr_trie);
-	_nat->num_rewr_trie = NULL;
-
 	/* replace the file name */
 	osmo_talloc_replace_string(_nat, &_nat->num_rewr_trie_name, argv[0]);
 	if (!_nat->num_rewr_trie_name) {
@@ -764,15 +798,20 @@ DEFUN(cfg_nat_prefix_trie,
 		return CMD_WARNING;
 	}
 
-	_nat->num_rewr_trie = nat_rewrite_parse(_nat, _nat->num_rewr_trie_name);
-	if (!_nat->num_rewr_trie) {
-		vty_out(vty, "%% prefix-tree parsing has failed.%s", VTY_NEWLINE);
+	return load_prefix_trie(vty, _nat->num_rewr_trie_name);
+}
+
+DEFUN(reload_prefix_trie, reload_prefix_trie_cmd,
+      "reload prefix-tree",
+      "Reload a file\n" "Prefix tree for number rewriting\n")
+{
+	if (!_nat->num_rewr_trie_name) {
+		vty_out(vty, "%% there is no prefix tree configured.%s",
+			VTY_NEWLINE);
 		return CMD_WARNING;
 	}
 
-	vty_out(vty, "%% prefix-tree loaded %zu rules.%s",
-		_nat->num_rewr_trie->prefixes, VTY_NEWLINE);
-	return CMD_SUCCESS;
+	return load_prefix_trie(vty, _nat->num_rewr_trie_name);
 }
 
 DEFUN(cfg_nat_no_prefix_trie, cfg_nat_no_prefix_trie_cmd,
@@ -801,6 +840,42 @@ DEFUN(show_prefix_tree, show_prefix_tree_cmd,
 	return CMD_SUCCESS;
 }
 
+static void show_rewrite_rules(struct vty *vty, const char *name,
+			       const char *file, struct llist_head *head)
+{
+	struct bsc_nat_num_rewr_entry *entry;
+
+	if (!file)
+		return;
+
+	vty_out(vty, "%s %s:%s", name, file, VTY_NEWLINE);
+	llist_for_each_entry(entry, head, list)
+		vty_out(vty, " IMSI(%s) Number(%s) Replace(%s) Hits(%lu)%s%s",
+			entry->msisdn_pattern, entry->num_pattern, entry->replace,
+			entry->hits,
+			bsc_nat_num_rewr_is_compiled(entry) ? "" : " regexp",
+			VTY_NEWLINE);
+}
+
+DEFUN(show_nat_rewrite_rules, show_nat_rewrite_rules_cmd,
+      "show nat rewrite-rules",
+      SHOW_STR "Display NAT configuration details\n"
+      "Number rewriting rules and their usage\n")
+{
+	show_rewrite_rules(vty, "number-rewrite", _nat->num_rewr_name, &_nat->num_rewr);
+	show_rewrite_rules(vty, "number-rewrite-post", _nat->num_rewr_post_name,
+			   &_nat->num_rewr_post);
+	show_rewrite_rules(vty, "rewrite-smsc addr", _nat->smsc_rewr_name,
+			   &_nat->smsc_rewr);
+	show_rewrite_rules(vty, "rewrite-smsc tp-dest-match", _nat->tpdest_match_name,
+			   &_nat->tpdest_match);
+	show_rewrite_rules(vty, "sms-clear-tp-srr", _nat->sms_clear_tp_srr_name,
+			   &_nat->sms_clear_tp_srr);
+	show_rewrite_rules(vty, "sms-number-rewrite", _nat->sms_num_rewr_name,
+			   &_nat->sms_num_rewr);
+	return CMD_SUCCESS;
+}
+
 DEFUN(cfg_nat_ussd_lst_name,
       cfg_nat_ussd_lst_name_cmd,
       "ussd-list-name NAME",
@@ -920,7 +995,7 @@ DEFUN(cfg_bsc_token, cfg_bsc_token_cmd, "token TOKEN",
 	if (strncmp(conf->token, argv[0], 128) != 0)
 		conf->token_updated = true;
 
-	osmo_talloc_replace_string(conf, &conf->token, argv[0]);
+	bsc_config_set_token(conf, argv[0]);
 	return CMD_SUCCESS;
 }
 
@@ -1082,6 +1157,7 @@ DEFUN(cfg_bsc_paging_grp,
 {
 	struct bsc_config *conf = vty->index;
 	conf->paging_group = atoi(argv[0]);
+	bsc_nat_paging_update_cfg(conf);
 	return CMD_SUCCESS;
 }
 
@@ -1096,6 +1172,7 @@ DEFUN(cfg_bsc_no_paging_grp,
 {
 	struct bsc_config *conf = vty->index;
 	conf->paging_group = PAGIN_GROUP_UNASSIGNED;
+	bsc_nat_paging_update_cfg(conf);
 	return CMD_SUCCESS;
 }
 
@@ -1348,10 +1425,12 @@ int bsc_nat_vty_init(struct bsc_nat *nat)
 	install_element_ve(&show_bscs_cmd);
 	install_element_ve(&show_bar_lst_cmd);
 	install_element_ve(&show_prefix_tree_cmd);
+	install_element_ve(&show_nat_rewrite_rules_cmd);
 	install_element_ve(&show_ussd_connection_cmd);
 
 	install_element(ENABLE_NODE, &set_last_endp_cmd);
 	install_element(ENABLE_NODE, &block_new_conn_cmd);
+	install_element(ENABLE_NODE, &reload_prefix_trie_cmd);
 
 	/* nat group */
 	install_element(CONFIG_NODE, &cfg_nat_cmd);
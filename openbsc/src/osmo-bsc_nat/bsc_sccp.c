@@ -27,83 +27,374 @@
 
 #include <osmocom/core/talloc.h>
 
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 
-static int equal(struct sccp_source_reference *ref1, struct sccp_source_reference *ref2)
+static int equal(const struct sccp_source_reference *ref1,
+		 const struct sccp_source_reference *ref2)
 {
 	return memcmp(ref1, ref2, sizeof(*ref1)) == 0;
 }
 
 /*
- * SCCP patching below
+ * Hash indexes into nat->sccp_connections
  */
 
-/* check if we are using this ref for patched already */
-static int sccp_ref_is_free(struct sccp_source_reference *ref, struct bsc_nat *nat)
+/* every BSC counts its references from the same start, mix the BSC in */
+static unsigned int sccp_hash(const struct bsc_connection *bsc,
+			      const struct sccp_source_reference *ref)
+{
+	uint32_t key;
+
+	key = ref->octet1 | ref->octet2 << 8 | ref->octet3 << 16;
+	key ^= (uint32_t) ((uintptr_t) bsc >> 4);
+	return (key * 2654435761u) >> (32 - NAT_SCCP_HASH_BITS);
+}
+
+static unsigned int msc_endp_hash(int endp)
+{
+	return endp & (NAT_SCCP_HASH_SIZE - 1);
+}
+
+/* the connections are zero allocated or taken out with llist_del_init() */
+static int index_linked(struct llist_head *entry)
+{
+	return entry->next && !llist_empty(entry);
+}
+
+static void index_unlink(struct llist_head *entry)
+{
+	if (index_linked(entry))
+		llist_del_init(entry);
+}
+
+/**
+ * Put the connection on the lists of the nat and the BSC and into the
+ * indexes.
+ * The patched_ref has to come from nat->sccp_refs. Once added the
+ * references and the msc_endp must only be changed with the setters
+ * below.
+ */
+void sccp_connection_add(struct bsc_nat *nat, struct nat_sccp_connection *conn)
+{
+	llist_add_tail(&conn->list_entry, &nat->sccp_connections);
+	llist_add_tail(&conn->bsc_entry, &conn->bsc->sccp_connections);
+	conn->bsc->sccp_count += 1;
+	llist_add_tail(&conn->real_entry,
+		       &nat->sccp_by_real[sccp_hash(conn->bsc, &conn->real_ref)]);
+	llist_add_tail(&conn->patched_entry,
+		       &nat->sccp_by_patched[sccp_hash(NULL, &conn->patched_ref)]);
+	llist_add_tail(&conn->remote_entry,
+		       &nat->sccp_by_remote[sccp_hash(conn->bsc, &conn->remote_ref)]);
+
+	INIT_LLIST_HEAD(&conn->msc_endp_entry);
+	if (conn->msc_endp != -1)
+		llist_add_tail(&conn->msc_endp_entry,
+			       &nat->sccp_by_msc_endp[msc_endp_hash(conn->msc_endp)]);
+}
+
+/* the patched reference goes back to the pool */
+void sccp_connection_del(struct nat_sccp_connection *conn)
+{
+	if (index_linked(&conn->patched_entry))
+		nat_sccp_ref_pool_put(conn->bsc->nat->sccp_refs,
+				      sccp_src_ref_to_int(&conn->patched_ref));
+
+	llist_del(&conn->list_entry);
+	llist_del(&conn->bsc_entry);
+	conn->bsc->sccp_count -= 1;
+	nat_wheel_timer_del(conn->bsc->nat->timers, &conn->unconfirmed);
+	index_unlink(&conn->real_entry);
+	index_unlink(&conn->patched_entry);
+	index_unlink(&conn->remote_entry);
+	index_unlink(&conn->msc_endp_entry);
+}
+
+void sccp_connection_set_patched_ref(struct nat_sccp_connection *conn,
+				     const struct sccp_source_reference *ref)
+{
+	conn->patched_ref = *ref;
+	if (!index_linked(&conn->patched_entry))
+		return;
+
+	llist_del(&conn->patched_entry);
+	llist_add_tail(&conn->patched_entry,
+		       &conn->bsc->nat->sccp_by_patched[sccp_hash(NULL, ref)]);
+}
+
+void sccp_connection_set_remote_ref(struct nat_sccp_connection *conn,
+				    const struct sccp_source_reference *ref)
+{
+	conn->remote_ref = *ref;
+	if (!index_linked(&conn->remote_entry))
+		return;
+
+	llist_del(&conn->remote_entry);
+	llist_add_tail(&conn->remote_entry,
+		       &conn->bsc->nat->sccp_by_remote[sccp_hash(conn->bsc, ref)]);
+}
+
+/* a connection that has not been added yet only gets the value */
+void sccp_connection_set_msc_endp(struct nat_sccp_connection *conn, int endp)
+{
+	int linked = index_linked(&conn->real_entry);
+
+	conn->msc_endp = endp;
+	index_unlink(&conn->msc_endp_entry);
+	if (!linked || endp == -1)
+		return;
+
+	llist_add_tail(&conn->msc_endp_entry,
+		       &conn->bsc->nat->sccp_by_msc_endp[msc_endp_hash(endp)]);
+}
+
+static struct nat_sccp_connection *find_by_real(struct bsc_nat *nat,
+						struct bsc_connection *bsc,
+						const struct sccp_source_reference *ref)
+{
+	struct nat_sccp_connection *conn;
+
+	llist_for_each_entry(conn, &nat->sccp_by_real[sccp_hash(bsc, ref)], real_entry) {
+		if (conn->bsc == bsc && equal(ref, &conn->real_ref))
+			return conn;
+	}
+
+	return NULL;
+}
+
+static struct nat_sccp_connection *find_by_patched(struct bsc_nat *nat,
+						   const struct sccp_source_reference *ref)
 {
 	struct nat_sccp_connection *conn;
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
+	llist_for_each_entry(conn, &nat->sccp_by_patched[sccp_hash(NULL, ref)], patched_entry) {
 		if (equal(ref, &conn->patched_ref))
+			return conn;
+	}
+
+	return NULL;
+}
+
+static struct nat_sccp_connection *find_by_remote(struct bsc_nat *nat,
+						  struct bsc_connection *bsc,
+						  const struct sccp_source_reference *ref)
+{
+	struct nat_sccp_connection *conn;
+
+	llist_for_each_entry(conn, &nat->sccp_by_remote[sccp_hash(bsc, ref)], remote_entry) {
+		if (conn->bsc == bsc && equal(ref, &conn->remote_ref))
+			return conn;
+	}
+
+	return NULL;
+}
+
+/*
+ * Pool of the local references
+ */
+
+struct nat_sccp_ref_pool *nat_sccp_ref_pool_alloc(void *ctx, uint32_t first)
+{
+	struct nat_sccp_ref_pool *pool;
+
+	pool = talloc_zero(ctx, struct nat_sccp_ref_pool);
+	if (!pool)
+		return NULL;
+
+	pool->used = talloc_zero_array(pool, uint64_t, NAT_SCCP_REF_WORDS);
+	pool->full_words = talloc_zero_array(pool, uint64_t, NAT_SCCP_REF_BLOCKS);
+	if (!pool->used || !pool->full_words) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	/* do not use the reserved word */
+	pool->used[NAT_SCCP_REF_WORDS - 1] = 1ULL << 63;
+	pool->next = first % NAT_SCCP_REF_USABLE;
+	pool->usable = NAT_SCCP_REF_USABLE;
+	return pool;
+}
+
+/* the first block of a part, parts are whole blocks of references */
+static uint32_t ref_part_start(int part, int parts)
+{
+	return (part * NAT_SCCP_REF_BLOCKS + parts - 1) / parts;
+}
+
+/* the part of the reference space a reference belongs to */
+int nat_sccp_ref_part(uint32_t ref, int parts)
+{
+	return (ref / NAT_SCCP_REF_BLOCK_SIZE) * parts / NAT_SCCP_REF_BLOCKS;
+}
+
+/**
+ * Only hand out the references of one part of the space. The blocks
+ * of the other parts are marked as full, they are never looked at.
+ */
+void nat_sccp_ref_pool_restrict(struct nat_sccp_ref_pool *pool, int part, int parts)
+{
+	uint32_t block, start, end;
+
+	start = ref_part_start(part, parts);
+	end = ref_part_start(part + 1, parts);
+
+	for (block = 0; block < NAT_SCCP_REF_BLOCKS; ++block) {
+		if (block >= start && block < end)
+			continue;
+		memset(&pool->used[block * 64], 0xff, 64 * sizeof(uint64_t));
+		pool->full_words[block] = ~0ULL;
+		pool->full_blocks[block / 64] |= 1ULL << (block % 64);
+	}
+
+	pool->usable = (end - start) * NAT_SCCP_REF_BLOCK_SIZE;
+	if (end == NAT_SCCP_REF_BLOCKS)
+		pool->usable -= 1;
+	if (nat_sccp_ref_part(pool->next, parts) != part)
+		pool->next = start * NAT_SCCP_REF_BLOCK_SIZE;
+}
+
+static void ref_pool_mark_used(struct nat_sccp_ref_pool *pool, uint32_t ref)
+{
+	uint32_t word = ref / 64, block = word / 64;
+
+	pool->used[word] |= 1ULL << (ref % 64);
+	if (pool->used[word] != ~0ULL)
+		return;
+
+	pool->full_words[block] |= 1ULL << (word % 64);
+	if (pool->full_words[block] != ~0ULL)
+		return;
+
+	pool->full_blocks[block / 64] |= 1ULL << (block % 64);
+}
+
+static void ref_pool_mark_free(struct nat_sccp_ref_pool *pool, uint32_t ref)
+{
+	uint32_t word = ref / 64, block = word / 64;
+
+	pool->used[word] &= ~(1ULL << (ref % 64));
+	pool->full_words[block] &= ~(1ULL << (word % 64));
+	pool->full_blocks[block / 64] &= ~(1ULL << (block % 64));
+}
+
+/* the first free reference at or after ref, -1 when there is none */
+static int ref_pool_find(struct nat_sccp_ref_pool *pool, uint32_t ref)
+{
+	uint32_t word = ref / 64, block, top;
+	uint64_t bits;
+
+	bits = ~pool->used[word] & (~0ULL << (ref % 64));
+	if (bits)
+		return word * 64 + __builtin_ctzll(bits);
+
+	/* the next word with a free bit in this block */
+	word += 1;
+	if (word == NAT_SCCP_REF_WORDS)
+		return -1;
+	block = word / 64;
+	bits = ~pool->full_words[block] & (~0ULL << (word % 64));
+
+	/* or the next block with a free word */
+	if (!bits) {
+		block += 1;
+		if (block == NAT_SCCP_REF_BLOCKS)
+			return -1;
+		top = block / 64;
+		bits = ~pool->full_blocks[top] & (~0ULL << (block % 64));
+		while (!bits) {
+			top += 1;
+			if (top == ARRAY_SIZE(pool->full_blocks))
+				return -1;
+			bits = ~pool->full_blocks[top];
+		}
+		block = top * 64 + __builtin_ctzll(bits);
+		bits = ~pool->full_words[block];
+	}
+
+	word = block * 64 + __builtin_ctzll(bits);
+	return word * 64 + __builtin_ctzll(~pool->used[word]);
+}
+
+/**
+ * Hand out the next free reference after the last one, like the
+ * counter of sccp.c it only wraps at the end of the 24 bit space.
+ */
+int nat_sccp_ref_pool_get(struct nat_sccp_ref_pool *pool, uint32_t *ref)
+{
+	int found;
+
+	found = ref_pool_find(pool, pool->next);
+	if (found < 0) {
+		LOGP(DNAT, LOGL_NOTICE, "Wrapped searching for a free code\n");
+		found = ref_pool_find(pool, 0);
+		if (found < 0)
 			return -1;
 	}
 
+	ref_pool_mark_used(pool, found);
+	pool->num_used += 1;
+	if (pool->num_used > pool->peak_used)
+		pool->peak_used = pool->num_used;
+
+	pool->next = (found + 1) % NAT_SCCP_REF_USABLE;
+	*ref = found;
 	return 0;
 }
 
-/* copied from sccp.c */
+void nat_sccp_ref_pool_put(struct nat_sccp_ref_pool *pool, uint32_t ref)
+{
+	if (ref >= NAT_SCCP_REF_USABLE)
+		return;
+	if (!(pool->used[ref / 64] & (1ULL << (ref % 64))))
+		return;
+
+	ref_pool_mark_free(pool, ref);
+	pool->num_used -= 1;
+}
+
+/*
+ * SCCP patching below
+ */
+
 static int assign_src_local_reference(struct sccp_source_reference *ref, struct bsc_nat *nat)
 {
-	static uint32_t last_ref = 0x50000;
-	int wrapped = 0;
-
-	do {
-		struct sccp_source_reference reference;
-		reference.octet1 = (last_ref >>  0) & 0xff;
-		reference.octet2 = (last_ref >>  8) & 0xff;
-		reference.octet3 = (last_ref >> 16) & 0xff;
-
-		++last_ref;
-		/* do not use the reversed word and wrap around */
-		if ((last_ref & 0x00FFFFFF) == 0x00FFFFFF) {
-			LOGP(DNAT, LOGL_NOTICE, "Wrapped searching for a free code\n");
-			last_ref = 0;
-			++wrapped;
-		}
+	uint32_t val;
 
-		if (sccp_ref_is_free(&reference, nat) == 0) {
-			*ref = reference;
-			return 0;
-		}
-	} while (wrapped != 2);
+	if (nat_sccp_ref_pool_get(nat->sccp_refs, &val) != 0) {
+		LOGP(DNAT, LOGL_ERROR, "Finding a free reference failed\n");
+		return -1;
+	}
 
-	LOGP(DNAT, LOGL_ERROR, "Finding a free reference failed\n");
-	return -1;
+	ref->octet1 = (val >>  0) & 0xff;
+	ref->octet2 = (val >>  8) & 0xff;
+	ref->octet3 = (val >> 16) & 0xff;
+	return 0;
 }
 
 struct nat_sccp_connection *create_sccp_src_ref(struct bsc_connection *bsc,
 					     struct bsc_nat_parsed *parsed)
 {
 	struct nat_sccp_connection *conn;
+	struct sccp_source_reference ref;
 
 	/* Some commercial BSCs like to reassign there SRC ref */
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (conn->bsc != bsc)
-			continue;
-		if (!equal(parsed->src_local_ref, &conn->real_ref))
-			continue;
-
+	conn = find_by_real(bsc->nat, bsc, parsed->src_local_ref);
+	if (conn) {
 		/* the BSC has reassigned the SRC ref and we failed to keep track */
-		memset(&conn->remote_ref, 0, sizeof(conn->remote_ref));
-		if (assign_src_local_reference(&conn->patched_ref, bsc->nat) != 0) {
+		memset(&ref, 0, sizeof(ref));
+		sccp_connection_set_remote_ref(conn, &ref);
+		if (assign_src_local_reference(&ref, bsc->nat) != 0) {
 			LOGP(DNAT, LOGL_ERROR, "BSC %d reused src ref: %d and we failed to generate a new id.\n",
 			     bsc->cfg->nr, sccp_src_ref_to_int(parsed->src_local_ref));
 			bsc_mgcp_dlcx(conn);
-			llist_del(&conn->list_entry);
+			sccp_connection_del(conn);
 			talloc_free(conn);
 			return NULL;
 		} else {
+			nat_sccp_ref_pool_put(bsc->nat->sccp_refs,
+					      sccp_src_ref_to_int(&conn->patched_ref));
+			sccp_connection_set_patched_ref(conn, &ref);
 			clock_gettime(CLOCK_MONOTONIC, &conn->creation_time);
 			bsc_mgcp_dlcx(conn);
 			return conn;
@@ -127,7 +418,7 @@ struct nat_sccp_connection *create_sccp_src_ref(struct bsc_connection *bsc,
 	}
 
 	bsc_mgcp_init(conn);
-	llist_add_tail(&conn->list_entry, &bsc->nat->sccp_connections);
+	sccp_connection_add(bsc->nat, conn);
 	rate_ctr_inc(&bsc->cfg->stats.ctrg->ctr[BCFG_CTR_SCCP_CONN]);
 	osmo_counter_inc(bsc->cfg->nat->stats.sccp.conn);
 
@@ -145,8 +436,9 @@ int update_sccp_src_ref(struct nat_sccp_connection *sccp, struct bsc_nat_parsed
 		return -1;
 	}
 
-	sccp->remote_ref = *parsed->src_local_ref;
+	sccp_connection_set_remote_ref(sccp, parsed->src_local_ref);
 	sccp->has_remote_ref = 1;
+	nat_wheel_timer_del(sccp->bsc->nat->timers, &sccp->unconfirmed);
 	LOGP(DNAT, LOGL_DEBUG, "Updating 0x%x to remote 0x%x on %p\n",
 	     sccp_src_ref_to_int(&sccp->patched_ref),
 	     sccp_src_ref_to_int(&sccp->remote_ref), sccp->bsc);
@@ -158,11 +450,10 @@ void remove_sccp_src_ref(struct bsc_connection *bsc, struct msgb *msg, struct bs
 {
 	struct nat_sccp_connection *conn;
 
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (equal(parsed->src_local_ref, &conn->patched_ref)) {
-			sccp_connection_destroy(conn);
-			return;
-		}
+	conn = find_by_patched(bsc->nat, parsed->src_local_ref);
+	if (conn) {
+		sccp_connection_destroy(conn);
+		return;
 	}
 
 	LOGP(DNAT, LOGL_ERROR, "Can not remove connection: 0x%x\n",
@@ -185,17 +476,13 @@ struct nat_sccp_connection *patch_sccp_src_ref_to_bsc(struct msgb *msg,
 		return NULL;
 	}
 
+	conn = find_by_patched(nat, parsed->dest_local_ref);
+	if (!conn)
+		return NULL;
 
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
-		if (!equal(parsed->dest_local_ref, &conn->patched_ref))
-			continue;
-
-		/* Change the dest address to the real one */
-		*parsed->dest_local_ref = conn->real_ref;
-		return conn;
-	}
-
-	return NULL;
+	/* Change the dest address to the real one */
+	*parsed->dest_local_ref = conn->real_ref;
+	return conn;
 }
 
 /*
@@ -212,36 +499,22 @@ struct nat_sccp_connection *patch_sccp_src_ref_to_msc(struct msgb *msg,
 {
 	struct nat_sccp_connection *conn;
 
-	llist_for_each_entry(conn, &bsc->nat->sccp_connections, list_entry) {
-		if (conn->bsc != bsc)
-			continue;
-
-		if (parsed->src_local_ref) {
-			if (equal(parsed->src_local_ref, &conn->real_ref)) {
-				*parsed->src_local_ref = conn->patched_ref;
-				return conn;
-			}
-		} else if (parsed->dest_local_ref) {
-			if (equal(parsed->dest_local_ref, &conn->remote_ref))
-				return conn;
-		} else {
-			LOGP(DNAT, LOGL_ERROR, "Header has neither loc/dst ref.\n");
-			return NULL;
-		}
+	if (parsed->src_local_ref) {
+		conn = find_by_real(bsc->nat, bsc, parsed->src_local_ref);
+		if (conn)
+			*parsed->src_local_ref = conn->patched_ref;
+		return conn;
+	} else if (parsed->dest_local_ref) {
+		return find_by_remote(bsc->nat, bsc, parsed->dest_local_ref);
 	}
 
+	LOGP(DNAT, LOGL_ERROR, "Header has neither loc/dst ref.\n");
 	return NULL;
 }
 
 struct nat_sccp_connection *bsc_nat_find_con_by_bsc(struct bsc_nat *nat,
-						 struct sccp_source_reference *ref)
+						 struct bsc_connection *bsc,
+						 const struct sccp_source_reference *ref)
 {
-	struct nat_sccp_connection *conn;
-
-	llist_for_each_entry(conn, &nat->sccp_connections, list_entry) {
-		if (equal(ref, &conn->real_ref))
-			return conn;
-	}
-
-	return NULL;
+	return find_by_real(nat, bsc, ref);
 }
@@ -106,7 +106,8 @@ static int forward_sccp(struct bsc_nat *nat, struct msgb *msg)
 		return -1;
 	}
 
-	con = bsc_nat_find_con_by_bsc(nat, parsed->dest_local_ref);
+	/* the provider answers to the patched reference, see forward_ussd() */
+	con = patch_sccp_src_ref_to_bsc(msg, parsed, nat);
 	if (!con || !con->bsc) {
 		LOGP(DNAT, LOGL_ERROR, "No active connection found.\n");
 		msgb_free(msg);
@@ -352,7 +353,7 @@ static int forward_ussd(struct nat_sccp_connection *con, const struct ussd_reque
 	state->trans_id = req->transaction_id;
 	state->invoke_id = req->invoke_id;
 	memcpy(&state->src_ref, &con->remote_ref, sizeof(con->remote_ref));
-	memcpy(&state->dst_ref, &con->real_ref, sizeof(con->real_ref));
+	memcpy(&state->dst_ref, &con->patched_ref, sizeof(con->patched_ref));
 	memcpy(state->imsi, con->filter_state.imsi, strlen(con->filter_state.imsi));
 
 	/* add additional tag/values */
@@ -0,0 +1,58 @@
+/* Compile a prefix tree CSV file for the NAT */
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <openbsc/nat_rewrite_trie.h>
+#include <openbsc/debug.h>
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/talloc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv)
+{
+	struct nat_rewrite *trie;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s PREFIXES.csv OUTPUT\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	osmo_init_logging(&log_info);
+
+	trie = nat_rewrite_parse(NULL, argv[1]);
+	if (!trie) {
+		fprintf(stderr, "Failed to parse %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	/* the NAT maps the file, the old one stays valid until reloaded */
+	if (nat_rewrite_write(trie, argv[2]) != 0) {
+		fprintf(stderr, "Failed to write %s\n", argv[2]);
+		talloc_free(trie);
+		return EXIT_FAILURE;
+	}
+
+	printf("Compiled %zu rules with %u nodes into %s\n",
+		trie->prefixes, trie->hdr->num_nodes, argv[2]);
+	talloc_free(trie);
+	return EXIT_SUCCESS;
+}
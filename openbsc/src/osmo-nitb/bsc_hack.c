@@ -30,6 +30,7 @@
 #include <getopt.h>
 
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 #include <osmocom/core/application.h>
 #include <osmocom/core/select.h>
 #include <osmocom/core/stats.h>
@@ -65,6 +66,7 @@ extern const char *openbsc_copyright;
 static int daemonize = 0;
 static const char *mncc_sock_path = NULL;
 static int use_db_counter = 1;
+static volatile sig_atomic_t quit = 0;
 
 /* timer to store statistics */
 #define DB_SYNC_INTERVAL	60, 0
@@ -203,10 +205,8 @@ static void signal_handler(int signal)
 	switch (signal) {
 	case SIGINT:
 	case SIGTERM:
-		bsc_shutdown_net(bsc_gsmnet);
-		osmo_signal_dispatch(SS_L_GLOBAL, S_L_GLOBAL_SHUTDOWN, NULL);
-		sleep(3);
-		exit(0);
+		/* the shutdown is done by the main loop */
+		quit = 1;
 		break;
 	case SIGABRT:
 		osmo_generate_backtrace();
@@ -281,6 +281,9 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	/* changed subscribers are written back once they are unused */
+	bsc_gsmnet->subscr_group->write_back = subscr_write_back_db;
+
 	/* Initialize VTY */
 	bsc_vty_init(bsc_gsmnet);
 	ctrl_vty_init(tall_bsc_ctx);
@@ -395,8 +398,20 @@ int main(int argc, char **argv)
 		}
 	}
 
-	while (1) {
+	/* the database thread does not survive the fork */
+	if (db_async_start() != 0) {
+		printf("DB: Failed to start the database thread.\n");
+		return -1;
+	}
+
+	while (!quit) {
 		log_reset_context();
 		osmo_select_main(0);
 	}
+
+	bsc_shutdown_net(bsc_gsmnet);
+	osmo_signal_dispatch(SS_L_GLOBAL, S_L_GLOBAL_SHUTDOWN, NULL);
+	subscr_write_back_all();
+	db_async_drain(3000);
+	exit(0);
 }
@@ -26,24 +26,12 @@
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/utils.h>
 
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
-int main(int argc, char **argv)
+static void check_lookups(struct nat_rewrite *trie)
 {
-	struct nat_rewrite *trie;
-
-	osmo_init_logging(&log_info);
-
-	printf("Testing the trie\n");
-
-	trie = nat_rewrite_parse(NULL, "prefixes.csv");
-	OSMO_ASSERT(trie);
-
-	/* verify that it has been parsed */
-	OSMO_ASSERT(trie->prefixes == 17);
-	printf("Dumping the internal trie\n");
-	nat_rewrite_dump(trie);
-
 	/* now do the matching... */
 	OSMO_ASSERT(!nat_rewrite_lookup(trie, ""));
 	OSMO_ASSERT(!nat_rewrite_lookup(trie, "2"));
@@ -76,12 +64,87 @@ int main(int argc, char **argv)
 
 	/* invalid input */
 	OSMO_ASSERT(!nat_rewrite_lookup(trie, "12abc"));
+}
+
+/* write a copy of the compiled trie with a broken header or size */
+static void write_broken(struct nat_rewrite *trie, const char *filename,
+			 uint32_t version, size_t len)
+{
+	struct nat_rewrite_file_hdr hdr = *trie->hdr;
+	FILE *file;
+
+	hdr.version = version;
+	file = fopen(filename, "w");
+	OSMO_ASSERT(file);
+	OSMO_ASSERT(fwrite(&hdr, sizeof(hdr), 1, file) == 1);
+	OSMO_ASSERT(fwrite(trie->nodes, len - sizeof(hdr), 1, file) == 1);
+	fclose(file);
+}
+
+static void test_compiled(void)
+{
+	struct nat_rewrite *trie, *compiled;
+
+	printf("Testing the compiled trie\n");
 
+	trie = nat_rewrite_parse(NULL, "prefixes.csv");
+	OSMO_ASSERT(trie);
+	OSMO_ASSERT(!trie->map);
+	printf("Compiled %zu rules into %u nodes and %zu bytes\n",
+		trie->prefixes, trie->hdr->num_nodes, trie->len);
+
+	OSMO_ASSERT(nat_rewrite_write(trie, "prefixes.trie") == 0);
+	compiled = nat_rewrite_parse(NULL, "prefixes.trie");
+	OSMO_ASSERT(compiled);
+	OSMO_ASSERT(compiled->map);
+	OSMO_ASSERT(compiled->len == trie->len);
+	OSMO_ASSERT(memcmp(compiled->hdr, trie->hdr, trie->len) == 0);
+	OSMO_ASSERT(compiled->prefixes == 17);
+
+	printf("Dumping the mapped trie\n");
+	nat_rewrite_dump(compiled);
+	check_lookups(compiled);
+
+	/* replacing the file leaves the mapping alone */
+	OSMO_ASSERT(nat_rewrite_write(trie, "prefixes.trie") == 0);
+	check_lookups(compiled);
+	talloc_free(compiled);
+
+	/* broken files are refused */
+	write_broken(trie, "broken.trie", NAT_REWRITE_VERSION, trie->len - 1);
+	OSMO_ASSERT(!nat_rewrite_parse(NULL, "broken.trie"));
+	write_broken(trie, "broken.trie", NAT_REWRITE_VERSION + 1, trie->len);
+	OSMO_ASSERT(!nat_rewrite_parse(NULL, "broken.trie"));
+
+	unlink("broken.trie");
+	unlink("prefixes.trie");
+	talloc_free(trie);
+}
+
+int main(int argc, char **argv)
+{
+	struct nat_rewrite *trie;
+
+	osmo_init_logging(&log_info);
+
+	printf("Testing the trie\n");
+
+	trie = nat_rewrite_parse(NULL, "prefixes.csv");
+	OSMO_ASSERT(trie);
+
+	/* verify that it has been parsed */
+	OSMO_ASSERT(trie->prefixes == 17);
+	printf("Dumping the internal trie\n");
+	nat_rewrite_dump(trie);
+
+	check_lookups(trie);
 	talloc_free(trie);
 
 	trie = nat_rewrite_parse(NULL, "does_not_exist.csv");
 	OSMO_ASSERT(!trie);
 
+	test_compiled();
+
 	printf("Done with the tests.\n");
 	return 0;
 }
@@ -0,0 +1,479 @@
+/* Time the hot paths of the NAT */
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Not part of the testsuite, run it by hand:
+ *
+ *   bsc_nat_bench
+ *
+ * The numbers depend on the machine, the results are checked by
+ * bsc_nat_test instead. The time per lookup should not depend on the
+ * number of entries.
+ */
+
+#include <openbsc/debug.h>
+#include <openbsc/gsm_data.h>
+#include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_sccp.h>
+#include <openbsc/bsc_msg_filter.h>
+
+#include <osmocom/core/application.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+
+#include <osmocom/sccp/sccp.h>
+
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SCCP_BSCS	8
+#define SCCP_LOOKUPS	200000
+#define PAGING_LACS	5	/* per BSC */
+#define PAGINGS		10000
+#define ACC_ENTRIES	10000
+#define ACC_IMSIS	200
+#define ACC_ROUNDS	100	/* of the compiled list per IMSI */
+#define REWR_RULES	5000
+#define REWR_NUMBERS	500
+#define REWR_ROUNDS	100	/* of the compiled rules per number */
+#define WHEEL_TIMERS	200000
+#define WHEEL_TICKS	1200
+#define TOKEN_LOOKUPS	10000
+
+static double elapsed_ns(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 +
+		(end.tv_nsec - start->tv_nsec);
+}
+
+static void int_to_ref(struct sccp_source_reference *ref, uint32_t val)
+{
+	ref->octet1 = (val >>  0) & 0xff;
+	ref->octet2 = (val >>  8) & 0xff;
+	ref->octet3 = (val >> 16) & 0xff;
+}
+
+/* the BSC side of a CR, the MSC side of a DT1 and the BSC side of a DT1 */
+static void sccp_round(struct bsc_nat *nat, struct bsc_connection **bscs,
+		       struct nat_sccp_connection **conns, int i)
+{
+	struct bsc_nat_parsed parsed;
+	struct sccp_source_reference ref;
+
+	memset(&parsed, 0, sizeof(parsed));
+	int_to_ref(&ref, i / SCCP_BSCS);
+	parsed.src_local_ref = &ref;
+	OSMO_ASSERT(patch_sccp_src_ref_to_msc(NULL, &parsed,
+				bscs[i % SCCP_BSCS]) == conns[i]);
+
+	parsed.src_local_ref = NULL;
+	parsed.dest_local_ref = &ref;
+	OSMO_ASSERT(patch_sccp_src_ref_to_bsc(NULL, &parsed, nat) == conns[i]);
+
+	int_to_ref(&ref, 0x800000 | i);
+	OSMO_ASSERT(patch_sccp_src_ref_to_msc(NULL, &parsed,
+				bscs[i % SCCP_BSCS]) == conns[i]);
+}
+
+static void bench_sccp(int count)
+{
+	struct bsc_nat *nat;
+	struct bsc_connection *bscs[SCCP_BSCS];
+	struct nat_sccp_connection **conns;
+	struct bsc_nat_parsed parsed;
+	struct sccp_source_reference ref, remote;
+	struct timespec start;
+	int i;
+
+	nat = bsc_nat_alloc();
+	for (i = 0; i < SCCP_BSCS; ++i) {
+		bscs[i] = bsc_connection_alloc(nat);
+		bscs[i]->cfg = bsc_config_alloc(nat, "foo", i);
+		llist_add_tail(&bscs[i]->list_entry, &nat->bsc_connections);
+	}
+	conns = talloc_zero_array(nat, struct nat_sccp_connection *, count);
+
+	/* all BSCs hand out the same references */
+	memset(&parsed, 0, sizeof(parsed));
+	for (i = 0; i < count; ++i) {
+		int_to_ref(&ref, i / SCCP_BSCS);
+		parsed.src_local_ref = &ref;
+		parsed.dest_local_ref = NULL;
+		conns[i] = create_sccp_src_ref(bscs[i % SCCP_BSCS], &parsed);
+		OSMO_ASSERT(conns[i]);
+
+		int_to_ref(&remote, 0x800000 | i);
+		parsed.src_local_ref = &remote;
+		parsed.dest_local_ref = &conns[i]->patched_ref;
+		OSMO_ASSERT(update_sccp_src_ref(conns[i], &parsed) == 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < SCCP_LOOKUPS; ++i)
+		sccp_round(nat, bscs, conns, 1 + (i * 7919) % (count - 1));
+	printf("  %6d connections %8.1f ns per message\n", count,
+	       elapsed_ns(&start) / (SCCP_LOOKUPS * 3));
+
+	bsc_nat_free(nat);
+}
+
+/* the time per reference should not depend on the fill of the pool */
+static void bench_ref_pool(void)
+{
+	struct nat_sccp_ref_pool *pool;
+	struct timespec start;
+	uint32_t ref;
+	int quarter, i;
+
+	pool = nat_sccp_ref_pool_alloc(NULL, 1);
+	for (quarter = 1; quarter <= 4; ++quarter) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < NAT_SCCP_REF_USABLE / 4; ++i)
+			OSMO_ASSERT(nat_sccp_ref_pool_get(pool, &ref) == 0);
+		printf("  %d/4 used %8.1f ns per reference\n", quarter,
+		       elapsed_ns(&start) / i);
+	}
+
+	/* every second one free again, found from anywhere */
+	for (ref = 1; ref < NAT_SCCP_REF_USABLE; ref += 2)
+		nat_sccp_ref_pool_put(pool, ref);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; nat_sccp_ref_pool_get(pool, &ref) == 0; ++i)
+		;
+	printf("  refilled %8.1f ns per reference\n", elapsed_ns(&start) / i);
+
+	talloc_free(pool);
+}
+
+static void count_paged(struct bsc_connection *bsc, void *data)
+{
+	*(int *) data += 1;
+}
+
+/* the fan-out through the LAC index against walking every BSC */
+static void bench_paging(int num_bscs)
+{
+	struct bsc_nat *nat;
+	struct bsc_connection *bsc;
+	struct timespec start;
+	uint8_t cells[2];
+	int i, lac, paged = 0;
+	double ns_list, ns_index;
+
+	nat = bsc_nat_alloc();
+	for (i = 0; i < num_bscs; ++i) {
+		bsc = bsc_connection_alloc(nat);
+		bsc->cfg = bsc_config_alloc(nat, "foo", i);
+		llist_add_tail(&bsc->list_entry, &nat->bsc_connections);
+		bsc->authenticated = 1;
+		bsc_nat_paging_update(bsc);
+		for (lac = 0; lac < PAGING_LACS; ++lac)
+			bsc_config_add_lac(bsc->cfg, i * PAGING_LACS + lac);
+	}
+
+	/* what bsc_nat_handle_paging did before */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < PAGINGS; ++i) {
+		lac = (i * 7) % (num_bscs * PAGING_LACS);
+		llist_for_each_entry(bsc, &nat->bsc_connections, list_entry) {
+			if (!bsc->cfg || !bsc->authenticated)
+				continue;
+			if (!bsc_config_handles_lac(bsc->cfg, lac))
+				continue;
+			count_paged(bsc, &paged);
+		}
+	}
+	ns_list = elapsed_ns(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < PAGINGS; ++i) {
+		lac = (i * 7) % (num_bscs * PAGING_LACS);
+		cells[0] = lac >> 8;
+		cells[1] = lac & 0xff;
+		bsc_nat_paging_fan_out(nat, cells, 2, count_paged, &paged);
+	}
+	ns_index = elapsed_ns(&start);
+
+	OSMO_ASSERT(paged == 2 * PAGINGS);
+	printf("  %4d BSCs list %8.1f index %8.1f ns per paging\n",
+	       num_bscs, ns_list / PAGINGS, ns_index / PAGINGS);
+	bsc_nat_free(nat);
+}
+
+/* what the access lists did before they were compiled */
+static struct bsc_msg_acc_lst_entry *acc_regexec(struct bsc_msg_acc_lst *lst,
+						 const char *imsi)
+{
+	struct bsc_msg_acc_lst_entry *entry;
+
+	llist_for_each_entry(entry, &lst->fltr_list, list)
+		if (entry->imsi_deny && regexec(&entry->imsi_deny_re, imsi, 0, NULL, 0) == 0)
+			return entry;
+	return NULL;
+}
+
+/* a big list of prefixes with some regexps in between */
+static void bench_acc_lst(void)
+{
+	struct bsc_msg_acc_lst *lst;
+	struct bsc_msg_acc_lst_entry *entry;
+	struct timespec start;
+	char imsi[16], re[32];
+	const char *deny = re;
+	void *ctx = talloc_named_const(NULL, 0, "acc");
+	LLIST_HEAD(lists);
+	double ns_regexec = 0, ns_match = 0;
+	int i, j;
+
+	lst = bsc_msg_acc_lst_get(ctx, &lists, "big");
+	for (i = 0; i < ACC_ENTRIES; ++i) {
+		if (i % 1000 == 999)
+			snprintf(re, sizeof(re), "^2620%d.*9$", i / 1000);
+		else if (i % 2)
+			snprintf(re, sizeof(re), "^26201%04d", i);
+		else
+			snprintf(re, sizeof(re), "2620%04d", i);
+		entry = bsc_msg_acc_lst_entry_create(lst);
+		OSMO_ASSERT(gsm_parse_reg(entry, &entry->imsi_deny_re,
+					  &entry->imsi_deny, 1, &deny) == 0);
+	}
+
+	for (i = 0; i < ACC_IMSIS; ++i) {
+		snprintf(imsi, sizeof(imsi), "2620%d%04d%06d", i % 3, (i * 7919) % 10000, i);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		entry = acc_regexec(lst, imsi);
+		ns_regexec += elapsed_ns(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < ACC_ROUNDS; ++j)
+			OSMO_ASSERT(bsc_msg_acc_lst_find_deny(lst, imsi) == entry);
+		ns_match += elapsed_ns(&start);
+	}
+
+	printf("  %d entries regexec %10.1f compiled %8.1f ns per IMSI\n",
+	       ACC_ENTRIES, ns_regexec / ACC_IMSIS,
+	       ns_match / (ACC_IMSIS * ACC_ROUNDS));
+	bsc_msg_acc_lst_delete(lst);
+	talloc_free(ctx);
+}
+
+/* what the rewriting did before the rules were compiled */
+static struct bsc_nat_num_rewr_entry *rewrite_regexec(struct llist_head *head,
+						   const char *imsi, const char *number,
+						   int *group)
+{
+	struct bsc_nat_num_rewr_entry *entry;
+
+	llist_for_each_entry(entry, head, list) {
+		regmatch_t matches[2];
+
+		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
+			continue;
+		if (regexec(&entry->num_reg, number, 2, matches, 0) != 0)
+			continue;
+		if (group && matches[1].rm_eo == -1)
+			continue;
+		if (group)
+			*group = matches[1].rm_so;
+		return entry;
+	}
+
+	return NULL;
+}
+
+/* a rule for each network with a regexp in between */
+static void bench_rewrite(void)
+{
+	struct bsc_nat *nat = bsc_nat_alloc();
+	struct bsc_nat_num_rewr_entry *entry;
+	struct osmo_config_list cfg;
+	struct osmo_config_entry *cfg_entries;
+	struct timespec start;
+	char imsi[16], number[16];
+	double ns_regexec = 0, ns_match = 0;
+	int i, j, off, ref_off;
+
+	INIT_LLIST_HEAD(&cfg.entry);
+	cfg_entries = talloc_zero_array(nat, struct osmo_config_entry, REWR_RULES);
+	for (i = 0; i < REWR_RULES; ++i) {
+		char *mcc = talloc_asprintf(nat, "%03d", 200 + i / 100);
+		char *mnc = talloc_asprintf(nat, "%02d", i % 100);
+
+		cfg_entries[i].mcc = i % 1000 == 500 ? "*" : mcc;
+		cfg_entries[i].mnc = mnc;
+		cfg_entries[i].option = i % 1000 == 500 ? "^(1|2)(.*)" :
+				i % 2 ? "^0([1-9][0-9]*)" : "^\\+49([0-9]*)";
+		cfg_entries[i].text = "0049";
+		llist_add_tail(&cfg_entries[i].list, &cfg.entry);
+	}
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, &cfg);
+
+	for (i = 0; i < REWR_NUMBERS; ++i) {
+		snprintf(imsi, sizeof(imsi), "%03d%02d0000%05d", 200 + (i * 7) % 51, (i * 13) % 100, i);
+		snprintf(number, sizeof(number), "%s%d", i % 3 ? "0" : "+49", 301234 + i);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		entry = rewrite_regexec(&nat->num_rewr, imsi, number, &ref_off);
+		ns_regexec += elapsed_ns(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < REWR_ROUNDS; ++j)
+			OSMO_ASSERT(bsc_nat_num_rewr_find(&nat->num_rewr, NULL, imsi,
+							  number, &off) == entry);
+		ns_match += elapsed_ns(&start);
+	}
+
+	printf("  %d rules regexec %10.1f compiled %8.1f ns per number\n",
+	       REWR_RULES, ns_regexec / REWR_NUMBERS,
+	       ns_match / (REWR_NUMBERS * REWR_ROUNDS));
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, NULL);
+	bsc_nat_free(nat);
+}
+
+static void wheel_count_cb(void *data)
+{
+	*(int *) data += 1;
+}
+
+/* many timers, only the expiring ones are looked at */
+static void bench_timer_wheel(void)
+{
+	struct nat_timer_wheel *wheel;
+	struct nat_wheel_timer *timers;
+	struct timespec start;
+	uint32_t base;
+	int i, fired = 0;
+	double ns_schedule, ns_expire;
+
+	wheel = nat_timer_wheel_alloc(NULL);
+	timers = talloc_zero_array(NULL, struct nat_wheel_timer, WHEEL_TIMERS);
+	OSMO_ASSERT(wheel && timers);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < WHEEL_TIMERS; ++i) {
+		nat_wheel_timer_setup(&timers[i], wheel_count_cb, &fired);
+		nat_wheel_timer_schedule(wheel, &timers[i], 1 + i % WHEEL_TICKS);
+	}
+	ns_schedule = elapsed_ns(&start);
+
+	base = wheel->now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 1; i <= WHEEL_TICKS; ++i)
+		nat_timer_wheel_advance(wheel, base + i);
+	ns_expire = elapsed_ns(&start);
+
+	OSMO_ASSERT(fired == WHEEL_TIMERS && wheel->pending == 0);
+	printf("  %d timers schedule %6.1f expire %6.1f ns per timer\n",
+	       WHEEL_TIMERS, ns_schedule / WHEEL_TIMERS, ns_expire / WHEEL_TIMERS);
+	talloc_free(timers);
+	talloc_free(wheel);
+}
+
+/* the token lookup of the authentication, through the list and the index */
+static void bench_bsc_config(int num_bscs)
+{
+	struct bsc_nat *nat;
+	struct bsc_config *conf, *found;
+	struct timespec start;
+	char token[32];
+	double ns_list, ns_index;
+	int i, len;
+
+	nat = bsc_nat_alloc();
+	for (i = 0; i < num_bscs; ++i) {
+		snprintf(token, sizeof(token), "bsc-%d", i);
+		bsc_config_alloc(nat, token, i);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < TOKEN_LOOKUPS; ++i) {
+		len = snprintf(token, sizeof(token), "bsc-%d", (i * 7) % num_bscs) + 1;
+		found = NULL;
+		/* what bsc_config_by_token did before */
+		llist_for_each_entry(conf, &nat->bsc_configs, entry) {
+			if (strlen(conf->token) + 1 == len &&
+			    memcmp(conf->token, token, len) == 0) {
+				found = conf;
+				break;
+			}
+		}
+		OSMO_ASSERT(found);
+	}
+	ns_list = elapsed_ns(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < TOKEN_LOOKUPS; ++i) {
+		len = snprintf(token, sizeof(token), "bsc-%d", (i * 7) % num_bscs) + 1;
+		OSMO_ASSERT(bsc_config_by_token(nat, token, len));
+	}
+	ns_index = elapsed_ns(&start);
+
+	printf("  %4d BSCs list %8.1f index %8.1f ns per token\n",
+	       num_bscs, ns_list / TOKEN_LOOKUPS, ns_index / TOKEN_LOOKUPS);
+	bsc_nat_free(nat);
+}
+
+int main(int argc, char **argv)
+{
+	msgb_talloc_ctx_init(NULL, 0);
+	sccp_set_log_area(DSCCP);
+	osmo_init_logging(&log_info);
+	log_set_log_level(osmo_stderr_target, LOGL_FATAL);
+
+	printf("Patching the SCCP references\n");
+	bench_sccp(1000);
+	bench_sccp(10000);
+	bench_sccp(50000);
+
+	printf("Allocating SCCP references\n");
+	bench_ref_pool();
+
+	printf("Paging by LAC\n");
+	bench_paging(100);
+	bench_paging(1000);
+
+	printf("Matching the access lists\n");
+	bench_acc_lst();
+
+	printf("Rewriting the numbers\n");
+	bench_rewrite();
+
+	printf("Expiring the timers\n");
+	bench_timer_wheel();
+
+	printf("Looking up the BSC tokens\n");
+	bench_bsc_config(1000);
+	bench_bsc_config(2000);
+
+	return 0;
+}
+
+/* stub */
+void bsc_nat_send_mgcp_to_msc(struct bsc_nat *nat, struct msgb *msg)
+{
+	abort();
+}
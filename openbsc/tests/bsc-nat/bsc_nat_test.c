@@ -25,6 +25,7 @@
 #include <openbsc/debug.h>
 #include <openbsc/gsm_data.h>
 #include <openbsc/bsc_nat.h>
+#include <openbsc/bsc_nat_mux.h>
 #include <openbsc/bsc_nat_sccp.h>
 #include <openbsc/bsc_msg_filter.h>
 #include <openbsc/nat_rewrite_trie.h>
@@ -35,8 +36,13 @@
 
 #include <osmocom/sccp/sccp.h>
 #include <osmocom/gsm/protocol/gsm_08_08.h>
+#include <osmocom/gsm/protocol/ipaccess.h>
 
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
 
 /* test messages for ipa */
 static uint8_t ipa_id[] = {
@@ -598,7 +604,7 @@ static void test_mgcp_find(void)
 	sccp_con->msc_endp = 12;
 	sccp_con->bsc_endp = 12;
 	sccp_con->bsc = con;
-	llist_add(&sccp_con->list_entry, &nat->sccp_connections);
+	sccp_connection_add(nat, sccp_con);
 
 	if (bsc_mgcp_find_con(nat, 11) != NULL) {
 		printf("Found the wrong connection.\n");
@@ -911,6 +917,8 @@ static void test_cr_filter()
 			      cr_filter[i].bsc_imsi_deny ? 1 : 0,
 			      &cr_filter[i].bsc_imsi_deny) != 0)
 			abort();
+		bsc_msg_acc_lst_changed(nat_lst);
+		bsc_msg_acc_lst_changed(bsc_lst);
 
 		parsed = bsc_nat_parse(msg);
 		if (!parsed) {
@@ -1514,6 +1522,486 @@ static void test_barr_list_parsing(void)
 	rc = bsc_filter_barr_adapt(NULL, &root, NULL);
 }
 
+#define SCCP_INDEX_BSCS		8
+
+static void int_to_ref(struct sccp_source_reference *ref, uint32_t val)
+{
+	ref->octet1 = (val >>  0) & 0xff;
+	ref->octet2 = (val >>  8) & 0xff;
+	ref->octet3 = (val >> 16) & 0xff;
+}
+
+static int equal_ref(const struct sccp_source_reference *a,
+		     const struct sccp_source_reference *b)
+{
+	return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+/* the BSC side of a CR, CC, DT1 and the MSC side of a DT1 */
+static void sccp_index_round(struct bsc_nat *nat, struct bsc_connection **bscs,
+			     struct nat_sccp_connection **conns, int i)
+{
+	struct bsc_nat_parsed parsed;
+	struct sccp_source_reference ref;
+
+	memset(&parsed, 0, sizeof(parsed));
+	int_to_ref(&ref, i / SCCP_INDEX_BSCS);
+	parsed.src_local_ref = &ref;
+	OSMO_ASSERT(patch_sccp_src_ref_to_msc(NULL, &parsed,
+				bscs[i % SCCP_INDEX_BSCS]) == conns[i]);
+	OSMO_ASSERT(equal_ref(&ref, &conns[i]->patched_ref));
+
+	parsed.src_local_ref = NULL;
+	parsed.dest_local_ref = &ref;
+	OSMO_ASSERT(patch_sccp_src_ref_to_bsc(NULL, &parsed, nat) == conns[i]);
+	OSMO_ASSERT(equal_ref(&ref, &conns[i]->real_ref));
+
+	int_to_ref(&ref, 0x800000 | i);
+	OSMO_ASSERT(patch_sccp_src_ref_to_msc(NULL, &parsed,
+				bscs[i % SCCP_INDEX_BSCS]) == conns[i]);
+}
+
+static void sccp_index_run(int count)
+{
+	struct bsc_nat *nat;
+	struct bsc_connection *bscs[SCCP_INDEX_BSCS];
+	struct nat_sccp_connection **conns;
+	struct bsc_nat_parsed parsed;
+	struct sccp_source_reference ref, remote, patched;
+	int i;
+
+	nat = bsc_nat_alloc();
+	for (i = 0; i < SCCP_INDEX_BSCS; ++i) {
+		bscs[i] = bsc_connection_alloc(nat);
+		bscs[i]->cfg = bsc_config_alloc(nat, "foo", i);
+		llist_add_tail(&bscs[i]->list_entry, &nat->bsc_connections);
+	}
+	conns = talloc_zero_array(nat, struct nat_sccp_connection *, count);
+
+	/* all BSCs hand out the same references */
+	memset(&parsed, 0, sizeof(parsed));
+	for (i = 0; i < count; ++i) {
+		int_to_ref(&ref, i / SCCP_INDEX_BSCS);
+		parsed.src_local_ref = &ref;
+		parsed.dest_local_ref = NULL;
+		conns[i] = create_sccp_src_ref(bscs[i % SCCP_INDEX_BSCS], &parsed);
+		OSMO_ASSERT(conns[i]);
+
+		int_to_ref(&remote, 0x800000 | i);
+		parsed.src_local_ref = &remote;
+		parsed.dest_local_ref = &conns[i]->patched_ref;
+		OSMO_ASSERT(update_sccp_src_ref(conns[i], &parsed) == 0);
+	}
+
+	for (i = 0; i < count; ++i)
+		sccp_index_round(nat, bscs, conns, i);
+
+	/* a BSC reusing a reference gets a new patched one */
+	int_to_ref(&ref, 0);
+	patched = conns[0]->patched_ref;
+	parsed.src_local_ref = &ref;
+	OSMO_ASSERT(create_sccp_src_ref(bscs[0], &parsed) == conns[0]);
+	OSMO_ASSERT(!equal_ref(&patched, &conns[0]->patched_ref));
+	parsed.src_local_ref = NULL;
+	parsed.dest_local_ref = &patched;
+	OSMO_ASSERT(patch_sccp_src_ref_to_bsc(NULL, &parsed, nat) == NULL);
+	OSMO_ASSERT(bsc_nat_find_con_by_bsc(nat, bscs[0], &ref) == conns[0]);
+	OSMO_ASSERT(bsc_nat_find_con_by_bsc(nat, bscs[1], &ref) == conns[1]);
+
+	/* the MGCP endpoints */
+	sccp_connection_set_msc_endp(conns[1], 23);
+	sccp_connection_set_msc_endp(conns[2], 23 + NAT_SCCP_HASH_SIZE);
+	OSMO_ASSERT(bsc_mgcp_find_con(nat, 23) == conns[1]);
+	OSMO_ASSERT(bsc_mgcp_find_con(nat, 23 + NAT_SCCP_HASH_SIZE) == conns[2]);
+	sccp_connection_set_msc_endp(conns[1], -1);
+	OSMO_ASSERT(bsc_mgcp_find_con(nat, 23) == NULL);
+
+	/* release every second one */
+	for (i = 0; i < count; i += 2) {
+		patched = conns[i]->patched_ref;
+		parsed.src_local_ref = &patched;
+		remove_sccp_src_ref(bscs[i % SCCP_INDEX_BSCS], NULL, &parsed);
+	}
+	for (i = 1; i < count; i += 2)
+		sccp_index_round(nat, bscs, conns, i);
+	int_to_ref(&ref, 2 / SCCP_INDEX_BSCS);
+	parsed.src_local_ref = &ref;
+	parsed.dest_local_ref = NULL;
+	OSMO_ASSERT(patch_sccp_src_ref_to_msc(NULL, &parsed, bscs[2]) == NULL);
+	OSMO_ASSERT(llist_count(&nat->sccp_connections) == count / 2);
+	OSMO_ASSERT(llist_count(&bscs[0]->sccp_connections) == bscs[0]->sccp_count);
+	OSMO_ASSERT(nat->sccp_refs->num_used == count / 2);
+
+	printf("%d connections: ok\n", count);
+	bsc_nat_free(nat);
+}
+
+static void test_sccp_index(void)
+{
+	printf("Testing the SCCP connection indexes\n");
+
+	sccp_index_run(1000);
+	sccp_index_run(10000);
+	sccp_index_run(50000);
+}
+
+static void test_sccp_ref_pool(void)
+{
+	struct nat_sccp_ref_pool *pool;
+	uint32_t ref;
+	int i, count;
+
+	printf("Testing the SCCP reference pool\n");
+
+	/* in order and wrapping around the reserved reference */
+	pool = nat_sccp_ref_pool_alloc(NULL, 0xfffffd);
+	for (i = 0; i < 4; ++i) {
+		OSMO_ASSERT(nat_sccp_ref_pool_get(pool, &ref) == 0);
+		printf("ref 0x%x\n", ref);
+	}
+
+	/* no immediate reuse of a released one */
+	nat_sccp_ref_pool_put(pool, 1);
+	nat_sccp_ref_pool_put(pool, 1);
+	OSMO_ASSERT(pool->num_used == 3);
+	OSMO_ASSERT(nat_sccp_ref_pool_get(pool, &ref) == 0);
+	printf("ref 0x%x after release\n", ref);
+
+	/* exhaust it */
+	for (count = 0; nat_sccp_ref_pool_get(pool, &ref) == 0; ++count)
+		;
+
+	printf("got %d more, %u used, %u peak\n",
+	       count, pool->num_used, pool->peak_used);
+	OSMO_ASSERT(pool->num_used == NAT_SCCP_REF_USABLE);
+
+	/* a hole in a full pool is found from anywhere */
+	nat_sccp_ref_pool_put(pool, 0x123456);
+	nat_sccp_ref_pool_put(pool, 0xffffff);
+	OSMO_ASSERT(nat_sccp_ref_pool_get(pool, &ref) == 0);
+	printf("ref 0x%x in a full pool\n", ref);
+	OSMO_ASSERT(nat_sccp_ref_pool_get(pool, &ref) != 0);
+
+	talloc_free(pool);
+}
+
+/* what the rewriting did before the rules were compiled */
+static struct bsc_nat_num_rewr_entry *rewrite_regexec(struct llist_head *head,
+						   const char *imsi, const char *number,
+						   int *group)
+{
+	struct bsc_nat_num_rewr_entry *entry;
+
+	llist_for_each_entry(entry, head, list) {
+		regmatch_t matches[2];
+
+		if (regexec(&entry->msisdn_reg, imsi, 0, NULL, 0) != 0)
+			continue;
+		if (regexec(&entry->num_reg, number, 2, matches, 0) != 0)
+			continue;
+		if (group && matches[1].rm_eo == -1)
+			continue;
+		if (group)
+			*group = matches[1].rm_so;
+		return entry;
+	}
+
+	return NULL;
+}
+
+static void rewr_check(struct llist_head *head, const char *imsi, const char *number,
+		       int print)
+{
+	struct bsc_nat_num_rewr_entry *entry, *ref;
+	int off = -1, ref_off = -1;
+
+	ref = rewrite_regexec(head, imsi, number, &ref_off);
+	entry = bsc_nat_num_rewr_find(head, NULL, imsi, number, &off);
+	OSMO_ASSERT(entry == ref && off == ref_off);
+	if (print)
+		printf("IMSI(%s) Number(%s) rewrite: %s at %d", imsi, number,
+		       entry ? entry->replace : "none", off);
+
+	ref = rewrite_regexec(head, imsi, number, NULL);
+	entry = bsc_nat_num_rewr_find(head, NULL, imsi, number, NULL);
+	OSMO_ASSERT(entry == ref);
+	if (print)
+		printf(" match: %s\n", entry ? entry->replace : "none");
+}
+
+static void test_rewrite_match(void)
+{
+	static const struct {
+		const char *mcc, *mnc, *option, *text;
+	} rules[] = {
+		{ "274", "08", "^0([1-9])", "a" },
+		{ "^27[0-9]", "", "^1(2|3)(.*)", "b" },
+		{ "*", "*", "^\\+49([0-9]+)$", "c" },
+		{ "274", "*", "^00(.*)", "d" },
+		{ "^2", "", "^9", "e" },
+		{ "001", "01", "^([0-9])", "f" },
+		{ "*", "*", "^0([0-9]*)$", "g" },
+	};
+	static const struct {
+		const char *imsi, *number;
+	} numbers[] = {
+		{ "27408000001234", "0301234" },
+		{ "27409000001234", "0301234" },
+		{ "27409000001234", "0301234a" },
+		{ "27409000001234", "1312" },
+		{ "27409000001234", "+491234" },
+		{ "27409000001234", "+49" },
+		{ "27409000001234", "0012" },
+		{ "26201000001234", "9" },
+		{ "00101000001234", "" },
+		{ "00101000001234", "+1" },
+		{ "00101000001234", "5" },
+	};
+	struct bsc_nat *nat = bsc_nat_alloc();
+	struct bsc_nat_num_rewr_entry *entry;
+	struct osmo_config_list cfg;
+	struct osmo_config_entry *cfg_entries;
+	char imsi[16], number[16];
+	int i, off;
+
+	printf("Testing the compiled rewrite rules\n");
+
+	INIT_LLIST_HEAD(&cfg.entry);
+	cfg_entries = talloc_zero_array(nat, struct osmo_config_entry, 5000);
+	for (i = 0; i < ARRAY_SIZE(rules); ++i) {
+		cfg_entries[i].mcc = (char *) rules[i].mcc;
+		cfg_entries[i].mnc = (char *) rules[i].mnc;
+		cfg_entries[i].option = (char *) rules[i].option;
+		cfg_entries[i].text = (char *) rules[i].text;
+		llist_add_tail(&cfg_entries[i].list, &cfg.entry);
+	}
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, &cfg);
+
+	llist_for_each_entry(entry, &nat->num_rewr, list)
+		printf("IMSI(%s) Number(%s) %s\n", entry->msisdn_pattern, entry->num_pattern,
+		       bsc_nat_num_rewr_is_compiled(entry) ? "compiled" : "regexp");
+	for (i = 0; i < ARRAY_SIZE(numbers); ++i)
+		rewr_check(&nat->num_rewr, numbers[i].imsi, numbers[i].number, 1);
+
+	/* the next match after a prefix lookup without a result */
+	entry = bsc_nat_num_rewr_find(&nat->num_rewr, NULL, "27408000001234", "0301234", &off);
+	entry = bsc_nat_num_rewr_find(&nat->num_rewr, entry, "27408000001234", "0301234", &off);
+	printf("Next rewrite: %s at %d\n", entry ? entry->replace : "none", off);
+
+	/* a rule for each network with a regexp in between */
+	INIT_LLIST_HEAD(&cfg.entry);
+	for (i = 0; i < 5000; ++i) {
+		char *mcc = talloc_asprintf(nat, "%03d", 200 + i / 100);
+		char *mnc = talloc_asprintf(nat, "%02d", i % 100);
+
+		cfg_entries[i].mcc = i % 1000 == 500 ? "*" : mcc;
+		cfg_entries[i].mnc = mnc;
+		cfg_entries[i].option = i % 1000 == 500 ? "^(1|2)(.*)" :
+				i % 2 ? "^0([1-9][0-9]*)" : "^\\+49([0-9]*)";
+		cfg_entries[i].text = "0049";
+		llist_add_tail(&cfg_entries[i].list, &cfg.entry);
+	}
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, &cfg);
+
+	/* same answer as before */
+	for (i = 0; i < 500; ++i) {
+		snprintf(imsi, sizeof(imsi), "%03d%02d0000%05d", 200 + (i * 7) % 51, (i * 13) % 100, i);
+		snprintf(number, sizeof(number), "%s%d", i % 3 ? "0" : "+49", 301234 + i);
+		rewr_check(&nat->num_rewr, imsi, number, 0);
+	}
+
+	bsc_nat_num_rewr_entry_adapt(nat, &nat->num_rewr, NULL);
+	bsc_nat_free(nat);
+}
+
+static struct bsc_msg_acc_lst_entry *acc_add(struct bsc_msg_acc_lst *lst,
+					     const char *allow, const char *deny)
+{
+	struct bsc_msg_acc_lst_entry *entry;
+
+	entry = bsc_msg_acc_lst_entry_create(lst);
+	OSMO_ASSERT(entry);
+	OSMO_ASSERT(gsm_parse_reg(entry, &entry->imsi_allow_re, &entry->imsi_allow,
+				  allow ? 1 : 0, &allow) == 0);
+	OSMO_ASSERT(gsm_parse_reg(entry, &entry->imsi_deny_re, &entry->imsi_deny,
+				  deny ? 1 : 0, &deny) == 0);
+	return entry;
+}
+
+/* what the access lists did before they were compiled */
+static struct bsc_msg_acc_lst_entry *acc_regexec(struct bsc_msg_acc_lst *lst,
+						 const char *imsi)
+{
+	struct bsc_msg_acc_lst_entry *entry;
+
+	llist_for_each_entry(entry, &lst->fltr_list, list)
+		if (entry->imsi_deny && regexec(&entry->imsi_deny_re, imsi, 0, NULL, 0) == 0)
+			return entry;
+	return NULL;
+}
+
+static void test_acc_lst_match(void)
+{
+	static const char *patterns[] = {
+		"^9.9", "^262", "01$", "1234", "^0010$", "^00101[0-9]*", ".*",
+	};
+	static const char *imsis[] = {
+		"262011234567890", "919000000000001", "001011234000001",
+		"001010000000000", "0010", "00201123", "",
+	};
+	struct bsc_msg_acc_lst *lst, *big;
+	struct bsc_msg_acc_lst_entry *entry;
+	char imsi[16], re[32];
+	void *ctx = talloc_named_const(NULL, 0, "acc");
+	LLIST_HEAD(lists);
+	int i;
+
+	printf("Testing the compiled access lists\n");
+
+	lst = bsc_msg_acc_lst_get(ctx, &lists, "test");
+	for (i = 0; i < ARRAY_SIZE(patterns); ++i) {
+		entry = acc_add(lst, NULL, patterns[i]);
+		entry->cm_reject_cause = i;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(imsis); ++i) {
+		entry = bsc_msg_acc_lst_find_deny(lst, imsis[i]);
+		OSMO_ASSERT(entry == acc_regexec(lst, imsis[i]));
+		printf("IMSI '%s' denied by %s\n", imsis[i],
+		       patterns[entry->cm_reject_cause]);
+	}
+
+	/* allow and deny are kept apart, a change is picked up */
+	OSMO_ASSERT(bsc_msg_acc_lst_check_allow(lst, "262011234567890") == 1);
+	acc_add(lst, "^26201", NULL);
+	OSMO_ASSERT(bsc_msg_acc_lst_check_allow(lst, "262011234567890") == 0);
+	OSMO_ASSERT(bsc_msg_acc_lst_check_allow(lst, "262021234567890") == 1);
+	entry = llist_entry(lst->fltr_list.prev, struct bsc_msg_acc_lst_entry, list);
+	OSMO_ASSERT(gsm_parse_reg(entry, &entry->imsi_allow_re, &entry->imsi_allow,
+				  1, &patterns[1]) == 0);
+	bsc_msg_acc_lst_changed(lst);
+	OSMO_ASSERT(bsc_msg_acc_lst_check_allow(lst, "262021234567890") == 0);
+
+	/* a big list of prefixes with some regexps in between */
+	big = bsc_msg_acc_lst_get(ctx, &lists, "big");
+	for (i = 0; i < 10000; ++i) {
+		if (i % 1000 == 999)
+			snprintf(re, sizeof(re), "^2620%d.*9$", i / 1000);
+		else if (i % 2)
+			snprintf(re, sizeof(re), "^26201%04d", i);
+		else
+			snprintf(re, sizeof(re), "2620%04d", i);
+		acc_add(big, NULL, re);
+	}
+
+	/* same answer as before */
+	for (i = 0; i < 200; ++i) {
+		snprintf(imsi, sizeof(imsi), "2620%d%04d%06d", i % 3, (i * 7919) % 10000, i);
+		entry = acc_regexec(big, imsi);
+		OSMO_ASSERT(bsc_msg_acc_lst_find_deny(big, imsi) == entry);
+	}
+	printf("Compiled list of %d entries matches\n", big->deny_match ? 10000 : 0);
+
+	bsc_msg_acc_lst_delete(big);
+	bsc_msg_acc_lst_delete(lst);
+	talloc_free(ctx);
+}
+
+static void print_paged(struct bsc_connection *bsc, void *data)
+{
+	printf(" %d", bsc->cfg->nr);
+}
+
+static void page_lacs(struct bsc_nat *nat, const char *name,
+		      const uint16_t *lacs, int num_lacs)
+{
+	uint8_t cells[16];
+	int i, sent;
+
+	for (i = 0; i < num_lacs; ++i) {
+		cells[i * 2] = lacs[i] >> 8;
+		cells[i * 2 + 1] = lacs[i] & 0xff;
+	}
+
+	printf("%s:", name);
+	sent = bsc_nat_paging_fan_out(nat, cells, num_lacs * 2, print_paged, NULL);
+	printf(" (%d)\n", sent);
+}
+
+static struct bsc_connection *paging_bsc(struct bsc_nat *nat, int nr, int auth)
+{
+	struct bsc_connection *bsc;
+
+	bsc = bsc_connection_alloc(nat);
+	bsc->cfg = bsc_config_alloc(nat, "foo", nr);
+	llist_add_tail(&bsc->list_entry, &nat->bsc_connections);
+
+	/* like the authentication does it */
+	bsc->authenticated = auth;
+	bsc_nat_paging_update(bsc);
+	return bsc;
+}
+
+static void test_paging_index(void)
+{
+	static const uint16_t lac_1[] = { 1 };
+	static const uint16_t lac_2_3[] = { 2, 3 };
+	static const uint16_t lac_1_2_3_4[] = { 1, 2, 3, 4 };
+	static const uint16_t lac_5[] = { 5 };
+	struct bsc_nat *nat;
+	struct bsc_nat_paging_group *pgroup;
+	struct bsc_connection *bsc0, *bsc1, *bsc2, *bsc3;
+
+	printf("Testing the paging index\n");
+
+	nat = bsc_nat_alloc();
+	pgroup = bsc_nat_paging_group_create(nat, 5);
+	bsc_nat_paging_group_add_lac(pgroup, 3);
+	bsc_nat_paging_group_add_lac(pgroup, 4);
+
+	bsc0 = paging_bsc(nat, 0, 1);
+	bsc_config_add_lac(bsc0->cfg, 1);
+	bsc_config_add_lac(bsc0->cfg, 2);
+
+	bsc1 = paging_bsc(nat, 1, 1);
+	bsc_config_add_lac(bsc1->cfg, 2);
+	bsc1->cfg->paging_group = 5;
+	bsc_nat_paging_update_cfg(bsc1->cfg);
+
+	/* not authenticated yet */
+	bsc2 = paging_bsc(nat, 2, 0);
+	bsc_config_add_lac(bsc2->cfg, 1);
+
+	/* LAC 3 from the config and the paging group */
+	bsc3 = paging_bsc(nat, 3, 1);
+	bsc_config_add_lac(bsc3->cfg, 3);
+	bsc3->cfg->paging_group = 5;
+	bsc_nat_paging_update_cfg(bsc3->cfg);
+
+	page_lacs(nat, "LAC 1", lac_1, ARRAY_SIZE(lac_1));
+	page_lacs(nat, "LAC 2,3", lac_2_3, ARRAY_SIZE(lac_2_3));
+	page_lacs(nat, "LAC 1,2,3,4", lac_1_2_3_4, ARRAY_SIZE(lac_1_2_3_4));
+	page_lacs(nat, "LAC 5", lac_5, ARRAY_SIZE(lac_5));
+
+	bsc2->authenticated = 1;
+	bsc_nat_paging_update(bsc2);
+	page_lacs(nat, "LAC 1 authenticated", lac_1, ARRAY_SIZE(lac_1));
+
+	bsc_config_del_lac(bsc0->cfg, 2);
+	bsc_nat_paging_group_del_lac(pgroup, 4);
+	page_lacs(nat, "LAC 1,2,3,4 removed", lac_1_2_3_4, ARRAY_SIZE(lac_1_2_3_4));
+
+	bsc1->cfg->paging_group = PAGIN_GROUP_UNASSIGNED;
+	bsc_nat_paging_update_cfg(bsc1->cfg);
+	page_lacs(nat, "LAC 2,3 no group", lac_2_3, ARRAY_SIZE(lac_2_3));
+
+	bsc_nat_paging_group_delete(pgroup);
+	bsc_nat_paging_clear(bsc2);
+	page_lacs(nat, "LAC 1,2,3,4 deleted", lac_1_2_3_4, ARRAY_SIZE(lac_1_2_3_4));
+
+	bsc_nat_free(nat);
+}
+
 static void test_nat_extract_lac()
 {
 	int res;
@@ -1549,6 +2037,308 @@ static void test_nat_extract_lac()
 	bsc_nat_free(nat);
 }
 
+static int writev_fill(struct osmo_wqueue *queue, int count, int len)
+{
+	struct msgb *msg;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		msg = msgb_alloc(len, "writev");
+		memset(msgb_put(msg, len), i, len);
+		OSMO_ASSERT(osmo_wqueue_enqueue(queue, msg) == 0);
+	}
+
+	return count * len;
+}
+
+/* one round of the write queue, it hands out the head and frees it */
+static int writev_round(struct osmo_wqueue *queue, int fd, unsigned int *frames)
+{
+	static char buf[NAT_WRITEV_MAX_BYTES];
+	struct msgb *msg;
+	int rc;
+
+	msg = msgb_dequeue(&queue->msg_queue);
+	queue->current_length -= 1;
+	rc = bsc_nat_writev(&queue->bfd, msg, frames);
+	msgb_free(msg);
+
+	OSMO_ASSERT(rc > 0 && rc <= sizeof(buf));
+	OSMO_ASSERT(read(fd, buf, sizeof(buf)) == rc);
+	return rc;
+}
+
+static void test_writev(void)
+{
+	struct osmo_wqueue queue;
+	unsigned int frames;
+	int sv[2], rc, total;
+
+	printf("Testing coalesced writes\n");
+
+	OSMO_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	osmo_wqueue_init(&queue, 200);
+	queue.bfd.fd = sv[0];
+
+	/* everything queued goes out at once */
+	writev_fill(&queue, 10, 23);
+	rc = writev_round(&queue, sv[1], &frames);
+	printf("wrote %d bytes in %u frames, %u queued\n",
+		rc, frames, queue.current_length);
+	OSMO_ASSERT(llist_empty(&queue.msg_queue));
+
+	/* limited by the number of frames and by the bytes */
+	total = writev_fill(&queue, 150, 10);
+	total += writev_fill(&queue, 40, 1000);
+	while (!llist_empty(&queue.msg_queue)) {
+		rc = writev_round(&queue, sv[1], &frames);
+		printf("wrote %d bytes in %u frames, %u queued\n",
+			rc, frames, queue.current_length);
+		total -= rc;
+	}
+	OSMO_ASSERT(total == 0);
+	OSMO_ASSERT(queue.current_length == 0);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+struct wheel_test_timer {
+	struct nat_wheel_timer timer;
+	struct nat_timer_wheel *wheel;
+	uint32_t base;
+	unsigned int timeout;
+	int fired;
+};
+
+static void wheel_test_cb(void *data)
+{
+	struct wheel_test_timer *t = data;
+
+	printf("timer of %u fired at %u\n", t->timeout, t->wheel->now - t->base);
+	t->fired += 1;
+}
+
+static void wheel_count_cb(void *data)
+{
+	int *fired = data;
+
+	*fired += 1;
+}
+
+#define WHEEL_MANY_TIMERS 200000
+
+static void test_timer_wheel(void)
+{
+	static const unsigned int timeouts[] = {
+		1, 2, 63, 64, 65, 130, 4095, 4096, 4097, 20000, 300000,
+	};
+	struct wheel_test_timer timers[ARRAY_SIZE(timeouts)];
+	struct nat_wheel_timer *many;
+	struct nat_timer_wheel *wheel;
+	uint32_t base;
+	int i, fired = 0;
+
+	printf("Testing the timer wheel\n");
+
+	wheel = nat_timer_wheel_alloc(NULL);
+	OSMO_ASSERT(wheel);
+
+	memset(timers, 0, sizeof(timers));
+	for (i = 0; i < ARRAY_SIZE(timeouts); ++i) {
+		timers[i].wheel = wheel;
+		timers[i].timeout = timeouts[i];
+		nat_wheel_timer_setup(&timers[i].timer, wheel_test_cb, &timers[i]);
+		nat_wheel_timer_schedule(wheel, &timers[i].timer, timeouts[i]);
+	}
+	OSMO_ASSERT(wheel->pending == ARRAY_SIZE(timeouts));
+
+	/* they all have been started at the same time */
+	base = wheel->now;
+	for (i = 0; i < ARRAY_SIZE(timeouts); ++i)
+		timers[i].base = base;
+
+	/* deleted and restarted timers */
+	nat_wheel_timer_del(wheel, &timers[1].timer);
+	OSMO_ASSERT(!nat_wheel_timer_pending(&timers[1].timer));
+	nat_wheel_timer_del(wheel, &timers[1].timer);
+	nat_wheel_timer_schedule(wheel, &timers[4].timer, 100);
+	timers[4].timeout = 100;
+
+	/* a second at a time and in bigger steps */
+	for (i = 1; i <= 5000; ++i)
+		nat_timer_wheel_advance(wheel, base + i);
+	nat_timer_wheel_advance(wheel, base + 400000);
+
+	for (i = 0; i < ARRAY_SIZE(timeouts); ++i)
+		OSMO_ASSERT(timers[i].fired == (i == 1 ? 0 : 1));
+	OSMO_ASSERT(wheel->pending == 0);
+
+	/* many timers, only the expiring ones are looked at */
+	many = talloc_zero_array(NULL, struct nat_wheel_timer, WHEEL_MANY_TIMERS);
+	OSMO_ASSERT(many);
+	for (i = 0; i < WHEEL_MANY_TIMERS; ++i) {
+		nat_wheel_timer_setup(&many[i], wheel_count_cb, &fired);
+		nat_wheel_timer_schedule(wheel, &many[i], 1 + i % 1200);
+	}
+
+	base = wheel->now;
+	for (i = 1; i <= 1200; ++i)
+		nat_timer_wheel_advance(wheel, base + i);
+	printf("%d of %d timers fired, %u pending\n",
+		fired, WHEEL_MANY_TIMERS, wheel->pending);
+
+	talloc_free(many);
+	talloc_free(wheel);
+}
+
+/* the worker a frame of the MSC is routed to */
+static int mux_route(struct bsc_nat_mux *mux, struct msgb *msg,
+		     const uint8_t *data, int len)
+{
+	struct bsc_nat_parsed *parsed;
+	int nr;
+
+	copy_to_msg(msg, data, len);
+	parsed = bsc_nat_parse(msg);
+	OSMO_ASSERT(parsed);
+	nr = bsc_nat_mux_worker_for(mux, msg, parsed);
+	talloc_free(parsed);
+	return nr;
+}
+
+static void test_mux_routing(void)
+{
+	static const char *mgcp[] = {
+		"CRCX 23 1@mgw MGCP 1.0\r\n",
+		"DLCX 24 1E@mgw MGCP 1.0\r\n",
+		"AUEP 25 *@mgw MGCP 1.0\r\n",
+		"200 23 OK\r\n",
+	};
+	struct nat_sccp_ref_pool *pool;
+	struct bsc_nat_mux mux;
+	struct msgb *msg;
+	uint8_t frame[64];
+	uint32_t ref, first;
+	int i, len, count;
+
+	printf("Testing the routing to the workers\n");
+
+	/* the last of four workers */
+	pool = nat_sccp_ref_pool_alloc(NULL, 0x50000);
+	nat_sccp_ref_pool_restrict(pool, 3, 4);
+	OSMO_ASSERT(nat_sccp_ref_pool_get(pool, &first) == 0);
+	for (count = 1; nat_sccp_ref_pool_get(pool, &ref) == 0; ++count)
+		OSMO_ASSERT(nat_sccp_ref_part(ref, 4) == 3);
+	printf("first ref 0x%x, got %d of %u\n", first, count, pool->usable);
+	talloc_free(pool);
+
+	/* parts are whole blocks, the first ones are bigger */
+	pool = nat_sccp_ref_pool_alloc(NULL, 0x50000);
+	nat_sccp_ref_pool_restrict(pool, 1, 3);
+	OSMO_ASSERT(nat_sccp_ref_pool_get(pool, &first) == 0);
+	printf("first ref 0x%x, %u usable, 0x%x in part %d\n",
+	       first, pool->usable, first - 1, nat_sccp_ref_part(first - 1, 3));
+	talloc_free(pool);
+
+	memset(&mux, 0, sizeof(mux));
+	mux.num_workers = 4;
+	mux.num_endp = 32;
+	mux.endp_owner = talloc_zero_array(NULL, uint8_t, mux.num_endp);
+	msg = msgb_alloc(4096, "test");
+
+	printf("paging to worker %d\n",
+	       mux_route(&mux, msg, paging_by_lac_cmd, sizeof(paging_by_lac_cmd)));
+	printf("clear command to worker %d\n",
+	       mux_route(&mux, msg, msc_dtap, sizeof(msc_dtap)));
+	printf("assignment to worker %d\n",
+	       mux_route(&mux, msg, ass_cmd, sizeof(ass_cmd)));
+
+	/* the MGCP of the call agent follows the assignment */
+	for (i = 0; i < ARRAY_SIZE(mgcp); ++i) {
+		len = strlen(mgcp[i]);
+		frame[0] = 0;
+		frame[1] = len;
+		frame[2] = IPAC_PROTO_MGCP_OLD;
+		memcpy(&frame[3], mgcp[i], len);
+		printf("endpoint %d to worker %d\n",
+		       bsc_nat_mux_mgcp_endp(&frame[3], len),
+		       mux_route(&mux, msg, frame, len + 3));
+	}
+
+	msgb_free(msg);
+	talloc_free(mux.endp_owner);
+}
+
+static struct bsc_config *token_lookup(struct bsc_nat *nat, const char *token)
+{
+	return bsc_config_by_token(nat, token, strlen(token) + 1);
+}
+
+static void test_bsc_config_index(void)
+{
+	struct bsc_nat *nat;
+	struct bsc_config *conf;
+	struct timespec start = { 10, 900000000 }, end;
+	char token[32];
+	int i;
+
+	printf("Testing the BSC config index\n");
+
+	nat = bsc_nat_alloc();
+	for (i = 0; i < 2000; ++i) {
+		snprintf(token, sizeof(token), "bsc-%d", i);
+		OSMO_ASSERT(bsc_config_alloc(nat, token, i));
+	}
+
+	conf = token_lookup(nat, "bsc-1234");
+	printf("bsc-1234 is nr %d\n", conf ? conf->nr : -1);
+	printf("bsc-1234 without the nul found: %d\n",
+	       bsc_config_by_token(nat, "bsc-1234", strlen("bsc-1234")) != NULL);
+	printf("bsc-2000 found: %d\n", token_lookup(nat, "bsc-2000") != NULL);
+	conf = bsc_config_num(nat, 1999);
+	printf("nr 1999 is %s\n", conf ? conf->token : "none");
+	printf("nr 2000 found: %d, nr -1 found: %d\n",
+	       bsc_config_num(nat, 2000) != NULL, bsc_config_num(nat, -1) != NULL);
+
+	/* every one of them through the index */
+	for (i = 0; i < 2000; ++i) {
+		snprintf(token, sizeof(token), "bsc-%d", i);
+		conf = token_lookup(nat, token);
+		OSMO_ASSERT(conf && conf->nr == i);
+	}
+
+	/* the first one configured wins */
+	bsc_config_alloc(nat, "bsc-7", 7 + NAT_BSC_HASH_SIZE);
+	printf("bsc-7 is nr %d\n", token_lookup(nat, "bsc-7")->nr);
+
+	conf = bsc_config_num(nat, 1234);
+	bsc_config_set_token(conf, "renamed");
+	printf("after the rename bsc-1234 found: %d, renamed is nr %d\n",
+	       token_lookup(nat, "bsc-1234") != NULL,
+	       token_lookup(nat, "renamed")->nr);
+
+	bsc_config_free(conf);
+	printf("after the free renamed found: %d, nr 1234 found: %d, %d configs\n",
+	       token_lookup(nat, "renamed") != NULL,
+	       bsc_config_num(nat, 1234) != NULL, nat->num_bsc);
+
+	end = start;
+	bsc_nat_stat_auth(nat, &start, &end);
+	end.tv_sec = 12;
+	end.tv_nsec = 400000;
+	bsc_nat_stat_auth(nat, &start, &end);
+	end.tv_sec = 10;
+	end.tv_nsec = 902500000;
+	bsc_nat_stat_auth(nat, &start, &end);
+	printf("auth latency %lu of %lu us, max %lu us\n",
+	       nat->stats.bsc.auth_count,
+	       (unsigned long) nat->stats.bsc.auth_total_us,
+	       nat->stats.bsc.auth_max_us);
+
+	bsc_nat_free(nat);
+}
+
 int main(int argc, char **argv)
 {
 	msgb_talloc_ctx_init(NULL, 0);
@@ -1572,6 +2362,15 @@ int main(int argc, char **argv)
 	test_mgcp_allocations();
 	test_barr_list_parsing();
 	test_nat_extract_lac();
+	test_sccp_index();
+	test_sccp_ref_pool();
+	test_paging_index();
+	test_acc_lst_match();
+	test_rewrite_match();
+	test_writev();
+	test_timer_wheel();
+	test_mux_routing();
+	test_bsc_config_index();
 
 	printf("Testing execution completed.\n");
 	return 0;
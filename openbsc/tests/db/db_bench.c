@@ -0,0 +1,319 @@
+/* Time the hot queries of the subscriber and SMS tables */
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Not part of the testsuite, run it by hand:
+ *
+ *   db_bench [database] [subscribers] [sms]
+ *
+ * An empty database is filled first, which takes a while for the
+ * default of 1M subscribers and 5M SMS of which 1% are unsent. The
+ * queries are timed with the indexes and again after dropping them,
+ * they are created again by the next db_prepare().
+ */
+
+#include <openbsc/debug.h>
+#include <openbsc/db.h>
+#include <openbsc/gsm_subscriber.h>
+#include <openbsc/gsm_04_11.h>
+
+#include <osmocom/core/application.h>
+
+#include <sqlite3.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_EXTEN_BASE	100000
+
+static struct gsm_network dummy_net;
+static struct gsm_subscriber_group dummy_sgrp;
+
+static sqlite3 *bench_db;
+static unsigned long long num_subscr;
+static unsigned long long num_sms;
+
+static void bench_exec(const char *fmt, ...)
+{
+	va_list ap;
+	char *sql, *err = NULL;
+
+	va_start(ap, fmt);
+	sql = sqlite3_vmprintf(fmt, ap);
+	va_end(ap);
+
+	if (sqlite3_exec(bench_db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "Failed to run '%s': %s\n", sql, err);
+		exit(1);
+	}
+
+	sqlite3_free(sql);
+}
+
+static unsigned long long bench_count(const char *table)
+{
+	sqlite3_stmt *stmt;
+	unsigned long long count = 0;
+	char *sql;
+
+	sql = sqlite3_mprintf("SELECT count(*) FROM %s", table);
+	if (sqlite3_prepare_v2(bench_db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			count = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+
+	sqlite3_free(sql);
+	return count;
+}
+
+static void populate(void)
+{
+	printf("Creating %llu subscribers and %llu SMS.\n",
+	       num_subscr, num_sms);
+
+	bench_exec("BEGIN TRANSACTION");
+
+	/* nine out of ten are attached, none has expired */
+	bench_exec("INSERT INTO Subscriber "
+		   "(created, updated, imsi, extension, authorized, "
+		    "tmsi, lac, expire_lu) "
+		   "WITH RECURSIVE n(i) AS "
+			"(SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < %llu) "
+		   "SELECT datetime('now'), datetime('now'), "
+			"901700000000000 + i, %d + i, 1, i, "
+			"CASE WHEN i %% 10 THEN 1 ELSE 0 END, "
+			"datetime('now', '+1 day') "
+		   "FROM n",
+		   num_subscr, BENCH_EXTEN_BASE);
+
+	/* one in a hundred is still to be delivered */
+	bench_exec("INSERT INTO SMS "
+		   "(created, sent, reply_path_req, status_rep_req, "
+		    "is_report, msg_ref, protocol_id, data_coding_scheme, "
+		    "ud_hdr_ind, src_addr, src_ton, src_npi, "
+		    "dest_addr, dest_ton, dest_npi, text) "
+		   "WITH RECURSIVE n(i) AS "
+			"(SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < %llu) "
+		   "SELECT datetime('now'), "
+			"CASE WHEN i %% 100 THEN datetime('now') END, "
+			"0, 0, 0, 0, 0, 0, 0, '%d', 0, 0, "
+			"%d + 1 + abs(random()) %% %llu, 0, 0, 'Hello' "
+		   "FROM n",
+		   num_sms, BENCH_EXTEN_BASE, BENCH_EXTEN_BASE, num_subscr);
+
+	bench_exec("COMMIT TRANSACTION");
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void report(const char *name, int rounds, double start)
+{
+	printf("%-28s %6d rounds %10.3f ms/round\n", name, rounds,
+	       (now_ms() - start) / rounds);
+}
+
+static unsigned long long random_id(unsigned long long max)
+{
+	return 1 + (unsigned long long) rand() % max;
+}
+
+static void bench_queries(const char *label, int rounds)
+{
+	struct gsm_subscriber subscr = { .group = &dummy_sgrp, .lac = 1 };
+	unsigned long long ids[1000];
+	struct gsm_sms *sms;
+	double start;
+	int i;
+
+	printf("%s:\n", label);
+	srand(23);
+
+	start = now_ms();
+	for (i = 0; i < rounds; i++) {
+		subscr.id = random_id(num_subscr);
+		snprintf(subscr.extension, sizeof(subscr.extension), "%llu",
+			 BENCH_EXTEN_BASE + subscr.id);
+		sms = db_sms_get_unsent_for_subscr(&subscr);
+		if (sms)
+			sms_free(sms);
+	}
+	report("  sms_get_unsent_for_subscr", rounds, start);
+
+	start = now_ms();
+	for (i = 0; i < rounds; i++) {
+		sms = db_sms_get_unsent_by_subscr(&dummy_net,
+						  random_id(num_subscr), 100);
+		if (sms)
+			sms_free(sms);
+	}
+	report("  sms_get_unsent_by_subscr", rounds, start);
+
+	start = now_ms();
+	for (i = 0; i < rounds; i++) {
+		sms = db_sms_get_unsent(&dummy_net, random_id(num_sms));
+		if (sms)
+			sms_free(sms);
+	}
+	report("  sms_get_unsent", rounds, start);
+
+	start = now_ms();
+	for (i = 0; i < rounds; i++)
+		db_subscriber_expired(0, ids, ARRAY_SIZE(ids));
+	report("  subscriber_expired", rounds, start);
+}
+
+static void bench_alloc_tmsi(int rounds)
+{
+	struct gsm_subscriber *subscr;
+	double start;
+	int i;
+
+	subscr = db_get_subscriber(GSM_SUBSCRIBER_IMSI, "901700000000001");
+	if (!subscr)
+		return;
+	subscr->group = &dummy_sgrp;
+
+	start = now_ms();
+	for (i = 0; i < rounds; i++)
+		db_subscriber_alloc_tmsi(subscr);
+	report("  subscriber_alloc_tmsi", rounds, start);
+
+	subscr_put(subscr);
+}
+
+/* a location update each, one by one and in batches of the journal */
+static void bench_sync(int rounds)
+{
+	struct gsm_subscriber *batch;
+	double start;
+	int i, n;
+
+	batch = calloc(rounds, sizeof(*batch));
+	if (!batch)
+		return;
+
+	for (i = 0; i < rounds; i++) {
+		snprintf(batch[i].imsi, sizeof(batch[i].imsi), "%llu",
+			 901700000000000ULL + random_id(num_subscr));
+		batch[i].tmsi = GSM_RESERVED_TMSI;
+		batch[i].lac = 1;
+		batch[i].expire_lu = time(NULL) + 3600;
+	}
+
+	start = now_ms();
+	for (i = 0; i < rounds; i++)
+		db_sync_subscriber(&batch[i]);
+	report("  sync_subscriber", rounds, start);
+
+	start = now_ms();
+	for (i = 0; i < rounds; i += n) {
+		n = rounds - i;
+		if (n > GSM_SUBSCR_WRITE_BATCH_DEFAULT)
+			n = GSM_SUBSCR_WRITE_BATCH_DEFAULT;
+		db_sync_subscribers(&batch[i], n);
+	}
+	report("  sync_subscribers", rounds, start);
+
+	free(batch);
+}
+
+/* one in twenty expires, detached a chunk at a time */
+static void bench_expire(void)
+{
+	unsigned long long ids[1000];
+	double start;
+	int num, detached, total = 0;
+
+	bench_exec("UPDATE Subscriber "
+		   "SET lac = 1, expire_lu = datetime('now', '-1 minute') "
+		   "WHERE id %% 20 = 0");
+
+	start = now_ms();
+	while ((num = db_subscriber_expired(0, ids, ARRAY_SIZE(ids))) > 0) {
+		detached = db_subscriber_detach(ids, num);
+		if (detached <= 0)
+			break;
+		total += detached;
+	}
+	printf("  %-26s %6d expired %10.3f ms\n", "subscriber_detach", total,
+	       now_ms() - start);
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = "bench.sqlite3";
+
+	if (argc > 1)
+		name = argv[1];
+	num_subscr = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+	num_sms = argc > 3 ? strtoull(argv[3], NULL, 10) : 5000000;
+
+	osmo_init_logging(&log_info);
+	log_set_print_filename(osmo_stderr_target, 0);
+
+	dummy_net.subscr_group = &dummy_sgrp;
+	dummy_sgrp.net = &dummy_net;
+
+	if (db_init(name) || db_prepare()) {
+		fprintf(stderr, "Failed to open the database %s\n", name);
+		return 1;
+	}
+
+	if (sqlite3_open(name, &bench_db) != SQLITE_OK) {
+		fprintf(stderr, "Failed to open the database %s\n", name);
+		return 1;
+	}
+
+	if (bench_count("Subscriber") == 0)
+		populate();
+	num_subscr = bench_count("Subscriber");
+	num_sms = bench_count("SMS");
+	if (!num_subscr || !num_sms) {
+		fprintf(stderr, "Nothing to query in %s\n", name);
+		return 1;
+	}
+
+	bench_queries("With the indexes", 1000);
+	bench_alloc_tmsi(100);
+	bench_sync(1000);
+	bench_expire();
+
+	bench_exec("DROP INDEX SMS_dest_sent");
+	bench_exec("DROP INDEX SMS_sent");
+	bench_exec("DROP INDEX Subscriber_expire_lu");
+	bench_queries("Without the indexes", 10);
+
+	sqlite3_close(bench_db);
+	db_fini();
+	return 0;
+}
+
+/* stubs */
+void vty_out() {}
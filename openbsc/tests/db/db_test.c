@@ -20,16 +20,19 @@
 
 #include <openbsc/debug.h>
 #include <openbsc/db.h>
+#include <openbsc/db_async.h>
 #include <openbsc/gsm_subscriber.h>
 #include <openbsc/gsm_04_11.h>
 
 #include <osmocom/core/application.h>
+#include <osmocom/core/select.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <time.h>
 
 static struct gsm_network dummy_net;
 static struct gsm_subscriber_group dummy_sgrp;
@@ -160,6 +163,166 @@ static void test_sms_migrate(void)
 	subscr_put(rcv_subscr);
 }
 
+static void test_sync_batch(void)
+{
+	struct gsm_subscriber batch[2], *carol, *dave, *subscr_db;
+
+	printf("Testing the batched subscriber writes\n");
+
+	carol = db_create_subscriber("5555555555551", GSM_MIN_EXTEN,
+				     GSM_MAX_EXTEN, true);
+	dave = db_create_subscriber("5555555555552", GSM_MIN_EXTEN,
+				    GSM_MAX_EXTEN, false);
+	OSMO_ASSERT(carol && dave);
+
+	carol->lac = 23;
+	carol->tmsi = 0x2342;
+	osmo_strlcpy(carol->name, "Carol", sizeof(carol->name));
+	dave->lac = 42;
+	dave->authorized = 1;
+	memcpy(&batch[0], carol, sizeof(batch[0]));
+	memcpy(&batch[1], dave, sizeof(batch[1]));
+	OSMO_ASSERT(db_sync_subscribers(batch, ARRAY_SIZE(batch)) == 0);
+
+	subscr_db = db_get_subscriber(GSM_SUBSCRIBER_IMSI, carol->imsi);
+	COMPARE(carol, subscr_db);
+	SUBSCR_PUT(subscr_db);
+	subscr_db = db_get_subscriber(GSM_SUBSCRIBER_IMSI, dave->imsi);
+	COMPARE(dave, subscr_db);
+	SUBSCR_PUT(subscr_db);
+
+	SUBSCR_PUT(carol);
+	SUBSCR_PUT(dave);
+}
+
+static void test_expire(void)
+{
+	struct gsm_subscriber *erin, *erin_db;
+	unsigned long long ids[4];
+
+	printf("Testing the subscriber expiry\n");
+
+	erin = db_create_subscriber("6666666666666", GSM_MIN_EXTEN,
+				    GSM_MAX_EXTEN, true);
+	OSMO_ASSERT(erin);
+	OSMO_ASSERT(db_subscriber_expired(0, ids, ARRAY_SIZE(ids)) == 0);
+
+	erin->lac = 42;
+	erin->expire_lu = time(NULL) - 60;
+	db_sync_subscriber(erin);
+
+	OSMO_ASSERT(db_subscriber_expired(0, ids, ARRAY_SIZE(ids)) == 1);
+	OSMO_ASSERT(ids[0] == erin->id);
+	OSMO_ASSERT(db_subscriber_detach(ids, 1) == 1);
+	OSMO_ASSERT(db_subscriber_detach(ids, 1) == 0);
+	OSMO_ASSERT(db_subscriber_expired(0, ids, ARRAY_SIZE(ids)) == 0);
+
+	erin_db = db_get_subscriber(GSM_SUBSCRIBER_IMSI, erin->imsi);
+	OSMO_ASSERT(erin_db->lac == 0);
+	SUBSCR_PUT(erin_db);
+	SUBSCR_PUT(erin);
+}
+
+static void test_expire_cursor(void)
+{
+	struct gsm_subscriber *frank, *gina;
+	unsigned long long ids[1];
+
+	printf("Testing the subscriber expiry after a kept one\n");
+
+	frank = db_create_subscriber("6666666666661", GSM_MIN_EXTEN,
+				     GSM_MAX_EXTEN, true);
+	gina = db_create_subscriber("6666666666662", GSM_MIN_EXTEN,
+				    GSM_MAX_EXTEN, true);
+	OSMO_ASSERT(frank && gina && frank->id < gina->id);
+
+	frank->lac = gina->lac = 42;
+	frank->expire_lu = gina->expire_lu = time(NULL) - 60;
+	db_sync_subscriber(frank);
+	db_sync_subscriber(gina);
+
+	/* frank is kept attached, the next chunk goes on after him */
+	OSMO_ASSERT(db_subscriber_expired(0, ids, ARRAY_SIZE(ids)) == 1);
+	OSMO_ASSERT(ids[0] == frank->id);
+	OSMO_ASSERT(db_subscriber_expired(ids[0], ids, ARRAY_SIZE(ids)) == 1);
+	OSMO_ASSERT(ids[0] == gina->id);
+	OSMO_ASSERT(db_subscriber_detach(ids, 1) == 1);
+
+	/* the end was reached, starting over finds frank again */
+	OSMO_ASSERT(db_subscriber_expired(gina->id, ids, ARRAY_SIZE(ids)) == 0);
+	OSMO_ASSERT(db_subscriber_expired(0, ids, ARRAY_SIZE(ids)) == 1);
+	OSMO_ASSERT(ids[0] == frank->id);
+	OSMO_ASSERT(db_subscriber_detach(ids, 1) == 1);
+
+	SUBSCR_PUT(frank);
+	SUBSCR_PUT(gina);
+}
+
+static int async_done;
+
+static void async_sync_cb(int rc, void *data)
+{
+	printf("Subscriber synced: rc %d\n", rc);
+	async_done += 1;
+}
+
+static void async_tmsi_cb(int rc, void *data)
+{
+	struct gsm_subscriber *subscr = data;
+
+	printf("TMSI allocated: rc %d, reserved %d\n", rc,
+	       subscr->tmsi == GSM_RESERVED_TMSI);
+	async_done += 1;
+}
+
+static void async_cancelled_cb(int rc, void *data)
+{
+	printf("FAIL: cancelled request called back\n");
+}
+
+static void async_sms_cb(int rc, struct gsm_sms *sms, void *data)
+{
+	printf("SMS stored: rc %d, text %s\n", rc, sms->text);
+	async_done += 1;
+}
+
+static void test_async(void)
+{
+	struct gsm_subscriber *bob, *bob_db;
+	struct gsm_sms *sms;
+
+	printf("Testing the database thread\n");
+	OSMO_ASSERT(db_async_start() == 0);
+
+	bob = db_create_subscriber("7777777777777", GSM_MIN_EXTEN,
+				   GSM_MAX_EXTEN, true);
+	OSMO_ASSERT(bob);
+	bob->group = &dummy_sgrp;
+	bob->lac = 42;
+	osmo_strlcpy(bob->name, "Bob", sizeof(bob->name));
+
+	/* done in the order they were queued */
+	db_async_sync_subscriber(bob, async_sync_cb, NULL);
+	db_async_alloc_tmsi(bob, async_tmsi_cb, bob);
+	db_async_sync_subscriber(bob, async_cancelled_cb, &async_done);
+	db_async_cancel(&async_done);
+	sms = sms_from_text(bob, bob, 0, "Hello Bob");
+	db_async_sms_store(sms, async_sms_cb, NULL);
+
+	while (async_done < 3)
+		osmo_select_main(0);
+
+	bob_db = db_get_subscriber(GSM_SUBSCRIBER_IMSI, bob->imsi);
+	COMPARE(bob, bob_db);
+	SUBSCR_PUT(bob_db);
+
+	sms = db_sms_get_unsent_for_subscr(bob);
+	OSMO_ASSERT(sms);
+	OSMO_ASSERT(strcmp((char *) sms->text, "Hello Bob") == 0);
+	sms_free(sms);
+	SUBSCR_PUT(bob);
+}
+
 static void test_subs(const char *imsi, char *imei1, char *imei2, bool make_ext)
 {
 	struct gsm_subscriber *alice = NULL, *alice_db;
@@ -245,6 +408,10 @@ int main()
 
 	test_sms();
 	test_sms_migrate();
+	test_sync_batch();
+	test_expire();
+	test_expire_cursor();
+	test_async();
 
 	db_fini();
 
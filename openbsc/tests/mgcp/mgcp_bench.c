@@ -0,0 +1,326 @@
+/* Time the hot paths of the media gateway */
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Not part of the testsuite, run it by hand:
+ *
+ *   mgcp_bench
+ *
+ * The numbers depend on the machine, the results are checked by the
+ * tests instead.
+ */
+#define _GNU_SOURCE /* sendmmsg */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <osmocom/core/utils.h>
+
+#include <openbsc/mgcp_g711.h>
+#include <openbsc/mgcp_tokenizer.h>
+#include <openbsc/mgcp_udp.h>
+
+#define G711_SAMPLES	65536
+#define G711_FRAMES	200000
+#define FRAME_SAMPLES	160
+#define PARSE_COMMANDS	1000000
+#define UDP_PACKETS	200000
+#define UDP_BURST	32
+#define UDP_PAYLOAD	172	/* G.711 with RTP header */
+
+#define CRCX	"CRCX 2 1@mgw MGCP 1.0\r\n"	\
+		"M: recvonly\r\n"		\
+		"C: 2\r\n"			\
+		"L: p:20\r\n"			\
+		"\r\n"				\
+		"v=0\r\n"			\
+		"c=IN IP4 123.12.12.123\r\n"	\
+		"m=audio 5904 RTP/AVP 97\r\n"	\
+		"a=rtpmap:97 GSM-EFR/8000\r\n"	\
+		"a=ptime:40\r\n"
+
+static char rx_buf[MGCP_UDP_GRO_BUF_SIZE];
+
+static int16_t samples[G711_SAMPLES];
+static uint8_t l16[G711_SAMPLES * 2];
+static int16_t out_samples[G711_SAMPLES];
+static uint8_t out_l16[G711_SAMPLES * 2];
+
+typedef void (*encode_fn)(const int16_t *sample, uint8_t *buf, size_t n);
+typedef void (*decode_fn)(const uint8_t *buf, int16_t *sample, size_t n);
+
+static double elapsed_ns(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 +
+		(end.tv_nsec - start->tv_nsec);
+}
+
+static double bench_encode(encode_fn fn)
+{
+	struct timespec start;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < G711_FRAMES; ++i)
+		fn(&samples[(i * FRAME_SAMPLES) % (G711_SAMPLES - FRAME_SAMPLES)],
+		   out_l16, FRAME_SAMPLES);
+	return elapsed_ns(&start) / G711_FRAMES;
+}
+
+static double bench_decode(decode_fn fn)
+{
+	struct timespec start;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < G711_FRAMES; ++i)
+		fn(&l16[(i * FRAME_SAMPLES) % (G711_SAMPLES - FRAME_SAMPLES)],
+		   out_samples, FRAME_SAMPLES);
+	return elapsed_ns(&start) / G711_FRAMES;
+}
+
+static void bench_g711(void)
+{
+	const struct mgcp_g711_ops *ops;
+	int i;
+
+	for (i = 0; i < G711_SAMPLES; ++i) {
+		samples[i] = (int16_t) (i * 40503);
+		l16[i * 2] = i >> 3;
+		l16[i * 2 + 1] = i * 13;
+	}
+
+	printf("G.711 in ns per frame, %s selected\n", mgcp_g711->name);
+	for (i = 0; i < _NUM_MGCP_G711_IMPL; ++i) {
+		ops = mgcp_g711_get_impl(i);
+		if (!ops)
+			continue;
+
+		printf("  %-6s alaw enc %6.1f dec %6.1f "
+		       "ulaw enc %6.1f dec %6.1f l16 enc %6.1f dec %6.1f\n",
+		       ops->name,
+		       bench_encode(ops->alaw_encode),
+		       bench_decode(ops->alaw_decode),
+		       bench_encode(ops->ulaw_encode),
+		       bench_decode(ops->ulaw_decode),
+		       bench_encode(ops->l16_encode),
+		       bench_decode(ops->l16_decode));
+	}
+}
+
+/* walk every line of the message like the handlers do */
+static int parse_tokenizer(const char *msg, int len)
+{
+	struct mgcp_tokenized tok;
+	struct mgcp_token rest, line;
+	enum mgcp_eol eol;
+	int lines = 0;
+
+	if (mgcp_tokenize(msg, len, &tok) < 0)
+		return -1;
+
+	rest = tok.body;
+	while (mgcp_next_line(&rest, &line, &eol))
+		lines += 1;
+	return tok.num_words + lines;
+}
+
+/* the copy and strtok based parsing the tokenizer replaced */
+static int parse_strtok(const char *msg, int len)
+{
+	char *copy, *line, *word, *save_line, *save_word;
+	int count = 0;
+
+	copy = strndup(msg, len);
+	line = strtok_r(copy, "\r\n", &save_line);
+	if (line) {
+		for (word = strtok_r(line, " ", &save_word); word;
+		     word = strtok_r(NULL, " ", &save_word))
+			count += 1;
+		while (strtok_r(NULL, "\r\n", &save_line))
+			count += 1;
+	}
+	free(copy);
+	return count;
+}
+
+static void bench_parser(const char *name, int (*parse)(const char *, int))
+{
+	struct timespec start;
+	int i, len = strlen(CRCX);
+	volatile int sink = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < PARSE_COMMANDS; ++i)
+		sink += parse(CRCX, len);
+	printf("  %-9s %10.0f commands/s\n", name,
+	       PARSE_COMMANDS / elapsed_ns(&start) * 1e9);
+}
+
+/* an explicit port like the RTP sockets, see mgcp_udp_test */
+static int udp_socket(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT(fd >= 0);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	OSMO_ASSERT(bind(fd, (struct sockaddr *) addr, sizeof(*addr)) == 0);
+	OSMO_ASSERT(getsockname(fd, (struct sockaddr *) addr, &len) == 0);
+	close(fd);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT(fd >= 0);
+	OSMO_ASSERT(bind(fd, (struct sockaddr *) addr, sizeof(*addr)) == 0);
+	return fd;
+}
+
+/* count the packets waiting, coalesced ones are split up */
+static int drain(int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = rx_buf, .iov_len = sizeof(rx_buf) };
+	struct msghdr msg;
+	int rc, seg, packets = 0;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		rc = recvmsg(fd, &msg, MSG_DONTWAIT);
+		if (rc < 0)
+			break;
+
+		seg = mgcp_udp_gro_size(&msg);
+		packets += seg > 0 ? (rc + seg - 1) / seg : 1;
+	}
+
+	return packets;
+}
+
+enum bench_send_mode {
+	BENCH_SENDTO,
+	BENCH_SEND,
+	BENCH_SENDMMSG,
+	BENCH_GSO,
+};
+
+static const char *bench_send_names[] = {
+	[BENCH_SENDTO] = "sendto",
+	[BENCH_SEND] = "send",
+	[BENCH_SENDMMSG] = "sendmmsg",
+	[BENCH_GSO] = "gso",
+};
+
+static void bench_send(enum bench_send_mode mode)
+{
+	static char bufs[UDP_BURST][UDP_PAYLOAD];
+	struct mgcp_udp_peer peer;
+	struct sockaddr_in a_addr, b_addr;
+	struct mmsghdr msgs[UDP_BURST];
+	struct iovec iov[UDP_BURST];
+	struct timespec start;
+	int a, b, i, sent = 0, received = 0;
+
+	memset(&peer, 0, sizeof(peer));
+	memset(msgs, 0, sizeof(msgs));
+	a = udp_socket(&a_addr);
+	b = udp_socket(&b_addr);
+	mgcp_udp_set_gro(b, 1);
+
+	for (i = 0; i < UDP_BURST; ++i) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = UDP_PAYLOAD;
+		msgs[i].msg_hdr.msg_name = &b_addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(b_addr);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if (mode == BENCH_SEND || mode == BENCH_GSO)
+		mgcp_udp_connect(a, &peer, &b_addr.sin_addr, b_addr.sin_port);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (sent < UDP_PACKETS) {
+		switch (mode) {
+		case BENCH_SENDTO:
+			for (i = 0; i < UDP_BURST; ++i)
+				sendto(a, bufs[i], UDP_PAYLOAD, 0,
+				       (struct sockaddr *) &b_addr, sizeof(b_addr));
+			break;
+		case BENCH_SEND:
+			for (i = 0; i < UDP_BURST; ++i)
+				send(a, bufs[i], UDP_PAYLOAD, 0);
+			break;
+		case BENCH_SENDMMSG:
+			sendmmsg(a, msgs, UDP_BURST, 0);
+			break;
+		case BENCH_GSO:
+			/* one by one when the kernel can not segment */
+			if (!mgcp_udp_gso_supported() ||
+			    mgcp_udp_send_gso(a, iov, UDP_BURST, UDP_PAYLOAD) < 0)
+				for (i = 0; i < UDP_BURST; ++i)
+					send(a, bufs[i], UDP_PAYLOAD, 0);
+			break;
+		}
+		sent += UDP_BURST;
+		received += drain(b);
+	}
+
+	printf("  %-8s %10.0f packets/s (%d of %d received)\n",
+	       bench_send_names[mode], sent / elapsed_ns(&start) * 1e9,
+	       received, sent);
+
+	close(a);
+	close(b);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	bench_g711();
+
+	printf("Parsing a CRCX\n");
+	bench_parser("tokenizer", parse_tokenizer);
+	bench_parser("strtok", parse_strtok);
+
+	printf("Sending RTP over loopback, UDP_SEGMENT %ssupported\n",
+	       mgcp_udp_gso_supported() ? "" : "not ");
+	for (i = 0; i < ARRAY_SIZE(bench_send_names); ++i)
+		bench_send(i);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <osmocom/core/utils.h>
+
+#include <openbsc/mgcp_g711.h>
+
+/* not a multiple of the vector width to exercise the tails */
+#define NUM_SAMPLES	(65536 + 13)
+
+static int16_t samples[NUM_SAMPLES];
+static uint8_t codes[NUM_SAMPLES];
+static uint8_t l16[NUM_SAMPLES * 2];
+
+static uint8_t ref_codes[NUM_SAMPLES];
+static int16_t ref_samples[NUM_SAMPLES];
+static uint8_t ref_l16[NUM_SAMPLES * 2];
+
+static uint8_t out_codes[NUM_SAMPLES];
+static int16_t out_samples[NUM_SAMPLES];
+static uint8_t out_l16[NUM_SAMPLES * 2];
+
+typedef void (*encode_fn)(const int16_t *sample, uint8_t *buf, size_t n);
+typedef void (*decode_fn)(const uint8_t *buf, int16_t *sample, size_t n);
+
+static void fill_input(void)
+{
+	int i;
+
+	/* every possible sample and every possible code word */
+	for (i = 0; i < NUM_SAMPLES; ++i) {
+		samples[i] = (int16_t) (i * 40503);
+		codes[i] = i * 7;
+		l16[i * 2] = i >> 3;
+		l16[i * 2 + 1] = i * 13;
+	}
+}
+
+static void check_encode(const char *impl, const char *name,
+			 encode_fn ref, encode_fn test, size_t width)
+{
+	memset(out_codes, 0xaa, sizeof(out_codes));
+	ref(samples, ref_codes, NUM_SAMPLES);
+	test(samples, out_codes, NUM_SAMPLES);
+	if (memcmp(ref_codes, out_codes, NUM_SAMPLES * width) != 0) {
+		printf("%s %s differs from the scalar code\n", impl, name);
+		abort();
+	}
+}
+
+static void check_decode(const char *impl, const char *name,
+			 decode_fn ref, decode_fn test, const uint8_t *in)
+{
+	memset(out_samples, 0xaa, sizeof(out_samples));
+	ref(in, ref_samples, NUM_SAMPLES);
+	test(in, out_samples, NUM_SAMPLES);
+	if (memcmp(ref_samples, out_samples, sizeof(ref_samples)) != 0) {
+		printf("%s %s differs from the scalar code\n", impl, name);
+		abort();
+	}
+}
+
+static void check_l16_encode(const char *impl, encode_fn ref, encode_fn test)
+{
+	memset(out_l16, 0xaa, sizeof(out_l16));
+	ref(samples, ref_l16, NUM_SAMPLES);
+	test(samples, out_l16, NUM_SAMPLES);
+	if (memcmp(ref_l16, out_l16, sizeof(ref_l16)) != 0) {
+		printf("%s l16_encode differs from the scalar code\n", impl);
+		abort();
+	}
+}
+
+static void test_g711_impls(void)
+{
+	const struct mgcp_g711_ops *ref = mgcp_g711_get_impl(MGCP_G711_SCALAR);
+	int i;
+
+	printf("Testing G.711 implementations\n");
+
+	fill_input();
+	OSMO_ASSERT(ref);
+	OSMO_ASSERT(mgcp_g711);
+
+	for (i = 0; i < _NUM_MGCP_G711_IMPL; ++i) {
+		const struct mgcp_g711_ops *ops = mgcp_g711_get_impl(i);
+
+		if (!ops) {
+			fprintf(stderr, "implementation %d not supported\n", i);
+			continue;
+		}
+
+		check_encode(ops->name, "alaw_encode", ref->alaw_encode,
+			     ops->alaw_encode, 1);
+		check_decode(ops->name, "alaw_decode", ref->alaw_decode,
+			     ops->alaw_decode, codes);
+		check_encode(ops->name, "ulaw_encode", ref->ulaw_encode,
+			     ops->ulaw_encode, 1);
+		check_decode(ops->name, "ulaw_decode", ref->ulaw_decode,
+			     ops->ulaw_decode, codes);
+		check_l16_encode(ops->name, ref->l16_encode, ops->l16_encode);
+		check_decode(ops->name, "l16_decode", ref->l16_decode,
+			     ops->l16_decode, l16);
+	}
+
+	printf("All implementations match the scalar code\n");
+}
+
+int main(int argc, char **argv)
+{
+	test_g711_impls();
+
+	printf("Done\n");
+	return EXIT_SUCCESS;
+}
@@ -26,8 +26,11 @@
 #include <osmocom/core/application.h>
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/utils.h>
+#include <osmocom/netif/rtp.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <dlfcn.h>
 #include <time.h>
 #include <math.h>
@@ -1181,6 +1184,199 @@ static void test_no_name(void)
 	talloc_free(cfg);
 }
 
+#define CRCX_LOCAL "CRCX 2 1@mgw MGCP 1.0\r\n"	\
+		 "M: recvonly\r\n"		\
+		 "C: 2\r\n"			\
+		 "\r\n"				\
+		 "v=0\r\n"			\
+		 "c=IN IP4 127.0.0.1\r\n"	\
+		 "m=audio 5904 RTP/AVP 97\r\n"	\
+		 "a=rtpmap:97 GSM-EFR/8000\r\n"
+
+static int handle_and_check(struct mgcp_config *cfg, const char *req,
+			    const char *exp_code)
+{
+	struct msgb *inp, *msg;
+	int rc;
+
+	inp = create_msg(req);
+	msg = mgcp_handle_message(cfg, inp);
+	msgb_free(inp);
+	rc = strncmp((char *) msg->data, exp_code, strlen(exp_code));
+	if (rc != 0)
+		printf("Unexpected response: %s\n", (char *) msg->data);
+	msgb_free(msg);
+	return rc;
+}
+
+static void send_rtp(int fd, int port, int seq)
+{
+	struct sockaddr_in addr;
+	struct rtp_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = 2;
+	hdr.payload_type = 97;
+	hdr.sequence = htons(seq);
+	hdr.timestamp = htonl(seq * 160);
+	hdr.ssrc = htonl(0x2342);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	OSMO_ASSERT(sendto(fd, &hdr, sizeof(hdr), 0,
+			   (struct sockaddr *) &addr, sizeof(addr)) == sizeof(hdr));
+}
+
+static int worker_bts_packets(struct mgcp_endpoint *endp)
+{
+	int packets;
+
+	mgcp_rtp_worker_hold(endp);
+	packets = endp->bts_end.packets;
+	mgcp_rtp_worker_release(endp);
+	return packets;
+}
+
+static uint64_t worker_logs_dropped(struct mgcp_config *cfg)
+{
+	uint64_t sum = 0, events, holds, logs_dropped, wake_failed;
+	int i, sockets;
+
+	for (i = 0; i < cfg->rtp_workers_count; ++i) {
+		mgcp_rtp_worker_stats(cfg, i, &sockets, &events, &holds,
+				      &logs_dropped, &wake_failed);
+		sum += logs_dropped;
+	}
+	return sum;
+}
+
+static void test_rtp_worker(void)
+{
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	uint64_t logs_dropped;
+	int round, seq, wait, fd;
+
+	printf("Testing RTP through the worker threads\n");
+
+	cfg = mgcp_config_alloc();
+	cfg->trunk.number_endpoints = 64;
+	cfg->bts_ports.mode = PORT_ALLOC_DYNAMIC;
+	cfg->bts_ports.range_start = 34000;
+	cfg->bts_ports.range_end = 34099;
+	cfg->net_ports.mode = PORT_ALLOC_DYNAMIC;
+	cfg->net_ports.range_start = 34100;
+	cfg->net_ports.range_end = 34199;
+	cfg->rtp_worker_threads = 2;
+	mgcp_endpoints_allocate(&cfg->trunk);
+	OSMO_ASSERT(mgcp_rtp_workers_start(cfg) == 0);
+	OSMO_ASSERT(cfg->rtp_workers_count == 2);
+
+	endp = &cfg->trunk.endpoints[1];
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT(fd >= 0);
+
+	for (round = 0; round < 10; ++round) {
+		/* the keepalive dummy is sent while the worker runs */
+		OSMO_ASSERT(handle_and_check(cfg, CRCX_LOCAL, "200") == 0);
+		OSMO_ASSERT(endp->bts_end.rtp.fd >= 0);
+
+		/* finding the BTS is logged, the worker must only count it */
+		logs_dropped = worker_logs_dropped(cfg);
+		for (seq = 0; seq < 20; ++seq)
+			send_rtp(fd, endp->bts_end.local_port, seq);
+		OSMO_ASSERT(handle_and_check(cfg, MDCX3, "200") == 0);
+		for (; seq < 40; ++seq)
+			send_rtp(fd, endp->bts_end.local_port, seq);
+
+		for (wait = 0; wait < 2000; ++wait) {
+			if (worker_bts_packets(endp) == 40 &&
+			    worker_logs_dropped(cfg) > logs_dropped)
+				break;
+			usleep(1000);
+		}
+		OSMO_ASSERT(worker_bts_packets(endp) == 40);
+		OSMO_ASSERT(worker_logs_dropped(cfg) > logs_dropped);
+
+		OSMO_ASSERT(handle_and_check(cfg, DLCX, "250") == 0);
+		OSMO_ASSERT(endp->bts_end.rtp.fd == -1);
+		OSMO_ASSERT(endp->net_end.rtp.fd == -1);
+	}
+
+	close(fd);
+	mgcp_rtp_workers_stop(cfg);
+	OSMO_ASSERT(cfg->rtp_workers_count == 0);
+	talloc_free(cfg);
+}
+
+static int fd_is_open(int fd)
+{
+	return fcntl(fd, F_GETFD) != -1;
+}
+
+/* allocate a pair and bind it like bind_rtp() */
+static int port_pool_take(struct mgcp_config *cfg, struct mgcp_port_pool *pool,
+			  int *rtp_fd, int *rtcp_fd)
+{
+	struct osmo_fd rtp, rtcp;
+	int port;
+
+	port = mgcp_port_pool_alloc(pool);
+	OSMO_ASSERT(port > 0);
+	if (mgcp_port_pool_take_fds(pool, port, rtp_fd, rtcp_fd) == 0)
+		return port;
+
+	OSMO_ASSERT(mgcp_create_bind(cfg->source_addr, &rtp, port) == 0);
+	OSMO_ASSERT(mgcp_create_bind(cfg->source_addr, &rtcp, port + 1) == 0);
+	*rtp_fd = rtp.fd;
+	*rtcp_fd = rtcp.fd;
+	return port;
+}
+
+static void test_port_pool_release(void)
+{
+	struct mgcp_config *cfg;
+	struct mgcp_port_pool *pool;
+	int port[3], rtp_fd[3], rtcp_fd[3];
+	int i, used, free, bound, unusable;
+
+	printf("Testing the release of pooled RTP ports\n");
+
+	cfg = mgcp_config_alloc();
+	cfg->bts_ports.mode = PORT_ALLOC_DYNAMIC;
+	cfg->bts_ports.range_start = 34200;
+	cfg->bts_ports.range_end = 34209;
+	pool = mgcp_port_pool_get(cfg, &cfg->bts_ports);
+	OSMO_ASSERT(pool);
+
+	/* without a socket pool nothing stays bound */
+	for (i = 0; i < 10; ++i) {
+		port[0] = port_pool_take(cfg, pool, &rtp_fd[0], &rtcp_fd[0]);
+		mgcp_port_pool_release(pool, port[0], rtp_fd[0], rtcp_fd[0]);
+		OSMO_ASSERT(!fd_is_open(rtp_fd[0]));
+		OSMO_ASSERT(!fd_is_open(rtcp_fd[0]));
+	}
+	OSMO_ASSERT(mgcp_port_pool_stats(&cfg->bts_ports, &used, &free,
+					 &bound, &unusable) == 0);
+	OSMO_ASSERT(used == 0 && free == 5 && bound == 0 && unusable == 0);
+
+	/* up to the high watermark the released pairs are kept bound */
+	cfg->rtp_socket_pool_high = 2;
+	for (i = 0; i < 3; ++i)
+		port[i] = port_pool_take(cfg, pool, &rtp_fd[i], &rtcp_fd[i]);
+	for (i = 0; i < 3; ++i)
+		mgcp_port_pool_release(pool, port[i], rtp_fd[i], rtcp_fd[i]);
+	OSMO_ASSERT(fd_is_open(rtp_fd[0]) && fd_is_open(rtp_fd[1]));
+	OSMO_ASSERT(!fd_is_open(rtp_fd[2]) && !fd_is_open(rtcp_fd[2]));
+	OSMO_ASSERT(mgcp_port_pool_stats(&cfg->bts_ports, &used, &free,
+					 &bound, &unusable) == 0);
+	OSMO_ASSERT(used == 0 && free == 5 && bound == 2);
+
+	talloc_free(cfg);
+}
+
 static void test_osmux_cid(void)
 {
 	int id, i;
@@ -1225,6 +1421,8 @@ int main(int argc, char **argv)
 	test_multilple_codec();
 	test_no_cycle();
 	test_no_name();
+	test_rtp_worker();
+	test_port_pool_release();
 	test_osmux_cid();
 
 	OSMO_ASSERT(talloc_total_size(msgb_ctx) == 0);
@@ -0,0 +1,138 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <osmocom/core/utils.h>
+
+#include <openbsc/mgcp_tokenizer.h>
+
+#define CRCX	"CRCX 2 1@mgw MGCP 1.0\r\n"	\
+		"M: recvonly\r\n"		\
+		"C: 2\r\n"			\
+		"L: p:20\r\n"			\
+		"\r\n"				\
+		"v=0\r\n"			\
+		"c=IN IP4 123.12.12.123\r\n"	\
+		"m=audio 5904 RTP/AVP 97\r\n"	\
+		"a=rtpmap:97 GSM-EFR/8000\r\n"	\
+		"a=ptime:40\r\n"
+
+static const char *messages[] = {
+	CRCX,
+	"AUEP 158663169 ds/e1-1/2@172.16.6.66 MGCP 1.0\r\n",
+	"MDCX 18983216 1@mgw MGCP 1.0\n"
+	"C: 2\n"
+	"I: 1\n"
+	"\n"
+	"v=0\n",
+	"CRCX 2 1@mgw MGCP 1.0\r"
+	"M: sendrecv\r"
+	"C: 2\r"
+	"\r"
+	"v=0\r",
+	"DLCX  7   2@mgw  MGCP 1.0",
+	"200 1234 OK\r\nI: 1\r\n",
+	"RSIP 2 *@mgw MGCP 1.0 extra\r\n",
+	"",
+};
+
+/* the tokenizer stops at the first NUL */
+static const char nul_message[] = "AUEP 1\0 2@mgw MGCP 1.0\r\n";
+
+static void print_token(const char *name, const struct mgcp_token *tok)
+{
+	if (!tok->data) {
+		printf(" %s: -", name);
+		return;
+	}
+
+	printf(" %s: '%.*s'", name, tok->len, tok->data);
+}
+
+static void print_lines(const char *name, const struct mgcp_token *tok)
+{
+	static const char *eols[] = { "", "\\n", "\\r", "\\r\\n" };
+	struct mgcp_token rest = *tok, line;
+	enum mgcp_eol eol;
+
+	printf(" %s:", name);
+	while (mgcp_next_line(&rest, &line, &eol))
+		printf(" '%.*s'%s", line.len, line.data, eols[eol]);
+	printf("\n");
+}
+
+static void print_tokenized(const char *msg, int len)
+{
+	struct mgcp_tokenized tok;
+
+	if (mgcp_tokenize(msg, len, &tok) < 0) {
+		printf(" nothing\n");
+		return;
+	}
+
+	printf(" words: %d code: %d\n", tok.num_words, tok.code);
+	print_token("verb", &tok.verb);
+	print_token("trans", &tok.trans);
+	print_token("endpoint", &tok.endpoint);
+	print_token("proto", &tok.proto);
+	print_token("version", &tok.version);
+	printf("\n");
+	print_lines("params", &tok.params);
+	print_lines("sdp", &tok.sdp);
+}
+
+static void test_tokenize(void)
+{
+	int i;
+
+	printf("Testing the tokenizer\n");
+
+	for (i = 0; i < ARRAY_SIZE(messages); ++i) {
+		printf("Message %d:", i);
+		print_tokenized(messages[i], strlen(messages[i]));
+	}
+
+	printf("Message with NUL:");
+	print_tokenized(nul_message, sizeof(nul_message) - 1);
+}
+
+static void test_helpers(void)
+{
+	struct mgcp_token tok = { .data = "MGCP 1.0", .len = 4 };
+
+	printf("Testing the helpers\n");
+	OSMO_ASSERT(mgcp_token_equal(&tok, "MGCP"));
+	OSMO_ASSERT(!mgcp_token_equal(&tok, "MGC"));
+	OSMO_ASSERT(!mgcp_token_equal(&tok, "MGCP "));
+	OSMO_ASSERT(mgcp_token_prefix(&tok, "MG"));
+	OSMO_ASSERT(mgcp_token_prefix(&tok, "MGCP"));
+	OSMO_ASSERT(!mgcp_token_prefix(&tok, "MGCP 1"));
+}
+
+int main(int argc, char **argv)
+{
+	test_tokenize();
+	test_helpers();
+
+	printf("Done\n");
+	return EXIT_SUCCESS;
+}
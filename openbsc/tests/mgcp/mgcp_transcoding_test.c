@@ -4,6 +4,8 @@
 #include <string.h>
 #include <err.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include <osmocom/core/talloc.h>
 #include <osmocom/core/application.h>
@@ -21,6 +23,7 @@
 #endif
 
 #include "openbsc/mgcp_transcode.h"
+#include "openbsc/mgcp_g711.h"
 
 uint8_t *audio_frame_l16[] = {
 };
@@ -578,6 +581,102 @@ static int test_repacking(int in_samples, int out_samples, int no_transcode)
 	return 0;
 }
 
+/*
+ * The first A-law decode on the transcoding thread blocks until the
+ * test lets it go on.
+ */
+static const struct mgcp_g711_ops *real_g711;
+static struct mgcp_g711_ops blocking_g711;
+static sem_t decode_entered;
+static sem_t decode_release;
+static int decode_calls;
+static int decode_finished;
+
+static void blocking_alaw_decode(const uint8_t *buf, int16_t *sample, size_t n)
+{
+	if (decode_calls++ == 0) {
+		sem_post(&decode_entered);
+		sem_wait(&decode_release);
+	}
+	real_g711->alaw_decode(buf, sample, n);
+	decode_finished = 1;
+}
+
+static void *release_decode(void *data)
+{
+	usleep(10000);
+	sem_post(&decode_release);
+	return NULL;
+}
+
+static int submit_packet(struct mgcp_endpoint *endp, const struct rtp_packets *pkt,
+			 int payload_type)
+{
+	char buf[4096];
+	struct sockaddr_in addr;
+	struct rtp_hdr *hdr = (struct rtp_hdr *) buf;
+
+	memset(&addr, 0, sizeof(addr));
+	memcpy(buf, pkt->data, pkt->len);
+	hdr->payload_type = payload_type;
+	return mgcp_transcoding_submit(endp, MGCP_DEST_BTS, &addr, buf, pkt->len);
+}
+
+static void test_transcode_cancel(void)
+{
+	struct mgcp_config *cfg;
+	struct mgcp_endpoint *endp;
+	struct mgcp_process_rtp_state *state;
+	pthread_t thread;
+	void *ctx;
+
+	printf("Testing cancel while transcoding\n");
+	given_configured_endpoint(160, 0, "pcma", "gsm", &ctx, &endp);
+	cfg = ctx;
+	endp->net_end.alt_codec = endp->net_end.codec;
+	endp->net_end.alt_codec.payload_type = audio_name_to_type("l16");
+
+	cfg->transcoding_threads = 1;
+	OSMO_ASSERT(mgcp_transcoding_pool_start(cfg) == 0);
+
+	real_g711 = mgcp_g711;
+	blocking_g711 = *real_g711;
+	blocking_g711.alaw_decode = blocking_alaw_decode;
+	mgcp_g711 = &blocking_g711;
+	sem_init(&decode_entered, 0, 0);
+	sem_init(&decode_release, 0, 0);
+
+	/* the first packet is being decoded, the second one waits */
+	OSMO_ASSERT(submit_packet(endp, &audio_packets_pcma[0], 8) == 1);
+	sem_wait(&decode_entered);
+	OSMO_ASSERT(submit_packet(endp, &audio_packets_pcma[1], 8) == 1);
+	OSMO_ASSERT(cfg->transcode_stats.queue_depth == 2);
+
+	/* switching the codec has to wait for the thread to finish */
+	OSMO_ASSERT(pthread_create(&thread, NULL, release_decode, NULL) == 0);
+	OSMO_ASSERT(submit_packet(endp, &audio_packets_l16[0], 11) == 1);
+	OSMO_ASSERT(decode_finished);
+	pthread_join(thread, NULL);
+
+	state = endp->bts_end.rtp_process_data;
+	OSMO_ASSERT(state->src_fmt == AF_L16);
+	OSMO_ASSERT(state->dst_fmt == AF_GSM);
+
+	/* both packets of the old state are dropped, the new one is sent */
+	while (cfg->transcode_stats.queue_depth > 0)
+		osmo_select_main(0);
+	OSMO_ASSERT(cfg->transcode_stats.submitted == 3);
+	OSMO_ASSERT(cfg->transcode_stats.cancelled == 2);
+	OSMO_ASSERT(cfg->transcode_stats.transcoded == 1);
+
+	mgcp_transcoding_pool_stop(cfg);
+	OSMO_ASSERT(!cfg->transcode_pool);
+	mgcp_g711 = real_g711;
+	sem_destroy(&decode_entered);
+	sem_destroy(&decode_release);
+	talloc_free(ctx);
+}
+
 int main(int argc, char **argv)
 {
 	int rc;
@@ -648,6 +747,7 @@ int main(int argc, char **argv)
 	test_rtp_seq_state();
 	test_transcode_result();
 	test_transcode_change();
+	test_transcode_cancel();
 
 	return 0;
 }
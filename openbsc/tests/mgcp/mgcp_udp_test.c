@@ -0,0 +1,193 @@
+/*
+ * (C) 2018 by the OpenBSC contributors
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <osmocom/core/utils.h>
+
+#include <openbsc/mgcp_udp.h>
+
+#define PAYLOAD		172	/* G.711 with RTP header */
+
+static char rx_buf[MGCP_UDP_GRO_BUF_SIZE];
+
+/*
+ * Bind to an explicit port like the RTP sockets do, a port picked by
+ * the kernel would be given up again on disconnect.
+ */
+static int udp_socket(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT(fd >= 0);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	OSMO_ASSERT(bind(fd, (struct sockaddr *) addr, sizeof(*addr)) == 0);
+	OSMO_ASSERT(getsockname(fd, (struct sockaddr *) addr, &len) == 0);
+	close(fd);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	OSMO_ASSERT(fd >= 0);
+	OSMO_ASSERT(bind(fd, (struct sockaddr *) addr, sizeof(*addr)) == 0);
+	return fd;
+}
+
+/* count the packets waiting, coalesced ones are split up */
+static int drain(int fd, int *bytes)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = rx_buf, .iov_len = sizeof(rx_buf) };
+	struct msghdr msg;
+	int rc, seg, packets = 0;
+
+	*bytes = 0;
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		rc = recvmsg(fd, &msg, MSG_DONTWAIT);
+		if (rc < 0)
+			break;
+
+		seg = mgcp_udp_gro_size(&msg);
+		packets += seg > 0 ? (rc + seg - 1) / seg : 1;
+		*bytes += rc;
+	}
+
+	return packets;
+}
+
+static void test_connect(void)
+{
+	struct mgcp_udp_peer peer;
+	struct sockaddr_in a_addr, b_addr, c_addr, unused;
+	int a, b, c, bytes;
+	char buf[PAYLOAD];
+
+	printf("Testing connected sockets\n");
+
+	memset(&peer, 0, sizeof(peer));
+	memset(buf, 0x23, sizeof(buf));
+	a = udp_socket(&a_addr);
+	b = udp_socket(&b_addr);
+	c = udp_socket(&c_addr);
+
+	/* nothing to connect to yet */
+	memset(&unused, 0, sizeof(unused));
+	OSMO_ASSERT(mgcp_udp_connect(a, &peer, &unused.sin_addr, 0) == 0);
+	OSMO_ASSERT(peer.port == 0);
+
+	OSMO_ASSERT(mgcp_udp_connect(a, &peer, &b_addr.sin_addr, b_addr.sin_port) == 1);
+	OSMO_ASSERT(mgcp_udp_is_connected(&peer, &b_addr.sin_addr, b_addr.sin_port));
+	OSMO_ASSERT(!mgcp_udp_is_connected(&peer, &c_addr.sin_addr, c_addr.sin_port));
+	OSMO_ASSERT(send(a, buf, sizeof(buf), 0) == sizeof(buf));
+	printf("b received %d packet(s)\n", drain(b, &bytes));
+
+	/* only the peer gets through */
+	sendto(c, buf, sizeof(buf), 0, (struct sockaddr *) &a_addr, sizeof(a_addr));
+	sendto(b, buf, sizeof(buf), 0, (struct sockaddr *) &a_addr, sizeof(a_addr));
+	printf("a received %d packet(s) while connected\n", drain(a, &bytes));
+
+	/* a new peer replaces the old one */
+	OSMO_ASSERT(mgcp_udp_connect(a, &peer, &c_addr.sin_addr, c_addr.sin_port) == 1);
+	OSMO_ASSERT(send(a, buf, sizeof(buf), 0) == sizeof(buf));
+	printf("b received %d, ", drain(b, &bytes));
+	printf("c received %d packet(s)\n", drain(c, &bytes));
+
+	mgcp_udp_disconnect(a, &peer);
+	OSMO_ASSERT(peer.port == 0);
+	sendto(c, buf, sizeof(buf), 0, (struct sockaddr *) &a_addr, sizeof(a_addr));
+	sendto(b, buf, sizeof(buf), 0, (struct sockaddr *) &a_addr, sizeof(a_addr));
+	printf("a received %d packet(s) after disconnect\n", drain(a, &bytes));
+
+	close(a);
+	close(b);
+	close(c);
+}
+
+/* what the batch flush does, one by one when the kernel can not segment */
+static int send_segments(int fd, struct iovec *iov, int count, int seg_size)
+{
+	int i;
+
+	if (mgcp_udp_gso_supported() &&
+	    mgcp_udp_send_gso(fd, iov, count, seg_size) >= 0)
+		return count;
+
+	for (i = 0; i < count; ++i)
+		if (send(fd, iov[i].iov_base, iov[i].iov_len, 0) < 0)
+			break;
+	return i;
+}
+
+static void test_offload(void)
+{
+	static char bufs[9][PAYLOAD];
+	struct mgcp_udp_peer peer;
+	struct sockaddr_in a_addr, b_addr;
+	struct iovec iov[9];
+	int a, b, i, bytes, packets;
+
+	printf("Testing segmentation offload\n");
+
+	memset(&peer, 0, sizeof(peer));
+	a = udp_socket(&a_addr);
+	b = udp_socket(&b_addr);
+	fprintf(stderr, "UDP_SEGMENT %ssupported, UDP_GRO %ssupported\n",
+		mgcp_udp_gso_supported() ? "" : "not ",
+		mgcp_udp_set_gro(b, 1) ? "" : "not ");
+
+	/* eight full packets and a short one */
+	for (i = 0; i < 9; ++i) {
+		memset(bufs[i], i, PAYLOAD);
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = i == 8 ? 100 : PAYLOAD;
+	}
+
+	OSMO_ASSERT(mgcp_udp_connect(a, &peer, &b_addr.sin_addr, b_addr.sin_port) == 1);
+	printf("sent %d packets\n", send_segments(a, iov, 9, PAYLOAD));
+	packets = drain(b, &bytes);
+	printf("received %d packets with %d bytes\n", packets, bytes);
+
+	close(a);
+	close(b);
+}
+
+int main(int argc, char **argv)
+{
+	test_connect();
+	test_offload();
+
+	printf("Done\n");
+	return EXIT_SUCCESS;
+}
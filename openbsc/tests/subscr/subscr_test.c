@@ -101,6 +101,66 @@ static void test_subscr(void)
 	OSMO_ASSERT(llist_empty(&active_subscribers));
 }
 
+static int written_back;
+
+static int count_write_back(struct gsm_subscriber *subscr)
+{
+	written_back += 1;
+	return 0;
+}
+
+static void test_subscr_cache(void)
+{
+	struct gsm_subscriber *s1, *s2, *s3;
+
+	printf("Test the subscriber cache\n");
+
+	dummy_sgrp.keep_subscr = 0;
+	dummy_sgrp.cache_size = 2;
+	dummy_sgrp.write_back = count_write_back;
+
+	s1 = subscr_get_or_create(&dummy_sgrp, "901700000000001");
+	s2 = subscr_get_or_create(&dummy_sgrp, "901700000000002");
+	s3 = subscr_get_or_create(&dummy_sgrp, "901700000000003");
+
+	/* found by the new TMSI once it is hashed again */
+	s2->tmsi = 0x23;
+	OSMO_ASSERT(!subscr_active_by_tmsi(&dummy_sgrp, 0x23));
+	subscr_cache_index(s2);
+	OSMO_ASSERT(subscr_active_by_tmsi(&dummy_sgrp, 0x23) == s2);
+	OSMO_ASSERT(s2->use_count == 2);
+	subscr_put(s2);
+
+	/* the changes are written back with the last reference */
+	subscr_mark_dirty(s1);
+	subscr_put(s1);
+	printf("Written back %d\n", written_back);
+	OSMO_ASSERT(!s1->dirty);
+
+	/* the least recently used goes first */
+	subscr_put(s2);
+	subscr_put(s3);
+	OSMO_ASSERT(!subscr_active_by_imsi(&dummy_sgrp, "901700000000001"));
+
+	s2 = subscr_active_by_imsi(&dummy_sgrp, "901700000000002");
+	OSMO_ASSERT(s2 && s2->use_count == 1);
+	subscr_put(s2);
+
+	s1 = subscr_get_or_create(&dummy_sgrp, "901700000000001");
+	subscr_put(s1);
+	OSMO_ASSERT(!subscr_active_by_imsi(&dummy_sgrp, "901700000000003"));
+
+	s2 = subscr_active_by_imsi(&dummy_sgrp, "901700000000002");
+	OSMO_ASSERT(s2 && s2->tmsi == 0x23);
+	subscr_put(s2);
+
+	OSMO_ASSERT(subscr_purge_inactive(&dummy_sgrp) == 2);
+	OSMO_ASSERT(llist_empty(&active_subscribers));
+
+	dummy_sgrp.cache_size = 0;
+	dummy_sgrp.write_back = NULL;
+}
+
 int main()
 {
 	printf("Testing subscriber core code.\n");
@@ -111,6 +171,7 @@ int main()
 	dummy_sgrp.net         = &dummy_net;
 
 	test_subscr();
+	test_subscr_cache();
 
 	printf("Done\n");
 	return 0;